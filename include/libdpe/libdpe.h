@@ -74,6 +74,13 @@ typedef enum {
 typedef struct Pe Pe;
 typedef struct Pe_Scn Pe_Scn;
 
+/* one extent of the file that goes into an Authenticode digest */
+typedef struct {
+	size_t offset;
+	size_t size;
+	size_t padding;	/* zeros to hash after it, if padding is wanted */
+} Pe_HashRegion;
+
 extern Pe *pe_begin(int fildes, Pe_Cmd cmd, Pe *ref);
 extern Pe *pe_clone(Pe *pe, Pe_Cmd cmd);
 extern Pe *pe_memory(char *image, size_t size);
@@ -86,6 +93,8 @@ extern struct section_header *pe_getshdr(Pe_Scn *scn, struct section_header *dst
 extern struct pe_hdr *pe_getpehdr(Pe *pe, struct pe_hdr *pehdr);
 extern char *pe_rawfile(Pe *pe, size_t *ptr);
 extern int pe_getdatadir(Pe *pe, data_directory **dd);
+extern int pe_hashregions(Pe *pe, const Pe_HashRegion **regions,
+			  size_t *nregions);
 extern void *pe_getopthdr(Pe *pe);
 extern uint32_t pe_get_file_alignment(Pe *pe);
 extern uint32_t pe_get_scn_alignment(Pe *pe);
@@ -99,6 +108,7 @@ extern int pe_clearcert(Pe *pe);
 extern int pe_alloccert(Pe *pe, size_t len);
 extern int pe_populatecert(Pe *pe, void *cert, size_t len);
 
+/* the calling thread's last error */
 extern int pe_errno(void);
 extern const char *pe_errmsg(int error);
 
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef LIBPESIGN_H
+#define LIBPESIGN_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <efivar.h>
+
+/*
+ * Signing and checking UEFI binaries without running pesign, pesigcheck or
+ * efisiglist.  Every function that can fail returns NULL or -1 and leaves
+ * a description in libpesign_error(), which is per-thread.
+ *
+ * A libpesign handle owns an NSS context (read only; certdir may be NULL
+ * when nothing needs a certificate database) and the db/dbx contents used
+ * for verification.  Load the databases first; after that the handle may
+ * be shared between threads.  Images and signers are used by one thread
+ * at a time each.
+ *
+ * pesigcheck and efisiglist are built on this.  pesign, pesignd and
+ * pesign-client are not, and it isn't meant to cover what they do: page
+ * hashes, timestamps, signing helpers, signing sessions and pesignd's
+ * token handling have no equivalent here, and pesign-client only talks
+ * to pesignd.
+ */
+typedef struct libpesign libpesign;
+typedef struct libpesign_image libpesign_image;
+typedef struct libpesign_signer libpesign_signer;
+typedef struct libpesign_esl libpesign_esl;
+
+extern libpesign *libpesign_new(const char *certdir);
+extern void libpesign_free(libpesign *lib);
+extern const char *libpesign_error(void);
+
+/* EFI signature lists, as files or efivarfs variables, and DER certs */
+extern int libpesign_add_db(libpesign *lib, const char *path);
+extern int libpesign_add_dbx(libpesign *lib, const char *path);
+extern int libpesign_add_cert(libpesign *lib, const char *path);
+/* db, MokListRT and dbx from this machine; returns how many of db and
+ * MokListRT it had */
+extern int libpesign_add_system_dbs(libpesign *lib);
+/* a signed catalog, after db and dbx: 0 if it was added, 1 if it isn't
+ * trusted and so wasn't, -1 on error */
+extern int libpesign_add_catalog(libpesign *lib, const char *path);
+
+/* the fd or memory has to stay valid until the image is closed */
+extern libpesign_image *libpesign_image_open_fd(libpesign *lib, int fd);
+extern libpesign_image *libpesign_image_open_memory(libpesign *lib,
+						    void *data, size_t size);
+extern void libpesign_image_close(libpesign_image *image);
+extern int libpesign_image_num_signatures(libpesign_image *image);
+/* *size is the room at digest going in and the digest's size coming out */
+extern int libpesign_image_digest(libpesign_image *image,
+				  const char *digest_name,
+				  uint8_t *digest, size_t *size);
+/* 0 if db allows the image and dbx doesn't forbid it, -1 otherwise */
+extern int libpesign_image_verify(libpesign_image *image);
+/* the same, but only for the page hashes of the comma separated sections
+ * or file offsets in "which" */
+extern int libpesign_image_verify_pages(libpesign_image *image,
+					const char *which);
+
+/* token may be NULL for the NSS softokn, pin NULL if none is needed */
+extern libpesign_signer *libpesign_signer_new(libpesign *lib,
+					      const char *token,
+					      const char *certname,
+					      const char *pin);
+extern void libpesign_signer_free(libpesign_signer *signer);
+
+/* a detached PKCS#7 signature, which the caller frees */
+extern int libpesign_sign_detached(libpesign_signer *signer,
+				   libpesign_image *image,
+				   const char *digest_name,
+				   void **sig, size_t *siglen);
+/* write a copy of the image with a new signature added to outfd */
+extern int libpesign_sign(libpesign_signer *signer, libpesign_image *image,
+			  const char *digest_name, int outfd);
+/* the same, but with a signature made elsewhere */
+extern int libpesign_embed(libpesign_image *image, const void *sig,
+			   size_t siglen, int outfd);
+
+extern libpesign_esl *libpesign_esl_new(const efi_guid_t *type);
+extern int libpesign_esl_add(libpesign_esl *esl, const efi_guid_t *owner,
+			     const void *data, size_t size);
+/* *data belongs to the list, and lasts until it's changed or freed */
+extern int libpesign_esl_realize(libpesign_esl *esl, const void **data,
+				 size_t *size);
+extern void libpesign_esl_free(libpesign_esl *esl);
+
+#endif /* LIBPESIGN_H */
@@ -27,12 +27,6 @@ Pe *pe_clone(Pe *pe __attribute__((__unused__)),
 	return NULL;
 }
 
-Pe *pe_memory(char *image __attribute__((__unused__)),
-	      size_t size __attribute__((__unused__)))
-{
-	return NULL;
-}
-
 Pe_Kind pe_kind(Pe *pe)
 {
 	return pe == NULL ? PE_K_NONE : pe->kind;
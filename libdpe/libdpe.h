@@ -44,6 +44,7 @@ enum {
 	PE_E_FD_DISABLED,
 	PE_E_FD_MISMATCH,
 	PE_E_UPDATE_RO,
+	PE_E_INVALID_LAYOUT,
 	PE_E_NUM /* terminating entry */
 };
 
@@ -88,6 +89,9 @@ struct Pe {
 
 	int ref_count;
 
+	/* what an Authenticode digest covers; see pe_hashregions.c */
+	struct Pe_HashPlan *hashplan;
+
 	union {
 		struct {
 			struct mz_hdr *mzhdr;
@@ -175,5 +179,6 @@ extern off_t __pe_updatemmap(Pe *pe, size_t shnum);
 extern int __pe_updatefile(Pe *pe, size_t shnum);
 extern off_t __pe_updatenull(Pe *pe, size_t shnum);
 extern char *__libpe_readall(Pe *pe);
+extern void __pe_freehashplan(Pe *pe);
 
 #endif /* LIBDPE_PRIV_H */
@@ -356,3 +356,23 @@ pe_begin(int fildes, Pe_Cmd cmd, Pe *ref)
 
 	return retval;
 }
+
+/*
+ * Parse an image somebody else has already read into memory.  The caller
+ * owns the buffer, and has to keep it around until pe_end(); we don't copy
+ * it and we don't free it.
+ */
+Pe *
+pe_memory(char *image, size_t size)
+{
+	struct mz_hdr *mz = (struct mz_hdr *)image;
+
+	if (image == NULL || size < sizeof (*mz) ||
+			le32_to_cpu(mz->peaddr) > size - sizeof (struct pe_hdr)) {
+		__libpe_seterrno(PE_E_INVALID_FILE);
+		return NULL;
+	}
+
+	return __libpe_read_mmapped_file(-1, image, size, PE_C_READ_MMAP,
+					 NULL);
+}
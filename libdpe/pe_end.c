@@ -38,6 +38,8 @@ pe_end(Pe *pe)
 
 	parent = pe->parent;
 
+	__pe_freehashplan(pe);
+
 	switch (pe->kind) {
 	case PE_K_NONE:
 	case PE_K_MZ:
@@ -23,7 +23,9 @@
 
 #include "libdpe.h"
 
-static int global_error;
+/* per thread, so that threads working on different images each get
+ * their own error back from pe_errno() */
+static __thread int global_error;
 
 int
 pe_errno (void)
@@ -89,6 +91,10 @@ static const char msgstr[] =
 #define PE_E_UPDATE_RO_IDX \
 	(PE_E_FD_MISMATCH_IDX + sizeof "file descriptor mismatch")
 	"update() for write on read-only file"
+	"\0"
+#define PE_E_INVALID_LAYOUT_IDX \
+	(PE_E_UPDATE_RO_IDX + sizeof "update() for write on read-only file")
+	"headers describe data outside the image"
 };
 
 static const uint16_t msgidx[PE_E_NUM] =
@@ -107,6 +113,7 @@ static const uint16_t msgidx[PE_E_NUM] =
 	[PE_E_FD_DISABLED] = PE_E_FD_DISABLED_IDX,
 	[PE_E_FD_MISMATCH] = PE_E_FD_MISMATCH_IDX,
 	[PE_E_UPDATE_RO] = PE_E_UPDATE_RO_IDX,
+	[PE_E_INVALID_LAYOUT] = PE_E_INVALID_LAYOUT_IDX,
 };
 #define nmsgidx ((int) (sizeof (msgidx) / sizeof (msgidx[0])))
 
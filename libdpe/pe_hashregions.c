@@ -0,0 +1,260 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include "libdpe.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The parts of an image an Authenticode digest covers, in the order they
+ * get hashed: the headers less the checksum and the certificate table's
+ * directory entry, each section's raw data in file order, and whatever
+ * follows the headers and sections other than the certificate table.
+ *
+ * Working that out means copying and sorting the section table and
+ * checking every extent against the file, so it's done once and kept on
+ * the handle.  The plan keeps a copy of the headers it was worked out
+ * from, and is redone if they or the file's size change under it - which
+ * is what happens when space for a signature gets allocated.
+ */
+struct Pe_HashPlan {
+	size_t map_size;
+	size_t key_size;
+	char *key;
+
+	size_t nregions;
+	Pe_HashRegion regions[0];
+};
+
+void
+__pe_freehashplan(Pe *pe)
+{
+	if (pe->hashplan) {
+		xfree(pe->hashplan->key);
+		xfree(pe->hashplan);
+	}
+}
+
+static int
+compare_shdrs(const void *a, const void *b)
+{
+	const struct section_header *shdra = a;
+	const struct section_header *shdrb = b;
+	int rc;
+
+	if (shdra->data_addr > shdrb->data_addr)
+		return 1;
+	if (shdrb->data_addr > shdra->data_addr)
+		return -1;
+
+	if (shdra->virtual_address > shdrb->virtual_address)
+		return 1;
+	if (shdrb->virtual_address > shdra->virtual_address)
+		return -1;
+
+	rc = strcmp(shdra->name, shdrb->name);
+	if (rc != 0)
+		return rc;
+
+	if (shdra->virtual_size > shdrb->virtual_size)
+		return 1;
+	if (shdrb->virtual_size > shdra->virtual_size)
+		return -1;
+
+	if (shdra->raw_data_size > shdrb->raw_data_size)
+		return 1;
+	if (shdrb->raw_data_size > shdra->raw_data_size)
+		return -1;
+
+	return 0;
+}
+
+static int
+add_region(struct Pe_HashPlan *plan, size_t offset, size_t size)
+{
+	/* nothing may run off the end, and nothing may be the whole file */
+	if (offset > plan->map_size || size > plan->map_size - offset)
+		return -1;
+	if (offset == 0 && size >= plan->map_size)
+		return -1;
+
+	if (size == 0)
+		return 0;
+
+	Pe_HashRegion *region = &plan->regions[plan->nregions++];
+	region->offset = offset;
+	region->size = size;
+	region->padding = 0;
+	return 0;
+}
+
+static struct Pe_HashPlan *
+build_plan(Pe *pe, char *map, size_t map_size)
+{
+	struct Pe_HashPlan *plan = NULL;
+	struct section_header *shdrs = NULL;
+	size_t csum_offset, csum_size, header_size;
+
+	switch (pe_kind(pe)) {
+	case PE_K_PE_EXE: {
+		struct pe32_opt_hdr *opthdr = pe_getopthdr(pe);
+		csum_offset = (char *)&opthdr->csum - map;
+		csum_size = sizeof (opthdr->csum);
+		header_size = opthdr->header_size;
+		break;
+	}
+	case PE_K_PE64_EXE: {
+		struct pe32plus_opt_hdr *opthdr = pe_getopthdr(pe);
+		csum_offset = (char *)&opthdr->csum - map;
+		csum_size = sizeof (opthdr->csum);
+		header_size = opthdr->header_size;
+		break;
+	}
+	default:
+		__libpe_seterrno(PE_E_INVALID_HANDLE);
+		return NULL;
+	}
+
+	data_directory *dd = NULL;
+	if (pe_getdatadir(pe, &dd) < 0 || !dd)
+		goto invalid;
+	size_t dd_offset = (char *)dd - map;
+	if (dd_offset > map_size || sizeof (*dd) > map_size - dd_offset)
+		goto invalid;
+
+	struct pe_hdr *pehdr = pe->state.pe.pehdr;
+	size_t sections = pehdr->sections;
+	size_t shdr_end = (char *)pe->state.pe.shdr - map +
+			  sections * sizeof (struct section_header);
+
+	plan = calloc(1, sizeof (*plan) +
+			 (sections + 4) * sizeof (Pe_HashRegion));
+	if (!plan) {
+		__libpe_seterrno(PE_E_NOMEM);
+		return NULL;
+	}
+	plan->map_size = map_size;
+
+	/* everything up to the checksum, then up to the certificate
+	 * table's directory entry, then the rest of the headers */
+	size_t after_csum = csum_offset + csum_size;
+	size_t certs_offset = (char *)&dd->certs - map;
+	size_t relocs_offset = (char *)&dd->base_relocations - map;
+	if (add_region(plan, 0, csum_offset) < 0 ||
+	    add_region(plan, after_csum, certs_offset - after_csum) < 0 ||
+	    add_region(plan, relocs_offset, header_size - relocs_offset) < 0)
+		goto invalid;
+
+	size_t hashed_bytes = header_size;
+
+	shdrs = calloc(sections, sizeof (*shdrs));
+	if (!shdrs && sections) {
+		__libpe_seterrno(PE_E_NOMEM);
+		goto err;
+	}
+	Pe_Scn *scn = NULL;
+	for (size_t i = 0; i < sections; i++) {
+		scn = pe_nextscn(pe, scn);
+		if (scn == NULL)
+			break;
+		pe_getshdr(scn, &shdrs[i]);
+	}
+	/* This leaves the last section where the table has it.  It's always
+	 * been done this way, and changing it would change the digest of
+	 * any image that lists its sections out of order. */
+	if (sections > 1)
+		qsort(shdrs, sections - 1, sizeof (*shdrs), compare_shdrs);
+
+	for (size_t i = 0; i < sections; i++) {
+		if (shdrs[i].raw_data_size == 0)
+			continue;
+		if (add_region(plan, shdrs[i].data_addr,
+			       shdrs[i].raw_data_size) < 0)
+			goto invalid;
+		hashed_bytes += shdrs[i].raw_data_size;
+	}
+	xfree(shdrs);
+
+	if (map_size > hashed_bytes) {
+		size_t size = map_size - dd->certs.size - hashed_bytes;
+		if (add_region(plan, hashed_bytes, size) < 0)
+			goto invalid;
+		if (size)
+			plan->regions[plan->nregions - 1].padding =
+				ALIGNMENT_PADDING(size, 8);
+	}
+
+	/* anything in here changing means the plan above might have */
+	plan->key_size = header_size;
+	if (shdr_end > plan->key_size)
+		plan->key_size = shdr_end;
+	if (dd_offset + sizeof (*dd) > plan->key_size)
+		plan->key_size = dd_offset + sizeof (*dd);
+	if (plan->key_size > map_size)
+		goto invalid;
+	plan->key = malloc(plan->key_size);
+	if (!plan->key) {
+		__libpe_seterrno(PE_E_NOMEM);
+		goto err;
+	}
+	memcpy(plan->key, map, plan->key_size);
+
+	return plan;
+invalid:
+	__libpe_seterrno(PE_E_INVALID_LAYOUT);
+err:
+	xfree(shdrs);
+	xfree(plan);
+	return NULL;
+}
+
+int
+pe_hashregions(Pe *pe, const Pe_HashRegion **regions, size_t *nregions)
+{
+	char *map;
+	size_t map_size = 0;
+
+	if (!regions || !nregions) {
+		__libpe_seterrno(PE_E_INVALID_OPERAND);
+		return -1;
+	}
+
+	map = pe_rawfile(pe, &map_size);
+	if (!map)
+		return -1;
+
+	struct Pe_HashPlan *plan = pe->hashplan;
+	if (plan && (plan->map_size != map_size ||
+		     memcmp(plan->key, map, plan->key_size))) {
+		__pe_freehashplan(pe);
+		plan = NULL;
+	}
+
+	if (!plan) {
+		plan = build_plan(pe, map, map_size);
+		if (!plan)
+			return -1;
+		pe->hashplan = plan;
+	}
+
+	*regions = plan->regions;
+	*nregions = plan->nregions;
+	return 0;
+}
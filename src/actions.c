@@ -18,12 +18,16 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "pesign.h"
 
@@ -36,15 +40,15 @@
 #include <base64.h>
 #include <pk11pub.h>
 #include <secerr.h>
-
-static int saw_content;
+#include <secoid.h>
 
 static void
-handle_bytes(void *arg __attribute__((__unused__)),
+handle_bytes(void *arg,
 	     const char *buf __attribute__((__unused__)),
 	     unsigned long len __attribute__((__unused__)))
 {
-	saw_content = 1;
+	int *saw_content = arg;
+	*saw_content = 1;
 }
 
 static PRBool
@@ -90,115 +94,1187 @@ err:
 	memset(&cms->newsig, '\0', sizeof (cms->newsig));
 }
 
-int
-list_signatures(pesign_context *ctx)
+/*
+ * Listing signatures.  Each file is described into a buffer of its own by
+ * one of a few threads, and the buffers are printed in the order the files
+ * were given, so the output doesn't depend on how many threads there are.
+ */
+typedef struct {
+	list_format format;
+	int verify;
+	int nfiles;
+} list_options;
+
+static void
+json_string(FILE *f, const char *str)
+{
+	if (!str) {
+		fputs("null", f);
+		return;
+	}
+
+	fputc('"', f);
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		switch (*c) {
+		case '"':
+			fputs("\\\"", f);
+			break;
+		case '\\':
+			fputs("\\\\", f);
+			break;
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case '\t':
+			fputs("\\t", f);
+			break;
+		default:
+			if (*c < 0x20)
+				fprintf(f, "\\u%04x", *c);
+			else
+				fputc(*c, f);
+			break;
+		}
+	}
+	fputc('"', f);
+}
+
+static void
+json_time(FILE *f, PRTime when)
+{
+	time_t t = when / PR_USEC_PER_SEC;
+	struct tm tm;
+	char buf[32];
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof (buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	json_string(f, buf);
+}
+
+static void
+json_serial(FILE *f, SECItem *serial)
+{
+	fputc('"', f);
+	for (unsigned int i = 0; i < serial->len; i++)
+		fprintf(f, "%02x", serial->data[i]);
+	fputc('"', f);
+}
+
+static void
+json_name(FILE *f, CERTName *name)
+{
+	char *ascii = CERT_NameToAscii(name);
+
+	json_string(f, ascii);
+	if (ascii)
+		PORT_Free(ascii);
+}
+
+/*
+ * The signer's certificate, out of the ones in the signature itself.
+ * SEC_PKCS7GetSignerCommonName() and friends only find it by verifying the
+ * signature, which is exactly what --no-verify is trying not to do.
+ */
+static CERTCertificate *
+find_signer(SEC_PKCS7SignedData *sd, SEC_PKCS7SignerInfo *si)
+{
+	for (int i = 0; sd->rawCerts && sd->rawCerts[i]; i++) {
+		CERTCertificate *cert;
+
+		cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(),
+					       sd->rawCerts[i], NULL, PR_FALSE,
+					       PR_TRUE);
+		if (!cert)
+			continue;
+		if (CERT_CompareName(&cert->issuer,
+				     &si->issuerAndSN->issuer) == SECEqual &&
+		    SECITEM_CompareItem(&cert->serialNumber,
+				    &si->issuerAndSN->serialNumber) == SECEqual)
+			return cert;
+		CERT_DestroyCertificate(cert);
+	}
+	return NULL;
+}
+
+static void
+json_certificates(FILE *f, SEC_PKCS7SignedData *sd)
 {
+	fputc('[', f);
+	for (int i = 0; sd->rawCerts && sd->rawCerts[i]; i++) {
+		CERTCertificate *cert;
+		PRTime not_before, not_after;
+
+		if (i)
+			fputs(", ", f);
+		cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(),
+					       sd->rawCerts[i], NULL, PR_FALSE,
+					       PR_TRUE);
+		if (!cert) {
+			fputs("{\"error\": \"could not decode certificate\"}",
+			      f);
+			continue;
+		}
+
+		fputs("{\"subject\": ", f);
+		json_name(f, &cert->subject);
+		fputs(", \"issuer\": ", f);
+		json_name(f, &cert->issuer);
+		fputs(", \"serial\": ", f);
+		json_serial(f, &cert->serialNumber);
+		if (CERT_GetCertTimes(cert, &not_before, &not_after)
+				== SECSuccess) {
+			fputs(", \"not_before\": ", f);
+			json_time(f, not_before);
+			fputs(", \"not_after\": ", f);
+			json_time(f, not_after);
+		}
+		fputc('}', f);
+		CERT_DestroyCertificate(cert);
+	}
+	fputc(']', f);
+}
+
+static void
+json_signature(FILE *f, list_options *opts, SEC_PKCS7ContentInfo *cinfo,
+	       int saw_content)
+{
+	SEC_PKCS7SignedData *sd = cinfo->content.signedData;
+	SEC_PKCS7SignerInfo *si = sd->signerInfos ? sd->signerInfos[0] : NULL;
+
+	fprintf(f, "\"encrypted\": %s",
+		SEC_PKCS7ContentIsEncrypted(cinfo) ? "true" : "false");
+	fprintf(f, ", \"content_detached\": %s", saw_content ? "false"
+							     : "true");
+
+	fputs(", \"verified\": ", f);
+	if (opts->verify && saw_content) {
+		PORT_SetError(0);
+		if (SEC_PKCS7VerifySignature(cinfo, certUsageEmailSigner,
+					     PR_FALSE)) {
+			fputs("true", f);
+		} else {
+			fputs("false, \"verify_error\": ", f);
+			json_string(f, PR_ErrorToName(PORT_GetError()));
+		}
+	} else {
+		fputs("null", f);
+	}
+
+	if (si) {
+		CERTCertificate *signer = find_signer(sd, si);
+
+		fputs(", \"signer\": ", f);
+		if (signer) {
+			char *cn = CERT_GetCommonName(&signer->subject);
+			char *email = CERT_GetCertEmailAddress(
+							&signer->subject);
+
+			fputs("{\"subject\": ", f);
+			json_name(f, &signer->subject);
+			fputs(", \"common_name\": ", f);
+			json_string(f, cn);
+			fputs(", \"email\": ", f);
+			json_string(f, email);
+			fputc('}', f);
+
+			if (cn)
+				PORT_Free(cn);
+			if (email)
+				PORT_Free(email);
+			CERT_DestroyCertificate(signer);
+		} else {
+			fputs("null", f);
+		}
+
+		fputs(", \"issuer\": ", f);
+		json_name(f, &si->issuerAndSN->issuer);
+		fputs(", \"serial\": ", f);
+		json_serial(f, &si->issuerAndSN->serialNumber);
+		fputs(", \"digest_algorithm\": ", f);
+		json_string(f, SECOID_FindOIDTagDescription(
+				SECOID_GetAlgorithmTag(&si->digestAlg)));
+	}
+
+	PRTime when;
+	SECItem *signing_time = SEC_PKCS7GetSigningTime(cinfo);
+	fputs(", \"signing_time\": ", f);
+	if (signing_time && DER_DecodeTimeChoice(&when, signing_time)
+				== SECSuccess)
+		json_time(f, when);
+	else
+		fputs("null", f);
+
+	fputs(", \"certificates\": ", f);
+	json_certificates(f, sd);
+}
+
+static void
+text_signature(FILE *f, list_options *opts, void *data,
+	       SEC_PKCS7ContentInfo *cinfo, int saw_content)
+{
+	fprintf(f, "---------------------------------------------\n");
+	fprintf(f, "certificate address is %p\n", data);
+	fprintf(f, "Content was%s encrypted.\n",
+		SEC_PKCS7ContentIsEncrypted(cinfo) ? "" : " not");
+	if (!SEC_PKCS7ContentIsSigned(cinfo))
+		return;
+
+	char *signer_cname, *signer_ename;
+	SECItem *signing_time;
+
+	if (!opts->verify) {
+		fprintf(f, "Signature was not verified.\n");
+	} else if (saw_content) {
+		fprintf(f, "Signature is ");
+		PORT_SetError(0);
+		if (SEC_PKCS7VerifySignature(cinfo, certUsageEmailSigner,
+					     PR_FALSE)) {
+			fprintf(f, "valid.\n");
+		} else {
+			fprintf(f, "invalid (Reason: 0x%08x).\n",
+				(uint32_t)PORT_GetError());
+		}
+	} else {
+		fprintf(f, "Content is detached; signature cannot "
+			"be verified.\n");
+	}
+
+	if (opts->verify) {
+		signer_cname = SEC_PKCS7GetSignerCommonName(cinfo);
+		signer_ename = SEC_PKCS7GetSignerEmailAddress(cinfo);
+	} else {
+		SEC_PKCS7SignedData *sd = cinfo->content.signedData;
+		CERTCertificate *signer = NULL;
+
+		if (sd->signerInfos && sd->signerInfos[0])
+			signer = find_signer(sd, sd->signerInfos[0]);
+		signer_cname = signer ? CERT_GetCommonName(&signer->subject)
+				      : NULL;
+		signer_ename = signer
+			? CERT_GetCertEmailAddress(&signer->subject) : NULL;
+		if (signer)
+			CERT_DestroyCertificate(signer);
+	}
+
+	if (signer_cname != NULL) {
+		fprintf(f, "The signer's common name is %s\n", signer_cname);
+		PORT_Free(signer_cname);
+	} else {
+		fprintf(f, "No signer common name.\n");
+	}
+
+	if (signer_ename != NULL) {
+		fprintf(f, "The signer's email address is %s\n", signer_ename);
+		PORT_Free(signer_ename);
+	} else {
+		fprintf(f, "No signer email address.\n");
+	}
+
+	signing_time = SEC_PKCS7GetSigningTime(cinfo);
+	if (signing_time != NULL) {
+		char *signing_time_str = DER_TimeChoiceDayToAscii(signing_time);
+		fprintf(f, "Signing time: %s\n", signing_time_str);
+		PORT_Free(signing_time_str);
+	} else {
+		fprintf(f, "No signing time included.\n");
+	}
+
+	fprintf(f, "There were%s certs or crls included.\n",
+		SEC_PKCS7ContainsCertsOrCrls(cinfo) ? "" : " no");
+}
+
+static void
+describe_file(FILE *f, list_options *opts, const char *path, Pe *pe)
+{
+	int json = opts->format == LIST_FORMAT_JSON;
 	cert_iter iter;
 
-	int rc = cert_iter_init(&iter, ctx->inpe);
+	if (json) {
+		fputs("  {\"file\": ", f);
+		json_string(f, path);
+		fputs(", \"signatures\": [", f);
+	} else if (opts->nfiles > 1) {
+		fprintf(f, "%s:\n", path);
+	}
 
+	int rc = cert_iter_init(&iter, pe);
 	if (rc < 0) {
-		printf("No certificate list found.\n");
-		return rc;
+		if (json)
+			fputs("]}", f);
+		else
+			fprintf(f, "No certificate list found.\n");
+		return;
 	}
 
 	void *data;
 	ssize_t datalen;
 	int nsigs = 0;
+	int n = 0;
 
-	rc = 0;
 	while (1) {
 		rc = next_cert(&iter, &data, &datalen);
 		if (rc <= 0)
 			break;
 
+		int saw_content = 0;
 		SEC_PKCS7DecoderContext *dc = NULL;
-		saw_content = 0;
-		dc = SEC_PKCS7DecoderStart(handle_bytes, NULL, NULL, NULL,
-					NULL, NULL, decryption_allowed);
+		dc = SEC_PKCS7DecoderStart(handle_bytes, &saw_content, NULL,
+					   NULL, NULL, NULL,
+					   decryption_allowed);
 
 		if (dc == NULL) {
 			fprintf(stderr, "SEC_PKCS7DecoderStart failed\n");
 			exit(1);
 		}
 
+		if (json)
+			fprintf(f, "%s\n    {\"index\": %d, ",
+				n ? "," : "", n);
+		n++;
+
+		SEC_PKCS7ContentInfo *cinfo = NULL;
 		SECStatus status = SEC_PKCS7DecoderUpdate(dc, data, datalen);
+		if (status == SECSuccess)
+			cinfo = SEC_PKCS7DecoderFinish(dc);
+		else
+			SEC_PKCS7DecoderAbort(dc, PORT_GetError());
 
-		if (status != SECSuccess) {
-			fprintf(stderr, "Found invalid certificate\n");
+		if (cinfo == NULL) {
+			if (json)
+				fputs("\"error\": \"invalid signature\"}", f);
+			else
+				fprintf(stderr, "Found invalid certificate\n");
 			continue;
 		}
 
-		SEC_PKCS7ContentInfo *cinfo = SEC_PKCS7DecoderFinish(dc);
+		nsigs++;
+		if (json) {
+			if (SEC_PKCS7ContentIsSigned(cinfo))
+				json_signature(f, opts, cinfo, saw_content);
+			else
+				fputs("\"error\": \"not signed\"", f);
+			fputc('}', f);
+		} else {
+			text_signature(f, opts, data, cinfo, saw_content);
+		}
+		SEC_PKCS7DestroyContentInfo(cinfo);
+	}
 
-		if (cinfo == NULL) {
-			fprintf(stderr, "Found invalid certificate\n");
+	if (json)
+		fprintf(f, "%s]}", n ? "\n  " : "");
+	else if (nsigs)
+		fprintf(f, "---------------------------------------------\n");
+	else
+		fprintf(f, "No signatures found.\n");
+}
+
+typedef struct {
+	list_options opts;
+	int npaths;
+	ingest ing;
+	pthread_mutex_t lock;
+	char **results;
+	int next_print;
+	int failures;
+} list_job;
+
+/* called with the lock held */
+static void
+print_results(list_job *job)
+{
+	while (job->next_print < job->npaths &&
+	       job->results[job->next_print]) {
+		if (job->opts.format == LIST_FORMAT_JSON)
+			fputs(job->next_print ? ",\n" : "\n", stdout);
+		fputs(job->results[job->next_print], stdout);
+		xfree(job->results[job->next_print]);
+		job->next_print++;
+	}
+	fflush(stdout);
+}
+
+static void *
+list_worker(void *arg)
+{
+	list_job *job = arg;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		ingest_buffer *buf = ingest_next(&job->ing);
+		pthread_mutex_unlock(&job->lock);
+		if (!buf)
+			break;
+
+		char *text = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&text, &len);
+		if (!f) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			exit(1);
+		}
+
+		const char *error = NULL;
+		Pe *pe = NULL;
+		if (buf->error)
+			error = strerror(buf->error);
+		else if (!(pe = pe_memory(buf->data, buf->size)))
+			error = pe_errmsg(pe_errno());
+
+		if (pe) {
+			describe_file(f, &job->opts, buf->path, pe);
+			pe_end(pe);
+		} else if (job->opts.format == LIST_FORMAT_JSON) {
+			fputs("  {\"file\": ", f);
+			json_string(f, buf->path);
+			fputs(", \"error\": ", f);
+			json_string(f, error);
+			fputc('}', f);
+		} else {
+			fprintf(stderr, "pesign: could not load \"%s\": %s\n",
+				buf->path, error);
+		}
+		fclose(f);
+
+		pthread_mutex_lock(&job->lock);
+		if (!pe)
+			job->failures++;
+		job->results[buf->index] = text;
+		ingest_release(&job->ing, buf);
+		print_results(job);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+int
+list_signatures(pesign_context *ctx)
+{
+	list_job job;
+	char **paths;
+	int npaths = 0;
+
+	memset(&job, '\0', sizeof (job));
+
+	paths = calloc(ctx->nlistfiles + 1, sizeof (char *));
+	if (!paths)
+		goto oom;
+	if (ctx->infile)
+		paths[npaths++] = ctx->infile;
+	for (int i = 0; i < ctx->nlistfiles; i++)
+		paths[npaths++] = ctx->listfiles[i];
+	if (npaths == 0) {
+		fprintf(stderr, "pesign: No input file specified.\n");
+		exit(1);
+	}
+
+	job.opts.format = ctx->list_format;
+	job.opts.verify = ctx->list_verify;
+	job.opts.nfiles = npaths;
+	job.npaths = npaths;
+	job.results = calloc(npaths, sizeof (char *));
+	if (!job.results)
+		goto oom;
+
+	int jobs = ctx->list_jobs;
+	if (jobs <= 0) {
+		long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = nproc > 0 ? nproc : 1;
+	}
+	if (jobs > npaths)
+		jobs = npaths;
+
+	/* every thread holds at most one buffer, and we want to be
+	 * reading ahead of all of them */
+	int depth = jobs * 2 > INGEST_DEFAULT_DEPTH ? jobs * 2
+						    : INGEST_DEFAULT_DEPTH;
+	if (ingest_start(&job.ing, paths, npaths, INGEST_AUTO, depth) < 0) {
+		fprintf(stderr, "pesign: could not start reading input: %m\n");
+		exit(1);
+	}
+	pthread_mutex_init(&job.lock, NULL);
+
+	if (job.opts.format == LIST_FORMAT_JSON)
+		fputs("[", stdout);
+
+	pthread_t *threads = calloc(jobs, sizeof (pthread_t));
+	if (!threads)
+		goto oom;
+	int nthreads = 0;
+	for (int i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[nthreads], NULL, list_worker,
+				   &job) != 0)
+			break;
+		nthreads++;
+	}
+	/* and this thread does its share too */
+	list_worker(&job);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (job.opts.format == LIST_FORMAT_JSON)
+		fputs("\n]\n", stdout);
+
+	int rc = job.failures ? -1 : 0;
+	if (job.next_print < npaths) {
+		fprintf(stderr, "pesign: could not read \"%s\": %s\n",
+			paths[job.next_print], strerror(job.ing.error));
+		rc = -1;
+	}
+
+	ingest_finish(&job.ing);
+	pthread_mutex_destroy(&job.lock);
+	for (int i = 0; i < npaths; i++)
+		free(job.results[i]);
+	free(job.results);
+	free(paths);
+	return rc;
+oom:
+	fprintf(stderr, "pesign: could not allocate memory: %m\n");
+	exit(1);
+}
+
+typedef struct {
+	cms_context *cms;
+	ingest ing;
+	pthread_mutex_t lock;
+	catalog_member *members;
+	int failures;
+} catalog_job;
+
+static void *
+catalog_worker(void *arg)
+{
+	catalog_job *job = arg;
+	cms_context *cms = NULL;
+
+	if (cms_context_alloc(&cms) < 0 ||
+	    set_digest_parameters(cms,
+			(char *)digest_get_digest_name(job->cms)) < 0) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		exit(1);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		ingest_buffer *buf = ingest_next(&job->ing);
+		pthread_mutex_unlock(&job->lock);
+		if (!buf)
+			break;
+
+		const char *error = NULL;
+		Pe *pe = NULL;
+		if (buf->error)
+			error = strerror(buf->error);
+		else if (!(pe = pe_memory(buf->data, buf->size)))
+			error = pe_errmsg(pe_errno());
+		else if (generate_digest(cms, pe, 1) < 0)
+			error = "could not generate digest";
+
+		pthread_mutex_lock(&job->lock);
+		if (error) {
+			fprintf(stderr, "pesign: could not load \"%s\": %s\n",
+				buf->path, error);
+			job->failures++;
+		} else {
+			catalog_member *member = &job->members[buf->index];
+			member->name = (char *)buf->path;
+			if (SECITEM_CopyItem(job->cms->arena, &member->digest,
+				cms->digests[cms->selected_digest].pe_digest)
+					!= SECSuccess)
+				job->failures++;
+		}
+		/* pe points into buf */
+		if (pe)
+			pe_end(pe);
+		ingest_release(&job->ing, buf);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	/* this frees cms, too */
+	cms_context_fini(cms);
+	return NULL;
+}
+
+/*
+ * Digest every file we were given, as many at once as --jobs says, and
+ * write one signed catalog that lists all of them to ctx->outcatalogfd.
+ */
+int
+sign_catalog(pesign_context *ctx)
+{
+	catalog_job job;
+	char **paths;
+	int npaths = 0;
+
+	memset(&job, '\0', sizeof (job));
+	job.cms = ctx->cms_ctx;
+
+	paths = calloc(ctx->nlistfiles + 1, sizeof (char *));
+	if (!paths)
+		goto oom;
+	if (ctx->infile)
+		paths[npaths++] = ctx->infile;
+	for (int i = 0; i < ctx->nlistfiles; i++)
+		paths[npaths++] = ctx->listfiles[i];
+	if (npaths == 0) {
+		fprintf(stderr, "pesign: No input file specified.\n");
+		exit(1);
+	}
+
+	job.members = calloc(npaths, sizeof (catalog_member));
+	if (!job.members)
+		goto oom;
+
+	int jobs = ctx->list_jobs;
+	if (jobs <= 0) {
+		long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = nproc > 0 ? nproc : 1;
+	}
+	if (jobs > npaths)
+		jobs = npaths;
+
+	int depth = jobs * 2 > INGEST_DEFAULT_DEPTH ? jobs * 2
+						    : INGEST_DEFAULT_DEPTH;
+	if (ingest_start(&job.ing, paths, npaths, INGEST_AUTO, depth) < 0) {
+		fprintf(stderr, "pesign: could not start reading input: %m\n");
+		exit(1);
+	}
+	pthread_mutex_init(&job.lock, NULL);
+
+	pthread_t *threads = calloc(jobs, sizeof (pthread_t));
+	if (!threads)
+		goto oom;
+	int nthreads = 0;
+	for (int i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[nthreads], NULL, catalog_worker,
+				   &job) != 0)
+			break;
+		nthreads++;
+	}
+	catalog_worker(&job);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	int rc = job.failures ? -1 : 0;
+	if (job.ing.next_out < npaths) {
+		fprintf(stderr, "pesign: could not read \"%s\": %s\n",
+			paths[job.ing.next_out], strerror(job.ing.error));
+		rc = -1;
+	}
+	ingest_finish(&job.ing);
+	pthread_mutex_destroy(&job.lock);
+
+	SECItem ctl;
+	if (rc == 0 &&
+	    (generate_catalog(ctx->cms_ctx, job.members, npaths, &ctl) < 0 ||
+	     generate_catalog_signed_data(ctx->cms_ctx, &ctl,
+					  &ctx->cms_ctx->newsig) < 0)) {
+		fprintf(stderr, "pesign: could not sign catalog\n");
+		rc = -1;
+	}
+	if (rc == 0 && export_signature(ctx->cms_ctx, ctx->outcatalogfd,
+					ctx->ascii) < 0)
+		rc = -1;
+
+	free(job.members);
+	free(paths);
+	return rc;
+oom:
+	fprintf(stderr, "pesign: could not allocate memory: %m\n");
+	exit(1);
+}
+
+/*
+ * Signing many files at once: a directory of them, or whatever pairs of
+ * input and output a manifest lists.  The certificate is found, and the
+ * token logged in to, once; then several threads each read, hash, and
+ * rewrite files with their own cms_context, sharing the signer.  The
+ * private key operations themselves go one at a time through the one
+ * token session (see key_lock in cms_context), or are all handed to the
+ * signer helper without waiting on each other, and everything else -
+ * including waiting on a timestamp server, which batches up whatever the
+ * threads ask it for - happens in parallel.
+ */
+typedef struct {
+	cms_context *cms;
+	ingest ing;
+	pthread_mutex_t lock;
+	pthread_mutex_t key_lock;
+	char **outpaths;
+	mode_t outmode;
+	int force;
+	int verbose;
+	int failures;
+} sign_job;
+
+static void
+share_signer(sign_job *job, cms_context *cms)
+{
+	cms->tokenname = job->cms->tokenname;
+	cms->certname = job->cms->certname;
+	if (job->cms->cert)
+		cms->cert = CERT_DupCertificate(job->cms->cert);
+	cms->template = job->cms->template;
+	cms->func = job->cms->func;
+	cms->pwdata = job->cms->pwdata;
+	cms->helper = job->cms->helper;
+	cms->tsa = job->cms->tsa;
+	cms->key_lock = &job->key_lock;
+	cms->page_hashes = job->cms->page_hashes;
+	cms->log = job->cms->log;
+	cms->log_priv = job->cms->log_priv;
+}
+
+static void
+unshare_signer(cms_context *cms)
+{
+	cms->tokenname = NULL;
+	cms->certname = NULL;
+	cms->template = NULL;
+	cms->pwdata = NULL;
+	cms->helper = NULL;
+	cms->tsa = NULL;
+	cms->key_lock = NULL;
+}
+
+/*
+ * Everything a file leaves in cms is either malloced, and freed here, or
+ * in the arena after mark, which the caller releases; forget about the
+ * latter so nothing looks at it again.
+ */
+static void
+forget_file(cms_context *cms)
+{
+	for (int i = 0; i < cms->num_signatures; i++) {
+		free(cms->signatures[i]->data);
+		free(cms->signatures[i]);
+	}
+	xfree(cms->signatures);
+	cms->num_signatures = 0;
+
+	if (cms->newsig.data) {
+		free(cms->newsig.data);
+		memset(&cms->newsig, '\0', sizeof (cms->newsig));
+	}
+
+	cms->ci_digest = NULL;
+	memset(&cms->page_hash_table, '\0', sizeof (cms->page_hash_table));
+	teardown_digests(cms);
+}
+
+static int
+write_all(int fd, const char *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* returns NULL if it worked, or why not */
+static const char *
+sign_one(sign_job *job, cms_context *cms, ingest_buffer *buf,
+	 const char *outpath)
+{
+	const char *error = NULL;
+	Pe *inpe, *outpe = NULL;
+	int outfd;
+
+	if (buf->error)
+		return strerror(buf->error);
+
+	inpe = pe_memory(buf->data, buf->size);
+	if (!inpe)
+		return pe_errmsg(pe_errno());
+
+	if (parse_signatures(&cms->signatures, &cms->num_signatures,
+			     inpe) < 0) {
+		pe_end(inpe);
+		return "could not parse signature list";
+	}
+	pe_end(inpe);
+
+	/* O_EXCL, rather than checking first, so nothing can appear at
+	 * outpath in between and get truncated anyway */
+	outfd = open(outpath, O_RDWR|O_CREAT|O_CLOEXEC|
+			      (job->force ? O_TRUNC : O_EXCL), job->outmode);
+	if (outfd < 0) {
+		if (errno == EEXIST)
+			return "output exists and --force was not given";
+		return strerror(errno);
+	}
+
+	if (write_all(outfd, buf->data, buf->size) < 0) {
+		error = strerror(errno);
+		goto err;
+	}
+
+	outpe = pe_begin(outfd, PE_C_RDWR_MMAP, NULL);
+	if (!outpe) {
+		error = pe_errmsg(pe_errno());
+		goto err;
+	}
+	pe_clearcert(outpe);
+
+	/* the digest covers the certificate table's directory entry, so
+	 * it has to be taken again once the space is allocated */
+	if (generate_digest(cms, outpe, 1) < 0) {
+		error = "could not generate digest";
+		goto err;
+	}
+	ssize_t sigspace = calculate_signature_space(cms, outpe);
+	if (sigspace < 0 || pe_alloccert(outpe, sigspace) < 0) {
+		error = "could not allocate space for signature";
+		goto err;
+	}
+	if (generate_digest(cms, outpe, 1) < 0) {
+		error = "could not generate digest";
+		goto err;
+	}
+	if (generate_signature(cms) < 0) {
+		error = "could not sign";
+		goto err;
+	}
+	insert_signature(cms, -1);
+	if (finalize_signatures(cms->signatures, cms->num_signatures,
+				outpe) < 0) {
+		error = "could not write signature";
+		goto err;
+	}
+	/* the certificate table went straight into the map, so like
+	 * close_output() in pesign.c there's nothing to check here */
+	pe_update(outpe, PE_C_RDWR_MMAP);
+	pe_end(outpe);
+	if (close(outfd) < 0) {
+		error = strerror(errno);
+		unlink(outpath);
+	}
+	return error;
+err:
+	if (outpe)
+		pe_end(outpe);
+	close(outfd);
+	unlink(outpath);
+	return error;
+}
+
+static void *
+sign_worker(void *arg)
+{
+	sign_job *job = arg;
+	cms_context *cms = NULL;
+
+	if (cms_context_alloc(&cms) < 0 ||
+	    set_digest_parameters(cms,
+			(char *)digest_get_digest_name(job->cms)) < 0) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		exit(1);
+	}
+	share_signer(job, cms);
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		ingest_buffer *buf = ingest_next(&job->ing);
+		pthread_mutex_unlock(&job->lock);
+		if (!buf)
+			break;
+
+		const char *outpath = job->outpaths[buf->index];
+		void *mark = PORT_ArenaMark(cms->arena);
+		const char *error = sign_one(job, cms, buf, outpath);
+		forget_file(cms);
+		PORT_ArenaRelease(cms->arena, mark);
+
+		pthread_mutex_lock(&job->lock);
+		if (error) {
+			fprintf(stderr, "pesign: could not sign \"%s\": %s\n",
+				buf->path, error);
+			job->failures++;
+		} else if (job->verbose) {
+			printf("%s -> %s\n", buf->path, outpath);
+		}
+		ingest_release(&job->ing, buf);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	unshare_signer(cms);
+	/* this frees cms, too */
+	cms_context_fini(cms);
+	return NULL;
+}
+
+static void
+add_pair(char ***inpaths, char ***outpaths, int *npaths, char *in, char *out)
+{
+	char **ins = realloc(*inpaths, sizeof (char *) * (*npaths + 1));
+	if (ins)
+		*inpaths = ins;
+	char **outs = realloc(*outpaths, sizeof (char *) * (*npaths + 1));
+	if (outs)
+		*outpaths = outs;
+	if (!ins || !outs || !in || !out) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		exit(1);
+	}
+	(*inpaths)[*npaths] = in;
+	(*outpaths)[*npaths] = out;
+	(*npaths)++;
+}
+
+/*
+ * One "input output" pair per line.  They're split at a tab if there is
+ * one, so that names can have spaces in them, and at the first run of
+ * spaces if not.  Blank lines and lines starting with '#' are skipped.
+ */
+static int
+read_manifest(const char *manifest, char ***inpaths, char ***outpaths,
+	      int *npaths)
+{
+	FILE *f = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int lineno = 0;
+	int rc = 0;
+
+	if (!f) {
+		fprintf(stderr, "pesign: could not open manifest \"%s\": "
+			"%m\n", manifest);
+		return -1;
+	}
+
+	while ((len = getline(&line, &size, f)) >= 0) {
+		lineno++;
+		while (len > 0 && (line[len - 1] == '\n' ||
+				   line[len - 1] == '\r'))
+			line[--len] = '\0';
+		char *in = line + strspn(line, " \t");
+		if (!*in || *in == '#')
+			continue;
+
+		char *sep = strchr(in, '\t');
+		if (!sep)
+			sep = strchr(in, ' ');
+		char *out = sep ? sep + strspn(sep, " \t") : NULL;
+		if (!out || !*out) {
+			fprintf(stderr, "pesign: %s:%d: no output file for "
+				"\"%s\"\n", manifest, lineno, in);
+			rc = -1;
 			continue;
 		}
+		*sep = '\0';
+		add_pair(inpaths, outpaths, npaths, strdup(in), strdup(out));
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return rc;
+}
 
-		nsigs++;
-		printf("---------------------------------------------\n");
-		printf("certificate address is %p\n", data);
-		printf("Content was%s encrypted.\n",
-			SEC_PKCS7ContentIsEncrypted(cinfo) ? "" : " not");
-		if (SEC_PKCS7ContentIsSigned(cinfo)) {
-			char *signer_cname, *signer_ename;
-			SECItem *signing_time;
-
-			if (saw_content) {
-				printf("Signature is ");
-				PORT_SetError(0);
-				if (SEC_PKCS7VerifySignature(cinfo,
-						certUsageEmailSigner,
-						PR_FALSE)) {
-					printf("valid.\n");
-				} else {
-					printf("invalid (Reason: 0x%08x).\n",
-						(uint32_t)PORT_GetError());
-				}
-			} else {
-				printf("Content is detached; signature cannot "
-					"be verified.\n");
-			}
-
-			signer_cname = SEC_PKCS7GetSignerCommonName(cinfo);
-			if (signer_cname != NULL) {
-				printf("The signer's common name is %s\n",
-					signer_cname);
-				PORT_Free(signer_cname);
-			} else {
-				printf("No signer common name.\n");
-			}
-
-			signer_ename = SEC_PKCS7GetSignerEmailAddress(cinfo);
-			if (signer_ename != NULL) {
-				printf("The signer's email address is %s\n",
-					signer_ename);
-				PORT_Free(signer_ename);
-			} else {
-				printf("No signer email address.\n");
-			}
-
-			signing_time = SEC_PKCS7GetSigningTime(cinfo);
-			if (signing_time != NULL) {
-				char *signing_time_str = DER_TimeChoiceDayToAscii(signing_time);
-				printf("Signing time: %s\n", signing_time_str);
-				PORT_Free(signing_time_str);
-			} else {
-				printf("No signing time included.\n");
-			}
-
-			printf("There were%s certs or crls included.\n",
-				SEC_PKCS7ContainsCertsOrCrls(cinfo) ? "" : " no");
-
-			SEC_PKCS7DestroyContentInfo(cinfo);
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* every regular file in indir, to the same name in outdir */
+static int
+read_directory(const char *indir, const char *outdir, char ***inpaths,
+	       char ***outpaths, int *npaths)
+{
+	struct stat statbuf;
+	struct dirent *de;
+	char **names = NULL;
+	int nnames = 0;
+	DIR *d;
+
+	if (!outdir) {
+		fprintf(stderr, "pesign: No output directory specified.\n");
+		return -1;
+	}
+	if (stat(outdir, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode)) {
+		fprintf(stderr, "pesign: \"%s\" is not a directory\n", outdir);
+		return -1;
+	}
+
+	d = opendir(indir);
+	if (!d) {
+		fprintf(stderr, "pesign: could not open \"%s\": %m\n", indir);
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_type != DT_REG && de->d_type != DT_LNK &&
+		    de->d_type != DT_UNKNOWN)
+			continue;
+		if (fstatat(dirfd(d), de->d_name, &statbuf, 0) < 0 ||
+		    !S_ISREG(statbuf.st_mode))
+			continue;
+
+		char **n = realloc(names, sizeof (char *) * (nnames + 1));
+		if (!n || !(n[nnames] = strdup(de->d_name))) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			exit(1);
 		}
+		names = n;
+		nnames++;
 	}
-	if (nsigs) {
-		printf("---------------------------------------------\n");
-	} else {
-		printf("No signatures found.\n");
+	closedir(d);
+
+	/* so the order (and what --verbose says) doesn't depend on the
+	 * filesystem */
+	if (nnames)
+		qsort(names, nnames, sizeof (char *), compare_names);
+	for (int i = 0; i < nnames; i++) {
+		char *in = NULL, *out = NULL;
+		if (asprintf(&in, "%s/%s", indir, names[i]) < 0)
+			in = NULL;
+		if (asprintf(&out, "%s/%s", outdir, names[i]) < 0)
+			out = NULL;
+		add_pair(inpaths, outpaths, npaths, in, out);
+		free(names[i]);
 	}
+	free(names);
+	return 0;
+}
+
+/*
+ * Two inputs written to the same place would race each other there, and
+ * at best one of them would be lost, so refuse before anything is signed.
+ * This only compares the names as given.
+ */
+static void
+check_duplicate_outputs(char **outpaths, int npaths)
+{
+	char **sorted = calloc(npaths, sizeof (char *));
+	int duplicates = 0;
+
+	if (!sorted) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		exit(1);
+	}
+	memcpy(sorted, outpaths, sizeof (char *) * npaths);
+	qsort(sorted, npaths, sizeof (char *), compare_names);
+	for (int i = 1; i < npaths; i++) {
+		if (strcmp(sorted[i - 1], sorted[i]))
+			continue;
+		/* only say so once however many times it's listed */
+		if (i < 2 || strcmp(sorted[i - 2], sorted[i]))
+			fprintf(stderr, "pesign: \"%s\" is the output for more "
+				"than one input\n", sorted[i]);
+		duplicates = 1;
+	}
+	free(sorted);
+	if (duplicates)
+		exit(1);
+}
+
+int
+sign_files(pesign_context *ctx)
+{
+	sign_job job;
+	char **paths = NULL;
+	int npaths = 0;
+	int rc;
+
+	memset(&job, '\0', sizeof (job));
+	job.cms = ctx->cms_ctx;
+	job.outmode = ctx->outmode;
+	job.force = ctx->force;
+	job.verbose = ctx->verbose;
+
+	if (ctx->manifest)
+		rc = read_manifest(ctx->manifest, &paths, &job.outpaths,
+				   &npaths);
+	else
+		rc = read_directory(ctx->infile, ctx->outfile, &paths,
+				    &job.outpaths, &npaths);
+	if (rc < 0)
+		exit(1);
+	if (npaths == 0) {
+		fprintf(stderr, "pesign: Nothing to sign.\n");
+		return 0;
+	}
+
+	for (int i = 0; i < npaths; i++) {
+		if (!strcmp(paths[i], job.outpaths[i])) {
+			fprintf(stderr, "pesign: \"%s\": in-place file editing "
+				"is not yet supported\n", paths[i]);
+			exit(1);
+		}
+	}
+	check_duplicate_outputs(job.outpaths, npaths);
+
+	/* everybody shares this, so it has to exist before they start */
+	if (generate_signer_template(ctx->cms_ctx) < 0) {
+		fprintf(stderr, "pesign: could not set up signer\n");
+		exit(1);
+	}
+
+	int jobs = ctx->list_jobs;
+	if (jobs <= 0) {
+		long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = nproc > 0 ? nproc : 1;
+	}
+	if (jobs > npaths)
+		jobs = npaths;
+
+	int depth = jobs * 2 > INGEST_DEFAULT_DEPTH ? jobs * 2
+						    : INGEST_DEFAULT_DEPTH;
+	if (ingest_start(&job.ing, paths, npaths, INGEST_AUTO, depth) < 0) {
+		fprintf(stderr, "pesign: could not start reading input: %m\n");
+		exit(1);
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_mutex_init(&job.key_lock, NULL);
+
+	pthread_t *threads = calloc(jobs, sizeof (pthread_t));
+	if (!threads) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		exit(1);
+	}
+	int nthreads = 0;
+	for (int i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[nthreads], NULL, sign_worker,
+				   &job) != 0)
+			break;
+		nthreads++;
+	}
+	sign_worker(&job);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (job.ing.next_out < npaths) {
+		fprintf(stderr, "pesign: could not read \"%s\": %s\n",
+			paths[job.ing.next_out], strerror(job.ing.error));
+		job.failures += npaths - job.ing.next_out;
+	}
+	ingest_finish(&job.ing);
+	pthread_mutex_destroy(&job.key_lock);
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.failures)
+		fprintf(stderr, "pesign: %d of %d files could not be signed\n",
+			job.failures, npaths);
+	rc = job.failures ? -1 : 0;
+
+	for (int i = 0; i < npaths; i++) {
+		free(paths[i]);
+		free(job.outpaths[i]);
+	}
+	free(paths);
+	free(job.outpaths);
 	return rc;
 }
 
@@ -332,9 +1408,9 @@ parse_signature(pesign_context *ctx)
 
 #if 0
 	SEC_PKCS7DecoderContext *dc = NULL;
-	saw_content = 0;
-	dc = SEC_PKCS7DecoderStart(handle_bytes, NULL, NULL, NULL, NULL, NULL,
-				decryption_allowed);
+	int saw_content = 0;
+	dc = SEC_PKCS7DecoderStart(handle_bytes, &saw_content, NULL, NULL,
+				NULL, NULL, decryption_allowed);
 	if (dc == NULL) {
 decoder_error:
 		fprintf(stderr, "pesign: Invalid signature.\n");
@@ -358,14 +1434,15 @@ decoder_error:
 void
 import_raw_signature(pesign_context *pctx)
 {
-	if (pctx->rawsigfd < 0 || pctx->insattrsfd < 0) {
+	cms_context *ctx = pctx->cms_ctx;
+
+	if (pctx->rawsigfd < 0 ||
+			(pctx->insattrsfd < 0 && !ctx->raw_signed_attrs)) {
 		fprintf(stderr, "pesign: raw signature and signed attributes "
 			"must both be imported.\n");
 		exit(1);
 	}
 
-	cms_context *ctx = pctx->cms_ctx;
-
 	ctx->raw_signature = SECITEM_AllocItem(ctx->arena, NULL, 0);
 	ctx->raw_signature->type = siBuffer;
 	int rc = read_file(pctx->rawsigfd,
@@ -376,6 +1453,10 @@ import_raw_signature(pesign_context *pctx)
 		exit(1);
 	}
 
+	/* the signing session already gave us these */
+	if (pctx->insattrsfd < 0)
+		return;
+
 	ctx->raw_signed_attrs = SECITEM_AllocItem(ctx->arena, NULL, 0);
 	ctx->raw_signed_attrs->type = siBuffer;
 	rc = read_file(pctx->insattrsfd,
@@ -388,6 +1469,212 @@ import_raw_signature(pesign_context *pctx)
 	}
 }
 
+/*
+ * A signing session is everything the second half of an external signing
+ * run needs in order to put the signature together: the digest of the
+ * binary, the SpcContentInfo and signed attributes that were handed to the
+ * external signer, and the signer's certificate chain.  With it, importing
+ * the raw signature needs neither another pass over the binary nor an NSS
+ * database holding the signer's certificate.
+ */
+#define SIGNING_SESSION_VERSION 1
+
+typedef struct {
+	SECItem version;
+	SECItem digest_type;
+	SECItem digest;
+	SECItem content_info;
+	SECItem signed_attrs;
+	SECItem **certificates;
+} SigningSession;
+
+static const SEC_ASN1Template SigningSessionTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (SigningSession)
+	},
+	{
+	.kind = SEC_ASN1_INTEGER,
+	.offset = offsetof(SigningSession, version),
+	.sub = &SEC_IntegerTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_OBJECT_ID,
+	.offset = offsetof(SigningSession, digest_type),
+	.sub = &SEC_ObjectIDTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING,
+	.offset = offsetof(SigningSession, digest),
+	.sub = &SEC_OctetStringTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_ANY,
+	.offset = offsetof(SigningSession, content_info),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_ANY,
+	.offset = offsetof(SigningSession, signed_attrs),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_SEQUENCE_OF,
+	.offset = offsetof(SigningSession, certificates),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem **)
+	},
+	{ 0, }
+};
+
+static void
+export_session(pesign_context *ctx, SpcContentInfo *ci, SECItem *sattrs)
+{
+	cms_context *cms = ctx->cms_ctx;
+	SigningSession session;
+
+	memset(&session, '\0', sizeof (session));
+
+	if (SEC_ASN1EncodeInteger(cms->arena, &session.version,
+				SIGNING_SESSION_VERSION) == NULL) {
+		fprintf(stderr, "pesign: could not encode session version\n");
+		exit(1);
+	}
+
+	SECOidData *oid = SECOID_FindOIDByTag(digest_get_digest_oid(cms));
+	if (!oid) {
+		fprintf(stderr, "pesign: could not find digest OID\n");
+		exit(1);
+	}
+	session.digest_type = oid->oid;
+	session.digest = *cms->digests[cms->selected_digest].pe_digest;
+
+	if (SEC_ASN1EncodeItem(cms->arena, &session.content_info, ci,
+			SpcContentInfoTemplate) == NULL) {
+		fprintf(stderr, "pesign: could not encode content info: %s\n",
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	session.signed_attrs = *sattrs;
+	session.certificates = cms->template->certificates;
+
+	SECItem der = { 0, };
+	if (SEC_ASN1EncodeItem(cms->arena, &der, &session,
+			SigningSessionTemplate) == NULL) {
+		fprintf(stderr, "pesign: could not encode signing session: "
+			"%s\n", PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	ssize_t rc = write(ctx->outsessionfd, der.data, der.len);
+	if (rc < 0 || (size_t)rc != der.len) {
+		fprintf(stderr, "pesign: could not write signing session: "
+			"%m\n");
+		exit(1);
+	}
+}
+
+void
+import_session(pesign_context *ctx)
+{
+	cms_context *cms = ctx->cms_ctx;
+	SigningSession session;
+	SECItem der = { 0, };
+	char *buf = NULL;
+	size_t len = 0;
+
+	if (read_file(ctx->insessionfd, &buf, &len) < 0) {
+		fprintf(stderr, "pesign: could not read signing session: %m\n");
+		exit(1);
+	}
+	der.data = (unsigned char *)buf;
+	der.len = len;
+
+	memset(&session, '\0', sizeof (session));
+	if (SEC_ASN1DecodeItem(cms->arena, &session, SigningSessionTemplate,
+			&der) != SECSuccess) {
+		fprintf(stderr, "pesign: could not decode signing session: "
+			"%s\n", PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	unsigned long version = 0;
+	if (SEC_ASN1DecodeInteger(&session.version, &version) != SECSuccess ||
+			version != SIGNING_SESSION_VERSION) {
+		fprintf(stderr, "pesign: unsupported signing session version\n");
+		exit(1);
+	}
+
+	if (import_digest(cms, SECOID_FindOIDTag(&session.digest_type),
+			&session.digest) < 0) {
+		fprintf(stderr, "pesign: could not import session digest\n");
+		exit(1);
+	}
+
+	/* The content info is completely determined by the digest; make sure
+	 * the one we'll embed is the one the signed attributes refer to. */
+	SpcContentInfo ci;
+	SECItem ci_der = { 0, };
+	memset(&ci, '\0', sizeof (ci));
+	if (generate_spc_content_info(cms, &ci) < 0 ||
+			SEC_ASN1EncodeItem(cms->arena, &ci_der, &ci,
+				SpcContentInfoTemplate) == NULL) {
+		fprintf(stderr, "Could not generate content info: %s\n",
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+	if (!SECITEM_ItemsAreEqual(&ci_der, &session.content_info)) {
+		fprintf(stderr, "pesign: signing session content info does "
+			"not match its digest\n");
+		exit(1);
+	}
+
+	cms->raw_signed_attrs = SECITEM_ArenaDupItem(cms->arena,
+						&session.signed_attrs);
+	if (!cms->raw_signed_attrs) {
+		fprintf(stderr, "pesign: could not allocate memory: %s\n",
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	if (generate_signer_template_from_der(cms, session.certificates) < 0) {
+		fprintf(stderr, "pesign: could not use session certificates\n");
+		exit(1);
+	}
+
+	free(buf);
+}
+
+/*
+ * A session is only any good for the binary it was exported from, so make
+ * sure that's the one the signature is about to go into.
+ */
+void
+check_session_digest(pesign_context *ctx)
+{
+	cms_context *cms = ctx->cms_ctx;
+	SECItem *expected = cms->digests[cms->selected_digest].pe_digest;
+
+	if (generate_digest(cms, ctx->outpe, 1) < 0) {
+		fprintf(stderr, "pesign: could not generate digest\n");
+		exit(1);
+	}
+	if (!SECITEM_ItemsAreEqual(expected,
+			cms->digests[cms->selected_digest].pe_digest)) {
+		fprintf(stderr, "pesign: signing session does not match "
+			"\"%s\"\n", ctx->infile);
+		exit(1);
+	}
+}
+
 int
 generate_sattr_blob(pesign_context *ctx)
 {
@@ -410,6 +1697,9 @@ generate_sattr_blob(pesign_context *ctx)
 		exit(1);
 	}
 
+	if (ctx->outsessionfd >= 0)
+		export_session(ctx, &ci, &sa);
+
 	return write(ctx->outsattrsfd, sa.data, sa.len);
 }
 
@@ -25,10 +25,14 @@
 #include "wincert.h"
 
 extern int list_signatures(pesign_context *ctx);
+extern int sign_catalog(pesign_context *ctx);
+extern int sign_files(pesign_context *ctx);
 extern void check_signature_space(pesign_context *ctx);
 extern void allocate_signature_space(Pe *pe, ssize_t sigspace);
 extern ssize_t export_signature(cms_context *cms, int fd, int ascii_armor);
 extern void import_raw_signature(pesign_context *pctx);
+extern void import_session(pesign_context *pctx);
+extern void check_session_digest(pesign_context *pctx);
 extern void remove_signature(pesign_context *ctx);
 extern void export_pubkey(pesign_context *ctx);
 extern void export_cert(pesign_context *ctx);
@@ -0,0 +1,556 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+#define ARCHIVE_BUFFER	(64 * 1024)
+
+/* enough of a member to find the PE header in anything sane */
+#define ARCHIVE_PEEK	4096
+
+/* nobody has a file name longer than this; a bigger one is garbage */
+#define ARCHIVE_MAX_NAME	(64 * 1024)
+#define ARCHIVE_MAX_PAX		(1024 * 1024)
+
+#define CPIO_HEADER_SIZE	110
+#define TAR_BLOCK_SIZE		512
+
+/*
+ * Make sure there are at least "want" bytes in the read-ahead buffer,
+ * unless the stream ends first.  Returns how many there are.
+ */
+static ssize_t
+fill(archive *ar, size_t want)
+{
+	if (ar->buf_pos > 0) {
+		memmove(ar->buf, ar->buf + ar->buf_pos,
+			ar->buf_end - ar->buf_pos);
+		ar->buf_end -= ar->buf_pos;
+		ar->buf_pos = 0;
+	}
+
+	while (ar->buf_end < want && !ar->eof) {
+		ssize_t rc = read(ar->fd, ar->buf + ar->buf_end,
+				  ARCHIVE_BUFFER - ar->buf_end);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			ar->eof = 1;
+		ar->buf_end += rc;
+	}
+	return ar->buf_end;
+}
+
+/*
+ * Copy the next n bytes of the stream to dst, or throw them away if dst
+ * is NULL.  Big reads into a member go straight from read() into the
+ * member's buffer rather than bouncing through ours.
+ */
+static int
+take(archive *ar, void *dst, size_t n)
+{
+	uint8_t *out = dst;
+
+	while (n > 0) {
+		size_t avail = ar->buf_end - ar->buf_pos;
+
+		if (avail == 0 && out && n >= ARCHIVE_BUFFER && !ar->eof) {
+			ssize_t rc = read(ar->fd, out, n);
+			if (rc < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			if (rc == 0) {
+				ar->eof = 1;
+				continue;
+			}
+			out += rc;
+			n -= rc;
+			ar->offset += rc;
+			continue;
+		}
+
+		if (avail == 0) {
+			if (ar->eof) {
+				/* truncated archive */
+				errno = EINVAL;
+				return -1;
+			}
+			if (fill(ar, 1) < 0)
+				return -1;
+			continue;
+		}
+
+		if (avail > n)
+			avail = n;
+		if (out) {
+			memcpy(out, ar->buf + ar->buf_pos, avail);
+			out += avail;
+		}
+		ar->buf_pos += avail;
+		ar->offset += avail;
+		n -= avail;
+	}
+	return 0;
+}
+
+static int
+skip_to(archive *ar, size_t alignment)
+{
+	size_t pad = (alignment - ar->offset % alignment) % alignment;
+	return take(ar, NULL, pad);
+}
+
+static int
+grow_data(archive *ar, size_t size)
+{
+	if (size <= ar->alloc)
+		return 0;
+
+	char *data = realloc(ar->data, size);
+	if (!data)
+		return -1;
+	ar->data = data;
+	ar->alloc = size;
+	return 0;
+}
+
+static inline uint32_t
+le32(const char *p)
+{
+	const uint8_t *u = (const uint8_t *)p;
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+/*
+ * Read a regular file member's data.  Returns 1 if it's a PE image and
+ * member has been filled in, 0 if it's something else and has been
+ * skipped, and -1 if the stream's broken.
+ */
+static int
+take_member(archive *ar, size_t size, archive_member *member)
+{
+	size_t have = size < ARCHIVE_PEEK ? size : ARCHIVE_PEEK;
+	int is_pe = 0;
+
+	if (grow_data(ar, ARCHIVE_PEEK) < 0)
+		return -1;
+	if (take(ar, ar->data, have) < 0)
+		return -1;
+
+	if (have >= 0x40 && ar->data[0] == 'M' && ar->data[1] == 'Z') {
+		size_t pe = le32(ar->data + 0x3c);
+
+		if (pe <= size - 4 && pe + 4 <= ar->max_member) {
+			if (pe + 4 > have) {
+				if (grow_data(ar, pe + 4) < 0)
+					return -1;
+				if (take(ar, ar->data + have, pe + 4 - have) < 0)
+					return -1;
+				have = pe + 4;
+			}
+			is_pe = !memcmp(ar->data + pe, "PE\0\0", 4);
+		}
+	}
+
+	if (!is_pe)
+		return take(ar, NULL, size - have);
+
+	memset(member, 0, sizeof (*member));
+	member->path = ar->path;
+	member->size = size;
+
+	if (size > ar->max_member) {
+		member->error = EFBIG;
+		return take(ar, NULL, size - have) < 0 ? -1 : 1;
+	}
+
+	if (grow_data(ar, size) < 0) {
+		member->error = errno;
+		return take(ar, NULL, size - have) < 0 ? -1 : 1;
+	}
+	if (take(ar, ar->data + have, size - have) < 0)
+		return -1;
+
+	member->data = ar->data;
+	return 1;
+}
+
+static void
+set_path(archive *ar, char *path)
+{
+	free(ar->path);
+	ar->path = path;
+}
+
+static int
+parse_hex(const uint8_t *s, uint32_t *val)
+{
+	uint32_t v = 0;
+
+	for (int i = 0; i < 8; i++) {
+		int c = s[i];
+
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else
+			return -1;
+		v = (v << 4) | c;
+	}
+	*val = v;
+	return 0;
+}
+
+static int
+is_cpio(const uint8_t *hdr)
+{
+	return !memcmp(hdr, "07070", 5) && (hdr[5] == '1' || hdr[5] == '2');
+}
+
+/*
+ * newc: a 110 byte header of hex fields, then the name, then the data,
+ * with the name and the data each padded out to 4 bytes.
+ */
+static int
+cpio_next(archive *ar, archive_member *member)
+{
+	for (;;) {
+		uint8_t hdr[CPIO_HEADER_SIZE];
+		uint32_t mode, filesize, namesize;
+
+		if (take(ar, hdr, sizeof (hdr)) < 0)
+			return -1;
+		if (!is_cpio(hdr) ||
+		    parse_hex(hdr + 14, &mode) < 0 ||
+		    parse_hex(hdr + 54, &filesize) < 0 ||
+		    parse_hex(hdr + 94, &namesize) < 0 ||
+		    namesize == 0 || namesize > ARCHIVE_MAX_NAME) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		char *name = malloc(namesize);
+		if (!name)
+			return -1;
+		if (take(ar, name, namesize) < 0) {
+			free(name);
+			return -1;
+		}
+		if (name[namesize - 1] != '\0') {
+			free(name);
+			errno = EINVAL;
+			return -1;
+		}
+		set_path(ar, name);
+		if (skip_to(ar, 4) < 0)
+			return -1;
+
+		if (!strcmp(name, "TRAILER!!!"))
+			return 0;
+
+		int rc;
+		if ((mode & 0170000) == 0100000)
+			rc = take_member(ar, filesize, member);
+		else
+			rc = take(ar, NULL, filesize);
+		if (rc < 0 || skip_to(ar, 4) < 0)
+			return -1;
+		if (rc > 0)
+			return 1;
+	}
+}
+
+static int
+tar_number(const uint8_t *s, size_t len, uint64_t *val)
+{
+	uint64_t v = 0;
+	size_t i = 0;
+
+	/* GNU base-256, for things too big for the octal field */
+	if (s[0] & 0x80) {
+		if (s[0] & 0x40)
+			return -1;
+		v = s[0] & 0x3f;
+		for (i = 1; i < len; i++) {
+			if (v >> 56)
+				return -1;
+			v = (v << 8) | s[i];
+		}
+		*val = v;
+		return 0;
+	}
+
+	while (i < len && s[i] == ' ')
+		i++;
+	for (; i < len && s[i] != '\0' && s[i] != ' '; i++) {
+		if (s[i] < '0' || s[i] > '7' || (v >> 61))
+			return -1;
+		v = (v << 3) | (s[i] - '0');
+	}
+	*val = v;
+	return 0;
+}
+
+static int
+tar_checksum_ok(const uint8_t *hdr)
+{
+	uint64_t want;
+	unsigned int usum = 0;
+	int ssum = 0;
+
+	if (tar_number(hdr + 148, 8, &want) < 0)
+		return 0;
+
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		uint8_t c = (i >= 148 && i < 156) ? ' ' : hdr[i];
+		usum += c;
+		ssum += (int8_t)c;
+	}
+	/* some old tars summed signed chars */
+	return want == usum || want == (uint64_t)(int64_t)ssum;
+}
+
+static int
+read_extension(archive *ar, uint64_t size, size_t limit, char **out)
+{
+	if (size > limit) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	char *data = malloc(size + 1);
+	if (!data)
+		return -1;
+	if (take(ar, data, size) < 0 || skip_to(ar, TAR_BLOCK_SIZE) < 0) {
+		free(data);
+		return -1;
+	}
+	data[size] = '\0';
+	*out = data;
+	return 0;
+}
+
+/*
+ * pax headers are "<len> <key>=<value>\n" records; the only one we care
+ * about is the path.
+ */
+static int
+parse_pax(archive *ar, const char *data, size_t size)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		char *end;
+		unsigned long len = strtoul(data + pos, &end, 10);
+
+		if (end == data + pos || *end != ' ' || len == 0 ||
+		    len > size - pos || data[pos + len - 1] != '\n') {
+			errno = EINVAL;
+			return -1;
+		}
+
+		const char *key = end + 1;
+		const char *stop = data + pos + len - 1;
+		if (stop - key > 5 && !memcmp(key, "path=", 5)) {
+			char *path = strndup(key + 5, stop - key - 5);
+			if (!path)
+				return -1;
+			free(ar->long_name);
+			ar->long_name = path;
+		}
+		pos += len;
+	}
+	return 0;
+}
+
+static char *
+tar_name(archive *ar, const uint8_t *hdr)
+{
+	if (ar->long_name) {
+		char *name = ar->long_name;
+		ar->long_name = NULL;
+		return name;
+	}
+
+	const char *name = (const char *)hdr;
+	const char *prefix = (const char *)hdr + 345;
+	size_t namelen = strnlen(name, 100);
+	size_t prefixlen = 0;
+
+	if (!memcmp(hdr + 257, "ustar", 5))
+		prefixlen = strnlen(prefix, 155);
+
+	char *path = malloc(prefixlen + namelen + 2);
+	if (!path)
+		return NULL;
+
+	char *p = path;
+	if (prefixlen) {
+		memcpy(p, prefix, prefixlen);
+		p += prefixlen;
+		*p++ = '/';
+	}
+	memcpy(p, name, namelen);
+	p[namelen] = '\0';
+	return path;
+}
+
+static int
+tar_next(archive *ar, archive_member *member)
+{
+	for (;;) {
+		uint8_t hdr[TAR_BLOCK_SIZE];
+		uint64_t size;
+		char *ext;
+
+		/* plenty of things stop writing after the first empty block */
+		ssize_t avail = fill(ar, 1);
+		if (avail < 0)
+			return -1;
+		if (avail == 0)
+			return 0;
+
+		if (take(ar, hdr, sizeof (hdr)) < 0)
+			return -1;
+
+		int i;
+		for (i = 0; i < TAR_BLOCK_SIZE && hdr[i] == 0; i++)
+			;
+		if (i == TAR_BLOCK_SIZE)
+			return 0;
+
+		if (!tar_checksum_ok(hdr) ||
+		    tar_number(hdr + 124, 12, &size) < 0 ||
+		    size > SIZE_MAX - TAR_BLOCK_SIZE) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		switch (hdr[156]) {
+		case 'L':
+			if (read_extension(ar, size, ARCHIVE_MAX_NAME,
+					   &ext) < 0)
+				return -1;
+			free(ar->long_name);
+			ar->long_name = ext;
+			continue;
+		case 'x':
+			if (read_extension(ar, size, ARCHIVE_MAX_PAX,
+					   &ext) < 0)
+				return -1;
+			int rc = parse_pax(ar, ext, size);
+			free(ext);
+			if (rc < 0)
+				return -1;
+			continue;
+		case '0':
+		case '7':
+		case '\0':
+			break;
+		default:
+			/* directories, links, devices, and global pax */
+			if (take(ar, NULL, size) < 0 ||
+			    skip_to(ar, TAR_BLOCK_SIZE) < 0)
+				return -1;
+			free(ar->long_name);
+			ar->long_name = NULL;
+			continue;
+		}
+
+		char *path = tar_name(ar, hdr);
+		if (!path)
+			return -1;
+		set_path(ar, path);
+
+		int rc = take_member(ar, size, member);
+		if (rc < 0 || skip_to(ar, TAR_BLOCK_SIZE) < 0)
+			return -1;
+		if (rc > 0)
+			return 1;
+	}
+}
+
+int
+archive_open(archive *ar, int fd)
+{
+	memset(ar, 0, sizeof (*ar));
+	ar->fd = fd;
+	ar->max_member = ARCHIVE_MAX_MEMBER;
+
+	ar->buf = malloc(ARCHIVE_BUFFER);
+	if (!ar->buf)
+		return -1;
+
+	ssize_t avail = fill(ar, TAR_BLOCK_SIZE);
+	if (avail < 0)
+		goto err;
+
+	if (avail >= CPIO_HEADER_SIZE && is_cpio(ar->buf)) {
+		ar->format = ARCHIVE_CPIO;
+		return 0;
+	}
+	if (avail >= TAR_BLOCK_SIZE && tar_checksum_ok(ar->buf)) {
+		ar->format = ARCHIVE_TAR;
+		return 0;
+	}
+	errno = EINVAL;
+err:
+	free(ar->buf);
+	ar->buf = NULL;
+	return -1;
+}
+
+/*
+ * Find the next PE image in the stream.  Returns 1 and fills in member,
+ * whose data stays good until the next call, or 0 at the end of the
+ * archive, or -1 with errno set if the archive can't be read.  A PE
+ * member we couldn't keep is returned with member->error set; the
+ * stream carries on after it.
+ */
+int
+archive_next(archive *ar, archive_member *member)
+{
+	if (ar->format == ARCHIVE_CPIO)
+		return cpio_next(ar, member);
+	return tar_next(ar, member);
+}
+
+void
+archive_close(archive *ar)
+{
+	free(ar->buf);
+	free(ar->data);
+	free(ar->path);
+	free(ar->long_name);
+	memset(ar, 0, sizeof (*ar));
+	ar->fd = -1;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reads PE images straight out of a cpio (newc) or tar stream, so release
+ * checks don't have to unpack an RPM payload to disk just to look at the
+ * few EFI binaries in it.  The stream is read once, front to back, so a
+ * pipe is as good as a file; an RPM goes through rpm2cpio (and whatever
+ * decompresses the payload) on the way in.
+ *
+ * Members that don't start with an MZ header pointing at a PE signature
+ * are skipped through a small fixed buffer.  Only PE members are kept,
+ * one at a time, in a buffer that gets reused for the next one, so memory
+ * use is bounded by the biggest PE image rather than by the archive.
+ */
+typedef enum {
+	ARCHIVE_CPIO,
+	ARCHIVE_TAR,
+} archive_format;
+
+#define ARCHIVE_MAX_MEMBER	(256 * 1024 * 1024)
+
+typedef struct {
+	int fd;
+	archive_format format;
+
+	/* read-ahead from the stream */
+	uint8_t *buf;
+	size_t buf_pos;
+	size_t buf_end;
+	uint64_t offset;		/* bytes consumed so far */
+	int eof;
+
+	/* the member we've most recently returned */
+	char *path;
+	char *data;
+	size_t size;
+	size_t alloc;
+	size_t max_member;
+
+	char *long_name;		/* from a GNU 'L' or pax header */
+} archive;
+
+typedef struct {
+	const char *path;
+	char *data;			/* NULL if error is set */
+	size_t size;
+	int error;			/* an errno, or 0 */
+} archive_member;
+
+extern int archive_open(archive *ar, int fd);
+extern int archive_next(archive *ar, archive_member *member);
+extern void archive_close(archive *ar);
+
+#endif /* ARCHIVE_H */
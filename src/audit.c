@@ -0,0 +1,351 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <popt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pesign.h"
+
+typedef struct {
+	long uid;
+	char *token;
+	char *cert;
+	char *requester;
+	int status;
+	char *digest;
+	uint64_t since;
+	uint64_t until;
+} audit_filter;
+
+typedef struct {
+	uint64_t count[AUDIT_STATUS_MAX];
+	uint64_t wait_usecs;
+	uint64_t total_usecs;
+	uint64_t served;
+} audit_summary;
+
+static uint64_t
+parse_time(const char *s)
+{
+	struct tm tm;
+	char *end;
+
+	memset(&tm, '\0', sizeof (tm));
+	end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+	if (!end || *end) {
+		memset(&tm, '\0', sizeof (tm));
+		end = strptime(s, "%Y-%m-%d", &tm);
+	}
+	if (!end || *end) {
+		errno = 0;
+		unsigned long long secs = strtoull(s, &end, 10);
+		if (errno || *end)
+			errx(1, "could not parse time \"%s\"", s);
+		return secs * 1000000000ULL;
+	}
+
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	if (t == (time_t)-1)
+		errx(1, "could not parse time \"%s\"", s);
+	return (uint64_t)t * 1000000000ULL;
+}
+
+static int
+parse_status(const char *s)
+{
+	for (int i = 0; i < AUDIT_STATUS_MAX; i++) {
+		if (!strcmp(s, audit_status_name(i)))
+			return i;
+	}
+	errx(1, "unknown status \"%s\"", s);
+}
+
+static void
+format_digest(audit_record *r, char *buf)
+{
+	buf[0] = '\0';
+	for (uint32_t i = 0; i < r->digest_len && i < sizeof (r->digest); i++)
+		sprintf(buf + i * 2, "%02x", r->digest[i]);
+}
+
+static int
+matches(audit_filter *filter, audit_record *r)
+{
+	if (filter->uid >= 0 && r->uid != (uint32_t)filter->uid)
+		return 0;
+	if (filter->token && strcmp(filter->token, r->token))
+		return 0;
+	if (filter->cert && strcmp(filter->cert, r->cert))
+		return 0;
+	if (filter->requester && strcmp(filter->requester, r->requester))
+		return 0;
+	if (filter->status >= 0 && r->status != (uint32_t)filter->status)
+		return 0;
+	if (filter->since && r->time < filter->since)
+		return 0;
+	if (filter->until && r->time >= filter->until)
+		return 0;
+	if (filter->digest) {
+		char digest[sizeof (r->digest) * 2 + 1];
+
+		format_digest(r, digest);
+		if (strncasecmp(digest, filter->digest,
+				strlen(filter->digest)))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+print_record(audit_record *r)
+{
+	char digest[sizeof (r->digest) * 2 + 1];
+	char timebuf[64] = "";
+	time_t t = r->time / 1000000000ULL;
+	struct tm tm;
+
+	if (localtime_r(&t, &tm))
+		strftime(timebuf, sizeof (timebuf), "%Y-%m-%d %H:%M:%S", &tm);
+	format_digest(r, digest);
+
+	if (r->status == AUDIT_LOST) {
+		printf("%s.%06llu %-9s %d records\n", timebuf,
+			(unsigned long long)(r->time % 1000000000ULL) / 1000,
+			audit_status_name(r->status), r->rc);
+		return;
+	}
+
+	printf("%s.%06llu %-9s uid=%u pid=%u queue=%s key=\"%s:%s\" rc=%d "
+		"wait=%uus cert=%uus digest=%uus sign=%uus total=%uus",
+		timebuf,
+		(unsigned long long)(r->time % 1000000000ULL) / 1000,
+		audit_status_name(r->status), r->uid, r->pid, r->queue,
+		r->token, r->cert, r->rc, r->wait_usecs, r->cert_usecs,
+		r->digest_usecs, r->sign_usecs, r->total_usecs);
+	if (r->digest_len)
+		printf(" %s:%s", r->digest_name, digest);
+	if (r->requester[0])
+		printf(" requester=\"%s\"", r->requester);
+	printf("\n");
+}
+
+static void
+print_summary(audit_summary *summary)
+{
+	for (int i = 0; i < AUDIT_STATUS_MAX; i++)
+		printf("%-9s %llu\n", audit_status_name(i),
+			(unsigned long long)summary->count[i]);
+
+	uint64_t served = summary->served ? summary->served : 1;
+	printf("average wait %llu us, average signing time %llu us\n",
+		(unsigned long long)(summary->wait_usecs / served),
+		(unsigned long long)(summary->total_usecs / served));
+}
+
+static void
+read_log(const char *path, audit_filter *filter, audit_summary *summary)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		err(1, "could not open \"%s\"", path);
+
+	audit_log_header hdr;
+	if (fread(&hdr, sizeof (hdr), 1, f) != 1)
+		errx(1, "\"%s\" is not a pesign audit log", path);
+	if (memcmp(hdr.magic, AUDIT_LOG_MAGIC, sizeof (hdr.magic)))
+		errx(1, "\"%s\" is not a pesign audit log", path);
+	size_t record_size = sizeof (audit_record);
+	if (hdr.version == 1 && hdr.record_size == AUDIT_RECORD_V1_SIZE)
+		record_size = AUDIT_RECORD_V1_SIZE;
+	else if (hdr.version != AUDIT_LOG_VERSION ||
+			hdr.record_size != sizeof (audit_record))
+		errx(1, "\"%s\": unsupported audit log version %u",
+			path, hdr.version);
+
+	audit_record r;
+	memset(&r, '\0', sizeof (r));
+	while (fread(&r, record_size, 1, f) == 1) {
+		r.queue[sizeof (r.queue) - 1] = '\0';
+		r.token[sizeof (r.token) - 1] = '\0';
+		r.cert[sizeof (r.cert) - 1] = '\0';
+		r.digest_name[sizeof (r.digest_name) - 1] = '\0';
+		r.requester[sizeof (r.requester) - 1] = '\0';
+
+		if (!matches(filter, &r))
+			continue;
+
+		if (!summary) {
+			print_record(&r);
+			continue;
+		}
+
+		if (r.status == AUDIT_LOST)
+			summary->count[r.status] += r.rc;
+		else if (r.status < AUDIT_STATUS_MAX)
+			summary->count[r.status]++;
+		if (r.status == AUDIT_SIGNED || r.status == AUDIT_FAILED) {
+			summary->served++;
+			summary->wait_usecs += r.wait_usecs;
+			summary->total_usecs += r.total_usecs;
+		}
+	}
+	if (ferror(f))
+		err(1, "could not read \"%s\"", path);
+	fclose(f);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rc;
+	char *infile = NULL;
+	char *status = NULL;
+	char *since = NULL;
+	char *until = NULL;
+	int summarize = 0;
+	audit_filter filter = {
+		.uid = -1,
+		.status = -1,
+	};
+
+	poptContext optCon;
+	struct poptOption options[] = {
+		{.argInfo = POPT_ARG_INTL_DOMAIN,
+		 .arg = "pesign" },
+		{.longName = "in",
+		 .shortName = 'i',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &infile,
+		 .descrip = "audit log to read",
+		 .argDescrip = "<infile>" },
+		{.longName = "uid",
+		 .shortName = 'u',
+		 .argInfo = POPT_ARG_LONG,
+		 .arg = &filter.uid,
+		 .descrip = "only show requests from this uid",
+		 .argDescrip = "<uid>" },
+		{.longName = "token",
+		 .shortName = 't',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &filter.token,
+		 .descrip = "only show requests for this NSS token",
+		 .argDescrip = "<token>" },
+		{.longName = "certificate",
+		 .shortName = 'c',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &filter.cert,
+		 .descrip = "only show requests for this certificate",
+		 .argDescrip = "<nickname>" },
+		{.longName = "requester",
+		 .shortName = 'r',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &filter.requester,
+		 .descrip = "only show requests pesign-gateway made for this "
+			    "client",
+		 .argDescrip = "<subject>" },
+		{.longName = "status",
+		 .shortName = 's',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &status,
+		 .descrip = "only show requests which were signed, failed, "
+			    "rejected, expired, cancelled, or lost",
+		 .argDescrip = "<status>" },
+		{.longName = "digest",
+		 .shortName = 'd',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &filter.digest,
+		 .descrip = "only show images whose digest starts with this",
+		 .argDescrip = "<hex>" },
+		{.longName = "since",
+		 .shortName = 'S',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &since,
+		 .descrip = "only show requests from this time on",
+		 .argDescrip = "<time>" },
+		{.longName = "until",
+		 .shortName = 'U',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &until,
+		 .descrip = "only show requests before this time",
+		 .argDescrip = "<time>" },
+		{.longName = "summary",
+		 .shortName = 'm',
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &summarize,
+		 .val = 1,
+		 .descrip = "print totals instead of each request" },
+		POPT_AUTOALIAS
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+
+	optCon = poptGetContext("pesign", argc, (const char **)argv, options,0);
+
+	rc = poptReadDefaultConfig(optCon, 0);
+	if (rc < 0 && !(rc == POPT_ERROR_ERRNO && errno == ENOENT)) {
+		fprintf(stderr,
+			"pesign-audit: poptReadDefaultConfig failed: %s\n",
+			poptStrerror(rc));
+		exit(1);
+	}
+
+	while ((rc = poptGetNextOpt(optCon)) > 0)
+		;
+
+	if (rc < -1) {
+		fprintf(stderr, "pesign-audit: Invalid argument: %s: %s\n",
+			poptBadOption(optCon, 0), poptStrerror(rc));
+		exit(1);
+	}
+
+	if (poptPeekArg(optCon)) {
+		fprintf(stderr, "pesign-audit: Invalid Argument: \"%s\"\n",
+			poptPeekArg(optCon));
+		exit(1);
+	}
+
+	if (!infile) {
+		fprintf(stderr, "pesign-audit: no input file specified\n");
+		exit(1);
+	}
+
+	if (status)
+		filter.status = parse_status(status);
+	if (since)
+		filter.since = parse_time(since);
+	if (until)
+		filter.until = parse_time(until);
+
+	audit_summary summary;
+	memset(&summary, '\0', sizeof (summary));
+
+	read_log(infile, &filter, summarize ? &summary : NULL);
+
+	if (summarize)
+		print_summary(&summary);
+
+	poptFreeContext(optCon);
+	return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pesign.h"
+
+static const char *status_names[] = {
+	[AUDIT_SIGNED] = "signed",
+	[AUDIT_FAILED] = "failed",
+	[AUDIT_REJECTED] = "rejected",
+	[AUDIT_EXPIRED] = "expired",
+	[AUDIT_CANCELLED] = "cancelled",
+	[AUDIT_LOST] = "lost",
+};
+
+const char *
+audit_status_name(uint32_t status)
+{
+	if (status >= AUDIT_STATUS_MAX)
+		return "unknown";
+	return status_names[status];
+}
+
+void
+audit_set_string(char *dest, size_t size, const char *src)
+{
+	if (!src)
+		src = "";
+	strncpy(dest, src, size - 1);
+	dest[size - 1] = '\0';
+}
+
+static int
+write_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+audit_log_open(audit_log *log, const char *path, int use_syslog,
+	       int syslog_priority, int full_wait_msecs)
+{
+	memset(log, '\0', sizeof (*log));
+	log->fd = -1;
+	log->efd = -1;
+	log->use_syslog = use_syslog;
+	log->syslog_priority = syslog_priority;
+	log->full_wait_usecs = full_wait_msecs > 0 ? full_wait_msecs * 1000 : 0;
+
+	if (!path && !use_syslog)
+		return 0;
+
+	if (path) {
+		log->fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,
+			       0600);
+		if (log->fd < 0)
+			return -1;
+
+		struct stat sb;
+		if (fstat(log->fd, &sb) < 0)
+			goto err;
+
+		audit_log_header hdr = {
+			.magic = AUDIT_LOG_MAGIC,
+			.version = AUDIT_LOG_VERSION,
+			.record_size = sizeof (audit_record),
+		};
+		if (sb.st_size == 0) {
+			if (write_all(log->fd, &hdr, sizeof (hdr)) < 0)
+				goto err;
+		} else {
+			/* we can't append our records to an older log */
+			audit_log_header old;
+
+			if (pread(log->fd, &old, sizeof (old), 0) !=
+					sizeof (old) ||
+			    memcmp(&old, &hdr, sizeof (hdr))) {
+				errno = EPROTO;
+				goto err;
+			}
+		}
+	}
+
+	log->efd = eventfd(0, EFD_CLOEXEC);
+	if (log->efd < 0)
+		goto err;
+
+	log->slots = calloc(AUDIT_RING_SIZE, sizeof (audit_slot));
+	if (!log->slots)
+		goto err;
+	log->mask = AUDIT_RING_SIZE - 1;
+	for (uint64_t i = 0; i < AUDIT_RING_SIZE; i++)
+		log->slots[i].seq = i;
+
+	return 0;
+err:
+	if (log->fd >= 0)
+		save_errno(close(log->fd));
+	if (log->efd >= 0)
+		save_errno(close(log->efd));
+	log->fd = -1;
+	log->efd = -1;
+	return -1;
+}
+
+static void
+wake_writer(audit_log *log)
+{
+	uint64_t one = 1;
+	write(log->efd, &one, sizeof (one));
+}
+
+#define AUDIT_FULL_RETRY_USECS 100
+
+/* Sleep a little if we haven't been waiting for room longer than we're
+ * allowed to; the deadline is set the first time through. */
+static int
+still_waiting(audit_log *log, struct timespec *deadline)
+{
+	struct timespec now;
+
+	if (!log->full_wait_usecs)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!deadline->tv_sec && !deadline->tv_nsec) {
+		uint64_t ns = now.tv_nsec + log->full_wait_usecs * 1000ULL;
+		deadline->tv_sec = now.tv_sec + ns / 1000000000;
+		deadline->tv_nsec = ns % 1000000000;
+	} else if (now.tv_sec > deadline->tv_sec ||
+		   (now.tv_sec == deadline->tv_sec &&
+		    now.tv_nsec >= deadline->tv_nsec)) {
+		return 0;
+	}
+
+	struct timespec ts = {
+		.tv_nsec = AUDIT_FULL_RETRY_USECS * 1000,
+	};
+	nanosleep(&ts, NULL);
+	return 1;
+}
+
+/*
+ * This is a bounded multi-producer, single-consumer ring: each slot's
+ * sequence number says whether it's free for the producer that claimed
+ * position "pos" (seq == pos), or full and waiting for the writer
+ * (seq == pos + 1).  Producers never wait on each other; they only wait
+ * (for at most full_wait_usecs) on the writer when the ring is full.
+ */
+void
+audit_log_submit(audit_log *log, audit_record *record)
+{
+	if (!log->slots)
+		return;
+
+	uint64_t pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+	struct timespec deadline = { 0, 0 };
+	audit_slot *slot;
+
+	while (1) {
+		slot = &log->slots[pos & log->mask];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)seq - (int64_t)pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&log->head, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* the writer is behind; give it a moment to catch up,
+			 * but don't hold up signing for it indefinitely. */
+			if (still_waiting(log, &deadline)) {
+				pos = __atomic_load_n(&log->head,
+						      __ATOMIC_RELAXED);
+				continue;
+			}
+
+			/* everything before "pos" is already in the ring, so
+			 * that's where the marker goes. */
+			__atomic_store_n(&log->lost_at, pos, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELEASE);
+			wake_writer(log);
+			return;
+		} else {
+			pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(&slot->record, record, sizeof (*record));
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	wake_writer(log);
+}
+
+/*
+ * If records have been dropped since the last marker, and everything that
+ * was in the ring ahead of them has been taken out, make an AUDIT_LOST
+ * record to stand in for them.
+ */
+static int
+take_marker(audit_log *log, audit_record *record)
+{
+	uint64_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_ACQUIRE);
+	if (dropped == log->reported)
+		return 0;
+	if (__atomic_load_n(&log->lost_at, __ATOMIC_RELAXED) > log->tail)
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	memset(record, '\0', sizeof (*record));
+	record->time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	record->status = AUDIT_LOST;
+	record->rc = dropped - log->reported > INT32_MAX
+		     ? INT32_MAX : (int32_t)(dropped - log->reported);
+	log->reported = dropped;
+	return 1;
+}
+
+static int
+take_record(audit_log *log, audit_record *record)
+{
+	uint64_t pos = log->tail;
+	audit_slot *slot = &log->slots[pos & log->mask];
+
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq != pos + 1)
+		return 0;
+
+	memcpy(record, &slot->record, sizeof (*record));
+	__atomic_store_n(&slot->seq, pos + log->mask + 1, __ATOMIC_RELEASE);
+	log->tail = pos + 1;
+	return 1;
+}
+
+static void
+syslog_record(audit_log *log, audit_record *r)
+{
+	char digest[sizeof (r->digest) * 2 + 1] = "";
+
+	if (r->status == AUDIT_LOST) {
+		syslog(log->syslog_priority|LOG_WARNING,
+			"audit log dropped %d records", r->rc);
+		return;
+	}
+
+	for (uint32_t i = 0; i < r->digest_len && i < sizeof (r->digest); i++)
+		snprintf(digest + i * 2, 3, "%02x", r->digest[i]);
+
+	syslog(log->syslog_priority|LOG_NOTICE,
+		"%s \"%s:%s\" for uid %u pid %u (queue %s): rc %d, "
+		"waited %u us, certificate %u us, digest %u us, "
+		"signing %u us, total %u us, %s %s%s%s",
+		audit_status_name(r->status), r->token, r->cert, r->uid,
+		r->pid, r->queue, r->rc, r->wait_usecs, r->cert_usecs,
+		r->digest_usecs, r->sign_usecs, r->total_usecs,
+		r->digest_len ? r->digest_name : "no digest", digest,
+		r->requester[0] ? ", for " : "", r->requester);
+}
+
+#define AUDIT_BATCH 32
+
+static void
+drain(audit_log *log)
+{
+	audit_record batch[AUDIT_BATCH];
+	int n;
+
+	do {
+		for (n = 0; n < AUDIT_BATCH; n++) {
+			if (!take_marker(log, &batch[n]) &&
+					!take_record(log, &batch[n]))
+				break;
+		}
+		if (n == 0)
+			break;
+
+		if (log->fd >= 0 && write_all(log->fd, batch,
+					      n * sizeof (batch[0])) < 0)
+			syslog(log->syslog_priority|LOG_ERR,
+				"could not write audit log: %m");
+
+		/* lost records get a warning even if the rest don't go
+		 * to syslog */
+		for (int i = 0; i < n; i++) {
+			if (log->use_syslog || batch[i].status == AUDIT_LOST)
+				syslog_record(log, &batch[i]);
+		}
+	} while (n == AUDIT_BATCH);
+}
+
+static void *
+audit_writer(void *data)
+{
+	audit_log *log = data;
+
+	while (1) {
+		drain(log);
+
+		if (__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+			drain(log);
+			break;
+		}
+
+		uint64_t count;
+		if (read(log->efd, &count, sizeof (count)) < 0 &&
+				errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+
+int
+audit_log_start(audit_log *log)
+{
+	if (!log->slots || log->running)
+		return 0;
+
+	/* signals are the main loop's business, not ours */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	int rc = pthread_create(&log->thread, NULL, audit_writer, log);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	log->running = 1;
+	return 0;
+}
+
+void
+audit_log_close(audit_log *log)
+{
+	if (log->running) {
+		uint64_t one = 1;
+
+		__atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+		write(log->efd, &one, sizeof (one));
+		pthread_join(log->thread, NULL);
+		log->running = 0;
+	}
+
+	if (log->fd >= 0)
+		close(log->fd);
+	if (log->efd >= 0)
+		close(log->efd);
+	log->fd = -1;
+	log->efd = -1;
+	xfree(log->slots);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef AUDIT_LOG_H
+#define AUDIT_LOG_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * pesignd's audit log is a file of fixed size records, one for every
+ * signing request, after a small header.  Records are only ever appended.
+ *
+ * The daemon doesn't write them itself; it drops them in a ring buffer,
+ * and a writer thread takes them out and writes them to the file (and, if
+ * asked to, formats them for syslog).  If the writer falls behind and the
+ * ring fills up, a request waits a little while for room; after that its
+ * record is dropped, and an AUDIT_LOST record saying how many went missing
+ * is written where they would have been.  "pesign-audit" decodes the file.
+ */
+#define AUDIT_LOG_MAGIC		"PESIGNAL"
+#define AUDIT_LOG_VERSION	2
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} audit_log_header;
+
+typedef enum {
+	AUDIT_SIGNED,
+	AUDIT_FAILED,
+	AUDIT_REJECTED,
+	AUDIT_EXPIRED,
+	AUDIT_CANCELLED,
+	AUDIT_LOST,			/* rc is how many records */
+	AUDIT_STATUS_MAX
+} audit_status;
+
+typedef struct {
+	uint64_t time;			/* CLOCK_REALTIME, in nanoseconds */
+	uint32_t uid;			/* of the client */
+	uint32_t pid;
+	uint32_t command;		/* pesignd_cmd */
+	uint32_t status;		/* audit_status */
+	int32_t rc;
+	uint32_t digest_len;
+	char digest_name[16];
+	uint8_t digest[64];		/* of the input image */
+	uint32_t wait_usecs;		/* in the queue */
+	uint32_t cert_usecs;		/* finding the certificate */
+	uint32_t digest_usecs;		/* hashing the image */
+	uint32_t sign_usecs;		/* making the signature */
+	uint32_t total_usecs;		/* everything after the queue */
+	char queue[32];
+	char token[64];
+	char cert[64];
+	/* version 2: who pesign-gateway says the request came from */
+	char requester[128];
+} audit_record;
+
+/* version 1 records are the same, up to "requester" */
+#define AUDIT_RECORD_V1_SIZE	offsetof(audit_record, requester)
+
+typedef struct {
+	uint64_t seq;
+	audit_record record;
+} audit_slot;
+
+typedef struct {
+	audit_slot *slots;
+	uint64_t mask;
+	uint64_t head;			/* next slot to fill */
+	uint64_t tail;			/* next slot to write out */
+	uint64_t dropped;
+	uint64_t lost_at;		/* where the last one would have gone */
+	uint64_t reported;		/* dropped records we've marked */
+	unsigned int full_wait_usecs;
+
+	int fd;
+	int efd;
+	int use_syslog;
+	int syslog_priority;
+	int stop;
+	int running;
+	pthread_t thread;
+} audit_log;
+
+#define AUDIT_RING_SIZE 1024
+#define AUDIT_FULL_WAIT_MSECS 100
+
+extern int audit_log_open(audit_log *log, const char *path, int use_syslog,
+			  int syslog_priority, int full_wait_msecs);
+extern int audit_log_start(audit_log *log);
+extern void audit_log_close(audit_log *log);
+extern void audit_log_submit(audit_log *log, audit_record *record);
+extern const char *audit_status_name(uint32_t status);
+extern void audit_set_string(char *dest, size_t size, const char *src);
+
+#endif /* AUDIT_LOG_H */
@@ -131,6 +131,8 @@ open_input(authvar_context *ctx)
 		fprintf(stderr, "authvar: Error mapping valuefile: %m\n");
 		exit(1);
 	}
+	/* it gets hashed once and written once, front to back */
+	madvise(ctx->value, ctx->value_size, MADV_SEQUENTIAL);
 }
 
 #define EFIVAR_DIR "/sys/firmware/efi/efivars/"
@@ -19,6 +19,7 @@
 
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <prerror.h>
 #include <nss.h>
@@ -86,42 +87,42 @@ generate_descriptor(authvar_context *ctx)
 {
 	win_cert_uefi_guid_t *authinfo;
 	SECItem sd_der;
-	char *name_ptr;
-	uint8_t *buf, *ptr;
-	size_t buf_len;
+	efi_char16_t *name;
+	size_t name_len;
 	uint64_t offset;
-	efi_char16_t *wptr;
 	int rc;
 
-	/* prepare buffer for varname, vendor_guid, attr, timestamp, value */
-	buf_len = strlen(ctx->name)*sizeof(efi_char16_t) + sizeof(efi_guid_t) +
-		  sizeof(uint32_t) + sizeof(efi_time_t) + ctx->value_size;
-	buf = calloc(1, buf_len);
-	if (!buf)
+	/*
+	 * What gets signed is the variable name, vendor guid, attributes,
+	 * timestamp, and value, one after the other.  Hash them where they
+	 * are, rather than copying a value that might be a whole dbx update
+	 * in after the rest.
+	 */
+	name_len = strlen(ctx->name);
+	name = calloc(name_len, sizeof(efi_char16_t));
+	if (name_len && !name)
 		return -1;
+	for (size_t i = 0; i < name_len; i++)
+		name[i] = ctx->name[i];
 
-	ptr = buf;
-	name_ptr = ctx->name;
-	while (*name_ptr != '\0') {
-		wptr = (efi_char16_t *)ptr;
-		*wptr = *name_ptr;
-		name_ptr++;
-		ptr += sizeof(efi_char16_t);
+	rc = generate_digest_begin(ctx->cms_ctx);
+	if (rc < 0) {
+		free(name);
+		return rc;
 	}
-
-	memcpy(ptr, &ctx->guid, sizeof(efi_guid_t));
-	ptr += sizeof(efi_guid_t);
-
-	memcpy(ptr, &ctx->attr, sizeof(uint32_t));
-	ptr += sizeof(uint32_t);
-
-	memcpy(ptr, &ctx->timestamp, sizeof(efi_time_t));
-	ptr += sizeof(efi_time_t);
-
-	memcpy(ptr, ctx->value, ctx->value_size);
-
-	ctx->cms_ctx->authbuf_len = buf_len;
-	ctx->cms_ctx->authbuf = buf;
+	generate_digest_step(ctx->cms_ctx, name,
+			     name_len * sizeof(efi_char16_t));
+	generate_digest_step(ctx->cms_ctx, &ctx->guid, sizeof(efi_guid_t));
+	generate_digest_step(ctx->cms_ctx, &ctx->attr, sizeof(uint32_t));
+	generate_digest_step(ctx->cms_ctx, &ctx->timestamp,
+			     sizeof(efi_time_t));
+	if (ctx->value_size)
+		generate_digest_step(ctx->cms_ctx, ctx->value,
+				     ctx->value_size);
+	free(name);
+	rc = generate_digest_finish(ctx->cms_ctx);
+	if (rc < 0)
+		return rc;
 
 	/* XXX set the value to get SEC_OID_PKCS1_SHA1_WITH_RSA_ENCRYPTION
 	   from digest_get_signature_oid(). */
@@ -153,52 +154,89 @@ generate_descriptor(authvar_context *ctx)
 	return 0;
 }
 
+static int
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t wlen = writev(fd, iov, iovcnt);
+		if (wlen < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (iovcnt > 0 && (size_t)wlen >= iov->iov_len) {
+			wlen -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + wlen;
+			iov->iov_len -= wlen;
+		}
+	}
+	return 0;
+}
+
 int
 write_authvar(authvar_context *ctx)
 {
-	efi_var_auth_2_t *descriptor;
-	void *buffer, *ptr;
-	size_t buf_len, des_len, remain;
-	ssize_t wlen;
+	struct iovec iov[4];
+	size_t buf_len = 0;
+	int iovcnt = 0;
 
 	if (!ctx->authinfo)
 		cmsreterr(-1, ctx->cms_ctx, "Not a valid authvar");
 
-	des_len = sizeof(efi_var_auth_2_t) + ctx->authinfo->hdr.length -
-		  sizeof(win_cert_uefi_guid_t);
-	buf_len = sizeof(ctx->attr) + des_len + ctx->value_size;
-
-	buffer = calloc(buf_len, 1);
-	if (!buffer)
-		cmsreterr(-1, ctx->cms_ctx, "could not allocate buffer");
-	ptr = buffer;
-
 	/* The attribute of the variable */
-	memcpy(ptr, &ctx->attr, sizeof(ctx->attr));
-	ptr += sizeof(ctx->attr);
+	iov[iovcnt].iov_base = &ctx->attr;
+	iov[iovcnt++].iov_len = sizeof(ctx->attr);
 
 	/* EFI_VARIABLE_AUTHENTICATION_2 */
-	descriptor = (efi_var_auth_2_t *)ptr;
-	memcpy(&descriptor->timestamp, &ctx->timestamp, sizeof(efi_time_t));
-	memcpy(&descriptor->authinfo, ctx->authinfo, ctx->authinfo->hdr.length);
-	ptr += des_len;
+	iov[iovcnt].iov_base = &ctx->timestamp;
+	iov[iovcnt++].iov_len = sizeof(efi_time_t);
+	iov[iovcnt].iov_base = ctx->authinfo;
+	iov[iovcnt++].iov_len = ctx->authinfo->hdr.length;
 
 	/* Data */
-	if (ctx->value_size > 0)
-		memcpy(ptr, ctx->value, ctx->value_size);
-
-	if (!ctx->to_firmware) {
-		ftruncate(ctx->exportfd, buf_len);
-		lseek(ctx->exportfd, 0, SEEK_SET);
+	if (ctx->value_size > 0) {
+		iov[iovcnt].iov_base = ctx->value;
+		iov[iovcnt++].iov_len = ctx->value_size;
 	}
 
-	remain = buf_len;
-	do {
-		wlen = write(ctx->exportfd, buffer, remain);
-		if (wlen < 0)
+	for (int i = 0; i < iovcnt; i++)
+		buf_len += iov[i].iov_len;
+
+	/*
+	 * efivarfs takes a variable in exactly one write(), and writev()
+	 * would hand it one piece at a time, so that still gets a buffer.
+	 * Firmware won't hold a variable big enough for that to matter.
+	 */
+	if (ctx->to_firmware) {
+		uint8_t *buffer, *ptr;
+		ssize_t wlen;
+
+		buffer = calloc(buf_len, 1);
+		if (!buffer)
+			cmsreterr(-1, ctx->cms_ctx, "could not allocate buffer");
+		ptr = buffer;
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+			ptr += iov[i].iov_len;
+		}
+
+		wlen = write(ctx->exportfd, buffer, buf_len);
+		free(buffer);
+		if (wlen < 0 || (size_t)wlen != buf_len)
 			cmsreterr(-1, ctx->cms_ctx, "failed to write authvar");
-		remain -= wlen;
-	} while (remain > 0);
+		return 0;
+	}
+
+	ftruncate(ctx->exportfd, buf_len);
+	lseek(ctx->exportfd, 0, SEEK_SET);
+
+	if (writev_all(ctx->exportfd, iov, iovcnt) < 0)
+		cmsreterr(-1, ctx->cms_ctx, "failed to write authvar");
 
 	return 0;
 }
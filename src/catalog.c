@@ -0,0 +1,596 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "pesign.h"
+
+#include <prerror.h>
+#include <pk11pub.h>
+#include <sechash.h>
+
+#include "content_info_priv.h"
+#include "ucs2.h"
+
+typedef struct {
+	SECItem subjectIdentifier;
+	Attribute **subjectAttributes;
+} TrustedSubject;
+
+static SEC_ASN1Template TrustedSubjectTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (TrustedSubject),
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING,
+	.offset = offsetof(TrustedSubject, subjectIdentifier),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_SET_OF |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(TrustedSubject, subjectAttributes),
+	.sub = AttributeTemplate,
+	.size = sizeof (Attribute **),
+	},
+	{ 0, }
+};
+
+/*
+ * Microsoft's CertificateTrustList.  The version is left at its default,
+ * and we never write a sequence number, next update, or extensions, but
+ * catalogs from elsewhere may have them.
+ */
+typedef struct {
+	SECItem **subjectUsage;
+	SECItem listIdentifier;
+	SECItem sequenceNumber;
+	SECItem thisUpdate;
+	SECItem nextUpdate;
+	SECAlgorithmID subjectAlgorithm;
+	TrustedSubject **trustedSubjects;
+	SECItem extensions;
+} CertTrustList;
+
+static SEC_ASN1Template CertTrustListTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (CertTrustList),
+	},
+	{
+	.kind = SEC_ASN1_SEQUENCE_OF,
+	.offset = offsetof(CertTrustList, subjectUsage),
+	.sub = &SEC_ObjectIDTemplate,
+	.size = sizeof (SECItem **),
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(CertTrustList, listIdentifier),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_INTEGER |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(CertTrustList, sequenceNumber),
+	.sub = &SEC_IntegerTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_ANY,
+	.offset = offsetof(CertTrustList, thisUpdate),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_UTC_TIME |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(CertTrustList, nextUpdate),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_INLINE,
+	.offset = offsetof(CertTrustList, subjectAlgorithm),
+	.sub = &SECOID_AlgorithmIDTemplate,
+	.size = sizeof (SECAlgorithmID),
+	},
+	{
+	.kind = SEC_ASN1_SEQUENCE_OF |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(CertTrustList, trustedSubjects),
+	.sub = TrustedSubjectTemplate,
+	.size = sizeof (TrustedSubject **),
+	},
+	{
+	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 0 |
+		SEC_ASN1_CONSTRUCTED |
+		SEC_ASN1_EXPLICIT |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(CertTrustList, extensions),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+/* a member's file name, as makecat writes it */
+typedef struct {
+	SECItem tag;
+	SECItem flags;
+	SECItem value;
+} CatNameValue;
+
+static SEC_ASN1Template CatNameValueTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (CatNameValue),
+	},
+	{
+	.kind = SEC_ASN1_BMP_STRING,
+	.offset = offsetof(CatNameValue, tag),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_INTEGER,
+	.offset = offsetof(CatNameValue, flags),
+	.sub = &SEC_IntegerTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING,
+	.offset = offsetof(CatNameValue, value),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+#define CAT_NAMEVALUE_FLAGS	0x10010001
+
+static int
+make_attribute(cms_context *cms, Attribute **attrp, ms_oid_t type,
+	       SECItem *value)
+{
+	Attribute *attr = PORT_ArenaZAlloc(cms->arena, sizeof (*attr));
+	SECItem **values = PORT_ArenaZAlloc(cms->arena, sizeof (*values) * 2);
+	if (!attr || !values)
+		return -1;
+
+	if (get_ms_oid_secitem(type, &attr->attrType) < 0)
+		return -1;
+	values[0] = SECITEM_ArenaDupItem(cms->arena, value);
+	if (!values[0])
+		return -1;
+	attr->attrValues = values;
+
+	*attrp = attr;
+	return 0;
+}
+
+static int
+generate_member_name(cms_context *cms, SECItem *der, const char *path)
+{
+	static const uint8_t file_tag[] = { 0, 'F', 0, 'i', 0, 'l', 0, 'e' };
+	CatNameValue nv;
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	uint16_t *ucs2 = ascii_to_ucs2(name);
+	if (!ucs2)
+		return -1;
+
+	memset(&nv, '\0', sizeof (nv));
+	nv.tag.data = (uint8_t *)file_tag;
+	nv.tag.len = sizeof (file_tag);
+	nv.value.data = (uint8_t *)ucs2;
+	nv.value.len = (ucs2_strlen(ucs2) + 1) * sizeof (uint16_t);
+	if (SEC_ASN1EncodeInteger(cms->arena, &nv.flags,
+				  CAT_NAMEVALUE_FLAGS) == NULL ||
+	    SEC_ASN1EncodeItem(cms->arena, der, &nv,
+			       CatNameValueTemplate) == NULL) {
+		free(ucs2);
+		cmsreterr(-1, cms, "could not encode member name");
+	}
+	free(ucs2);
+	return 0;
+}
+
+static int
+generate_trusted_subject(cms_context *cms, TrustedSubject *ts,
+			 catalog_member *member)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	SECItem der;
+
+	SECITEM_AllocItem(cms->arena, &ts->subjectIdentifier,
+			  member->digest.len * 2 * sizeof (uint16_t));
+	if (!ts->subjectIdentifier.data)
+		return -1;
+	uint8_t *tag = ts->subjectIdentifier.data;
+	for (unsigned int i = 0; i < member->digest.len; i++) {
+		uint8_t c = member->digest.data[i];
+		*tag++ = hex[c >> 4];
+		*tag++ = 0;
+		*tag++ = hex[c & 0xf];
+		*tag++ = 0;
+	}
+
+	ts->subjectAttributes = PORT_ArenaZAlloc(cms->arena,
+				sizeof (Attribute *) * 3);
+	if (!ts->subjectAttributes)
+		return -1;
+
+	if (generate_member_name(cms, &der, member->name) < 0 ||
+	    make_attribute(cms, &ts->subjectAttributes[0],
+			   CAT_NAMEVALUE_OBJID, &der) < 0)
+		return -1;
+
+	if (generate_spc_indirect_data_content(cms, &der,
+					       &member->digest) < 0 ||
+	    make_attribute(cms, &ts->subjectAttributes[1],
+			   SPC_INDIRECT_DATA_OBJID, &der) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The members' digests have to be of the type cms has selected; it's the
+ * one their SpcIndirectDataContent says they are.
+ */
+int
+generate_catalog(cms_context *cms, catalog_member *members, int nmembers,
+		 SECItem *ctl)
+{
+	CertTrustList tl;
+
+	memset(&tl, '\0', sizeof (tl));
+	void *mark = PORT_ArenaMark(cms->arena);
+
+	tl.subjectUsage = PORT_ArenaZAlloc(cms->arena, sizeof (SECItem *) * 2);
+	if (!tl.subjectUsage)
+		goto err;
+	tl.subjectUsage[0] = PORT_ArenaZAlloc(cms->arena, sizeof (SECItem));
+	if (!tl.subjectUsage[0] ||
+	    get_ms_oid_secitem(szOID_CATALOG_LIST, tl.subjectUsage[0]) < 0)
+		goto err;
+
+	SECITEM_AllocItem(cms->arena, &tl.listIdentifier, 16);
+	if (!tl.listIdentifier.data ||
+	    PK11_GenerateRandom(tl.listIdentifier.data, 16) != SECSuccess)
+		goto err;
+
+	if (generate_time(cms, &tl.thisUpdate, time(NULL)) < 0)
+		goto err;
+
+	if (generate_algorithm_id(cms, &tl.subjectAlgorithm,
+			find_ms_oid_tag(szOID_CATALOG_LIST_MEMBER)) < 0)
+		goto err;
+
+	tl.trustedSubjects = PORT_ArenaZAlloc(cms->arena,
+				sizeof (TrustedSubject *) * (nmembers + 1));
+	if (!tl.trustedSubjects)
+		goto err;
+	for (int i = 0; i < nmembers; i++) {
+		tl.trustedSubjects[i] = PORT_ArenaZAlloc(cms->arena,
+						sizeof (TrustedSubject));
+		if (!tl.trustedSubjects[i] ||
+		    generate_trusted_subject(cms, tl.trustedSubjects[i],
+					     &members[i]) < 0)
+			goto err;
+	}
+
+	if (SEC_ASN1EncodeItem(cms->arena, ctl, &tl,
+			       CertTrustListTemplate) == NULL)
+		goto err;
+
+	PORT_ArenaUnmark(cms->arena, mark);
+	return 0;
+err:
+	save_port_err(PORT_ArenaRelease(cms->arena, mark));
+	cmsreterr(-1, cms, "could not encode catalog");
+}
+
+/*
+ * What gets signed is the list's contents octets - everything after its
+ * SEQUENCE tag and length - the way PKCS#7 says it should be.
+ */
+int
+generate_catalog_digest(SECItem *ctl, SECOidTag digest_tag, SECItem *digest)
+{
+	SECItem contents;
+
+	if (ctl->len < 2 || ctl->data[0] != (SEC_ASN1_SEQUENCE |
+					     SEC_ASN1_CONSTRUCTED))
+		return -1;
+	if (der_contents(ctl, &contents) < 0)
+		return -1;
+
+	HASH_HashType type = HASH_GetHashTypeByOidTag(digest_tag);
+	if (type == HASH_AlgNULL || HASH_ResultLen(type) > digest->len)
+		return -1;
+
+	if (PK11_HashBuf(digest_tag, digest->data, contents.data,
+			 contents.len) != SECSuccess)
+		return -1;
+	digest->len = HASH_ResultLen(type);
+	return 0;
+}
+
+/*
+ * Every member of every catalog we trust, by digest.  Digests are as good
+ * a hash as we could ask for, so the table is open addressing on their
+ * first bytes.
+ */
+typedef struct {
+	SECOidTag digest_tag;
+	unsigned int len;
+	uint8_t *digest;
+} catalog_entry;
+
+struct catalog_index {
+	size_t size;
+	size_t count;
+	catalog_entry *entries;
+
+	SECOidTag digest_tags[MAX_CATALOG_DIGEST_TYPES];
+	int ndigest_tags;
+};
+
+catalog_index *
+catalog_index_new(void)
+{
+	catalog_index *idx = calloc(1, sizeof (*idx));
+	if (!idx)
+		return NULL;
+
+	idx->size = 64;
+	idx->entries = calloc(idx->size, sizeof (catalog_entry));
+	if (!idx->entries) {
+		free(idx);
+		return NULL;
+	}
+	return idx;
+}
+
+void
+catalog_index_free(catalog_index *idx)
+{
+	if (!idx)
+		return;
+
+	for (size_t i = 0; i < idx->size; i++)
+		free(idx->entries[i].digest);
+	free(idx->entries);
+	free(idx);
+}
+
+static size_t
+slot_of(catalog_index *idx, SECOidTag digest_tag, const uint8_t *digest,
+	unsigned int len)
+{
+	size_t hash = digest_tag;
+
+	memcpy(&hash, digest, len < sizeof (hash) ? len : sizeof (hash));
+	return (hash ^ digest_tag) & (idx->size - 1);
+}
+
+static catalog_entry *
+find_entry(catalog_index *idx, SECOidTag digest_tag, const uint8_t *digest,
+	   unsigned int len)
+{
+	size_t i = slot_of(idx, digest_tag, digest, len);
+
+	while (idx->entries[i].digest) {
+		catalog_entry *entry = &idx->entries[i];
+		if (entry->digest_tag == digest_tag && entry->len == len &&
+		    !memcmp(entry->digest, digest, len))
+			return entry;
+		i = (i + 1) & (idx->size - 1);
+	}
+	return &idx->entries[i];
+}
+
+static int
+grow_index(catalog_index *idx)
+{
+	catalog_entry *old = idx->entries;
+	size_t oldsize = idx->size;
+
+	idx->entries = calloc(oldsize * 2, sizeof (catalog_entry));
+	if (!idx->entries) {
+		idx->entries = old;
+		return -1;
+	}
+	idx->size = oldsize * 2;
+
+	for (size_t i = 0; i < oldsize; i++) {
+		if (!old[i].digest)
+			continue;
+		*find_entry(idx, old[i].digest_tag, old[i].digest,
+			    old[i].len) = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+static int
+add_digest(catalog_index *idx, SECOidTag digest_tag, SECItem *digest)
+{
+	int known = 0;
+
+	for (int i = 0; i < idx->ndigest_tags; i++) {
+		if (idx->digest_tags[i] == digest_tag)
+			known = 1;
+	}
+	/* don't quietly keep members we would never look up */
+	if (!known && idx->ndigest_tags >= MAX_CATALOG_DIGEST_TYPES) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	if ((idx->count + 1) * 2 > idx->size && grow_index(idx) < 0)
+		return -1;
+
+	catalog_entry *entry = find_entry(idx, digest_tag, digest->data,
+					  digest->len);
+	if (entry->digest)
+		return 0;
+
+	entry->digest = malloc(digest->len ? digest->len : 1);
+	if (!entry->digest)
+		return -1;
+	memcpy(entry->digest, digest->data, digest->len);
+	entry->len = digest->len;
+	entry->digest_tag = digest_tag;
+	idx->count++;
+
+	if (!known)
+		idx->digest_tags[idx->ndigest_tags++] = digest_tag;
+	return 0;
+}
+
+static SEC_ASN1Template IndirectDataDecodeTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (SpcIndirectDataContent),
+	},
+	{
+	.kind = SEC_ASN1_ANY,
+	.offset = offsetof(SpcIndirectDataContent, data),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_ANY,
+	.offset = offsetof(SpcIndirectDataContent, messageDigest),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+/*
+ * Add the members of a certificate trust list - the content of a catalog
+ * whose signature has already been checked - to the index.  If the index
+ * would need more than MAX_CATALOG_DIGEST_TYPES kinds of digest, this
+ * fails with errno set to E2BIG.
+ */
+int
+catalog_index_add(catalog_index *idx, SECItem *ctl)
+{
+	SECItem indirect_data_oid;
+	CertTrustList tl;
+	int rc = -1;
+
+	if (get_ms_oid_secitem(SPC_INDIRECT_DATA_OBJID,
+			       &indirect_data_oid) < 0)
+		return -1;
+
+	PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+	if (!arena)
+		return -1;
+
+	memset(&tl, '\0', sizeof (tl));
+	if (SEC_ASN1DecodeItem(arena, &tl, CertTrustListTemplate,
+			       ctl) != SECSuccess)
+		goto out;
+
+	for (int i = 0; tl.trustedSubjects && tl.trustedSubjects[i]; i++) {
+		Attribute **attrs = tl.trustedSubjects[i]->subjectAttributes;
+
+		for (int j = 0; attrs && attrs[j]; j++) {
+			SpcIndirectDataContent idc;
+			DigestInfo di;
+
+			if (SECITEM_CompareItem(&attrs[j]->attrType,
+						&indirect_data_oid) != SECEqual)
+				continue;
+			if (!attrs[j]->attrValues || !attrs[j]->attrValues[0])
+				goto out;
+
+			memset(&idc, '\0', sizeof (idc));
+			memset(&di, '\0', sizeof (di));
+			if (SEC_ASN1DecodeItem(arena, &idc,
+					IndirectDataDecodeTemplate,
+					attrs[j]->attrValues[0]) != SECSuccess ||
+			    SEC_ASN1DecodeItem(arena, &di, DigestInfoTemplate,
+					&idc.messageDigest) != SECSuccess)
+				goto out;
+
+			SECOidTag tag = SECOID_GetAlgorithmTag(
+							&di.digestAlgorithm);
+			if (add_digest(idx, tag, &di.digest) < 0)
+				goto out;
+		}
+	}
+	rc = 0;
+out:
+	PORT_FreeArena(arena, PR_FALSE);
+	return rc;
+}
+
+/* 1 if the digest is in a catalog, 0 if not */
+int
+catalog_index_lookup(catalog_index *idx, SECOidTag digest_tag,
+		     SECItem *digest)
+{
+	if (!idx || !digest || !digest->data)
+		return 0;
+
+	return find_entry(idx, digest_tag, digest->data,
+			  digest->len)->digest != NULL;
+}
+
+/* whether the binary cms has just digested (all ways) is in a catalog */
+int
+catalog_lists_image(catalog_index *idx, cms_context *cms)
+{
+	if (!idx)
+		return 0;
+
+	for (int i = 0; i < idx->ndigest_tags; i++) {
+		int j = digest_get_index_by_oid(idx->digest_tags[i]);
+		if (j < 0)
+			continue;
+		if (catalog_index_lookup(idx, idx->digest_tags[i],
+					 cms->digests[j].pe_digest))
+			return 1;
+	}
+	return 0;
+}
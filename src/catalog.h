@@ -0,0 +1,58 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef CATALOG_H
+#define CATALOG_H 1
+
+/*
+ * A catalog signs any number of binaries with one signature.  It's laid out
+ * the way a Windows .cat file is: a PKCS#7 SignedData whose content is a
+ * certificate trust list, with one entry per binary.  Each entry is tagged
+ * with the binary's digest in upper case hex (as UTF-16LE), and carries the
+ * SpcIndirectDataContent the binary would have had if it were signed by
+ * itself, and its file name.
+ *
+ * A binary is covered by a catalog if the catalog's signature checks out
+ * and the binary's digest is in its list, so checking many binaries
+ * against a catalog is one signature check and then one lookup each.
+ */
+
+typedef struct {
+	char *name;
+	SECItem digest;
+} catalog_member;
+
+extern int generate_catalog(cms_context *cms, catalog_member *members,
+			    int nmembers, SECItem *ctl);
+extern int generate_catalog_digest(SECItem *ctl, SECOidTag digest_tag,
+				   SECItem *digest);
+
+/* how many kinds of digest the members of all the catalogs in an index
+ * may use between them */
+#define MAX_CATALOG_DIGEST_TYPES 4
+
+typedef struct catalog_index catalog_index;
+
+extern catalog_index *catalog_index_new(void);
+extern void catalog_index_free(catalog_index *idx);
+extern int catalog_index_add(catalog_index *idx, SECItem *ctl);
+extern int catalog_index_lookup(catalog_index *idx, SECOidTag digest_tag,
+				SECItem *digest);
+extern int catalog_lists_image(catalog_index *idx, cms_context *cms);
+
+#endif /* CATALOG_H */
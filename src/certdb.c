@@ -29,6 +29,10 @@
 #include <cert.h>
 #include <pkcs7t.h>
 #include <pk11pub.h>
+#include <sechash.h>
+#include <secerr.h>
+#include <cryptohi.h>
+#include <keyhi.h>
 
 #include "pesigcheck.h"
 
@@ -134,39 +138,36 @@ add_cert_file(pesigcheck_context *ctx, const char *filename)
 #define MOK_PATH "/sys/firmware/efi/efivars/MokListRT-605dab50-e046-4300-abb6-3dd810dd8b23"
 #define DBX_PATH "/sys/firmware/efi/efivars/dbx-d719b2cb-3d3a-4596-a3bc-dad00e67656f"
 
-void
-init_cert_db(pesigcheck_context *ctx, int use_system_dbs)
+/*
+ * Add db, MokListRT and dbx from the running machine's efivarfs, skipping
+ * any it doesn't have.  Returns how many of db and MokListRT there were,
+ * or -1 with *path set to the one we couldn't read.
+ */
+int
+add_system_dbs(pesigcheck_context *ctx, const char **path)
 {
-	int rc = 0;
-
-	if (!use_system_dbs)
-		return;
-
-	rc = add_db_file(ctx, DB, DB_PATH, DB_EFIVAR);
-	if (rc < 0 && errno != ENOENT) {
-		fprintf(stderr, "pesigcheck: Could not add key database "
-			"\"%s\": %m\n", DB_PATH);
-		exit(1);
-	}
-
-	rc = add_db_file(ctx, DB, MOK_PATH, DB_EFIVAR);
-	if (rc < 0 && errno != ENOENT) {
-		fprintf(stderr, "pesigcheck: Could not add key database "
-			"\"%s\": %m\n", MOK_PATH);
-		exit(1);
-	}
-
-	if (ctx->db == NULL) {
-		fprintf(stderr, "pesigcheck: warning: "
-			"No key database available\n");
-	}
-
-	rc = add_db_file(ctx, DBX, DBX_PATH, DB_EFIVAR);
-	if (rc < 0 && errno != ENOENT) {
-		fprintf(stderr, "pesigcheck: Could not add revocation "
-			"database \"%s\": %m\n", DBX_PATH);
-		exit(1);
+	static const struct {
+		db_specifier which;
+		const char *path;
+	} vars[] = {
+		{ DB, DB_PATH },
+		{ DB, MOK_PATH },
+		{ DBX, DBX_PATH },
+	};
+	int found = 0;
+
+	for (unsigned int i = 0; i < sizeof (vars) / sizeof (vars[0]); i++) {
+		if (add_db_file(ctx, vars[i].which, vars[i].path,
+				DB_EFIVAR) < 0) {
+			if (errno == ENOENT)
+				continue;
+			*path = vars[i].path;
+			return -1;
+		}
+		if (vars[i].which == DB)
+			found++;
 	}
+	return found;
 }
 
 typedef db_status (*checkfn)(pesigcheck_context *ctx, SECItem *sig,
@@ -258,51 +259,336 @@ determine_reasonable_time(CERTCertificate *cert)
 	return notBefore;
 }
 
-static db_status
-check_cert(pesigcheck_context *ctx, SECItem *sig, efi_guid_t *sigtype,
-	   SECItem *pkcs7sig)
+/*
+ * Nearly everything in a compose is signed by one of two or three
+ * certificates chaining to the same db entries, and building and checking
+ * that chain is most of what SEC_PKCS7VerifyDetachedSignatureAtTime()
+ * costs.  So how it came out is remembered, keyed by the signer, the other
+ * certificates that came with it, the db entry, and the day it's checked
+ * at; the next binary with the same signer only needs its own signature
+ * checked.  An outcome is only reused at times when all of the signature's
+ * certificates are valid, so that being a day wide doesn't matter.
+ */
+#define CHAIN_MEMO_MAX		256
+#define CHAIN_MEMO_BUCKET	((PRTime)24 * 60 * 60 * PR_USEC_PER_SEC)
+
+typedef struct {
+	uint8_t key[SHA256_LENGTH];
+	PRTime not_before;
+	PRTime not_after;
+	CERTCertificate *signer;
+} chain_id;
+
+static int
+cmp_cert_digest(const void *a, const void *b)
 {
-	SEC_PKCS7ContentInfo *cinfo = NULL;
-	CERTCertificate *cert = NULL;
-	CERTCertTrust trust;
-	SECItem *content, *digest = NULL;
+	return memcmp(a, b, SHA256_LENGTH);
+}
+
+static int
+narrow_cert_times(CERTCertificate *cert, chain_id *id)
+{
+	PRTime not_before, not_after;
+
+	if (CERT_GetCertTimes(cert, &not_before, &not_after) != SECSuccess)
+		return -1;
+	if (not_before > id->not_before)
+		id->not_before = not_before;
+	if (not_after < id->not_after)
+		id->not_after = not_after;
+	return 0;
+}
+
+/*
+ * Find cinfo's signer among its certificates, and work out what its
+ * chain to the db entry anchor, checked at time at, is filed under.
+ */
+static int
+get_chain_id(SEC_PKCS7ContentInfo *cinfo, SECItem *anchor, PRTime at,
+	     chain_id *id)
+{
+	SEC_PKCS7SignedData *sd = cinfo->content.signedData;
+	SEC_PKCS7SignerInfo *si;
+	uint8_t (*others)[SHA256_LENGTH] = NULL;
 	PK11Context *pk11ctx = NULL;
-	SECOidData *oid;
-	PRBool result;
-	SECStatus rv;
-	db_status status = NOT_FOUND;
+	int ncerts = 0, nothers = 0;
+	unsigned int len;
+	int rc = -1;
 
-	efi_guid_t efi_x509 = efi_guid_x509_cert;
+	memset(id, '\0', sizeof (*id));
+	id->not_before = INT64_MIN;
+	id->not_after = INT64_MAX;
 
-	if (memcmp(sigtype, &efi_x509, sizeof(efi_guid_t)) != 0)
-		return NOT_FOUND;
+	if (!SEC_PKCS7ContentIsSigned(cinfo) || !sd->signerInfos ||
+	    !sd->signerInfos[0] || sd->signerInfos[1] || !sd->rawCerts)
+		return -1;
+	si = sd->signerInfos[0];
+	if (!si->issuerAndSN)
+		return -1;
 
-	cinfo = SEC_PKCS7DecodeItem(pkcs7sig, NULL, NULL, NULL, NULL, NULL,
-				    NULL, NULL);
-	if (!cinfo)
-		goto out;
+	while (sd->rawCerts[ncerts])
+		ncerts++;
+	others = calloc(ncerts + 1, SHA256_LENGTH);
+	if (!others)
+		return -1;
 
-	/* Generate the digest of contentInfo */
-	/* XXX support only sha256 for now */
-	digest = SECITEM_AllocItem(NULL, NULL, 32);
-	if (digest == NULL)
+	for (int i = 0; i < ncerts; i++) {
+		SECItem *raw = sd->rawCerts[i];
+		CERTCertificate *cert;
+
+		cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), raw,
+					       NULL, PR_FALSE, PR_TRUE);
+		if (!cert)
+			goto out;
+		if (narrow_cert_times(cert, id) < 0) {
+			CERT_DestroyCertificate(cert);
+			goto out;
+		}
+		if (!id->signer &&
+		    SECITEM_ItemsAreEqual(&cert->derIssuer,
+					  &si->issuerAndSN->derIssuer) &&
+		    SECITEM_ItemsAreEqual(&cert->serialNumber,
+					  &si->issuerAndSN->serialNumber)) {
+			id->signer = cert;
+			continue;
+		}
+		CERT_DestroyCertificate(cert);
+		if (PK11_HashBuf(SEC_OID_SHA256, others[nothers++], raw->data,
+				 raw->len) != SECSuccess)
+			goto out;
+	}
+	if (!id->signer)
 		goto out;
 
-	content = cinfo->content.signedData->contentInfo.content.data;
-	oid = SECOID_FindOIDByTag(SEC_OID_SHA256);
-	if (oid == NULL)
-		goto out;
-	pk11ctx = PK11_CreateDigestContext(oid->offset);
-	if (ctx == NULL)
-		goto out;
-	if (PK11_DigestBegin(pk11ctx) != SECSuccess)
-		goto out;
-	/*   Skip the SEQUENCE tag */
-	if (PK11_DigestOp(pk11ctx, content->data + 2, content->len - 2) != SECSuccess)
-		goto out;
-	if (PK11_DigestFinal(pk11ctx, digest->data, &digest->len, 32) != SECSuccess)
+	/* which intermediates came along counts, not what order they're in */
+	qsort(others, nothers, SHA256_LENGTH, cmp_cert_digest);
+
+	uint8_t bucket[8];
+	uint64_t day = at / CHAIN_MEMO_BUCKET;
+	for (int i = 7; i >= 0; i--, day >>= 8)
+		bucket[i] = day & 0xff;
+
+	pk11ctx = PK11_CreateDigestContext(SEC_OID_SHA256);
+	if (!pk11ctx ||
+	    PK11_DigestBegin(pk11ctx) != SECSuccess ||
+	    PK11_DigestOp(pk11ctx, id->signer->derCert.data,
+			  id->signer->derCert.len) != SECSuccess ||
+	    (nothers && PK11_DigestOp(pk11ctx, others[0],
+				      nothers * SHA256_LENGTH) != SECSuccess) ||
+	    PK11_DigestOp(pk11ctx, anchor->data, anchor->len) != SECSuccess ||
+	    PK11_DigestOp(pk11ctx, bucket, sizeof (bucket)) != SECSuccess ||
+	    PK11_DigestFinal(pk11ctx, id->key, &len,
+			     sizeof (id->key)) != SECSuccess)
 		goto out;
 
+	rc = 0;
+out:
+	if (rc < 0 && id->signer) {
+		CERT_DestroyCertificate(id->signer);
+		id->signer = NULL;
+	}
+	if (pk11ctx)
+		PK11_DestroyContext(pk11ctx, PR_TRUE);
+	free(others);
+	return rc;
+}
+
+static chain_memo *
+find_chain_memo(pesigcheck_context *ctx, chain_id *id, PRTime at)
+{
+	for (chain_memo *memo = ctx->chains; memo; memo = memo->next) {
+		if (!memcmp(memo->key, id->key, sizeof (memo->key)) &&
+		    at >= memo->not_before && at <= memo->not_after)
+			return memo;
+	}
+	return NULL;
+}
+
+static void
+add_chain_memo(pesigcheck_context *ctx, chain_id *id, PRTime at,
+	       int trusted, PRErrorCode error)
+{
+	if (ctx->nchains >= CHAIN_MEMO_MAX)
+		return;
+	if (at < id->not_before || at > id->not_after)
+		return;
+
+	chain_memo *memo = calloc(1, sizeof (*memo));
+	if (!memo)
+		return;
+
+	memcpy(memo->key, id->key, sizeof (memo->key));
+	memo->not_before = id->not_before;
+	memo->not_after = id->not_after;
+	memo->trusted = trusted;
+	memo->error = error;
+	memo->next = ctx->chains;
+	ctx->chains = memo;
+	ctx->nchains++;
+}
+
+/* errors from checking the chain, rather than the signature itself */
+static int
+is_chain_error(PRErrorCode error)
+{
+	switch (error) {
+	case SEC_ERROR_UNKNOWN_ISSUER:
+	case SEC_ERROR_UNTRUSTED_ISSUER:
+	case SEC_ERROR_UNTRUSTED_CERT:
+	case SEC_ERROR_EXPIRED_CERTIFICATE:
+	case SEC_ERROR_EXPIRED_ISSUER_CERTIFICATE:
+	case SEC_ERROR_CA_CERT_INVALID:
+	case SEC_ERROR_INADEQUATE_KEY_USAGE:
+	case SEC_ERROR_INADEQUATE_CERT_TYPE:
+	case SEC_ERROR_PATH_LEN_CONSTRAINT_INVALID:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* whether attrs has a tag attribute with just one value, and it's want */
+static int
+attr_is(SEC_PKCS7Attribute **attrs, SECOidTag tag, SECItem *want)
+{
+	for (; *attrs; attrs++) {
+		SEC_PKCS7Attribute *attr = *attrs;
+
+		if (SECOID_FindOIDTag(&attr->type) != tag)
+			continue;
+		if (!attr->values || !attr->values[0] || attr->values[1])
+			return 0;
+
+		SECItem value = *attr->values[0];
+		if (attr->encoded && der_contents(attr->values[0], &value) < 0)
+			return 0;
+		return SECITEM_ItemsAreEqual(&value, want);
+	}
+	return 0;
+}
+
+/*
+ * Find the signer's authenticated attributes as they were encoded; they
+ * have to be hashed exactly as signed, which re-encoding NSS's decoded
+ * copy wouldn't reliably give us.
+ */
+static int
+find_signed_attrs(SECItem *pkcs7sig, SECItem *attrs)
+{
+	SECItem der = *pkcs7sig;
+	SECItem ci, wrapper, sd, sis, si, skip;
+
+	if (der_take(&der, 0x30, &ci) < 0 ||
+	    der_take(&ci, 0x06, &skip) < 0 ||
+	    der_take(&ci, 0xa0, &wrapper) < 0 ||
+	    der_take(&wrapper, 0x30, &sd) < 0 ||
+	    der_take(&sd, 0x02, &skip) < 0 ||
+	    der_take(&sd, 0x31, &skip) < 0 ||
+	    der_take(&sd, 0x30, &skip) < 0)
+		return -1;
+	if (sd.len > 0 && sd.data[0] == 0xa0 && der_next(&sd, &skip) < 0)
+		return -1;
+	if (sd.len > 0 && sd.data[0] == 0xa1 && der_next(&sd, &skip) < 0)
+		return -1;
+	if (der_take(&sd, 0x31, &sis) < 0 ||
+	    der_take(&sis, 0x30, &si) < 0 ||
+	    der_take(&si, 0x02, &skip) < 0 ||
+	    der_take(&si, 0x30, &skip) < 0 ||
+	    der_take(&si, 0x30, &skip) < 0)
+		return -1;
+	if (si.len < 2 || si.data[0] != 0xa0)
+		return -1;
+	return der_next(&si, attrs);
+}
+
+/*
+ * Check only the signer's own signature over digest, which is all that's
+ * left to do once we know its chain is good.  0 if it's right.
+ */
+static int
+check_signer_signature(SEC_PKCS7ContentInfo *cinfo, SECItem *pkcs7sig,
+		       CERTCertificate *signer, SECItem *digest)
+{
+	SEC_PKCS7SignedData *sd = cinfo->content.signedData;
+	SEC_PKCS7SignerInfo *si = sd->signerInfos[0];
+	SECOidTag hash_tag = SECOID_GetAlgorithmTag(&si->digestAlg);
+	SECOidTag enc_tag = SECOID_GetAlgorithmTag(&si->digestEncAlg);
+	uint8_t buf[HASH_LENGTH_MAX];
+	SECItem signed_digest = *digest;
+	SECKEYPublicKey *key;
+	int rc = -1;
+
+	switch (enc_tag) {
+	case SEC_OID_PKCS1_SHA1_WITH_RSA_ENCRYPTION:
+	case SEC_OID_PKCS1_SHA256_WITH_RSA_ENCRYPTION:
+	case SEC_OID_PKCS1_SHA384_WITH_RSA_ENCRYPTION:
+	case SEC_OID_PKCS1_SHA512_WITH_RSA_ENCRYPTION:
+		enc_tag = SEC_OID_PKCS1_RSA_ENCRYPTION;
+		break;
+	default:
+		break;
+	}
+
+	if (si->authAttr) {
+		SECItem attrs;
+		PK11Context *pk11ctx;
+		unsigned int len;
+
+		if (!attr_is(si->authAttr, SEC_OID_PKCS9_MESSAGE_DIGEST,
+			     digest) ||
+		    !attr_is(si->authAttr, SEC_OID_PKCS9_CONTENT_TYPE,
+			     &sd->contentInfo.contentType))
+			return -1;
+		if (find_signed_attrs(pkcs7sig, &attrs) < 0)
+			return -1;
+
+		/* what's signed is them as a SET, not under their [0] tag */
+		uint8_t set = 0x31;
+		pk11ctx = PK11_CreateDigestContext(hash_tag);
+		if (!pk11ctx)
+			return -1;
+		if (PK11_DigestBegin(pk11ctx) != SECSuccess ||
+		    PK11_DigestOp(pk11ctx, &set, 1) != SECSuccess ||
+		    PK11_DigestOp(pk11ctx, attrs.data + 1,
+				  attrs.len - 1) != SECSuccess ||
+		    PK11_DigestFinal(pk11ctx, buf, &len,
+				     sizeof (buf)) != SECSuccess) {
+			PK11_DestroyContext(pk11ctx, PR_TRUE);
+			return -1;
+		}
+		PK11_DestroyContext(pk11ctx, PR_TRUE);
+		signed_digest.data = buf;
+		signed_digest.len = len;
+	}
+
+	key = CERT_ExtractPublicKey(signer);
+	if (!key)
+		return -1;
+	if (VFY_VerifyDigestDirect(&signed_digest, key, &si->encDigest,
+				   enc_tag, hash_tag, NULL) == SECSuccess)
+		rc = 0;
+	SECKEY_DestroyPublicKey(key);
+	return rc;
+}
+
+/*
+ * Whether cinfo's signature over digest checks out, with sig - a
+ * certificate from one of the databases - as the one trusted root.
+ */
+static db_status
+check_signed_by(pesigcheck_context *ctx, SEC_PKCS7ContentInfo *cinfo,
+		SECItem *pkcs7sig, SECItem *sig, SECItem *digest,
+		HASH_HashType hash_type)
+{
+	CERTCertificate *cert = NULL;
+	CERTCertTrust trust;
+	chain_id id = { .signer = NULL };
+	chain_memo *memo = NULL;
+	int have_id;
+	PRBool result;
+	SECStatus rv;
+	db_status status = NOT_FOUND;
+
 	/* Import the trusted certificate */
 	cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), sig, "Temp CA",
 				       PR_FALSE, PR_TRUE);
@@ -337,22 +623,102 @@ check_cert(pesigcheck_context *ctx, SECItem *sig, efi_guid_t *sigtype,
 	} else {
 		atTime = determine_reasonable_time(cert);
 	}
+
+	have_id = get_chain_id(cinfo, sig, atTime, &id) == 0;
+	if (have_id) {
+		memo = find_chain_memo(ctx, &id, atTime);
+		if (memo && !memo->trusted) {
+			fprintf(stderr, "%s\n", PORT_ErrorToString(memo->error));
+			goto out;
+		}
+		if (memo && check_signer_signature(cinfo, pkcs7sig, id.signer,
+						   digest) == 0) {
+			status = FOUND;
+			goto out;
+		}
+	}
+
 	/* Verify the signature */
 	result = SEC_PKCS7VerifyDetachedSignatureAtTime(cinfo,
 						certUsageSSLServer,
-						digest, HASH_AlgSHA256,
+						digest, hash_type,
 						PR_FALSE, atTime);
 	if (!result) {
-		fprintf(stderr, "%s\n",	PORT_ErrorToString(PORT_GetError()));
+		PRErrorCode error = PORT_GetError();
+
+		fprintf(stderr, "%s\n",	PORT_ErrorToString(error));
+		/*
+		 * If the signature itself is fine, it's the chain that's no
+		 * good, and it'll be just as bad for the next binary.
+		 */
+		if (have_id && !memo && is_chain_error(error) &&
+		    check_signer_signature(cinfo, pkcs7sig, id.signer,
+					   digest) == 0)
+			add_chain_memo(ctx, &id, atTime, 0, error);
 		goto out;
 	}
 
+	if (have_id && !memo)
+		add_chain_memo(ctx, &id, atTime, 1, 0);
 	status = FOUND;
 out:
-	if (cinfo)
-		SEC_PKCS7DestroyContentInfo(cinfo);
+	if (id.signer)
+		CERT_DestroyCertificate(id.signer);
 	if (cert)
 		CERT_DestroyCertificate(cert);
+
+	return status;
+}
+
+static db_status
+check_cert(pesigcheck_context *ctx, SECItem *sig, efi_guid_t *sigtype,
+	   SECItem *pkcs7sig)
+{
+	SEC_PKCS7ContentInfo *cinfo = NULL;
+	SECItem *content, *digest = NULL;
+	PK11Context *pk11ctx = NULL;
+	SECOidData *oid;
+	db_status status = NOT_FOUND;
+
+	efi_guid_t efi_x509 = efi_guid_x509_cert;
+
+	if (memcmp(sigtype, &efi_x509, sizeof(efi_guid_t)) != 0)
+		return NOT_FOUND;
+
+	cinfo = SEC_PKCS7DecodeItem(pkcs7sig, NULL, NULL, NULL, NULL, NULL,
+				    NULL, NULL);
+	if (!cinfo)
+		goto out;
+
+	/* Generate the digest of contentInfo */
+	/* XXX support only sha256 for now */
+	digest = SECITEM_AllocItem(NULL, NULL, 32);
+	if (digest == NULL)
+		goto out;
+
+	content = cinfo->content.signedData->contentInfo.content.data;
+	oid = SECOID_FindOIDByTag(SEC_OID_SHA256);
+	if (oid == NULL)
+		goto out;
+	pk11ctx = PK11_CreateDigestContext(oid->offset);
+	if (ctx == NULL)
+		goto out;
+	if (PK11_DigestBegin(pk11ctx) != SECSuccess)
+		goto out;
+	/*   Skip the SEQUENCE tag and length */
+	SECItem contents;
+	if (der_contents(content, &contents) < 0)
+		goto out;
+	if (PK11_DigestOp(pk11ctx, contents.data, contents.len) != SECSuccess)
+		goto out;
+	if (PK11_DigestFinal(pk11ctx, digest->data, &digest->len, 32) != SECSuccess)
+		goto out;
+
+	status = check_signed_by(ctx, cinfo, pkcs7sig, sig, digest,
+				 HASH_AlgSHA256);
+out:
+	if (cinfo)
+		SEC_PKCS7DestroyContentInfo(cinfo);
 	if (pk11ctx)
 		PK11_DestroyContext(pk11ctx, PR_TRUE);
 	if (digest)
@@ -366,3 +732,250 @@ check_db_cert(db_specifier which, pesigcheck_context *ctx, void *data, ssize_t d
 {
 	return check_db(which, ctx, check_cert, data, datalen);
 }
+
+/*
+ * Like check_cert(), but for a catalog: what's signed is a certificate
+ * trust list, and its digest is of whatever type the signer says.
+ */
+static db_status
+check_catalog_cert(pesigcheck_context *ctx, SECItem *sig, efi_guid_t *sigtype,
+		   SECItem *pkcs7sig)
+{
+	SEC_PKCS7ContentInfo *cinfo = NULL;
+	SECItem ctl_oid, digest;
+	uint8_t digest_buf[HASH_LENGTH_MAX];
+	db_status status = NOT_FOUND;
+
+	efi_guid_t efi_x509 = efi_guid_x509_cert;
+
+	if (memcmp(sigtype, &efi_x509, sizeof(efi_guid_t)) != 0)
+		return NOT_FOUND;
+
+	if (get_ms_oid_secitem(szOID_CTL, &ctl_oid) < 0)
+		return NOT_FOUND;
+
+	cinfo = SEC_PKCS7DecodeItem(pkcs7sig, NULL, NULL, NULL, NULL, NULL,
+				    NULL, NULL);
+	if (!cinfo || !SEC_PKCS7ContentIsSigned(cinfo))
+		goto out;
+
+	SEC_PKCS7SignedData *sd = cinfo->content.signedData;
+	if (SECITEM_CompareItem(&sd->contentInfo.contentType,
+				&ctl_oid) != SECEqual)
+		goto out;
+	if (!sd->digestAlgorithms || !sd->digestAlgorithms[0] ||
+	    !sd->contentInfo.content.data)
+		goto out;
+
+	SECOidTag digest_tag = SECOID_GetAlgorithmTag(sd->digestAlgorithms[0]);
+	digest.type = siBuffer;
+	digest.data = digest_buf;
+	digest.len = sizeof (digest_buf);
+	if (generate_catalog_digest(sd->contentInfo.content.data, digest_tag,
+				    &digest) < 0)
+		goto out;
+
+	status = check_signed_by(ctx, cinfo, pkcs7sig, sig, &digest,
+				 HASH_GetHashTypeByOidTag(digest_tag));
+out:
+	if (cinfo)
+		SEC_PKCS7DestroyContentInfo(cinfo);
+
+	return status;
+}
+
+/*
+ * Whether a catalog is signed by something in ctx->db and nothing in
+ * ctx->dbx: 0 if so, -1 if not.
+ */
+int
+check_catalog(pesigcheck_context *ctx, void *data, ssize_t datalen)
+{
+	if (check_db(DBX, ctx, check_catalog_cert, data, datalen) == FOUND)
+		return -1;
+	if (check_db(DB, ctx, check_catalog_cert, data, datalen) == FOUND)
+		return 0;
+	return -1;
+}
+
+static int
+cert_matches_digest(pesigcheck_context *ctx, void *data, ssize_t datalen)
+{
+	SECItem sig, *pe_digest, *content;
+	uint8_t *digest;
+	SEC_PKCS7ContentInfo *cinfo = NULL;
+	int ret = -1;
+
+	sig.data = data;
+	sig.len = datalen;
+	sig.type = siBuffer;
+
+	cinfo = SEC_PKCS7DecodeItem(&sig, NULL, NULL, NULL, NULL, NULL,
+				    NULL, NULL);
+
+	if (!SEC_PKCS7ContentIsSigned(cinfo))
+		goto out;
+
+	/* TODO Find out the digest type in spc_content */
+	pe_digest = ctx->cms_ctx->digests[0].pe_digest;
+	content = cinfo->content.signedData->contentInfo.content.data;
+	digest = content->data + content->len - pe_digest->len;
+	if (memcmp(pe_digest->data, digest, pe_digest->len) != 0)
+		goto out;
+
+	ret = 0;
+out:
+	if (cinfo)
+		SEC_PKCS7DestroyContentInfo(cinfo);
+
+	return ret;
+}
+
+/*
+ * Whether the page hashes in a signature match the parts of ctx->inpe
+ * we've been asked about.
+ */
+static int
+cert_matches_pages(pesigcheck_context *ctx, void *data, ssize_t datalen,
+		   page_range *ranges, int nranges)
+{
+	SEC_PKCS7ContentInfo *cinfo = NULL;
+	SECItem sig, table;
+	SECOidTag digest_tag;
+	int ret = -1;
+
+	sig.data = data;
+	sig.len = datalen;
+	sig.type = siBuffer;
+
+	cinfo = SEC_PKCS7DecodeItem(&sig, NULL, NULL, NULL, NULL, NULL,
+				    NULL, NULL);
+	if (!cinfo || !SEC_PKCS7ContentIsSigned(cinfo))
+		goto out;
+
+	SECItem *content = cinfo->content.signedData->contentInfo.content.data;
+	if (!content || find_page_hashes(content, &digest_tag, &table) < 0)
+		goto out;
+
+	ret = check_page_hashes(ctx->inpe, digest_tag, &table, ranges,
+				nranges);
+out:
+	if (cinfo)
+		SEC_PKCS7DestroyContentInfo(cinfo);
+
+	return ret;
+}
+
+/*
+ * check_signature() for --verify-pages: the same, except that instead of
+ * the digest of the whole image, what has to match is the page hashes for
+ * the parts we were asked about.  Nothing else in the image gets read,
+ * and so hashes of the whole image in db and dbx can't be checked.
+ */
+static int
+check_signature_pages(pesigcheck_context *ctx)
+{
+	page_range *ranges = NULL;
+	int nranges = 0;
+	int has_valid_cert = 0;
+	int has_invalid_cert = 0;
+	cert_iter iter;
+	void *data;
+	ssize_t datalen;
+
+	if (select_pages(ctx->inpe, ctx->verify_pages, &ranges,
+			 &nranges) < 0) {
+		ctx->cms_ctx->log(ctx->cms_ctx, LOG_ERR,
+				  "could not find \"%s\": %m",
+				  ctx->verify_pages);
+		return -1;
+	}
+
+	if (cert_iter_init(&iter, ctx->inpe) < 0)
+		goto out;
+
+	while (next_cert(&iter, &data, &datalen) > 0) {
+		if (cert_matches_pages(ctx, data, datalen, ranges,
+				       nranges) < 0) {
+			has_invalid_cert = 1;
+			break;
+		}
+
+		if (check_db_cert(DBX, ctx, data, datalen) == FOUND) {
+			has_invalid_cert = 1;
+			break;
+		}
+
+		if (check_db_cert(DB, ctx, data, datalen) == FOUND)
+			has_valid_cert = 1;
+	}
+out:
+	free(ranges);
+	if (has_invalid_cert || !has_valid_cert)
+		return -1;
+	return 0;
+}
+
+/*
+ * Whether the image in ctx->inpe would be allowed to run by a machine with
+ * ctx->db and ctx->dbx: 0 if so, -1 if not.
+ */
+int
+check_signature(pesigcheck_context *ctx)
+{
+	int has_valid_cert = 0;
+	int has_invalid_cert = 0;
+	int rc = 0;
+
+	cert_iter iter;
+
+	if (ctx->verify_pages)
+		return check_signature_pages(ctx);
+
+	if (generate_digest(ctx->cms_ctx, ctx->inpe, 1) < 0)
+		return -1;
+
+	if (check_db_hash(DBX, ctx) == FOUND)
+		return -1;
+
+	if (check_db_hash(DB, ctx) == FOUND)
+		has_valid_cert = 1;
+
+	if (catalog_lists_image(ctx->catalogs, ctx->cms_ctx))
+		has_valid_cert = 1;
+
+	rc = cert_iter_init(&iter, ctx->inpe);
+	if (rc < 0)
+		goto err;
+
+	void *data;
+	ssize_t datalen;
+
+	while (1) {
+		rc = next_cert(&iter, &data, &datalen);
+		if (rc <= 0)
+			break;
+
+		if (cert_matches_digest(ctx, data, datalen) < 0) {
+			has_invalid_cert = 1;
+			break;
+		}
+
+		if (check_db_cert(DBX, ctx, data, datalen) == FOUND) {
+			has_invalid_cert = 1;
+			break;
+		}
+
+		if (check_db_cert(DB, ctx, data, datalen) == FOUND)
+			has_valid_cert = 1;
+	}
+
+err:
+	if (has_invalid_cert)
+		return -1;
+
+	if (has_valid_cert)
+		return 0;
+
+	return -1;
+}
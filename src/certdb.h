@@ -45,9 +45,12 @@ extern db_status check_db_hash(db_specifier which, pesigcheck_context *ctx);
 extern db_status check_db_cert(db_specifier which, pesigcheck_context *ctx,
 				void *data, ssize_t datalen);
 
-extern void init_cert_db(pesigcheck_context *ctx, int use_system_dbs);
+extern int add_system_dbs(pesigcheck_context *ctx, const char **path);
 extern int add_cert_db(pesigcheck_context *ctx, const char *filename);
 extern int add_cert_dbx(pesigcheck_context *ctx, const char *filename);
 extern int add_cert_file(pesigcheck_context *ctx, const char *filename);
 
+extern int check_catalog(pesigcheck_context *ctx, void *data, ssize_t datalen);
+extern int check_signature(pesigcheck_context *ctx);
+
 #endif /* CERTDB_H */
@@ -16,6 +16,7 @@
  * Author(s): Peter Jones <pjones@redhat.com>
  */
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -29,12 +30,21 @@
 
 #include "pesign.h"
 
+#include <nss.h>
+#include <pk11pub.h>
+#include <prerror.h>
+#include <prnetdb.h>
+#include <ssl.h>
+#include <sslproto.h>
+
 #define NO_FLAGS		0x00
 #define UNLOCK_TOKEN		0x01
 #define KILL_DAEMON		0x02
 #define SIGN_BINARY		0x04
 #define IS_TOKEN_UNLOCKED	0x08
-#define FLAG_LIST_END		0x10
+#define RELOAD_DAEMON		0x10
+#define GET_STATUS		0x20
+#define FLAG_LIST_END		0x40
 
 static struct {
 	int flag;
@@ -44,6 +54,8 @@ static struct {
 	{KILL_DAEMON, "kill"},
 	{SIGN_BINARY, "sign"},
 	{IS_TOKEN_UNLOCKED, "is-unlocked"},
+	{RELOAD_DAEMON, "reload"},
+	{GET_STATUS, "status"},
 	{FLAG_LIST_END, NULL},
 };
 
@@ -57,31 +69,46 @@ print_flag_name(FILE *f, int flag)
 }
 
 static int
-connect_to_server(void)
+open_socket(const char *sockpath)
 {
-	int rc = access(SOCKPATH, R_OK);
-	if (rc != 0) {
-		fprintf(stderr, "pesign-client: could not connect to server: "
-			"%m\n");
-		exit(1);
-	}
-
 	struct sockaddr_un addr_un = {
 		.sun_family = AF_UNIX,
-		.sun_path = SOCKPATH,
 	};
 
-	int sd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sd < 0) {
-		fprintf(stderr, "pesign-client: could not open socket: %m\n");
-		exit(1);
+	if (strlen(sockpath) >= sizeof(addr_un.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
+	strcpy(addr_un.sun_path, sockpath);
+
+	int sd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
 
 	socklen_t len = strlen(addr_un.sun_path) +
 			sizeof(addr_un.sun_family);
 
-	rc = connect(sd, (struct sockaddr *)&addr_un, len);
+	int rc = connect(sd, (struct sockaddr *)&addr_un, len);
 	if (rc < 0) {
+		save_errno(close(sd));
+		return -1;
+	}
+
+	return sd;
+}
+
+static int
+connect_to_server(const char *sockpath)
+{
+	int rc = access(sockpath, R_OK);
+	if (rc != 0) {
+		fprintf(stderr, "pesign-client: could not connect to server: "
+			"%m\n");
+		exit(1);
+	}
+
+	int sd = open_socket(sockpath);
+	if (sd < 0) {
 		fprintf(stderr, "pesign-client: could not connect to daemon: "
 			"%m\n");
 		exit(1);
@@ -93,8 +120,8 @@ connect_to_server(void)
 static int32_t
 check_response(int sd, char **srvmsg);
 
-static void
-check_cmd_version(int sd, uint32_t command, char *name, int32_t version)
+static int32_t
+get_cmd_version(int sd, uint32_t command)
 {
 	struct msghdr msg;
 	struct iovec iov[1];
@@ -129,6 +156,14 @@ check_cmd_version(int sd, uint32_t command, char *name, int32_t version)
 
 	char *srvmsg = NULL;
 	int32_t rc = check_response(sd, &srvmsg);
+	xfree(srvmsg);
+	return rc;
+}
+
+static void
+check_cmd_version(int sd, uint32_t command, char *name, int32_t version)
+{
+	int32_t rc = get_cmd_version(sd, command);
 	if (rc < 0)
 		errx(1, "command \"%s\" not known by server", name);
 	if (rc != version)
@@ -165,57 +200,140 @@ send_kill_daemon(int sd)
 	}
 }
 
-static int32_t
-check_response(int sd, char **srvmsg)
+static void
+send_reload(int sd)
 {
-	ssize_t n;
 	struct msghdr msg;
 	struct iovec iov;
-	char buffer[1024];
+	pesignd_msghdr pm;
 
-	pesignd_msghdr *pm;
+	check_cmd_version(sd, CMD_RELOAD, "reload", 0);
 
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
+	pm.version = PESIGND_VERSION;
+	pm.command = CMD_RELOAD;
+	pm.size = 0;
+
+	iov.iov_base = &pm;
+	iov.iov_len = sizeof(pm);
 
 	memset(&msg, '\0', sizeof(msg));
-	memset(buffer, '\0', sizeof(buffer));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ssize_t n;
+
+	n = sendmsg(sd, &msg, 0);
+	if (n < 0) {
+		fprintf(stderr, "pesign-client: reload failed: %m\n");
+		exit(1);
+	}
 
-	iov.iov_base = buffer;
-	iov.iov_len = 1023;
+	char *srvmsg = NULL;
+	int32_t rc = check_response(sd, &srvmsg);
+	if (rc < 0)
+		errx(1, "%s", srvmsg);
+}
+
+static void
+get_status(int sd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	pesignd_msghdr pm;
+
+	check_cmd_version(sd, CMD_GET_STATUS, "status", 0);
+
+	pm.version = PESIGND_VERSION;
+	pm.command = CMD_GET_STATUS;
+	pm.size = 0;
+
+	iov.iov_base = &pm;
+	iov.iov_len = sizeof(pm);
+
+	memset(&msg, '\0', sizeof(msg));
 	msg.msg_iov = &iov;
 	msg.msg_iovlen = 1;
 
-	n = recvmsg(sd, &msg, 0);
+	ssize_t n;
+
+	n = sendmsg(sd, &msg, 0);
+	if (n < 0) {
+		fprintf(stderr, "pesign-client: status failed: %m\n");
+		exit(1);
+	}
+
+	char *srvmsg = NULL;
+	int32_t rc = check_response(sd, &srvmsg);
+	if (rc < 0)
+		errx(1, "%s", srvmsg ? srvmsg : "status failed");
+	if (srvmsg)
+		fputs(srvmsg, stdout);
+	free(srvmsg);
+}
+
+/*
+ * The message is usually an error, but some commands (status) answer with
+ * text, so if there's one at all, hand it back.
+ */
+static int32_t
+check_response(int sd, char **srvmsg)
+{
+	ssize_t n;
+	pesignd_msghdr pm;
+
+	n = recv(sd, &pm, sizeof(pm), MSG_WAITALL);
 	if (n < 0) {
 		fprintf(stderr, "pesign-client: could not get response from "
 			"server: %m\n");
 		exit(1);
 	}
+	if (n == 0) {
+		/* it went away before answering, so it never did the job */
+		*srvmsg = strdup("daemon closed the connection");
+		return PESIGND_RETRY;
+	}
+	if (n != sizeof(pm)) {
+		fprintf(stderr, "pesign-client: got truncated response\n");
+		exit(1);
+	}
 
-	pm = (pesignd_msghdr *)buffer;
-
-	if (pm->version != PESIGND_VERSION) {
+	if (pm.version != PESIGND_VERSION) {
 		fprintf(stderr, "pesign-client: got version %d, "
-			"expected version %d\n", pm->version, PESIGND_VERSION);
+			"expected version %d\n", pm.version, PESIGND_VERSION);
 		exit(1);
 	}
 
-	if (pm->command != CMD_RESPONSE) {
+	if (pm.command != CMD_RESPONSE) {
 		fprintf(stderr, "pesign-client: got unexpected response: %d\n",
-			pm->command);
+			pm.command);
 		exit(1);
 	}
 
-	pesignd_cmd_response *resp = (pesignd_cmd_response *)((uint8_t *)pm +
-					offsetof(pesignd_msghdr, size) +
-					sizeof(pm->size));
+	if (pm.size < sizeof(int32_t)) {
+		fprintf(stderr, "pesign-client: got truncated response\n");
+		exit(1);
+	}
 
-	if (resp->rc == 0)
-		return 0;
+	/* one more byte so the message is terminated no matter what */
+	pesignd_cmd_response *resp = calloc(1, pm.size + 1);
+	if (!resp) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
 
-	*srvmsg = strdup((char *)resp->errmsg);
-	return resp->rc;
+	n = recv(sd, resp, pm.size, MSG_WAITALL);
+	if (n < 0 || (size_t)n != pm.size) {
+		fprintf(stderr, "pesign-client: could not get response from "
+			"server: %m\n");
+		exit(1);
+	}
+
+	int32_t rc = resp->rc;
+	if (rc != 0 || resp->errmsg[0])
+		*srvmsg = strdup((char *)resp->errmsg);
+	free(resp);
+	return rc;
 }
 
 static char *
@@ -440,47 +558,26 @@ send_fd(int sd, int fd)
 	}
 }
 
+/*
+ * Signing requests and load queries both send a header followed by the
+ * token name and certificate nickname.
+ */
 static void
-sign(int sd, char *infile, char *outfile, char *tokenname, char *certname,
-	int attached)
+send_key_request(int sd, uint32_t command, char *name, char *tokenname,
+		 char *certname)
 {
-	int infd = open(infile, O_RDONLY);
-	if (infd < 0) {
-		fprintf(stderr, "pesign-client: could not open input file "
-			"\"%s\": %m\n", infile);
-		exit(1);
-	}
-
-	int outfd = open(outfile, O_RDWR|O_CREAT, 0600);
-	if (outfd < 0) {
-		fprintf(stderr, "pesign-client: could not open output file "
-			"\"%s\": %m\n", outfile);
-		exit(1);
-	}
-
 	struct msghdr msg;
 	struct iovec iov[2];
+	pesignd_msghdr pm;
 
 	uint32_t size0 = pesignd_string_size(tokenname);
 	uint32_t size1 = pesignd_string_size(certname);
 
-	pesignd_msghdr *pm;
-	pm = calloc(1, sizeof(*pm));
-	if (!pm) {
-oom:
-		fprintf(stderr, "pesign-client: could not allocate memory: "
-			"%m\n");
-		exit(1);
-	}
-
-	check_cmd_version(sd, attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED,
-			attached ? "sign-attached" : "sign-detached", 0);
-
-	pm->version = PESIGND_VERSION;
-	pm->command = attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED;
-	pm->size = size0 + size1;
-	iov[0].iov_base = pm;
-	iov[0].iov_len = sizeof (*pm);
+	pm.version = PESIGND_VERSION;
+	pm.command = command;
+	pm.size = size0 + size1;
+	iov[0].iov_base = &pm;
+	iov[0].iov_len = sizeof (pm);
 
 	memset(&msg, '\0', sizeof(msg));
 	msg.msg_iov = iov;
@@ -489,15 +586,18 @@ oom:
 	ssize_t n;
 	n = sendmsg(sd, &msg, 0);
 	if (n < 0) {
-		fprintf(stderr, "pesign-client: sign: sendmsg failed: "
-			"%m\n");
+		fprintf(stderr, "pesign-client: %s: sendmsg failed: %m\n",
+			name);
 		exit(1);
 	}
 
 	char *buffer;
 	buffer = malloc(size0 + size1);
-	if (!buffer)
-		goto oom;
+	if (!buffer) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
 
 	pesignd_string *tn = (pesignd_string *)buffer;
 	pesignd_string_set(tn, tokenname);
@@ -514,27 +614,578 @@ oom:
 
 	n = sendmsg(sd, &msg, 0);
 	if (n < 0) {
-		fprintf(stderr, "pesign-client: sign: sendmsg failed: "
-			"%m\n");
+		fprintf(stderr, "pesign-client: %s: sendmsg failed: %m\n",
+			name);
 		exit(1);
 	}
 	free(buffer);
+}
+
+static int
+sign(int sd, char *infile, char *outfile, char *tokenname, char *certname,
+	int attached, int retry)
+{
+	int infd = open(infile, O_RDONLY);
+	if (infd < 0) {
+		fprintf(stderr, "pesign-client: could not open input file "
+			"\"%s\": %m\n", infile);
+		exit(1);
+	}
+
+	/* a daemon we already tried may have left something behind */
+	int outfd = open(outfile, O_RDWR|O_CREAT|(retry ? O_TRUNC : 0), 0600);
+	if (outfd < 0) {
+		fprintf(stderr, "pesign-client: could not open output file "
+			"\"%s\": %m\n", outfile);
+		exit(1);
+	}
+
+	check_cmd_version(sd, attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED,
+			attached ? "sign-attached" : "sign-detached", 0);
+
+	send_key_request(sd, attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED,
+			 "sign", tokenname, certname);
 
 	send_fd(sd, infd);
 	send_fd(sd, outfd);
 
 	char *srvmsg = NULL;
 	int rc = check_response(sd, &srvmsg);
-	if (rc < 0) {
+	if (rc < 0)
 		fprintf(stderr, "pesign-client: signing failed: \"%s\"\n",
 			srvmsg);
+	xfree(srvmsg);
+
+	close(infd);
+	close(outfd);
+
+	return rc < 0 ? rc : 0;
+}
+
+/*
+ * We can be pointed at more than one pesignd, either by naming their
+ * sockets or a directory they all live in.  Each of them may have
+ * different tokens and certificates, and some may be busier (or deader)
+ * than others.
+ */
+typedef struct {
+	char *sockpath;
+	int sd;
+	int32_t load;
+	int order;
+} daemon_instance;
+
+#define LOAD_UNKNOWN INT32_MAX
+
+static void
+add_daemon(daemon_instance **daemons, int *ndaemons, char *sockpath)
+{
+	daemon_instance *new_daemons;
+
+	new_daemons = realloc(*daemons, sizeof (**daemons) * (*ndaemons + 1));
+	if (!new_daemons) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
 		exit(1);
 	}
+	*daemons = new_daemons;
+	memset(&new_daemons[*ndaemons], '\0', sizeof (**daemons));
+	new_daemons[*ndaemons].sockpath = sockpath;
+	new_daemons[*ndaemons].sd = -1;
+	new_daemons[*ndaemons].load = LOAD_UNKNOWN;
+	*ndaemons += 1;
+}
+
+static int
+cmpstringp(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *)p1, *(char * const *)p2);
+}
+
+static void
+find_daemons(char *socklist, char *sockdir, daemon_instance **daemons,
+	     int *ndaemons)
+{
+	*daemons = NULL;
+	*ndaemons = 0;
+
+	if (socklist) {
+		char *saveptr = NULL;
+		char *list = strdup(socklist);
+		if (!list) {
+			fprintf(stderr, "pesign-client: could not allocate "
+				"memory: %m\n");
+			exit(1);
+		}
+		for (char *sockpath = strtok_r(list, ",", &saveptr); sockpath;
+				sockpath = strtok_r(NULL, ",", &saveptr))
+			add_daemon(daemons, ndaemons, sockpath);
+	}
+
+	if (sockdir) {
+		DIR *dir = opendir(sockdir);
+		if (!dir) {
+			fprintf(stderr, "pesign-client: could not open "
+				"\"%s\": %m\n", sockdir);
+			exit(1);
+		}
+
+		char **paths = NULL;
+		int npaths = 0;
+		struct dirent *de;
+		while ((de = readdir(dir))) {
+			char *sockpath = NULL;
+			struct stat sb;
+
+			if (de->d_name[0] == '.')
+				continue;
+			if (asprintf(&sockpath, "%s/%s", sockdir,
+					de->d_name) < 0) {
+				fprintf(stderr, "pesign-client: could not "
+					"allocate memory: %m\n");
+				exit(1);
+			}
+			if (stat(sockpath, &sb) < 0 || !S_ISSOCK(sb.st_mode)) {
+				free(sockpath);
+				continue;
+			}
+
+			char **new_paths = realloc(paths,
+					sizeof (*paths) * (npaths + 1));
+			if (!new_paths) {
+				fprintf(stderr, "pesign-client: could not "
+					"allocate memory: %m\n");
+				exit(1);
+			}
+			paths = new_paths;
+			paths[npaths++] = sockpath;
+		}
+		closedir(dir);
+
+		qsort(paths, npaths, sizeof (*paths), cmpstringp);
+		for (int i = 0; i < npaths; i++)
+			add_daemon(daemons, ndaemons, paths[i]);
+		free(paths);
+	}
+
+	if (*ndaemons == 0 && !socklist && !sockdir)
+		add_daemon(daemons, ndaemons, SOCKPATH);
 
+	if (*ndaemons == 0) {
+		fprintf(stderr, "pesign-client: no daemon sockets found\n");
+		exit(1);
+	}
+}
+
+/*
+ * Ask a daemon whether it can sign with this key, and if so, how many
+ * requests it already has queued.  Daemons too old to answer are assumed
+ * to be able to, but are only tried after the ones we know about.
+ */
+static int
+query_load(daemon_instance *daemon, char *tokenname, char *certname)
+{
+	int32_t version = get_cmd_version(daemon->sd, CMD_GET_LOAD);
+	if (version != 0) {
+		daemon->load = LOAD_UNKNOWN;
+		return 0;
+	}
+
+	send_key_request(daemon->sd, CMD_GET_LOAD, "get-load", tokenname,
+			 certname);
+
+	char *srvmsg = NULL;
+	int32_t rc = check_response(daemon->sd, &srvmsg);
+	if (rc < 0) {
+		fprintf(stderr, "pesign-client: %s: %s\n", daemon->sockpath,
+			srvmsg ? srvmsg : "cannot sign");
+		xfree(srvmsg);
+		return -1;
+	}
+	xfree(srvmsg);
+
+	daemon->load = rc;
+	return 0;
+}
+
+static int
+cmpdaemonp(const void *p1, const void *p2)
+{
+	const daemon_instance *d1 = p1;
+	const daemon_instance *d2 = p2;
+
+	if (d1->load != d2->load)
+		return d1->load < d2->load ? -1 : 1;
+	return d1->order - d2->order;
+}
+
+/*
+ * Send the request to the least busy daemon which can do it, and if that
+ * one is full or goes away, to the next one.  Ties are broken starting
+ * from a different daemon for each client process, so a build that runs
+ * lots of us at once gets spread over all of them.
+ */
+static void
+sign_sharded(daemon_instance *daemons, int ndaemons, char *infile,
+	     char *outfile, char *tokenname, char *certname, int attached)
+{
+	daemon_instance *candidates = calloc(ndaemons, sizeof (*candidates));
+	int ncandidates = 0;
+
+	if (!candidates) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < ndaemons; i++) {
+		daemon_instance *daemon = &daemons[i];
+
+		daemon->sd = open_socket(daemon->sockpath);
+		if (daemon->sd < 0) {
+			fprintf(stderr, "pesign-client: %s: could not connect "
+				"to daemon: %m\n", daemon->sockpath);
+			continue;
+		}
+
+		if (query_load(daemon, tokenname, certname) < 0) {
+			close(daemon->sd);
+			daemon->sd = -1;
+			continue;
+		}
+
+		daemon->order = (i + ndaemons - getpid() % ndaemons) % ndaemons;
+		candidates[ncandidates++] = *daemon;
+	}
+
+	if (ncandidates == 0) {
+		fprintf(stderr, "pesign-client: no daemon can sign with "
+			"\"%s:%s\"\n", tokenname, certname);
+		exit(1);
+	}
+
+	qsort(candidates, ncandidates, sizeof (*candidates), cmpdaemonp);
+
+	int rc = -1;
+	for (int i = 0; i < ncandidates; i++) {
+		rc = sign(candidates[i].sd, infile, outfile, tokenname,
+			  certname, attached, i > 0);
+		if (rc != PESIGND_RETRY)
+			break;
+		if (i + 1 < ncandidates)
+			fprintf(stderr, "pesign-client: trying %s instead\n",
+				candidates[i + 1].sockpath);
+	}
+
+	for (int i = 0; i < ncandidates; i++)
+		close(candidates[i].sd);
+	free(candidates);
+
+	if (rc < 0)
+		exit(1);
+}
+
+/*
+ * With --digest-only, the binary never leaves this machine; we hash it
+ * here, and only the digest goes to the gateway.
+ */
+static SECItem *
+digest_image(char *infile, char *digest_name)
+{
+	cms_context *cms = NULL;
+
+	if (cms_context_alloc(&cms) < 0) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+
+	if (set_digest_parameters(cms, digest_name) < 0) {
+		fprintf(stderr, "pesign-client: unsupported digest \"%s\"\n",
+			digest_name);
+		exit(1);
+	}
+
+	int infd = open(infile, O_RDONLY);
+	if (infd < 0) {
+		fprintf(stderr, "pesign-client: could not open input file "
+			"\"%s\": %m\n", infile);
+		exit(1);
+	}
+
+	Pe *pe = pe_begin(infd, PE_C_READ_MMAP, NULL);
+	if (!pe)
+		pe = pe_begin(infd, PE_C_READ, NULL);
+	if (!pe) {
+		fprintf(stderr, "pesign-client: could not load input file: "
+			"%s\n", pe_errmsg(pe_errno()));
+		exit(1);
+	}
+
+	if (generate_digest(cms, pe, 1) < 0) {
+		fprintf(stderr, "pesign-client: could not digest \"%s\"\n",
+			infile);
+		exit(1);
+	}
+
+	SECItem *digest = SECITEM_DupItem(
+				cms->digests[cms->selected_digest].pe_digest);
+	if (!digest) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%s\n", PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	pe_end(pe);
 	close(infd);
+	cms_context_fini(cms);
+	return digest;
+}
+
+static PRFileDesc *
+connect_to_gateway(char *remote, char *client_cert, secuPWData *pwdata)
+{
+	char *host = NULL;
+	PRUint16 port = 0;
+
+	if (remote_parse_address(remote, &host, &port) < 0 || !host) {
+		fprintf(stderr, "pesign-client: invalid remote address "
+			"\"%s\"\n", remote);
+		exit(1);
+	}
+
+	PRAddrInfo *ai = PR_GetAddrInfoByName(host, PR_AF_UNSPEC,
+					      PR_AI_ADDRCONFIG);
+	if (!ai) {
+		fprintf(stderr, "pesign-client: could not resolve \"%s\": "
+			"%s\n", host, PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	PRFileDesc *fd = NULL;
+	PRNetAddr addr;
+	void *iter = NULL;
+	while ((iter = PR_EnumerateAddrInfo(iter, ai, port, &addr))) {
+		fd = PR_OpenTCPSocket(PR_NetAddrFamily(&addr));
+		if (!fd)
+			continue;
+		if (PR_Connect(fd, &addr, PR_SecondsToInterval(
+				GATEWAY_TIMEOUT)) == PR_SUCCESS)
+			break;
+		PR_Close(fd);
+		fd = NULL;
+	}
+	PR_FreeAddrInfo(ai);
+	if (!fd) {
+		fprintf(stderr, "pesign-client: could not connect to \"%s\": "
+			"%s\n", remote, PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	PRFileDesc *sslfd = SSL_ImportFD(NULL, fd);
+	if (!sslfd) {
+tls_error:
+		fprintf(stderr, "pesign-client: could not set up TLS: %s\n",
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	SSLVersionRange range = {
+		.min = SSL_LIBRARY_VERSION_TLS_1_2,
+		.max = SSL_LIBRARY_VERSION_TLS_1_3,
+	};
+
+	/* the gateway's certificate is checked against the trust in our
+	 * database, and its name against the host we asked for */
+	if (SSL_OptionSet(sslfd, SSL_SECURITY, PR_TRUE) != SECSuccess ||
+	    SSL_OptionSet(sslfd, SSL_HANDSHAKE_AS_CLIENT,
+			  PR_TRUE) != SECSuccess ||
+	    SSL_VersionRangeSet(sslfd, &range) != SECSuccess ||
+	    SSL_SetURL(sslfd, host) != SECSuccess ||
+	    SSL_SetPKCS11PinArg(sslfd, pwdata) != SECSuccess ||
+	    SSL_GetClientAuthDataHook(sslfd, NSS_GetClientAuthData,
+				      client_cert) != SECSuccess ||
+	    SSL_ResetHandshake(sslfd, PR_FALSE) != SECSuccess)
+		goto tls_error;
+
+	if (SSL_ForceHandshakeWithTimeout(sslfd,
+			PR_SecondsToInterval(GATEWAY_TIMEOUT)) != SECSuccess) {
+		fprintf(stderr, "pesign-client: TLS handshake with \"%s\" "
+			"failed: %s\n", remote,
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	free(host);
+	return sslfd;
+}
+
+static void
+remote_write_or_die(PRFileDesc *fd, const void *buf, size_t len)
+{
+	if (remote_write(fd, buf, len) < 0) {
+		fprintf(stderr, "pesign-client: could not send request: %s\n",
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+}
+
+static void
+remote_read_or_die(PRFileDesc *fd, void *buf, size_t len)
+{
+	if (remote_read(fd, buf, len) < 0) {
+		fprintf(stderr, "pesign-client: could not get response from "
+			"gateway: %s\n", PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+}
+
+/*
+ * Sign through pesign-gateway.  The request carries the whole binary, or
+ * with --digest-only just its digest, and the answer carries the signed
+ * binary or the detached signature.
+ */
+static void
+sign_remote(char *remote, char *certdir, char *client_cert, char *pinfile,
+	    char *infile, char *outfile, char *tokenname, char *certname,
+	    int attached, char *digest_name)
+{
+	SECStatus status = NSS_Init(certdir);
+	if (status != SECSuccess) {
+		fprintf(stderr, "pesign-client: could not open NSS database "
+			"\"%s\": %s\n", certdir,
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+	if (NSS_SetDomesticPolicy() != SECSuccess) {
+		fprintf(stderr, "pesign-client: could not set up TLS: %s\n",
+			PORT_ErrorToString(PORT_GetError()));
+		exit(1);
+	}
+
+	secuPWData pwdata = {
+		.source = pinfile ? PW_FROMFILE : PW_NONE,
+		.data = pinfile,
+	};
+	PK11_SetPasswordFunc(SECU_GetModulePassword);
+
+	uint32_t size0 = pesignd_string_size(tokenname);
+	uint32_t size1 = pesignd_string_size(certname);
+	uint32_t size2 = 0;
+	uint32_t size3 = 0;
+	SECItem *digest = NULL;
+	char *image = NULL;
+	size_t imagelen = 0;
+
+	if (digest_name) {
+		digest = digest_image(infile, digest_name);
+		size2 = pesignd_string_size(digest_name);
+		size3 = sizeof (uint32_t) + digest->len;
+	} else {
+		int infd = open(infile, O_RDONLY);
+		if (infd < 0 || read_file(infd, &image, &imagelen) < 0) {
+			fprintf(stderr, "pesign-client: could not read input "
+				"file \"%s\": %m\n", infile);
+			exit(1);
+		}
+		close(infd);
+	}
+
+	uint64_t total = (uint64_t)size0 + size1 + size2 + size3 + imagelen;
+	if (total > GATEWAY_MAX_MESSAGE) {
+		fprintf(stderr, "pesign-client: \"%s\" is too big to sign "
+			"remotely\n", infile);
+		exit(1);
+	}
+
+	uint8_t *key = calloc(1, size0 + size1 + size2 + size3);
+	if (!key) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+
+	pesignd_string *str = (pesignd_string *)key;
+	pesignd_string_set(str, tokenname);
+	str = pesignd_string_next(str);
+	pesignd_string_set(str, certname);
+	if (digest) {
+		str = pesignd_string_next(str);
+		pesignd_string_set(str, digest_name);
+		str = pesignd_string_next(str);
+		str->size = digest->len;
+		memcpy(str->value, digest->data, digest->len);
+	}
+
+	pesignd_msghdr pm = {
+		.version = PESIGND_VERSION,
+		.command = digest ? CMD_SIGN_DIGEST :
+			   attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED,
+		.size = total,
+	};
+
+	PRFileDesc *fd = connect_to_gateway(remote, client_cert, &pwdata);
+
+	remote_write_or_die(fd, &pm, sizeof (pm));
+	remote_write_or_die(fd, key, size0 + size1 + size2 + size3);
+	if (image)
+		remote_write_or_die(fd, image, imagelen);
+
+	int32_t rc;
+	uint32_t msglen;
+	remote_read_or_die(fd, &pm, sizeof (pm));
+	if (pm.version != PESIGND_VERSION || pm.command != CMD_RESPONSE ||
+			pm.size < sizeof (rc) + sizeof (msglen)) {
+		fprintf(stderr, "pesign-client: got unexpected response from "
+			"gateway\n");
+		exit(1);
+	}
+	remote_read_or_die(fd, &rc, sizeof (rc));
+	remote_read_or_die(fd, &msglen, sizeof (msglen));
+	if (msglen > pm.size - sizeof (rc) - sizeof (msglen)) {
+		fprintf(stderr, "pesign-client: got unexpected response from "
+			"gateway\n");
+		exit(1);
+	}
+
+	size_t outlen = pm.size - sizeof (rc) - sizeof (msglen) - msglen;
+	char *srvmsg = calloc(1, msglen + 1);
+	uint8_t *out = malloc(outlen ? outlen : 1);
+	if (!srvmsg || !out) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+	remote_read_or_die(fd, srvmsg, msglen);
+	remote_read_or_die(fd, out, outlen);
+	PR_Close(fd);
+
+	if (rc < 0) {
+		fprintf(stderr, "pesign-client: signing failed: \"%s\"\n",
+			srvmsg);
+		exit(1);
+	}
+
+	int outfd = open(outfile, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (outfd < 0) {
+		fprintf(stderr, "pesign-client: could not open output file "
+			"\"%s\": %m\n", outfile);
+		exit(1);
+	}
+	if (write(outfd, out, outlen) != (ssize_t)outlen) {
+		fprintf(stderr, "pesign-client: could not write output file "
+			"\"%s\": %m\n", outfile);
+		exit(1);
+	}
 	close(outfd);
 
-	return;
+	free(srvmsg);
+	free(out);
+	free(key);
+	xfree(image);
+	if (digest)
+		SECITEM_FreeItem(digest, PR_TRUE);
+	NSS_Shutdown();
 }
 
 int
@@ -552,6 +1203,13 @@ main(int argc, char *argv[])
 	int pinfd = -1;
 	char *pinfile = NULL;
 	char *tokenpin = NULL;
+	char *socklist = NULL;
+	char *sockdir = NULL;
+	char *remote = NULL;
+	char *remote_certdir = "/etc/pki/pesign";
+	char *remote_cert = NULL;
+	int digest_only = 0;
+	char *digest_name = "sha256";
 
 	struct poptOption options[] = {
 		{.argInfo = POPT_ARG_INTL_DOMAIN,
@@ -586,6 +1244,18 @@ main(int argc, char *argv[])
 		 .arg = &action,
 		 .val = KILL_DAEMON,
 		 .descrip = "kill running daemon" },
+		{.longName = "reload",
+		 .shortName = 'r',
+		 .argInfo = POPT_ARG_VAL|POPT_ARGFLAG_OR,
+		 .arg = &action,
+		 .val = RELOAD_DAEMON,
+		 .descrip = "reload the daemon's certificate database" },
+		{.longName = "status",
+		 .shortName = 'T',
+		 .argInfo = POPT_ARG_VAL|POPT_ARGFLAG_OR,
+		 .arg = &action,
+		 .val = GET_STATUS,
+		 .descrip = "show the daemon's token health and load" },
 		{.longName = "sign",
 		 .shortName = 's',
 		 .argInfo = POPT_ARG_VAL|POPT_ARGFLAG_OR,
@@ -623,6 +1293,45 @@ main(int argc, char *argv[])
 		 .arg = &pinfile,
 		 .descrip = "read named file for pin information",
 		 .argDescrip = "<pin file name>" },
+		{.longName = "socket",
+		 .shortName = 'S',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &socklist,
+		 .descrip = "comma separated list of daemon sockets",
+		 .argDescrip = "<socket>[,<socket>...]" },
+		{.longName = "socket-dir",
+		 .shortName = 'D',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &sockdir,
+		 .descrip = "use every daemon socket in this directory",
+		 .argDescrip = "<directory>" },
+		{.longName = "remote",
+		 .shortName = 'R',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &remote,
+		 .descrip = "sign through pesign-gateway on this host",
+		 .argDescrip = "<host>:<port>" },
+		{.longName = "remote-certdir",
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &remote_certdir,
+		 .descrip = "NSS database with our TLS certificate and the "
+			    "gateway's CA",
+		 .argDescrip = "<directory>" },
+		{.longName = "remote-certificate",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &remote_cert,
+		 .descrip = "our TLS certificate's nickname",
+		 .argDescrip = "<nickname>" },
+		{.longName = "digest-only",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &digest_only,
+		 .val = 1,
+		 .descrip = "only send the binary's digest to the gateway" },
+		{.longName = "digest-type",
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &digest_name,
+		 .descrip = "digest type to use with --digest-only",
+		 .argDescrip = "<digest>" },
 		POPT_AUTOALIAS
 		POPT_AUTOHELP
 		POPT_TABLEEND
@@ -677,6 +1386,45 @@ main(int argc, char *argv[])
 
 	poptFreeContext(optCon);
 
+	if (remote) {
+		if (action != SIGN_BINARY) {
+			fprintf(stderr, "pesign-client: --remote only works "
+				"with --sign\n");
+			exit(1);
+		}
+		if (socklist || sockdir) {
+			fprintf(stderr, "pesign-client: --remote can't be "
+				"used with --socket or --socket-dir\n");
+			exit(1);
+		}
+		if (!remote_cert) {
+			fprintf(stderr, "pesign-client: no remote certificate "
+				"specified\n");
+			exit(1);
+		}
+		if (digest_only && attached) {
+			fprintf(stderr, "pesign-client: --digest-only needs "
+				"--export\n");
+			exit(1);
+		}
+	} else if (digest_only) {
+		fprintf(stderr, "pesign-client: --digest-only needs "
+			"--remote\n");
+		exit(1);
+	}
+
+	daemon_instance *daemons = NULL;
+	int ndaemons = 0;
+	find_daemons(socklist, sockdir, &daemons, &ndaemons);
+
+	/* everything but signing is about one daemon in particular */
+	if (ndaemons > 1 && action != SIGN_BINARY) {
+		fprintf(stderr, "pesign-client: ");
+		print_flag_name(stderr, action);
+		fprintf(stderr, "needs exactly one daemon socket\n");
+		exit(1);
+	}
+
 	int sd = -1;
 
 	switch (action) {
@@ -691,18 +1439,26 @@ main(int argc, char *argv[])
 					"specified");
 			exit(1);
 		}
-		sd = connect_to_server();
+		sd = connect_to_server(daemons[0].sockpath);
 		unlock_token(sd, tokenname, tokenpin);
 		free(tokenpin);
 		break;
 	case IS_TOKEN_UNLOCKED:
-		sd = connect_to_server();
+		sd = connect_to_server(daemons[0].sockpath);
 		is_token_unlocked(sd, tokenname);
 		break;
 	case KILL_DAEMON:
-		sd = connect_to_server();
+		sd = connect_to_server(daemons[0].sockpath);
 		send_kill_daemon(sd);
 		break;
+	case RELOAD_DAEMON:
+		sd = connect_to_server(daemons[0].sockpath);
+		send_reload(sd);
+		break;
+	case GET_STATUS:
+		sd = connect_to_server(daemons[0].sockpath);
+		get_status(sd);
+		break;
 	case SIGN_BINARY:
 		if (!infile) {
 			fprintf(stderr, "pesign-client: no input file "
@@ -719,8 +1475,23 @@ main(int argc, char *argv[])
 				"spefified\n");
 			exit(1);
 		}
-		sd = connect_to_server();
-		sign(sd, infile, outfile, tokenname, certname, attached);
+		if (remote) {
+			sign_remote(remote, remote_certdir, remote_cert,
+				    pinfile, infile, outfile, tokenname,
+				    certname, attached,
+				    digest_only ? digest_name : NULL);
+			break;
+		}
+		if (ndaemons > 1) {
+			sign_sharded(daemons, ndaemons, infile, outfile,
+				     tokenname, certname, attached);
+			break;
+		}
+		sd = connect_to_server(daemons[0].sockpath);
+		rc = sign(sd, infile, outfile, tokenname, certname, attached,
+			  0);
+		if (rc < 0)
+			exit(1);
 		break;
 	default:
 		fprintf(stderr, "Incompatible flags (0x%08x): ", action);
@@ -76,6 +76,13 @@ digest_get_digest_oid(cms_context *cms)
 	return digest_params[i].digest_tag;
 }
 
+const char *
+digest_get_digest_name(cms_context *cms)
+{
+	int i = cms->selected_digest;
+	return digest_params[i].name;
+}
+
 SECOidTag
 digest_get_encryption_oid(cms_context *cms)
 {
@@ -97,6 +104,200 @@ digest_get_digest_size(cms_context *cms)
 	return digest_params[i].size;
 }
 
+/*
+ * Find the contents octets of a DER element - everything after its tag and
+ * length.  It has to be the whole of der.
+ */
+int
+der_contents(SECItem *der, SECItem *contents)
+{
+	size_t header = 2;
+
+	if (der->len < 2)
+		return -1;
+	if (der->data[1] & 0x80)
+		header += der->data[1] & 0x7f;
+	if (header > der->len)
+		return -1;
+
+	contents->type = der->type;
+	contents->data = der->data + header;
+	contents->len = der->len - header;
+	return 0;
+}
+
+/* take the next whole element, tag and all, off the front of der */
+int
+der_next(SECItem *der, SECItem *element)
+{
+	size_t header = 2;
+
+	if (der->len < 2)
+		return -1;
+	if (der->data[1] & 0x80) {
+		size_t n = der->data[1] & 0x7f;
+		size_t len = 0;
+
+		if (n == 0 || n > 4 || der->len < 2 + n)
+			return -1;
+		for (size_t i = 0; i < n; i++)
+			len = (len << 8) | der->data[2 + i];
+		header += n;
+		element->len = header + len;
+	} else {
+		element->len = header + der->data[1];
+	}
+	if (element->len > der->len)
+		return -1;
+
+	element->type = siBuffer;
+	element->data = der->data;
+	der->data += element->len;
+	der->len -= element->len;
+	return 0;
+}
+
+/* take one element off the front of der, which has to be tagged want */
+int
+der_take(SECItem *der, uint8_t want, SECItem *contents)
+{
+	SECItem element;
+
+	if (der->len < 2 || der->data[0] != want)
+		return -1;
+	if (der_next(der, &element) < 0)
+		return -1;
+	return der_contents(&element, contents);
+}
+
+/*
+ * Writing DER directly: work out how big everything is first with the
+ * *_length() functions, allocate the whole thing once, and then fill it in
+ * front to back with the der_put*() functions, each of which returns where
+ * the next element goes.  Lengths are always the shortest encoding, the
+ * same as SEC_ASN1EncodeItem() makes.
+ */
+
+/* the whole size of an element with len bytes of contents */
+size_t
+der_length(size_t len)
+{
+	size_t header = 2;
+
+	if (len > 0x7f) {
+		for (size_t n = len; n > 0; n >>= 8)
+			header++;
+	}
+	return header + len;
+}
+
+uint8_t *
+der_put_header(uint8_t *p, uint8_t tag, size_t len)
+{
+	size_t n = der_length(len) - len - 2;
+
+	*p++ = tag;
+	if (n == 0) {
+		*p++ = len;
+		return p;
+	}
+	*p++ = 0x80 | n;
+	while (n-- > 0)
+		*p++ = (len >> (8 * n)) & 0xff;
+	return p;
+}
+
+uint8_t *
+der_put(uint8_t *p, uint8_t tag, const void *data, size_t len)
+{
+	p = der_put_header(p, tag, len);
+	if (len)
+		memcpy(p, data, len);
+	return p + len;
+}
+
+/* an element that's already encoded, tag and all */
+uint8_t *
+der_put_raw(uint8_t *p, SECItem *der)
+{
+	if (der->len)
+		memcpy(p, der->data, der->len);
+	return p + der->len;
+}
+
+/*
+ * INTEGERs the way NSS writes them: redundant leading zeros come off, and
+ * unsigned ones get a zero back on if they'd otherwise look negative.
+ */
+static size_t
+der_integer_trim(SECItem *integer, uint8_t **data, int *pad)
+{
+	uint8_t *d = integer->data;
+	size_t len = integer->len;
+
+	while (len > 1 && d[0] == 0 && !(d[1] & 0x80)) {
+		d++;
+		len--;
+	}
+	*pad = integer->type == siUnsignedInteger && len && (d[0] & 0x80);
+	*data = d;
+	return len;
+}
+
+size_t
+der_integer_length(SECItem *integer)
+{
+	uint8_t *data;
+	int pad;
+	size_t len = der_integer_trim(integer, &data, &pad);
+
+	return der_length(len + pad);
+}
+
+uint8_t *
+der_put_integer(uint8_t *p, SECItem *integer)
+{
+	uint8_t *data;
+	int pad;
+	size_t len = der_integer_trim(integer, &data, &pad);
+
+	p = der_put_header(p, SEC_ASN1_INTEGER, len + pad);
+	if (pad)
+		*p++ = 0;
+	memcpy(p, data, len);
+	return p + len;
+}
+
+/* parameters, if there are any, are already encoded */
+size_t
+der_algorithm_id_length(SECAlgorithmID *alg)
+{
+	return der_length(der_length(alg->algorithm.len) +
+			  alg->parameters.len);
+}
+
+uint8_t *
+der_put_algorithm_id(uint8_t *p, SECAlgorithmID *alg)
+{
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   der_length(alg->algorithm.len) +
+			   alg->parameters.len);
+	p = der_put(p, SEC_ASN1_OBJECT_ID, alg->algorithm.data,
+		    alg->algorithm.len);
+	return der_put_raw(p, &alg->parameters);
+}
+
+/* which of cms->digests is made with this algorithm, or -1 for none */
+int
+digest_get_index_by_oid(SECOidTag tag)
+{
+	for (int i = 0; i < n_digest_params; i++) {
+		if (digest_params[i].digest_tag == tag)
+			return i;
+	}
+	return -1;
+}
+
 void
 teardown_digests(cms_context *ctx)
 {
@@ -163,6 +364,21 @@ cms_context_fini(cms_context *cms)
 		cms->cert = NULL;
 	}
 
+	if (cms->template) {
+		free_signer_template(cms->template);
+		cms->template = NULL;
+	}
+
+	if (cms->helper) {
+		signer_helper_free(cms->helper);
+		cms->helper = NULL;
+	}
+
+	if (cms->tsa) {
+		timestamp_client_free(cms->tsa);
+		cms->tsa = NULL;
+	}
+
 	if (cms->privkey) {
 		free(cms->privkey);
 		cms->privkey = NULL;
@@ -221,11 +437,6 @@ cms_context_fini(cms_context *cms)
 	xfree(cms->signatures);
 	cms->num_signatures = 0;
 
-	if (cms->authbuf) {
-		xfree(cms->authbuf);
-		cms->authbuf_len = 0;
-	}
-
 	PORT_FreeArena(cms->arena, PR_TRUE);
 	memset(cms, '\0', sizeof(*cms));
 	xfree(cms);
@@ -391,6 +602,10 @@ find_certificate(cms_context *cms, int needs_private_key)
 		return -1;
 	}
 
+	/* the signer helper has the private key, not NSS */
+	if (cms->helper)
+		needs_private_key = 0;
+
 	secuPWData pwdata_val = { 0, 0 };
 	void *pwdata = cms->pwdata ? cms->pwdata : &pwdata_val;
 	PK11_SetPasswordFunc(cms->func ? cms->func : SECU_GetModulePassword);
@@ -476,7 +691,7 @@ find_certificate(cms_context *cms, int needs_private_key)
 	PK11_FreeSlotList(slots);
 	CERT_DestroyCertList(certlist);
 
-	return 0;
+	return generate_signer_template(cms);
 }
 
 int
@@ -746,8 +961,8 @@ generate_object_id(cms_context *cms, SECItem *der, SECOidTag tag)
 	return 0;
 }
 
-int
-generate_algorithm_id(cms_context *cms, SECAlgorithmID *idp, SECOidTag tag)
+static int
+__generate_algorithm_id(PRArenaPool *arena, SECAlgorithmID *idp, SECOidTag tag)
 {
 	SECAlgorithmID id;
 
@@ -760,10 +975,10 @@ generate_algorithm_id(cms_context *cms, SECAlgorithmID *idp, SECOidTag tag)
 		PORT_SetError(SEC_ERROR_INVALID_ALGORITHM);
 		return -1;
 	}
-	if (SECITEM_CopyItem(cms->arena, &id.algorithm, &oiddata->oid))
+	if (SECITEM_CopyItem(arena, &id.algorithm, &oiddata->oid))
 		return -1;
 
-	SECITEM_AllocItem(cms->arena, &id.parameters, 2);
+	SECITEM_AllocItem(arena, &id.parameters, 2);
 	if (id.parameters.data == NULL)
 		goto err;
 	id.parameters.data[0] = SEC_ASN1_NULL;
@@ -778,6 +993,188 @@ err:
 	return -1;
 }
 
+int
+generate_algorithm_id(cms_context *cms, SECAlgorithmID *idp, SECOidTag tag)
+{
+	return __generate_algorithm_id(cms->arena, idp, tag);
+}
+
+void
+free_signer_template(signer_template *template)
+{
+	if (!template)
+		return;
+
+	if (template->cert)
+		CERT_DestroyCertificate(template->cert);
+	if (template->arena)
+		PORT_FreeArena(template->arena, PR_TRUE);
+	memset(template, '\0', sizeof (*template));
+	free(template);
+}
+
+static int
+new_signer_template(cms_context *cms, signer_template **templatep)
+{
+	signer_template *st = calloc(1, sizeof (*st));
+	if (!st)
+		cmsreterr(-1, cms, "could not allocate signer template");
+
+	st->arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+	if (!st->arena) {
+		save_port_err(free_signer_template(st));
+		cmsreterr(-1, cms, "could not create signer template arena");
+	}
+
+	if (SEC_ASN1EncodeInteger(st->arena, &st->version, 1) == NULL)
+		goto err;
+
+	st->certificates = PORT_ArenaZAlloc(st->arena, sizeof (SECItem *) * 3);
+	st->digest_algorithms = PORT_ArenaZAlloc(st->arena,
+				sizeof (SECAlgorithmID) * n_digest_params);
+	st->encryption_algorithms = PORT_ArenaZAlloc(st->arena,
+				sizeof (SECAlgorithmID) * n_digest_params);
+	if (!st->certificates || !st->digest_algorithms ||
+			!st->encryption_algorithms)
+		goto err;
+
+	for (int i = 0; i < n_digest_params; i++) {
+		if (__generate_algorithm_id(st->arena,
+				&st->digest_algorithms[i],
+				digest_params[i].digest_tag) < 0)
+			goto err;
+		if (__generate_algorithm_id(st->arena,
+				&st->encryption_algorithms[i],
+				digest_params[i].digest_encryption_tag) < 0)
+			goto err;
+	}
+
+	*templatep = st;
+	return 0;
+err:
+	save_port_err(free_signer_template(st));
+	cmsreterr(-1, cms, "could not generate signer template");
+}
+
+int
+generate_signer_template(cms_context *cms)
+{
+	/* a template imported from DER has no cert to compare against */
+	if (cms->template && !cms->template->cert && !cms->cert)
+		return 0;
+
+	if (!cms->cert) {
+		cms->log(cms, LOG_ERR, "no certificate specified");
+		return -1;
+	}
+
+	/* if we already have one for this certificate, it's still good */
+	if (cms->template) {
+		if (cms->template->cert &&
+				SECITEM_ItemsAreEqual(
+					&cms->template->cert->derCert,
+					&cms->cert->derCert))
+			return 0;
+		free_signer_template(cms->template);
+		cms->template = NULL;
+	}
+
+	signer_template *st = NULL;
+	if (new_signer_template(cms, &st) < 0)
+		return -1;
+
+	st->cert = CERT_DupCertificate(cms->cert);
+
+	if (SECITEM_CopyItem(st->arena, &st->issuer, &cms->cert->derIssuer))
+		goto err;
+	if (SECITEM_CopyItem(st->arena, &st->serial,
+				&cms->cert->serialNumber))
+		goto err;
+
+	int i = 0;
+	st->certificates[i] = SECITEM_ArenaDupItem(st->arena,
+						&cms->cert->derCert);
+	if (!st->certificates[i++])
+		goto err;
+
+	if (!is_issuer_of(cms->cert, cms->cert)) {
+		CERTCertificate *signer = NULL;
+		int rc = find_named_certificate(cms, cms->cert->issuerName,
+						&signer);
+		if (rc == 0 && signer &&
+				signer->derCert.len && signer->derCert.data) {
+			if (!SECITEM_ItemsAreEqual(&signer->derCert,
+						&cms->cert->derCert)) {
+				st->certificates[i] = SECITEM_ArenaDupItem(
+						st->arena, &signer->derCert);
+				if (!st->certificates[i++]) {
+					save_port_err(
+						CERT_DestroyCertificate(signer));
+					goto err;
+				}
+			}
+			CERT_DestroyCertificate(signer);
+		}
+	}
+
+	cms->template = st;
+	return 0;
+err:
+	save_port_err(free_signer_template(st));
+	cmsreterr(-1, cms, "could not generate signer template");
+}
+
+/*
+ * Build the signer template from a certificate chain we were handed as DER
+ * (signer first, then its issuer), rather than from something we found in
+ * the NSS database.  This is what lets us assemble a signature without
+ * having the signer's certificate in a database at all.
+ */
+int
+generate_signer_template_from_der(cms_context *cms, SECItem **certificates)
+{
+	if (!certificates || !certificates[0])
+		cmsreterr(-1, cms, "no signer certificate specified");
+
+	if (cms->template) {
+		free_signer_template(cms->template);
+		cms->template = NULL;
+	}
+
+	signer_template *st = NULL;
+	if (new_signer_template(cms, &st) < 0)
+		return -1;
+
+	CERTCertificate *cert;
+	cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), certificates[0],
+				       NULL, PR_FALSE, PR_TRUE);
+	if (!cert) {
+		save_port_err(free_signer_template(st));
+		cmsreterr(-1, cms, "could not decode signer certificate");
+	}
+
+	int rc = 0;
+	if (SECITEM_CopyItem(st->arena, &st->issuer, &cert->derIssuer) ||
+	    SECITEM_CopyItem(st->arena, &st->serial, &cert->serialNumber))
+		rc = -1;
+	save_port_err(CERT_DestroyCertificate(cert));
+	if (rc < 0)
+		goto err;
+
+	for (int i = 0; i < 2 && certificates[i]; i++) {
+		st->certificates[i] = SECITEM_ArenaDupItem(st->arena,
+							certificates[i]);
+		if (!st->certificates[i])
+			goto err;
+	}
+
+	cms->template = st;
+	return 0;
+err:
+	save_port_err(free_signer_template(st));
+	cmsreterr(-1, cms, "could not generate signer template");
+}
+
 int
 encode_algorithm_id(cms_context *cms, SECItem *der, SECOidTag tag)
 {
@@ -863,6 +1260,13 @@ SEC_ASN1Template SpcLinkTemplate[] = {
 	.sub = &SpcStringTemplate,
 	.size = SpcLinkTypeFile,
 	},
+	/* [1] IMPLICIT SpcSerializedObject, already encoded by the caller */
+	{
+	.kind = SEC_ASN1_ANY,
+	.offset = offsetof(SpcLink, moniker),
+	.sub = &SEC_AnyTemplate,
+	.size = SpcLinkTypeMoniker,
+	},
 	{ 0, }
 };
 
@@ -887,6 +1291,11 @@ generate_spc_link(cms_context *cms, SpcLink *slp, SpcLinkType link_type,
 		sl.url.data = link_data;
 		sl.url.len = link_data_size;
 		break;
+	case SpcLinkTypeMoniker:
+		sl.moniker.type = siBuffer;
+		sl.moniker.data = link_data;
+		sl.moniker.len = link_data_size;
+		break;
 	default:
 		cms->log(cms, LOG_ERR, "Invalid SpcLinkType");
 		return -1;
@@ -991,6 +1400,45 @@ err:
 	return -1;
 }
 
+/*
+ * Use a digest somebody else computed for us (for example one saved in a
+ * signing session) instead of hashing the binary again.
+ */
+int
+import_digest(cms_context *cms, SECOidTag tag, SECItem *digest)
+{
+	int i;
+
+	for (i = 0; i < n_digest_params; i++) {
+		if (digest_params[i].digest_tag == tag)
+			break;
+	}
+	if (i == n_digest_params) {
+		cms->log(cms, LOG_ERR, "unsupported digest algorithm");
+		return -1;
+	}
+
+	if (digest->len != (unsigned int)digest_params[i].size) {
+		cms->log(cms, LOG_ERR, "%s digest has invalid size %d",
+			digest_params[i].name, digest->len);
+		return -1;
+	}
+
+	if (!cms->digests) {
+		cms->digests = PORT_ZAlloc(n_digest_params *
+					   sizeof (*cms->digests));
+		if (!cms->digests)
+			cmsreterr(-1, cms, "could not allocate digest context");
+	}
+
+	cms->digests[i].pe_digest = SECITEM_ArenaDupItem(cms->arena, digest);
+	if (!cms->digests[i].pe_digest)
+		cmsreterr(-1, cms, "could not allocate digest");
+
+	cms->selected_digest = i;
+	return 0;
+}
+
 /* before you run this, you'll need to enroll your CA with:
  * certutil -A -n 'my CA' -d /etc/pki/pesign -t CT,CT,CT -i ca.crt
  * And you'll need to enroll the private key like this:
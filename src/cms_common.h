@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <cert.h>
+#include <pthread.h>
 #include <secpkcs7.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -54,7 +55,30 @@ struct digest {
 	SECItem *pe_digest;
 };
 
+/*
+ * Everything in a SignedData / SignerInfo that depends only on the signing
+ * certificate and not on the binary being signed.  It gets built once when
+ * the certificate is resolved, and lives in its own arena so that it can
+ * outlive the cms_context it was built for (the daemon hands it from one
+ * request to the next).
+ */
+typedef struct {
+	PRArenaPool *arena;
+	CERTCertificate *cert;
+
+	SECItem version;
+	SECItem issuer;
+	SECItem serial;
+	SECItem **certificates;
+
+	/* indexed the same way as selected_digest */
+	SECAlgorithmID *digest_algorithms;
+	SECAlgorithmID *encryption_algorithms;
+} signer_template;
+
 struct cms_context;
+struct signer_helper;
+struct timestamp_client;
 
 typedef int (*cms_common_logger)(struct cms_context *, int priority,
 		char *fmt, ...)
@@ -67,9 +91,22 @@ typedef struct cms_context {
 	char *tokenname;
 	char *certname;
 	CERTCertificate *cert;
+	signer_template *template;
 	PK11PasswordFunc func;
 	void *pwdata;
 
+	struct signer_helper *helper;
+
+	/* contexts that share one token session take turns with it under
+	 * this, if it's set; with a signer helper it's only held while
+	 * sending a request, not while waiting for the answer */
+	pthread_mutex_t *key_lock;
+
+	/* countersign with an RFC 3161 timestamp, and whether this signature
+	 * is only being made to see how big it is */
+	struct timestamp_client *tsa;
+	int timestamp_sizing;
+
 	struct digest *digests;
 	int selected_digest;
 
@@ -77,15 +114,16 @@ typedef struct cms_context {
 
 	SECItem *ci_digest;
 
+	/* whether to make page hashes, and the last ones we made */
+	int page_hashes;
+	SECItem page_hash_table;
+
 	SECItem *raw_signed_attrs;
 	SECItem *raw_signature;
 
 	int num_signatures;
 	SECItem **signatures;
 
-	int authbuf_len;
-	void *authbuf;
-
 	cms_common_logger log;
 	void *log_priv;
 } cms_context;
@@ -94,6 +132,7 @@ typedef enum {
 	SpcLinkYouHaveFuckedThisUp = 0,
 	SpcLinkTypeUrl = 1,
 	SpcLinkTypeFile = 2,
+	SpcLinkTypeMoniker = 3,
 } SpcLinkType;
 
 typedef struct {
@@ -101,6 +140,7 @@ typedef struct {
 	union {
 		SECItem url;
 		SECItem file;
+		SECItem moniker;
 	};
 } SpcLink;
 extern SEC_ASN1Template SpcLinkTemplate[];
@@ -144,14 +184,33 @@ extern int generate_keys(cms_context *cms, PK11SlotInfo *slot,
 		SECKEYPrivateKey **privkey, SECKEYPublicKey **pubkey);
 extern int is_issuer_of(CERTCertificate *c0, CERTCertificate *c1);
 
+extern int generate_signer_template(cms_context *cms);
+extern int generate_signer_template_from_der(cms_context *cms,
+					SECItem **certificates);
+extern void free_signer_template(signer_template *template);
+
 extern int find_named_certificate(cms_context *cms, char *name,
 				CERTCertificate **cert);
 extern int find_slot_for_token(cms_context *cms, PK11SlotInfo **slot);
 
 extern SECOidTag digest_get_digest_oid(cms_context *cms);
+extern const char *digest_get_digest_name(cms_context *cms);
 extern SECOidTag digest_get_encryption_oid(cms_context *cms);
 extern SECOidTag digest_get_signature_oid(cms_context *cms);
 extern int digest_get_digest_size(cms_context *cms);
+extern int digest_get_index_by_oid(SECOidTag tag);
+extern int der_contents(SECItem *der, SECItem *contents);
+extern int der_next(SECItem *der, SECItem *element);
+extern int der_take(SECItem *der, uint8_t want, SECItem *contents);
+extern size_t der_length(size_t len);
+extern uint8_t *der_put_header(uint8_t *p, uint8_t tag, size_t len);
+extern uint8_t *der_put(uint8_t *p, uint8_t tag, const void *data,
+			size_t len);
+extern uint8_t *der_put_raw(uint8_t *p, SECItem *der);
+extern size_t der_integer_length(SECItem *integer);
+extern uint8_t *der_put_integer(uint8_t *p, SECItem *integer);
+extern size_t der_algorithm_id_length(SECAlgorithmID *alg);
+extern uint8_t *der_put_algorithm_id(uint8_t *p, SECAlgorithmID *alg);
 extern void cms_set_pw_callback(cms_context *cms, PK11PasswordFunc func);
 extern void cms_set_pw_data(cms_context *cms, void *pwdata);
 
@@ -160,6 +219,7 @@ extern int set_digest_parameters(cms_context *ctx, char *name);
 extern int generate_digest_begin(cms_context *cms);
 extern void generate_digest_step(cms_context *cms, void *data, size_t len);
 extern int generate_digest_finish(cms_context *cms);
+extern int import_digest(cms_context *cms, SECOidTag tag, SECItem *digest);
 
 typedef struct {
 	enum {
@@ -28,140 +28,9 @@
 
 #include "content_info_priv.h"
 
-/* This generates to the DER for a SpcPeImageData, which includes the two
- * DER chunks generated above. Output is basically:
- *
- *       C-Sequence (37)
- *          Bit String (1)
- *            00
- *          C-[0]  (32)
- *             C-[2]  (30)
- *                [0]  (28)
- *                   00 3c 00 3c 00 3c 00 4f 00 62 00 73 00
- *                   6f 00 6c 00 65 00 74 00 65 00 3e 00 3e
- *                   00 3e
- * The Bit String output is a cheap hack; I can't figure out how to get the
- * length right using DER_BIT_STRING in the template; it always comes out as
- * 07 00 instead of just 00. So instead, since it's /effectively/ constant,
- * I just picked DER_NULL since it'll always come out to the right size, and
- * then manually bang DER_BIT_STRING into the type in the encoded output.
- * I'm so sorry. -- pjones
- */
-SEC_ASN1Template SpcPeImageDataTemplate[] = {
-	{
-	.kind = SEC_ASN1_SEQUENCE,
-	.offset = 0,
-	.sub = NULL,
-	.size = sizeof (SpcPeImageData),
-	},
-	{
-	.kind = SEC_ASN1_NULL,
-	.offset = offsetof(SpcPeImageData, flags),
-	.sub = NULL,
-	.size = 1
-	},
-	{
-	.kind = SEC_ASN1_CONSTRUCTED |
-		SEC_ASN1_CONTEXT_SPECIFIC | 0 |
-		SEC_ASN1_EXPLICIT,
-	.offset = offsetof(SpcPeImageData, link),
-	.sub = &SpcLinkTemplate,
-	.size = sizeof (SpcLink),
-	},
-	{ 0, }
-};
-
-static int
-generate_spc_pe_image_data(cms_context *cms, SECItem *spidp)
-{
-	SpcPeImageData spid;
-
-	SECITEM_AllocItem(cms->arena, &spid.flags, 1);
-	if (!spid.flags.data)
-		return -1;
-	spid.flags.data[0] = 0;
-
-	char obsolete[28] = "";
-	int rc;
-	rc = generate_spc_link(cms, &spid.link, SpcLinkTypeFile, obsolete, 0);
-	if (rc < 0)
-		return rc;
-
-	if (SEC_ASN1EncodeItem(cms->arena, spidp, &spid,
-			SpcPeImageDataTemplate) == NULL) {
-		cms->log(cms, LOG_ERR, "could not encode SpcPeImageData: %s",
-			PORT_ErrorToString(PORT_GetError()));
-		return -1;
-	}
-
-	/* XXX OMG FIX THIS */
-	/* manually bang it from NULL to BIT STRING because I can't figure out
-	 * how to make the fucking templates work right for the bitstring size
-	 */
-	spidp->data[2] = DER_BIT_STRING;
-	return 0;
-}
-
-SEC_ASN1Template SpcAttributeTypeAndOptionalValueTemplate[] = {
-	{
-	.kind = SEC_ASN1_SEQUENCE,
-	.offset = 0,
-	.sub = NULL,
-	.size = sizeof (SpcAttributeTypeAndOptionalValue)
-	},
-	{
-	.kind = SEC_ASN1_OBJECT_ID,
-	.offset = offsetof(SpcAttributeTypeAndOptionalValue, contentType),
-	.sub = &SEC_ObjectIDTemplate,
-	.size = sizeof (SECItem)
-	},
-	{
-	.kind = SEC_ASN1_OPTIONAL |
-		SEC_ASN1_ANY,
-	.offset = offsetof(SpcAttributeTypeAndOptionalValue, value),
-	.sub = &SEC_AnyTemplate,
-	.size = sizeof (SECItem),
-	},
-	{ 0, }
-};
-
-/* Generate DER for SpcAttributeTypeAndValue, which is basically just
- * a DER_SEQUENCE containing the OID 1.3.6.1.4.1.311.2.1.15
- * (SPC_PE_IMAGE_DATA_OBJID) and the SpcPeImageData.
- */
-static int
-generate_spc_attribute_yadda_yadda(cms_context *cms, SECItem *ataovp)
-{
-	SpcAttributeTypeAndOptionalValue ataov;
-	memset(&ataov, '\0', sizeof (ataov));
-
-	int rc;
-
-	rc = get_ms_oid_secitem(SPC_PE_IMAGE_DATA_OBJID, &ataov.contentType);
-	if (rc < 0) {
-		cms->log(cms, LOG_ERR, "could not get SPC_PE_IMAGE_DATA_OBJID");
-		return -1;
-	}
-
-	rc = generate_spc_pe_image_data(cms, &ataov.value);
-	if (rc < 0)
-		return rc;
-
-	if (SEC_ASN1EncodeItem(cms->arena, ataovp, &ataov,
-			SpcAttributeTypeAndOptionalValueTemplate) == NULL) {
-		cms->log(cms, LOG_ERR, "could not encode "
-			"SpcAttributeTypeAndOptionalValue: %s",
-			PORT_ErrorToString(PORT_GetError()));
-
-		return -1;
-	}
-	return 0;
-}
-
-/* Generate the DigestInfo, which is a sequence containing a AlgorithmID
- * and an Octet String of the binary's hash in that algorithm. For some
- * reason this is the only place I could really get template chaining to
- * work right. It's probably my on defficiency.
+/* The DigestInfo is a sequence containing a AlgorithmID and an Octet
+ * String of the binary's hash in that algorithm.  We write it out by hand
+ * below, but catalogs still need to decode them.
  */
 SEC_ASN1Template DigestInfoTemplate[] = {
 	{
@@ -185,87 +54,137 @@ SEC_ASN1Template DigestInfoTemplate[] = {
 	{ 0, }
 };
 
-static int
-generate_spc_digest_info(cms_context *cms, SECItem *dip)
+/* Generate DER for SpcIndirectDataContent, which comes out as:
+ *
+ *	C-Sequence				SpcIndirectDataContent
+ *	   C-Sequence				SpcAttributeTypeAndOptionalValue
+ *	      Object ID	1.3.6.1.4.1.311.2.1.15	(SPC_PE_IMAGE_DATA_OBJID)
+ *	      C-Sequence			SpcPeImageData
+ *	         Bit String	00
+ *	         C-[0]
+ *	            SpcLink
+ *	   C-Sequence				DigestInfo
+ *	      C-Sequence			AlgorithmID
+ *	      Octet String	the digest
+ *
+ * The SpcLink is normally an empty file name:
+ *
+ *	C-[2]
+ *	   [0]	(0)
+ *
+ * but if we're making page hashes, it's instead a moniker that carries the
+ * table:
+ *
+ *	C-[1]
+ *	   Octet String (16)	a6 b5 86 d5 b4 a1 24 66 ae 05 a2 17 da 8e 60 d6
+ *	   Octet String
+ *	      C-Set
+ *	         C-Sequence
+ *	            Object ID	1.3.6.1.4.1.311.2.3.2 (.1 for SHA-1)
+ *	            C-Set
+ *	               Octet String	the table
+ *
+ * All of that used to be a SEC_ASN1EncodeItem() per level, each copied
+ * into the one above it, along with a certain amount of banging tags in
+ * by hand after the fact where the templates wouldn't cooperate.  Now the
+ * lengths are worked out first, innermost out, and then the whole thing is
+ * written front to back into one buffer.
+ *
+ * The digest is usually the one we just made of the binary, but catalogs
+ * have one of these for each of their members.
+ */
+int
+generate_spc_indirect_data_content(cms_context *cms, SECItem *idcp,
+				   SECItem *digest)
 {
-	DigestInfo di;
-	memset(&di, '\0', sizeof (di));
+	static uint8_t class_id[] = {
+		0xa6, 0xb5, 0x86, 0xd5, 0xb4, 0xa1, 0x24, 0x66,
+		0xae, 0x05, 0xa2, 0x17, 0xda, 0x8e, 0x60, 0xd6
+	};
+	static uint8_t flags[] = { 0x00 };
+	SECItem *table = &cms->page_hash_table;
+	SECItem image_oid, hash_oid;
+	SECAlgorithmID alg;
+	size_t values = 0, attr = 0, set = 0, serialized = 0;
+	size_t link, pe_image_data, ataov, digest_info, idc;
+	uint8_t *buf, *p;
+
+	if (get_ms_oid_secitem(SPC_PE_IMAGE_DATA_OBJID, &image_oid) < 0) {
+		cms->log(cms, LOG_ERR, "could not get SPC_PE_IMAGE_DATA_OBJID");
+		return -1;
+	}
 
-	if (generate_algorithm_id(cms, &di.digestAlgorithm,
-			digest_get_digest_oid(cms)) < 0)
+	if (generate_algorithm_id(cms, &alg, digest_get_digest_oid(cms)) < 0)
 		return -1;
-	int i = cms->selected_digest;
-	memcpy(&di.digest, cms->digests[i].pe_digest, sizeof (di.digest));
 
-	if (content_is_empty(di.digest.data, di.digest.len)) {
+	if (content_is_empty(digest->data, digest->len)) {
 		cms->log(cms, LOG_ERR, "got empty digest");
 		return -1;
 	}
 
-	if (SEC_ASN1EncodeItem(cms->arena, dip, &di,
-						DigestInfoTemplate) == NULL) {
-		cms->log(cms, LOG_ERR, "could not encode DigestInfo: %s",
-			PORT_ErrorToString(PORT_GetError()));
-		return -1;
+	if (table->data) {
+		ms_oid_t moid = digest_get_digest_oid(cms) == SEC_OID_SHA1 ?
+				SPC_PE_IMAGE_PAGE_HASHES_V1 :
+				SPC_PE_IMAGE_PAGE_HASHES_V2;
+		if (get_ms_oid_secitem(moid, &hash_oid) < 0)
+			cmsreterr(-1, cms, "could not get page hash OID");
+
+		values = der_length(table->len);
+		attr = der_length(hash_oid.len) + der_length(values);
+		set = der_length(attr);
+		serialized = der_length(set);
+		link = der_length(sizeof (class_id)) + der_length(serialized);
+	} else {
+		link = der_length(0);
 	}
-	return 0;
-}
-
-/* Generate DER for SpcIndirectDataContent. It's just a DER_SEQUENCE that
- * holds the digestInfo above and the SpcAttributeTypeAndValue, also above.
- * Sequences, all the way down.
- *
- * This also generates the actual DER for SpcContentInfo, and is a public
- * function. SpcContentInfo is another sequence that holds a OID,
- * 1.3.6.1.4.1.311.2.1.4 (SPC_INDIRECT_DATA_OBJID) and then a reference to
- * the generated SpcIndirectDataContent structure.
- */
-SEC_ASN1Template SpcIndirectDataContentTemplate[] = {
-	{
-	.kind = SEC_ASN1_SEQUENCE,
-	.offset = 0,
-	.sub = NULL,
-	.size = 0,
-	},
-	{
-	.kind = SEC_ASN1_ANY |
-		SEC_ASN1_OPTIONAL,
-	.offset = offsetof(SpcIndirectDataContent, data),
-	.sub = &SEC_AnyTemplate,
-	.size = sizeof (SECItem)
-	},
-	{
-	.kind = SEC_ASN1_ANY |
-		SEC_ASN1_OPTIONAL,
-	.offset = offsetof(SpcIndirectDataContent, messageDigest),
-	.sub = &DigestInfoTemplate,
-	.size = sizeof (SECItem)
-	},
-	{ 0, }
-};
-
-static int
-generate_spc_indirect_data_content(cms_context *cms, SECItem *idcp)
-{
-	SpcIndirectDataContent idc;
-	memset(&idc, '\0', sizeof (idc));
-	int rc;
-
-	rc = generate_spc_attribute_yadda_yadda(cms, &idc.data);
-	if (rc < 0)
-		return rc;
-
-	rc = generate_spc_digest_info(cms, &idc.messageDigest);
-	if (rc < 0) {
-		SECITEM_FreeItem(&idc.data, PR_FALSE);
-		return rc;
+	pe_image_data = der_length(sizeof (flags)) +
+			der_length(der_length(link));
+	ataov = der_length(image_oid.len) + der_length(pe_image_data);
+	digest_info = der_algorithm_id_length(&alg) + der_length(digest->len);
+	idc = der_length(ataov) + der_length(digest_info);
+
+	idcp->type = siBuffer;
+	idcp->len = der_length(idc);
+	idcp->data = buf = PORT_ArenaAlloc(cms->arena, idcp->len);
+	if (!buf)
+		cmsreterr(-1, cms, "could not encode SpcIndirectDataContent");
+
+	p = der_put_header(buf, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED, idc);
+
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED, ataov);
+	p = der_put(p, SEC_ASN1_OBJECT_ID, image_oid.data, image_oid.len);
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   pe_image_data);
+	p = der_put(p, SEC_ASN1_BIT_STRING, flags, sizeof (flags));
+	p = der_put_header(p, SEC_ASN1_CONTEXT_SPECIFIC | SEC_ASN1_CONSTRUCTED |
+			   0, der_length(link));
+	if (table->data) {
+		p = der_put_header(p, SEC_ASN1_CONTEXT_SPECIFIC |
+				   SEC_ASN1_CONSTRUCTED | 1, link);
+		p = der_put(p, SEC_ASN1_OCTET_STRING, class_id,
+			    sizeof (class_id));
+		p = der_put_header(p, SEC_ASN1_OCTET_STRING, serialized);
+		p = der_put_header(p, SEC_ASN1_SET | SEC_ASN1_CONSTRUCTED, set);
+		p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+				   attr);
+		p = der_put(p, SEC_ASN1_OBJECT_ID, hash_oid.data, hash_oid.len);
+		p = der_put_header(p, SEC_ASN1_SET | SEC_ASN1_CONSTRUCTED,
+				   values);
+		p = der_put(p, SEC_ASN1_OCTET_STRING, table->data, table->len);
+	} else {
+		p = der_put_header(p, SEC_ASN1_CONTEXT_SPECIFIC |
+				   SEC_ASN1_CONSTRUCTED | 2, link);
+		p = der_put(p, SEC_ASN1_CONTEXT_SPECIFIC | 0, NULL, 0);
 	}
 
-	if (SEC_ASN1EncodeItem(cms->arena, idcp, &idc,
-			SpcIndirectDataContentTemplate) == NULL) {
-		cms->log(cms, LOG_ERR, "could not encode "
-			"SpcIndirectDataContent: %s",
-			PORT_ErrorToString(PORT_GetError()));
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   digest_info);
+	p = der_put_algorithm_id(p, &alg);
+	p = der_put(p, SEC_ASN1_OCTET_STRING, digest->data, digest->len);
+
+	if (p != buf + idcp->len) {
+		cms->log(cms, LOG_ERR, "SpcIndirectDataContent came out %td "
+			 "bytes, not %u", p - buf, idcp->len);
 		return -1;
 	}
 	return 0;
@@ -303,13 +222,15 @@ generate_cinfo_digest(cms_context *cms, SpcContentInfo *cip)
 	 * Microsoft is embedding in their binaries if I do, so I'm calling
 	 * that "correct", where "correct" means "there's not enough booze
 	 * in the world."
+	 *
+	 * (It's PKCS#7 digesting the contents octets, without the tag and
+	 * length.  That's 2 bytes until there's a page hash table in there,
+	 * and then the length takes 3 more.)
 	 */
-	SECItem encoded = {
-		.type = cip->content.type,
-		.data = cip->content.data + 2,
-		.len = cip->content.len - 2
-	};
-	
+	SECItem encoded;
+	if (der_contents(&cip->content, &encoded) < 0)
+		return -1;
+
 	PK11Context *ctx = NULL;
 	SECOidData *oid = SECOID_FindOIDByTag(digest_get_digest_oid(cms));
 	if (oid == NULL)
@@ -375,7 +296,8 @@ generate_spc_content_info(cms_context *cms, SpcContentInfo *cip)
 		return rc;
 	}
 
-	rc = generate_spc_indirect_data_content(cms, &ci.content);
+	rc = generate_spc_indirect_data_content(cms, &ci.content,
+			cms->digests[cms->selected_digest].pe_digest);
 	if (rc < 0)
 		return rc;
 
@@ -33,6 +33,8 @@ typedef struct SpcContentInfo SpcContentInfo;
 extern const SEC_ASN1Template SpcContentInfoTemplate[];
 
 extern int generate_spc_content_info(cms_context *cms, SpcContentInfo *cip);
+extern int generate_spc_indirect_data_content(cms_context *cms, SECItem *idcp,
+					      SECItem *digest);
 extern void free_spc_content_info(cms_context *cms, SpcContentInfo *cip);
 extern int register_content_info(void);
 extern int generate_authvar_content_info(cms_context *cms, SpcContentInfo *cip);
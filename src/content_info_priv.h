@@ -22,17 +22,6 @@
 typedef struct {
 	SECItem flags;
 } SpcPeImageFlags;
-extern SEC_ASN1Template SpcAttributeTypeAndOptionalValueTemplate[];
-
-typedef struct {
-	SECItem flags;
-	SpcLink link;
-} SpcPeImageData;
-
-typedef struct _SpcAttributeTypeAndOptionalValue {
-	SECItem contentType;
-	SECItem value;
-} SpcAttributeTypeAndOptionalValue;
 
 typedef struct {
 	SECAlgorithmID digestAlgorithm;
@@ -44,6 +33,5 @@ typedef struct {
 	SECItem data;
 	SECItem messageDigest;
 } SpcIndirectDataContent;
-extern SEC_ASN1Template SpcIndirectDataContentTemplate[];
 
 #endif /* CONTENT_INFO_PRIV_H */
@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <grp.h>
 
@@ -38,8 +39,30 @@
 
 #include <prerror.h>
 #include <nss.h>
+#include <pk11pub.h>
 
 static int should_exit = 0;
+static int should_reload = 0;
+
+/*
+ * Besides the certificate database we're started with, we can serve any
+ * number of others, listed in /etc/pesign/databases one per line:
+ *
+ *	<name> <certificate directory>
+ *
+ * Each one is opened as a token of its own called <name>, so a request
+ * picks its database just by naming that token, and each has its own
+ * queues, so a pile of requests for one key doesn't hold up another.
+ * Anything that doesn't name one of these goes to the first database.
+ */
+typedef struct {
+	char *name;
+	char *certdir;
+	PK11SlotInfo *slot;
+	request_scheduler sched;
+	/* the first database keeps its template in backup_cms instead */
+	signer_template *template;
+} database;
 
 typedef struct {
 	cms_context *cms;
@@ -52,6 +75,14 @@ typedef struct {
 	char *errstr;
 	uint8_t **tokennames;
 	int ntokennames;
+	int socket_activated;
+	int idle_timeout;
+	database *databases;
+	int ndatabases;
+	int next_database;
+	audit_log audit;
+	token_monitor tokens;
+	int log_requests;
 } context;
 
 static void
@@ -62,16 +93,30 @@ steal_from_cms(cms_context *old, cms_context *new)
 
 	new->selected_digest = old->selected_digest;
 
+	/* the request owns the template while it runs: it may free it and
+	 * build another for a different certificate, and old mustn't be
+	 * left pointing at the one it freed */
+	new->template = old->template;
+	old->template = NULL;
+	new->helper = old->helper;
+	new->tsa = old->tsa;
+
 	new->log = old->log;
 	new->log_priv = old->log_priv;
 }
 
 static void
-hide_stolen_goods_from_cms(cms_context *new,
-			   cms_context *old __attribute__((__unused__)))
+hide_stolen_goods_from_cms(cms_context *new, cms_context *old)
 {
 	new->tokenname = NULL;
 	new->certname = NULL;
+
+	/* and then gives back whatever template it ended up with, if any,
+	 * so the next one for the same certificate doesn't rebuild it. */
+	old->template = new->template;
+	new->template = NULL;
+	new->helper = NULL;
+	new->tsa = NULL;
 }
 
 static void
@@ -154,6 +199,13 @@ add_token_to_authenticated_list(context *ctx, uint8_t *tokenname)
 	return 0;
 }
 
+static int
+token_is_authenticated(context *ctx, char *tokenname)
+{
+	return bsearch(&tokenname, ctx->tokennames, ctx->ntokennames,
+		       sizeof (char *), cmpstringp) != NULL;
+}
+
 static void
 handle_unlock_token(context *ctx, struct pollfd *pollfd, socklen_t size)
 {
@@ -246,13 +298,18 @@ malformed:
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
 			"authentication succeeded for token \"%s\"",
 			tn->value);
-		rc = add_token_to_authenticated_list(ctx, tn->value);
+		if (!token_is_authenticated(ctx, (char *)tn->value))
+			rc = add_token_to_authenticated_list(ctx, tn->value);
+		if (rc >= 0)
+			rc = token_monitor_add(&ctx->tokens,
+					       (char *)tn->value, pin);
 		if (rc < 0)
 			ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 				"couldn't add token to internal list: %m");
 	}
 
 	send_response(ctx, ctx->cms, pollfd, rc);
+	free_poison(buffer, size);
 	free(buffer);
 
 	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
@@ -311,19 +368,15 @@ malformed:
 	if (n != 0)
 		goto malformed;
 
-	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_INFO,
 		"querying token \"%s\"", tn->value);
 
-	char *key = (char *)tn->value;
-	char *tokenname;
+	int unlocked = token_is_authenticated(ctx, (char *)tn->value);
+	send_response(ctx, ctx->cms, pollfd, unlocked ? 0 : 1);
 
-	tokenname = bsearch(&key, ctx->tokennames, ctx->ntokennames,
-				sizeof (char *), cmpstringp);
-	send_response(ctx, ctx->cms, pollfd, tokenname == NULL ? 1 : 0);
-
-	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_INFO,
 			"token \"%s\" is %sunlocked", tn->value,
-			tokenname == NULL ? "not " : "");
+			unlocked ? "" : "not ");
 
 	free(buffer);
 
@@ -344,7 +397,7 @@ socket_get_fd(context *ctx, int sd, int *fd)
 	size_t controllen = CMSG_SPACE(sizeof(int));
 	struct cmsghdr *cm = malloc(controllen);
 	if (!cm) {
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
 			"unable to allocate memory: %m");
 		exit(1);
 	}
@@ -361,9 +414,9 @@ socket_get_fd(context *ctx, int sd, int *fd)
 	n = recvmsg(sd, &msg, MSG_WAITALL);
 	if (n < 0) {
 malformed:
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
 			"unlock-token: invalid data");
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
 			"possible exploit attempt. closing.");
 		close(sd);
 		return;
@@ -452,19 +505,28 @@ set_up_outpe(context *ctx, int fd, Pe *inpe, Pe **outpe)
 	return 0;
 }
 
-static void
-handle_signing(context *ctx, struct pollfd *pollfd, socklen_t size,
-	int attached)
+/*
+ * Sign requests and load queries all start with a token name and a
+ * certificate nickname as pesignd_strings.  Signing a digest adds the
+ * digest's name, and then the digest itself in the same sort of wrapper.
+ */
+static int
+receive_key_request(context *ctx, struct pollfd *pollfd, socklen_t size,
+		    char *cmdname, char **tokenname, char **certname,
+		    char **digest_name, uint8_t **digest, uint32_t *digest_len,
+		    char **requester)
 {
+	cms_context *cms = ctx->backup_cms;
 	struct msghdr msg;
 	struct iovec iov;
 	ssize_t n;
 	char *buffer = malloc(size);
-	Pe *inpe = NULL;
+	pesignd_string *strings[4];
+	int nstrings = digest_name ? 4 : 2;
 
 	if (!buffer) {
 oom:
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+		cms->log(cms, ctx->priority|LOG_ERR,
 			"unable to allocate memory: %m");
 		exit(1);
 	}
@@ -477,61 +539,243 @@ oom:
 	msg.msg_iovlen = 1;
 
 	n = recvmsg(pollfd->fd, &msg, MSG_WAITALL);
-
-	pesignd_string *tn = (pesignd_string *)buffer;
-	if (n < (long long)sizeof(tn->size)) {
+	if (n < 0) {
 malformed:
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"handle_signing: invalid data");
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"%s: invalid data", cmdname);
+		cms->log(cms, ctx->priority|LOG_ERR,
 			"possible exploit attempt. closing.");
 		close(pollfd->fd);
-		return;
+		free(buffer);
+		xfree(*tokenname);
+		xfree(*certname);
+		if (digest_name) {
+			xfree(*digest_name);
+			xfree(*digest);
+		}
+		return -1;
 	}
 
-	n -= sizeof(tn->size);
-	if ((size_t)n < tn->size)
+	pesignd_string *str = (pesignd_string *)buffer;
+	for (int i = 0; i < nstrings; i++) {
+		if ((size_t)n < sizeof(str->size))
+			goto malformed;
+		n -= sizeof(str->size);
+		if ((size_t)n < str->size)
+			goto malformed;
+		n -= str->size;
+		strings[i] = str;
+		str = pesignd_string_next(str);
+	}
+
+	/* pesign-gateway says who it's asking on behalf of */
+	if (n != 0 && requester) {
+		if ((size_t)n < sizeof(str->size))
+			goto malformed;
+		n -= sizeof(str->size);
+		if ((size_t)n != str->size || str->size == 0 ||
+				str->value[str->size - 1] != '\0')
+			goto malformed;
+		n = 0;
+		*requester = strdup((char *)str->value);
+		if (!*requester)
+			goto oom;
+	}
+	if (n != 0)
 		goto malformed;
-	n -= tn->size;
 
-	/* authenticating with nss frees these ... best API ever. */
-	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena,
-						(char *)tn->value);
-	if (!ctx->cms->tokenname)
+	*tokenname = strndup((char *)strings[0]->value, strings[0]->size);
+	if (!*tokenname)
 		goto oom;
 
-	if ((size_t)n < sizeof(tn->size))
-		goto malformed;
-	pesignd_string *cn = pesignd_string_next(tn);
-	n -= sizeof(cn->size);
-	if ((size_t)n < cn->size)
-		goto malformed;
-
-	ctx->cms->certname = PORT_ArenaStrdup(ctx->cms->arena,
-						(char *)cn->value);
-	if (!ctx->cms->certname)
+	*certname = strndup((char *)strings[1]->value, strings[1]->size);
+	if (!*certname)
 		goto oom;
 
-	n -= cn->size;
-	if (n != 0)
-		goto malformed;
+	if (digest_name) {
+		*digest_name = strndup((char *)strings[2]->value,
+				       strings[2]->size);
+		if (!*digest_name)
+			goto oom;
+
+		*digest_len = strings[3]->size;
+		*digest = malloc(*digest_len ? *digest_len : 1);
+		if (!*digest)
+			goto oom;
+		memcpy(*digest, strings[3]->value, *digest_len);
+	}
 
-	int infd=-1;
-	socket_get_fd(ctx, pollfd->fd, &infd);
+	free(buffer);
+	return 0;
+}
+
+/*
+ * Read the rest of a signing request off the socket, so that it can wait
+ * in a queue until it's its turn.  If this fails, the connection has
+ * already been closed.
+ */
+static int
+receive_signing_request(context *ctx, struct pollfd *pollfd, socklen_t size,
+			uint32_t command, queued_request **reqp)
+{
+	cms_context *cms = ctx->backup_cms;
+	queued_request *req = calloc(1, sizeof (*req));
 
-	int outfd=-1;
-	socket_get_fd(ctx, pollfd->fd, &outfd);
+	if (!req) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+	req->sd = pollfd->fd;
+	req->command = command;
+	req->infd = -1;
+	req->outfd = -1;
 
-	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
-		"attempting to sign with key \"%s:%s\"",
-		tn->value, cn->value);
-	free(buffer);
+	char *requester = NULL;
+	int rc;
+	if (command == CMD_SIGN_DIGEST)
+		rc = receive_key_request(ctx, pollfd, size, "sign-digest",
+					 &req->tokenname, &req->certname,
+					 &req->digest_name, &req->digest,
+					 &req->digest_len, &requester);
+	else
+		rc = receive_key_request(ctx, pollfd, size, "handle_signing",
+					 &req->tokenname, &req->certname,
+					 NULL, NULL, NULL, &requester);
+	if (rc < 0) {
+		free_queued_request(req);
+		return -1;
+	}
+	audit_set_string(req->record.requester,
+			 sizeof (req->record.requester), requester);
+	xfree(requester);
+
+	/* there's no binary when somebody else has already hashed it */
+	if (command != CMD_SIGN_DIGEST) {
+		socket_get_fd(ctx, pollfd->fd, &req->infd);
+		if (req->infd < 0) {
+			free_queued_request(req);
+			return -1;
+		}
+	}
+
+	socket_get_fd(ctx, pollfd->fd, &req->outfd);
+	if (req->outfd < 0) {
+		free_queued_request(req);
+		return -1;
+	}
+
+	*reqp = req;
+	return 0;
+}
+
+static void
+add_phase_time(uint32_t *usecs, struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*usecs += elapsed_usecs(start, &now);
+	*start = now;
+}
+
+static void
+audit_digest(cms_context *cms, audit_record *record)
+{
+	SECItem *digest = cms->digests[cms->selected_digest].pe_digest;
+
+	if (!digest || digest->len > sizeof (record->digest))
+		return;
+
+	audit_set_string(record->digest_name, sizeof (record->digest_name),
+			 digest_get_digest_name(cms));
+	memcpy(record->digest, digest->data, digest->len);
+	record->digest_len = digest->len;
+}
+
+/*
+ * The client (usually pesign-gateway, on behalf of a remote build machine)
+ * has already computed the Authenticode digest, so all we have to do is
+ * make a detached signature over it.
+ */
+static int
+sign_digest(context *ctx, queued_request *req, int outfd,
+	    struct timespec *phase)
+{
+	cms_context *cms = ctx->cms;
+
+	ftruncate(outfd, 0);
+
+	int rc = set_digest_parameters(cms, req->digest_name);
+	if (rc < 0 || !strcmp(req->digest_name, "help")) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"sign-digest: unsupported digest \"%s\"",
+			req->digest_name);
+		return -1;
+	}
+
+	SECItem digest = {
+		.type = siBuffer,
+		.data = req->digest,
+		.len = req->digest_len,
+	};
+	rc = import_digest(cms, digest_get_digest_oid(cms), &digest);
+	if (rc < 0)
+		return -1;
+	audit_digest(cms, &req->record);
 
+	clock_gettime(CLOCK_MONOTONIC, phase);
+	rc = generate_signature(cms);
+	add_phase_time(&req->record.sign_usecs, phase);
+	if (rc < 0)
+		return -1;
+
+	rc = export_signature(cms, outfd, 0);
+	if (rc < 0) {
+		ftruncate(outfd, 0);
+		return -1;
+	}
+	ftruncate(outfd, rc);
+	return 0;
+}
+
+static void
+handle_signing(context *ctx, struct pollfd *pollfd, queued_request *req,
+	       int attached)
+{
+	audit_record *record = &req->record;
+	struct timespec phase;
+	Pe *inpe = NULL;
+	int infd = req->infd;
+	int outfd = req->outfd;
+
+	/* we close these ourselves */
+	req->infd = -1;
+	req->outfd = -1;
+
+	/* authenticating with nss frees these ... best API ever. */
+	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena,
+						req->tokenname);
+	ctx->cms->certname = PORT_ArenaStrdup(ctx->cms->arena,
+						req->certname);
+	if (!ctx->cms->tokenname || !ctx->cms->certname) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
 	int rc = find_certificate(ctx->cms, 1);
+	add_phase_time(&record->cert_usecs, &phase);
 	if (rc < 0) {
 		goto finish;
 	}
 
+	if (req->command == CMD_SIGN_DIGEST) {
+		rc = sign_digest(ctx, req, outfd, &phase);
+		goto finish;
+	}
+
 	rc = set_up_inpe(ctx, infd, &inpe);
 	if (rc < 0)
 		goto finish;
@@ -543,7 +787,9 @@ malformed:
 		if (rc < 0)
 			goto finish;
 
+		clock_gettime(CLOCK_MONOTONIC, &phase);
 		rc = generate_digest(ctx->cms, outpe, 1);
+		add_phase_time(&record->digest_usecs, &phase);
 		if (rc < 0) {
 err_attached:
 			pe_end(outpe);
@@ -554,10 +800,14 @@ err_attached:
 		if (sigspace < 0)
 			goto err_attached;
 		allocate_signature_space(outpe, sigspace);
+		clock_gettime(CLOCK_MONOTONIC, &phase);
 		rc = generate_digest(ctx->cms, outpe, 1);
+		add_phase_time(&record->digest_usecs, &phase);
 		if (rc < 0)
 			goto err_attached;
+		audit_digest(ctx->cms, record);
 		rc = generate_signature(ctx->cms);
+		add_phase_time(&record->sign_usecs, &phase);
 		if (rc < 0)
 			goto err_attached;
 		insert_signature(ctx->cms, ctx->cms->num_signatures);
@@ -566,13 +816,17 @@ err_attached:
 		pe_end(outpe);
 	} else {
 		ftruncate(outfd, 0);
+		clock_gettime(CLOCK_MONOTONIC, &phase);
 		rc = generate_digest(ctx->cms, inpe, 1);
+		add_phase_time(&record->digest_usecs, &phase);
 		if (rc < 0) {
 err_detached:
 			ftruncate(outfd, 0);
 			goto finish;
 		}
+		audit_digest(ctx->cms, record);
 		rc = generate_signature(ctx->cms);
+		add_phase_time(&record->sign_usecs, &phase);
 		if (rc < 0)
 			goto err_detached;
 		rc = export_signature(ctx->cms, outfd, 0);
@@ -586,41 +840,398 @@ finish:
 	if (inpe)
 		pe_end(inpe);
 
-	close(infd);
+	if (infd >= 0)
+		close(infd);
 	close(outfd);
 
+	record->rc = rc;
+	record->status = rc < 0 ? AUDIT_FAILED : AUDIT_SIGNED;
+
 	send_response(ctx, ctx->cms, pollfd, rc);
 	teardown_digests(ctx->cms);
 }
 
+/*
+ * Everything the log needs to know about a request is filled in as we go;
+ * this just stamps it and hands it to the writer thread.
+ */
+static void
+submit_audit_record(context *ctx, queued_request *req)
+{
+	audit_record *record = &req->record;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	if (req->queue)
+		audit_set_string(record->queue, sizeof (record->queue),
+				 req->queue->name);
+
+	audit_log_submit(&ctx->audit, record);
+}
+
+/* which database a request for this token goes to */
+static database *
+find_database(context *ctx, const char *tokenname)
+{
+	for (int i = 1; i < ctx->ndatabases; i++) {
+		if (!strcmp(ctx->databases[i].name, tokenname))
+			return &ctx->databases[i];
+	}
+	return &ctx->databases[0];
+}
+
+static unsigned int
+pending_requests(context *ctx)
+{
+	unsigned int pending = 0;
+
+	for (int i = 0; i < ctx->ndatabases; i++)
+		pending += ctx->databases[i].sched.pending;
+	return pending;
+}
+
+static void
+queue_signing(context *ctx, struct pollfd *pollfd, socklen_t size,
+	      uint32_t command)
+{
+	cms_context *cms = ctx->backup_cms;
+	queued_request *req = NULL;
+
+	int rc = receive_signing_request(ctx, pollfd, size, command, &req);
+	if (rc < 0)
+		return;
+
+	struct ucred cred;
+	socklen_t len = sizeof (cred);
+	rc = getsockopt(pollfd->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+	if (rc < 0) {
+		cms->log(cms, ctx->priority|LOG_WARNING,
+			"could not get peer credentials: %m");
+		cred.uid = (uid_t)-1;
+		cred.gid = (gid_t)-1;
+		cred.pid = 0;
+	}
+
+	audit_record *record = &req->record;
+	record->uid = cred.uid;
+	record->pid = cred.pid;
+	record->command = command;
+	record->status = AUDIT_FAILED;
+	record->rc = -1;
+	audit_set_string(record->token, sizeof (record->token),
+			 req->tokenname);
+	audit_set_string(record->cert, sizeof (record->cert), req->certname);
+
+	database *db = find_database(ctx, req->tokenname);
+	request_queue *queue = scheduler_find_queue(&db->sched, cred.uid,
+						    cred.gid);
+	if (!queue) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	rc = scheduler_add(&db->sched, queue, req);
+	if (rc < 0) {
+		unsigned int retry = scheduler_retry_hint(queue);
+
+		req->queue = queue;
+		req->record.status = AUDIT_REJECTED;
+		submit_audit_record(ctx, req);
+
+		xfree(ctx->errstr);
+		rc = asprintf(&ctx->errstr, "pesignd is busy (%u requests "
+			"queued for %s); retry in %u seconds",
+			queue->depth, queue->name, retry);
+		if (rc < 0)
+			ctx->errstr = NULL;
+
+		send_response(ctx, cms, pollfd, PESIGND_RETRY);
+		free_queued_request(req);
+		return;
+	}
+
+	/* it's not going to say anything else until we answer */
+	pollfd->events = 0;
+}
+
 static void
 handle_sign_attached(context *ctx, struct pollfd *pollfd, socklen_t size)
 {
+	queue_signing(ctx, pollfd, size, CMD_SIGN_ATTACHED);
+}
+
+static void
+handle_sign_detached(context *ctx, struct pollfd *pollfd, socklen_t size)
+{
+	queue_signing(ctx, pollfd, size, CMD_SIGN_DETACHED);
+}
+
+static void
+handle_sign_digest(context *ctx, struct pollfd *pollfd, socklen_t size)
+{
+	queue_signing(ctx, pollfd, size, CMD_SIGN_DIGEST);
+}
+
+static void
+service_signing_request(context *ctx, database *db, queued_request *req)
+{
+	struct pollfd pollfd = {
+		.fd = req->sd,
+	};
+
 	int rc = cms_context_alloc(&ctx->cms);
+	if (rc < 0) {
+		send_response(ctx, ctx->backup_cms, &pollfd, rc);
+		return;
+	}
+
+	/* each database remembers the template for the last key it signed
+	 * with, so that taking turns doesn't mean rebuilding them each time */
+	signer_template *template = ctx->backup_cms->template;
+	if (db != ctx->databases)
+		ctx->backup_cms->template = db->template;
+
+	steal_from_cms(ctx->backup_cms, ctx->cms);
+
+	handle_signing(ctx, &pollfd, req, req->command == CMD_SIGN_ATTACHED);
+
+	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
+	cms_context_fini(ctx->cms);
+
+	if (db != ctx->databases) {
+		db->template = ctx->backup_cms->template;
+		ctx->backup_cms->template = template;
+	}
+}
+
+static void
+resume_polling(struct pollfd *pollfds, int nsockets, int sd)
+{
+	for (int i = 1; i < nsockets; i++) {
+		if (pollfds[i].fd == sd) {
+			pollfds[i].events = POLLIN|POLLPRI|POLLHUP;
+			return;
+		}
+	}
+}
+
+static void
+cancel_expired(context *ctx, request_scheduler *sched,
+	       struct pollfd *pollfds, int nsockets, struct timespec *now)
+{
+	cms_context *cms = ctx->backup_cms;
+	queued_request *req;
+
+	while ((req = scheduler_take_expired(sched, now))) {
+		struct pollfd pollfd = {
+			.fd = req->sd,
+		};
+
+		req->record.status = AUDIT_EXPIRED;
+		req->record.wait_usecs = elapsed_usecs(&req->arrival, now);
+		submit_audit_record(ctx, req);
+
+		xfree(ctx->errstr);
+		if (asprintf(&ctx->errstr, "request cancelled after waiting "
+				"%u seconds in the queue",
+				req->queue->deadline) < 0)
+			ctx->errstr = NULL;
+
+		send_response(ctx, cms, &pollfd, PESIGND_RETRY);
+		resume_polling(pollfds, nsockets, req->sd);
+		free_queued_request(req);
+	}
+}
+
+/*
+ * Cancel anything that's waited too long, and then sign the one request
+ * the scheduler says is next.  We only do one at a time so that whatever
+ * arrived while we were signing gets queued before the next decision.
+ * The databases take turns, so one that's busy (or slow to sign with)
+ * only ever holds up the others by a request at a time.
+ */
+static void
+run_queue(context *ctx, struct pollfd *pollfds, int nsockets)
+{
+	struct timespec start, end;
+	queued_request *req = NULL;
+	database *db = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < ctx->ndatabases; i++)
+		cancel_expired(ctx, &ctx->databases[i].sched, pollfds,
+			       nsockets, &start);
+
+	for (int i = 0; i < ctx->ndatabases && !req; i++) {
+		int n = (ctx->next_database + i) % ctx->ndatabases;
+
+		db = &ctx->databases[n];
+		req = scheduler_next(&db->sched);
+	}
+	if (!req)
+		return;
+	ctx->next_database = (db - ctx->databases + 1) % ctx->ndatabases;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	service_signing_request(ctx, db, req);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	scheduler_account(req, &start, &end);
+
+	req->record.wait_usecs = elapsed_usecs(&req->arrival, &start);
+	req->record.total_usecs = elapsed_usecs(&start, &end);
+	submit_audit_record(ctx, req);
+
+	resume_polling(pollfds, nsockets, req->sd);
+	free_queued_request(req);
+}
+
+/*
+ * Can we sign with this key right now?  The token has to be here and
+ * unlocked, and if a certificate is named, we have to be able to find it.
+ */
+static int
+can_sign_with(context *ctx, char *tokenname, char *certname)
+{
+	PK11SlotInfo *slot = PK11_FindSlotByName(tokenname);
+	int rc = 0;
+
+	xfree(ctx->errstr);
+	if (!slot) {
+		if (asprintf(&ctx->errstr, "token \"%s\" not found",
+				tokenname) < 0)
+			ctx->errstr = NULL;
+		return -1;
+	}
+
+	if (PK11_NeedLogin(slot) && !PK11_IsLoggedIn(slot, NULL)) {
+		if (asprintf(&ctx->errstr, "token \"%s\" is locked",
+				tokenname) < 0)
+			ctx->errstr = NULL;
+		rc = -1;
+	}
+	PK11_FreeSlot(slot);
+
+	if (rc < 0 || !*certname)
+		return rc;
+
+	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena, tokenname);
+	ctx->cms->certname = PORT_ArenaStrdup(ctx->cms->arena, certname);
+	if (!ctx->cms->tokenname || !ctx->cms->certname) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	return find_certificate(ctx->cms, 0);
+}
+
+/*
+ * Clients which can talk to several of us ask this first: the answer is
+ * negative if we can't sign with the key they want, and otherwise it's
+ * how many signing requests are waiting, so they can pick the least busy
+ * daemon that can do the job.
+ */
+static void
+handle_get_load(context *ctx, struct pollfd *pollfd, socklen_t size)
+{
+	char *tokenname = NULL;
+	char *certname = NULL;
+
+	int rc = receive_key_request(ctx, pollfd, size, "get-load",
+				     &tokenname, &certname, NULL, NULL, NULL,
+				     NULL);
 	if (rc < 0)
 		return;
 
+	rc = cms_context_alloc(&ctx->cms);
+	if (rc < 0) {
+		send_response(ctx, ctx->backup_cms, pollfd, rc);
+		goto out;
+	}
+
 	steal_from_cms(ctx->backup_cms, ctx->cms);
 
-	handle_signing(ctx, pollfd, size, 1);
+	rc = can_sign_with(ctx, tokenname, certname);
+	if (rc >= 0) {
+		xfree(ctx->errstr);
+		rc = find_database(ctx, tokenname)->sched.pending;
+	}
+	send_response(ctx, ctx->cms, pollfd, rc);
+
+	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
+	cms_context_fini(ctx->cms);
+out:
+	free(tokenname);
+	free(certname);
+}
+
+static int
+reload_nss(context *ctx);
+
+/*
+ * The answer is a human readable report in the response message: how the
+ * tokens we're watching are doing, whether the configured certificate has
+ * been found, and how much work is waiting, for each database we serve.
+ */
+static void
+handle_get_status(context *ctx, struct pollfd *pollfd,
+		  socklen_t size __attribute__((__unused__)))
+{
+	cms_context *cms = ctx->backup_cms;
+	char *tokens = NULL;
+	char *certificate = NULL;
+	char *databases = NULL;
+
+	xfree(ctx->errstr);
+	if (token_monitor_status(&ctx->tokens, &tokens) < 0)
+		goto oom;
+
+	if (cms->certname && *cms->certname) {
+		if (asprintf(&certificate, "certificate \"%s:%s\": %s\n",
+			     cms->tokenname, cms->certname,
+			     cms->cert ? "resolved" : "not resolved") < 0)
+			goto oom;
+	}
+
+	for (int i = 1; i < ctx->ndatabases; i++) {
+		database *db = &ctx->databases[i];
+		char *line = NULL;
+
+		if (asprintf(&line, "%sdatabase \"%s\" (%s): %u requests "
+			     "pending\n", databases ? databases : "",
+			     db->name, db->certdir, db->sched.pending) < 0)
+			goto oom;
+		free(databases);
+		databases = line;
+	}
+
+	if (asprintf(&ctx->errstr, "%s%s%s%u requests pending\n",
+		     tokens, certificate ? certificate : "",
+		     databases ? databases : "",
+		     pending_requests(ctx)) < 0) {
+oom:
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+	free(tokens);
+	free(certificate);
+	free(databases);
 
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
+	send_response(ctx, cms, pollfd, 0);
+	xfree(ctx->errstr);
 }
 
 static void
-handle_sign_detached(context *ctx, struct pollfd *pollfd, socklen_t size)
+handle_reload(context *ctx, struct pollfd *pollfd,
+	      socklen_t size __attribute__((__unused__)))
 {
-	int rc = cms_context_alloc(&ctx->cms);
-	if (rc < 0)
-		return;
-
-	steal_from_cms(ctx->backup_cms, ctx->cms);
+	int rc = reload_nss(ctx);
 
-	handle_signing(ctx, pollfd, size, 0);
-
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
+	send_response(ctx, ctx->backup_cms, pollfd, rc);
 }
 
 static void
@@ -657,6 +1268,10 @@ cmd_table_t cmd_table[] = {
 			"is-token-unlocked", 0 },
 		{ CMD_GET_CMD_VERSION, handle_get_cmd_version,
 			"get-cmd-version", 0 },
+		{ CMD_RELOAD, handle_reload, "reload", 0 },
+		{ CMD_GET_LOAD, handle_get_load, "get-load", 0 },
+		{ CMD_SIGN_DIGEST, handle_sign_digest, "sign-digest", 0 },
+		{ CMD_GET_STATUS, handle_get_status, "status", 0 },
 		{ CMD_LIST_END, NULL, "list-end", 0 }
 	};
 
@@ -704,12 +1319,12 @@ handle_get_cmd_version(context *ctx, struct pollfd *pollfd, socklen_t size)
 	}
 
 	memcpy(&command, buffer, sizeof (command));
-	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_INFO,
 			"searching for command %d", command);
 
 	for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
 		if (cmd_table[i].cmd == command) {
-			ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+			ctx->cms->log(ctx->cms, ctx->priority|LOG_INFO,
 					"cmd-version: found command \"%s\" "
 					"version %d",
 					cmd_table[i].name,
@@ -720,7 +1335,7 @@ handle_get_cmd_version(context *ctx, struct pollfd *pollfd, socklen_t size)
 	}
 
 	if (version == -1) {
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_INFO,
 				"cmd-version: could not find command %d",
 				command);
 	}
@@ -800,10 +1415,16 @@ handle_event(context *ctx, struct pollfd *pollfd)
 	return 0;
 }
 
+static void
+close_databases(context *ctx);
+
 static void
 do_shutdown(context *ctx, int nsockets, struct pollfd *pollfds)
 {
-	unlink(SOCKPATH);
+	/* if systemd gave us the socket, it's still listening on it for
+	 * us, so leave it alone. */
+	if (!ctx->socket_activated)
+		unlink(SOCKPATH);
 	unlink(PIDFILE);
 
 	for (int i = 0; i < ctx->ntokennames; i++)
@@ -813,6 +1434,24 @@ do_shutdown(context *ctx, int nsockets, struct pollfd *pollfds)
 	ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_NOTICE,
 			"pesignd exiting (pid %d)", getpid());
 
+	close_databases(ctx);
+	for (int i = 0; i < ctx->ndatabases; i++) {
+		database *db = &ctx->databases[i];
+
+		if (i > 0)
+			ctx->backup_cms->log(ctx->backup_cms,
+				ctx->priority|LOG_NOTICE,
+				"database \"%s\":", db->name);
+		scheduler_log_stats(&db->sched, ctx->backup_cms,
+				    ctx->priority);
+		scheduler_fini(&db->sched);
+		xfree(db->name);
+		xfree(db->certdir);
+	}
+	xfree(ctx->databases);
+	audit_log_close(&ctx->audit);
+	token_monitor_fini(&ctx->tokens);
+
 	xfree(ctx->errstr);
 
 	for (int i = 0; i < nsockets; i++)
@@ -820,6 +1459,9 @@ do_shutdown(context *ctx, int nsockets, struct pollfd *pollfds)
 	free(pollfds);
 }
 
+static void
+check_tokens(context *ctx);
+
 static int
 handle_events(context *ctx)
 {
@@ -837,15 +1479,79 @@ handle_events(context *ctx)
 	pollfds[0].fd = ctx->sd;
 	pollfds[0].events = POLLIN|POLLPRI|POLLHUP;
 
+	struct timespec busy = {
+		.tv_sec = 0,
+		.tv_nsec = 0,
+	};
+	struct timespec wait;
+	struct timespec now;
+	struct timespec last_active;
+	clock_gettime(CLOCK_MONOTONIC, &last_active);
+
+	/* SIGHUP stays blocked except while we're waiting in ppoll(), so a
+	 * reload can only ever happen between requests. */
+	sigset_t pollmask;
+	sigprocmask(SIG_SETMASK, NULL, &pollmask);
+	sigdelset(&pollmask, SIGHUP);
+
 	while (1) {
 		if (should_exit != 0) {
 shutdown:
 			do_shutdown(ctx, nsockets, pollfds);
 			return 0;
 		}
-		rc = ppoll(pollfds, nsockets, NULL, NULL);
+		if (should_reload != 0) {
+			should_reload = 0;
+			if (reload_nss(ctx) < 0 && should_exit)
+				goto shutdown;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (token_monitor_due(&ctx->tokens, &now))
+			check_tokens(ctx);
+
+		/* we only give up when nobody is connected; systemd will
+		 * start us again when somebody shows up. */
+		int use_idle = ctx->idle_timeout > 0 && nsockets == 1;
+		struct timespec *timeout = NULL;
+
+		if (use_idle) {
+			long long left = (long long)ctx->idle_timeout * 1000000000
+				- (now.tv_sec - last_active.tv_sec) * 1000000000LL
+				- (now.tv_nsec - last_active.tv_nsec);
+			if (left <= 0) {
+				ctx->backup_cms->log(ctx->backup_cms,
+					ctx->priority|LOG_NOTICE,
+					"idle for %d seconds, exiting",
+					ctx->idle_timeout);
+				goto shutdown;
+			}
+			wait.tv_sec = left / 1000000000;
+			wait.tv_nsec = left % 1000000000;
+			timeout = &wait;
+		}
+
+		/* wake up for the next token check, if that's sooner */
+		struct timespec check;
+		if (token_monitor_wait(&ctx->tokens, &now, &check) &&
+		    (!timeout || check.tv_sec < timeout->tv_sec ||
+		     (check.tv_sec == timeout->tv_sec &&
+		      check.tv_nsec < timeout->tv_nsec))) {
+			wait = check;
+			timeout = &wait;
+		}
+
+		/* if there's signing to do, just pick up whatever has come
+		 * in meanwhile and get back to it. */
+		if (pending_requests(ctx))
+			timeout = &busy;
+
+		rc = ppoll(pollfds, nsockets, timeout, &pollmask);
 		if (should_exit != 0)
 			goto shutdown;
+		if (rc != 0 || pending_requests(ctx) || nsockets > 1)
+			clock_gettime(CLOCK_MONOTONIC, &last_active);
+		if (rc < 0 && errno == EINTR)
+			continue;
 		if (rc < 0) {
 			ctx->backup_cms->log(ctx->backup_cms,
 				ctx->priority|LOG_WARNING,
@@ -875,6 +1581,17 @@ shutdown:
 		}
 		for (int i = 1; i < nsockets; i++) {
 			if (pollfds[i].revents & (POLLHUP|POLLNVAL)) {
+				queued_request *req = NULL;
+				for (int j = 0; !req && j < ctx->ndatabases;
+						j++)
+					req = scheduler_cancel_fd(
+						&ctx->databases[j].sched,
+						pollfds[i].fd);
+				if (req) {
+					req->record.status = AUDIT_CANCELLED;
+					submit_audit_record(ctx, req);
+					free_queued_request(req);
+				}
 				close(pollfds[i].fd);
 				if (i == nsockets-1) {
 					nsockets--;
@@ -883,9 +1600,9 @@ shutdown:
 				for (int j = i; j < nsockets - 1; j++) {
 					pollfds[j].fd = pollfds[j+1].fd;
 					pollfds[j].events =
-						pollfds[j].events;
+						pollfds[j+1].events;
 					pollfds[j].revents =
-						pollfds[j].revents;
+						pollfds[j+1].revents;
 				}
 				nsockets--;
 				i--;
@@ -895,6 +1612,8 @@ shutdown:
 			if (pollfds[i].revents & (POLLIN|POLLPRI))
 				handle_event(ctx, &pollfds[i]);
 		}
+
+		run_queue(ctx, pollfds, nsockets);
 	}
 	return 0;
 }
@@ -931,6 +1650,420 @@ quit_handler(int signal __attribute__((__unused__)))
 	should_exit = 1;
 }
 
+static void
+reload_handler(int signal __attribute__((__unused__)))
+{
+	should_reload = 1;
+}
+
+/*
+ * If systemd started us because somebody connected to pesign.socket, the
+ * listening socket is already open as fd 3.  This is sd_listen_fds(), minus
+ * the dependency.
+ */
+#define SD_LISTEN_FDS_START 3
+
+static int
+get_activation_socket(context *ctx)
+{
+	char *e = getenv("LISTEN_PID");
+	if (!e)
+		return -1;
+
+	errno = 0;
+	long pid = strtol(e, NULL, 10);
+	if (errno != 0 || pid != (long)getpid())
+		return -1;
+
+	e = getenv("LISTEN_FDS");
+	if (!e)
+		return -1;
+	long nfds = strtol(e, NULL, 10);
+	if (errno != 0 || nfds < 1)
+		return -1;
+
+	if (nfds > 1)
+		fprintf(stderr, "pesignd: ignoring %ld extra sockets from "
+			"systemd\n", nfds - 1);
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+
+	int sd = SD_LISTEN_FDS_START;
+	fcntl(sd, F_SETFD, FD_CLOEXEC);
+
+	ctx->socket_activated = 1;
+	ctx->sd = sd;
+	return 0;
+}
+
+/*
+ * Do everything the first signing request would otherwise have to do
+ * before we start taking requests: find the configured certificate (which
+ * also builds its signer template), and start the signer helper if there
+ * is one.  If the token is still locked this may not work yet; that's not
+ * an error, the first request will just do it instead.
+ */
+static void
+warm_up(context *ctx)
+{
+	cms_context *cms = ctx->backup_cms;
+
+	if (cms->helper)
+		signer_helper_start(cms);
+
+	if (!cms->certname || !*cms->certname)
+		return;
+
+	int rc = find_certificate(cms, 0);
+	if (rc < 0) {
+		cms->log(cms, ctx->priority|LOG_NOTICE,
+			"could not resolve certificate \"%s:%s\" yet",
+			cms->tokenname, cms->certname);
+		return;
+	}
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"resolved certificate \"%s:%s\"",
+		cms->tokenname, cms->certname);
+}
+
+/*
+ * A reopened database doesn't have any of our old logins, so only keep the
+ * tokens which are still usable (i.e. the ones without a PIN); anything
+ * else has to be unlocked again.
+ */
+static void
+revalidate_tokens(context *ctx)
+{
+	cms_context *cms = ctx->backup_cms;
+	int n = 0;
+
+	for (int i = 0; i < ctx->ntokennames; i++) {
+		char *tokenname = (char *)ctx->tokennames[i];
+		PK11SlotInfo *slot = PK11_FindSlotByName(tokenname);
+
+		if (slot && (!PK11_NeedLogin(slot) ||
+				PK11_IsLoggedIn(slot, NULL))) {
+			ctx->tokennames[n++] = ctx->tokennames[i];
+		} else {
+			cms->log(cms, ctx->priority|LOG_NOTICE,
+				"token \"%s\" needs to be unlocked again",
+				tokenname);
+			free(tokenname);
+		}
+		if (slot)
+			PK11_FreeSlot(slot);
+	}
+	ctx->ntokennames = n;
+}
+
+/*
+ * Anything the token monitor logged back in to with a PIN a client gave us
+ * is unlocked again as far as our clients are concerned.
+ */
+static void
+readd_tokens(context *ctx)
+{
+	cms_context *cms = ctx->backup_cms;
+
+	for (int i = 0; i < ctx->tokens.ntokens; i++) {
+		token_state *ts = &ctx->tokens.tokens[i];
+
+		if (!ts->pin || !ts->present || !ts->logged_in ||
+		    token_is_authenticated(ctx, ts->name))
+			continue;
+		if (add_token_to_authenticated_list(ctx,
+					(uint8_t *)ts->name) < 0)
+			cms->log(cms, ctx->priority|LOG_ERR,
+				"couldn't add token to internal list: %m");
+	}
+}
+
+/*
+ * Look in on the tokens between requests, so a token that's been logged
+ * out or pulled gets noticed (and logged back in to, if we kept its PIN)
+ * before somebody asks us to sign with it.
+ */
+static void
+check_tokens(context *ctx)
+{
+	int changed = token_monitor_probe(&ctx->tokens, ctx->backup_cms,
+					  ctx->priority);
+	revalidate_tokens(ctx);
+	if (changed > 0) {
+		readd_tokens(ctx);
+		warm_up(ctx);
+	}
+}
+
+static int
+add_database(context *ctx, const char *name, const char *certdir)
+{
+	database *databases = realloc(ctx->databases,
+			sizeof (database) * (ctx->ndatabases + 1));
+	if (!databases)
+		return -1;
+	ctx->databases = databases;
+
+	database *db = &ctx->databases[ctx->ndatabases];
+	memset(db, '\0', sizeof (*db));
+
+	/* we chdir() later, and a reload has to find it again */
+	db->certdir = realpath(certdir, NULL);
+	if (!db->certdir)
+		db->certdir = strdup(certdir);
+	if (!db->certdir)
+		return -1;
+	if (name && !(db->name = strdup(name))) {
+		free(db->certdir);
+		return -1;
+	}
+	ctx->ndatabases++;
+	return 0;
+}
+
+/*
+ * The first database is the one we were started with, and the rest come
+ * from DATABASE_CONFIG.  Like the queue configuration, this has to be read
+ * before we drop privileges.
+ */
+static int
+read_databases(context *ctx, const char *certdir, const char *path)
+{
+	cms_context *cms = ctx->backup_cms;
+
+	if (add_database(ctx, NULL, certdir) < 0)
+		goto oom;
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"could not open \"%s\": %m", path);
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	int rc = 0;
+
+	while (getline(&line, &linesize, f) >= 0) {
+		char *saveptr = NULL;
+
+		lineno++;
+
+		char *name = strtok_r(line, " \t\r\n", &saveptr);
+		if (!name || name[0] == '#')
+			continue;
+		char *dir = strtok_r(NULL, " \t\r\n", &saveptr);
+
+		/* a token label is only 32 bytes, and these both end up
+		 * quoted in an NSS module spec */
+		if (!dir || strtok_r(NULL, " \t\r\n", &saveptr) ||
+		    strlen(name) > 32 || strchr(name, '\'') ||
+		    strchr(dir, '\'')) {
+			cms->log(cms, ctx->priority|LOG_ERR,
+				"%s:%d: invalid line", path, lineno);
+			rc = -1;
+			continue;
+		}
+		for (int i = 1; i < ctx->ndatabases; i++) {
+			if (!strcmp(ctx->databases[i].name, name)) {
+				cms->log(cms, ctx->priority|LOG_ERR,
+					"%s:%d: database \"%s\" is already "
+					"defined", path, lineno, name);
+				rc = -1;
+				name = NULL;
+				break;
+			}
+		}
+		if (name && add_database(ctx, name, dir) < 0) {
+			free(line);
+			fclose(f);
+			goto oom;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return rc;
+oom:
+	cms->log(cms, ctx->priority|LOG_ERR, "could not allocate memory: %m");
+	exit(1);
+}
+
+/*
+ * Every database, including the one we were started with, is opened as an
+ * NSS module of its own, so that a reload can close it and open it again
+ * without NSS_Shutdown(), which would take every other token's login with
+ * it.  The first one gets the token name NSS_Init() would have given it.
+ */
+#define CERTDB_TOKEN_NAME "NSS Certificate DB"
+
+static const char *
+database_token(database *db)
+{
+	return db->name ? db->name : CERTDB_TOKEN_NAME;
+}
+
+static int
+open_database(context *ctx, database *db)
+{
+	cms_context *cms = ctx->backup_cms;
+	char *spec = NULL;
+
+	if (asprintf(&spec, "configdir='%s' tokenDescription='%s' "
+		     "flags=readOnly", db->certdir, database_token(db)) < 0) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"could not allocate memory: %m");
+		exit(1);
+	}
+	db->slot = SECMOD_OpenUserDB(spec);
+	free(spec);
+	if (!db->slot) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"could not open certificate database \"%s\": %s",
+			db->certdir, PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"serving certificate database \"%s\" as token \"%s\"",
+		db->certdir, database_token(db));
+	return 0;
+}
+
+static int
+close_database(context *ctx, database *db)
+{
+	cms_context *cms = ctx->backup_cms;
+
+	free_signer_template(db->template);
+	db->template = NULL;
+	if (!db->slot)
+		return 0;
+
+	if (SECMOD_CloseUserDB(db->slot) != SECSuccess) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"could not close certificate database \"%s\": %s",
+			db->certdir, PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+	PK11_FreeSlot(db->slot);
+	db->slot = NULL;
+	return 0;
+}
+
+/*
+ * NSS gets the first database's module configuration (so its hardware
+ * tokens are loaded as before) but not its certificates and keys; those
+ * come from open_database() like everybody else's.  The internal key slot
+ * is renamed to keep it from shadowing that token.
+ */
+static int
+init_nss(context *ctx)
+{
+	cms_context *cms = ctx->backup_cms;
+
+	PK11_ConfigurePKCS11(NULL, NULL, NULL, "NSS Internal Key Slot",
+			     NULL, NULL, NULL, NULL, 0, 0);
+	SECStatus status = NSS_Initialize(ctx->databases[0].certdir, "", "",
+					  SECMOD_DB, NSS_INIT_READONLY |
+					  NSS_INIT_NOCERTDB);
+	if (status != SECSuccess) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"Could not initialize nss: %s",
+			PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+
+	for (int i = 0; i < ctx->ndatabases; i++) {
+		if (open_database(ctx, &ctx->databases[i]) < 0)
+			return -1;
+	}
+
+	status = register_oids(cms);
+	if (status != SECSuccess) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"Could not register OIDs");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+close_databases(context *ctx)
+{
+	for (int i = 0; i < ctx->ndatabases; i++)
+		close_database(ctx, &ctx->databases[i]);
+}
+
+/*
+ * Close each certificate database and open it again, so that certificates
+ * which have been added or rotated since we started get picked up without
+ * anybody losing the socket.  Requests are handled one at a time and this
+ * only ever runs between them, so nothing is still using the old modules,
+ * and since NSS itself stays up, tokens in other modules stay logged in.
+ *
+ * A database we can't close stays in service as it was and the reload is
+ * reported as failed; one we closed but can't open again leaves us unable
+ * to do our job, so we exit.
+ */
+static int
+reload_nss(context *ctx)
+{
+	cms_context *cms = ctx->backup_cms;
+	struct timespec start, end;
+	int rc = 0;
+
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"reloading certificate databases");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* anything keyed on the old certificates is stale now */
+	free_signer_template(cms->template);
+	cms->template = NULL;
+	if (cms->cert) {
+		CERT_DestroyCertificate(cms->cert);
+		cms->cert = NULL;
+	}
+
+	for (int i = 0; i < ctx->ndatabases; i++) {
+		database *db = &ctx->databases[i];
+
+		if (close_database(ctx, db) < 0) {
+			rc = -1;
+			continue;
+		}
+		if (open_database(ctx, db) < 0) {
+			should_exit = 1;
+			return -1;
+		}
+	}
+
+	/* reopened databases have lost their logins; put back the ones we
+	 * can before deciding which tokens are still unlocked. */
+	token_monitor_probe(&ctx->tokens, cms, ctx->priority);
+	revalidate_tokens(ctx);
+	readd_tokens(ctx);
+	warm_up(ctx);
+
+	if (rc < 0) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"could not reload every certificate database");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long usecs = (end.tv_sec - start.tv_sec) * 1000000
+		     + (end.tv_nsec - start.tv_nsec) / 1000;
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"reloaded certificate databases in %ld.%06ld seconds",
+		usecs / 1000000, usecs % 1000000);
+	return 0;
+}
+
 static int
 set_up_socket(context *ctx)
 {
@@ -1029,8 +2162,14 @@ daemon_logger(cms_context *cms, int priority, char *fmt, ...)
 	if (ctx->errstr)
 		xfree(ctx->errstr);
 
+	/* the chatter about each request is in its audit record too; the
+	 * request path doesn't wait on syslog for it unless asked to. */
+	if (LOG_PRI(priority) >= LOG_INFO && !ctx->log_requests)
+		return 0;
+
 	va_start(ap, fmt);
-	if (priority & LOG_ERR) {
+	/* only errors get sent back to the client */
+	if (LOG_PRI(priority) <= LOG_ERR) {
 		va_list aq;
 
 		va_copy(aq, ap);
@@ -1066,29 +2205,43 @@ err:
 }
 
 int
-daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
+daemonize(cms_context *cms_ctx, daemon_options *options)
 {
 	int rc = 0;
 	context ctx = {
 		.backup_cms = cms_ctx,
-		.priority = do_fork ? LOG_PID
+		.priority = options->do_fork ? LOG_PID
 				    : LOG_PID|LOG_PERROR,
+		.log_requests = options->log_requests,
 	};
 
 	ctx.backup_cms = cms_ctx;
 	ctx.backup_cms->log_priv = &ctx;
 	ctx.sd = -1;
 
+	if (read_databases(&ctx, options->certdir, DATABASE_CONFIG) < 0)
+		exit(1);
+
 	if (getuid() != 0) {
 		fprintf(stderr, "pesignd must be started as root");
 		exit(1);
 	}
 
-	check_socket(&ctx);
+	/* this has to happen before we fork, since LISTEN_PID is ours */
+	if (get_activation_socket(&ctx) < 0)
+		check_socket(&ctx);
+
+	/* Exiting when idle only makes sense if something will start us
+	 * again. */
+	if (ctx.socket_activated)
+		ctx.idle_timeout = options->idle_timeout;
+	else if (options->idle_timeout > 0)
+		fprintf(stderr, "pesignd: not socket activated, ignoring "
+			"idle timeout\n");
 
 	openlog("pesignd", LOG_PID, LOG_DAEMON);
 
-	if (do_fork) {
+	if (options->do_fork) {
 		pid_t pid;
 
 		if ((pid = fork())) {
@@ -1103,22 +2256,10 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 	daemon_logger(ctx.backup_cms, ctx.priority|LOG_NOTICE,
 		"pesignd starting (pid %d)", ctx.pid);
 
-	SECStatus status = NSS_Init(certdir);
-	if (status != SECSuccess) {
-		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_NOTICE,
-			"Could not initialize nss: %s\n",
-			PORT_ErrorToString(PORT_GetError()));
-		exit(1);
-	}
-
-	status = register_oids(ctx.backup_cms);
-	if (status != SECSuccess) {
-		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_NOTICE,
-			"Could not register OIDs\n");
+	if (init_nss(&ctx) < 0)
 		exit(1);
-	}
 
-	if (do_fork) {
+	if (options->do_fork) {
 		int fd = open("/dev/zero", O_RDONLY);
 		if (fd < 0) {
 			ctx.backup_cms->log(ctx.backup_cms,
@@ -1167,7 +2308,7 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 
 	setsid();
 
-	if (do_fork) {
+	if (options->do_fork) {
 		struct sigaction sa = {
 			.sa_handler = quit_handler,
 		};
@@ -1176,6 +2317,16 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 		sigaction(SIGTERM, &sa, NULL);
 	}
 
+	struct sigaction sa = {
+		.sa_handler = reload_handler,
+	};
+	sigaction(SIGHUP, &sa, NULL);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
 	char *homedir = NULL;
 
 	rc = get_uid_and_gid(&ctx, &homedir);
@@ -1188,6 +2339,29 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 
 	chdir(homedir ? homedir : "/");
 
+	for (int i = 0; i < ctx.ndatabases; i++) {
+		scheduler_init(&ctx.databases[i].sched);
+		scheduler_read_config(&ctx.databases[i].sched,
+				      SCHEDULER_CONFIG, ctx.backup_cms,
+				      ctx.priority);
+	}
+
+	/* without a file, the audit records at least go to syslog */
+	rc = audit_log_open(&ctx.audit, options->audit_log,
+			    options->audit_syslog || !options->audit_log,
+			    ctx.priority, options->audit_wait);
+	if (rc < 0 && errno == EPROTO) {
+		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_ERR,
+			"audit log \"%s\" is in an older format; move it "
+			"aside to start a new one", options->audit_log);
+		exit(1);
+	} else if (rc < 0) {
+		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_ERR,
+			"could not open audit log \"%s\": %m",
+			options->audit_log);
+		exit(1);
+	}
+
 	if (getuid() == 0) {
 		/* process is running as root, drop privileges */
 		if (setgid(ctx.gid) != 0 || setgroups(0, NULL)) {
@@ -1204,16 +2378,39 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 		}
 	}
 
-	set_up_socket(&ctx);
+	if (!ctx.socket_activated)
+		set_up_socket(&ctx);
 
 	cms_set_pw_callback(ctx.backup_cms, get_password_fail);
 	cms_set_pw_data(ctx.backup_cms, NULL);
-	if (do_fork)
+	if (options->do_fork)
 		ctx.backup_cms->log = daemon_logger;
 
+	/* the token we were started with may need its session kept up too,
+	 * though without a PIN all we can do is report on it. */
+	token_monitor_init(&ctx.tokens, options->token_interval,
+			   options->keep_pins);
+	if (ctx.backup_cms->tokenname &&
+	    token_monitor_add(&ctx.tokens, ctx.backup_cms->tokenname,
+			      NULL) < 0) {
+		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_ERR,
+			"could not allocate memory: %m");
+		exit(1);
+	}
+	token_monitor_probe(&ctx.tokens, ctx.backup_cms, ctx.priority);
+
+	warm_up(&ctx);
+
+	rc = audit_log_start(&ctx.audit);
+	if (rc < 0) {
+		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_ERR,
+			"could not start audit log writer: %m");
+		exit(1);
+	}
+
 	rc = handle_events(&ctx);
 
-	status = NSS_Shutdown();
+	SECStatus status = NSS_Shutdown();
 	if (status != SECSuccess) {
 		ctx.backup_cms->log(ctx.backup_cms, ctx.priority|LOG_ERR,
 			"NSS_Shutdown failed: %s\n",
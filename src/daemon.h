@@ -19,7 +19,19 @@
 #ifndef DAEMON_H
 #define DAEMON_H 1
 
-extern int daemonize(cms_context *ctx, char *certdir, int do_fork);
+typedef struct {
+	char *certdir;
+	int do_fork;
+	int idle_timeout;
+	char *audit_log;
+	int audit_syslog;
+	int audit_wait;
+	int log_requests;
+	int token_interval;
+	int keep_pins;
+} daemon_options;
+
+extern int daemonize(cms_context *ctx, daemon_options *options);
 
 typedef struct {
 	uint32_t version;
@@ -45,11 +57,24 @@ typedef enum {
 	CMD_RESPONSE,
 	CMD_IS_TOKEN_UNLOCKED,
 	CMD_GET_CMD_VERSION,
+	CMD_RELOAD,
+	CMD_GET_LOAD,
+	CMD_SIGN_DIGEST,
+	CMD_GET_STATUS,
 	CMD_LIST_END
 } pesignd_cmd;
 
+/*
+ * A response with this rc means the daemon didn't take the request (it was
+ * too busy, or it waited too long in the queue), so it's safe to send it to
+ * another daemon instead.
+ */
+#define PESIGND_RETRY	-2
+
 #define PESIGND_VERSION 0x2a9edaf0
 #define SOCKPATH	"/var/run/pesign/socket"
+#define DEFAULT_CERTDIR	"/etc/pki/pesign"
+#define DATABASE_CONFIG	"/etc/pesign/databases"
 #define PIDFILE		"/var/run/pesign.pid"
 
 #endif /* DAEMON_H */
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pesign.h"
+
+/*
+ * Unlike pesign-client, nothing in here may exit: until the daemon has
+ * actually taken the request, any problem just means we sign by ourselves.
+ */
+
+static int
+open_daemon_socket(const char *sockpath)
+{
+	struct sockaddr_un addr_un = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(sockpath) >= sizeof(addr_un.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr_un.sun_path, sockpath);
+
+	int sd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	socklen_t len = strlen(addr_un.sun_path) +
+			sizeof(addr_un.sun_family);
+	if (connect(sd, (struct sockaddr *)&addr_un, len) < 0) {
+		save_errno(close(sd));
+		return -1;
+	}
+
+	return sd;
+}
+
+static int
+send_all(int sd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = send(sd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+send_request(int sd, uint32_t command, const void *payload, uint32_t size)
+{
+	pesignd_msghdr pm = {
+		.version = PESIGND_VERSION,
+		.command = command,
+		.size = size,
+	};
+
+	if (send_all(sd, &pm, sizeof(pm)) < 0)
+		return -1;
+	return send_all(sd, payload, size);
+}
+
+/*
+ * Returns -1 if there was no sensible answer at all; otherwise *rc is what
+ * the daemon said, and *srvmsg its message, if it sent one.
+ */
+static int
+get_response(int sd, int32_t *rc, char **srvmsg)
+{
+	pesignd_msghdr pm;
+	ssize_t n;
+
+	*srvmsg = NULL;
+
+	n = recv(sd, &pm, sizeof(pm), MSG_WAITALL);
+	if (n != sizeof(pm))
+		return -1;
+	if (pm.version != PESIGND_VERSION || pm.command != CMD_RESPONSE ||
+	    pm.size < sizeof(int32_t) || pm.size > 65536)
+		return -1;
+
+	pesignd_cmd_response *resp = calloc(1, pm.size + 1);
+	if (!resp)
+		return -1;
+
+	n = recv(sd, resp, pm.size, MSG_WAITALL);
+	if (n < 0 || (size_t)n != pm.size) {
+		free(resp);
+		return -1;
+	}
+
+	*rc = resp->rc;
+	if (resp->errmsg[0])
+		*srvmsg = strdup((char *)resp->errmsg);
+	free(resp);
+	return 0;
+}
+
+static int
+get_cmd_version(int sd, uint32_t command, int32_t *version)
+{
+	char *srvmsg = NULL;
+
+	if (send_request(sd, CMD_GET_CMD_VERSION, &command,
+			 sizeof(command)) < 0)
+		return -1;
+
+	int rc = get_response(sd, version, &srvmsg);
+	xfree(srvmsg);
+	return rc;
+}
+
+static int
+send_key_request(int sd, uint32_t command, char *tokenname, char *certname)
+{
+	uint32_t size0 = pesignd_string_size(tokenname);
+	uint32_t size1 = pesignd_string_size(certname);
+
+	char *buffer = malloc(size0 + size1);
+	if (!buffer)
+		return -1;
+
+	pesignd_string *tn = (pesignd_string *)buffer;
+	pesignd_string_set(tn, tokenname);
+	pesignd_string *cn = pesignd_string_next(tn);
+	pesignd_string_set(cn, certname);
+
+	int rc = send_request(sd, command, buffer, size0 + size1);
+	free(buffer);
+	return rc;
+}
+
+static int
+send_fd(int sd, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char buf[2] = "\0";
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	memset(&msg, '\0', sizeof(msg));
+	memset(&control, '\0', sizeof(control));
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cme = CMSG_FIRSTHDR(&msg);
+	cme->cmsg_len = CMSG_LEN(sizeof(int));
+	cme->cmsg_level = SOL_SOCKET;
+	cme->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cme), &fd, sizeof(fd));
+
+	return sendmsg(sd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static void
+declined(int verbose, const char *sockpath, const char *why)
+{
+	if (verbose)
+		fprintf(stderr, "pesign: not using daemon at %s: %s\n",
+			sockpath, why);
+}
+
+int
+delegate_sign(const char *sockpath, int infd, int outfd, char *tokenname,
+	      char *certname, int attached, int verbose)
+{
+	uint32_t command = attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED;
+	char *srvmsg = NULL;
+	int32_t version;
+	int32_t rc;
+
+	int sd = open_daemon_socket(sockpath);
+	if (sd < 0) {
+		if (verbose)
+			fprintf(stderr, "pesign: not using daemon at %s: %m\n",
+				sockpath);
+		return DELEGATE_DECLINED;
+	}
+
+	/* a daemon that can't tell us whether it has the key doesn't get
+	 * asked to use it */
+	if (get_cmd_version(sd, CMD_GET_LOAD, &version) < 0 || version != 0 ||
+	    get_cmd_version(sd, command, &version) < 0 || version != 0) {
+		declined(verbose, sockpath, "daemon is too old");
+		goto decline;
+	}
+
+	if (send_key_request(sd, CMD_GET_LOAD, tokenname, certname) < 0 ||
+	    get_response(sd, &rc, &srvmsg) < 0) {
+		declined(verbose, sockpath, "no answer from daemon");
+		goto decline;
+	}
+	if (rc < 0) {
+		declined(verbose, sockpath,
+			 srvmsg ? srvmsg : "daemon cannot use that key");
+		goto decline;
+	}
+	xfree(srvmsg);
+
+	if (send_key_request(sd, command, tokenname, certname) < 0 ||
+	    send_fd(sd, infd) < 0 || send_fd(sd, outfd) < 0 ||
+	    get_response(sd, &rc, &srvmsg) < 0) {
+		/* we can't know how far it got, so whatever is in the
+		 * output gets replaced when we do it ourselves */
+		declined(verbose, sockpath, "daemon went away");
+		goto decline;
+	}
+	if (rc == PESIGND_RETRY) {
+		declined(verbose, sockpath, srvmsg ? srvmsg : "daemon is busy");
+		goto decline;
+	}
+	close(sd);
+
+	if (rc < 0) {
+		fprintf(stderr, "pesign: signing failed: %s\n",
+			srvmsg ? srvmsg : "daemon did not say why");
+		xfree(srvmsg);
+		return -1;
+	}
+	xfree(srvmsg);
+
+	if (verbose)
+		fprintf(stderr, "pesign: signed by daemon at %s\n", sockpath);
+	return 0;
+decline:
+	xfree(srvmsg);
+	close(sd);
+	return DELEGATE_DECLINED;
+}
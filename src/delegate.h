@@ -0,0 +1,42 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef DELEGATE_H
+#define DELEGATE_H 1
+
+/*
+ * When a pesignd is already running with the token unlocked, "pesign -s"
+ * hands the signing to it, the way pesign-client would, rather than
+ * opening the database and logging in to the token itself.  The daemon is
+ * asked first (with CMD_GET_LOAD) whether it can sign with the token and
+ * certificate we were given; if it can't be reached, is too old to say, or
+ * doesn't have the key, or turns the request away as too busy, pesign
+ * signs locally instead.
+ *
+ * delegate_sign() returns 0 when the daemon did the signing, -1 when it
+ * took the request but failed (the error has been printed), and
+ * DELEGATE_DECLINED when nothing was done and the caller should go on and
+ * sign by itself.
+ */
+#define DELEGATE_DECLINED	1
+
+extern int delegate_sign(const char *sockpath, int infd, int outfd,
+			 char *tokenname, char *certname, int attached,
+			 int verbose);
+
+#endif /* DELEGATE_H */
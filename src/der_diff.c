@@ -0,0 +1,645 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+/*
+ * Does the DER we write by hand come out the same as what the SEC_ASN1
+ * templates it replaced would have made?  For each case below this builds
+ * one SignedData, and encodes it both with the old templates (which now
+ * only live here) and with encode_signed_data(); then it does the same for
+ * the SpcIndirectDataContent inside it.  Each pair has to match byte for
+ * byte, and if one doesn't we say where it first differs.
+ *
+ * It isn't built by default; "make der_diff" in src/, and then:
+ *
+ *   ./der_diff signer.der issuer.der
+ *
+ * Any certificate and its issuer will do, as DER; there's no private key
+ * involved, since the signature comes from a made up signer helper.
+ * authvar signer infos can only be made with a real key, so the authvar
+ * case borrows the PE signer info; it's there for the empty content.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pesign.h"
+#include "content_info_priv.h"
+#include "signed_data_priv.h"
+
+#include <nss.h>
+#include <prerror.h>
+
+/* signer_helper.c isn't linked in; these are the only parts of it the
+ * signing code uses, and they make up a signature from the content. */
+static SECItem *submitted;
+
+int
+signer_helper_submit(cms_context *cms __attribute__((__unused__)),
+		     SECItem *data, uint32_t *idp)
+{
+	submitted = data;
+	*idp = 0;
+	return 0;
+}
+
+int
+signer_helper_collect(cms_context *cms,
+		      uint32_t id __attribute__((__unused__)), SECItem *sig)
+{
+	uint8_t *p = PORT_ArenaAlloc(cms->arena, 256);
+
+	if (!p)
+		return -1;
+	for (int i = 0; i < 256; i++)
+		p[i] = submitted->data[i % submitted->len] ^ i;
+	sig->type = siBuffer;
+	sig->data = p;
+	sig->len = 256;
+	return 0;
+}
+
+void
+signer_helper_free(signer_helper *helper __attribute__((__unused__)))
+{
+}
+
+/*
+ * The templates, as they were before the direct writer replaced them.
+ */
+typedef struct {
+	SECItem flags;
+	SpcLink link;
+} SpcPeImageData;
+
+typedef struct {
+	SECItem contentType;
+	SECItem value;
+} SpcAttributeTypeAndOptionalValue;
+
+typedef struct {
+	SECItem classId;
+	SECItem serializedData;
+} SpcSerializedObject;
+
+typedef struct {
+	SECItem contentType;
+	SECItem content;
+} ContentInfo;
+
+static SEC_ASN1Template SpcPeImageDataTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (SpcPeImageData),
+	},
+	{
+	.kind = SEC_ASN1_NULL,
+	.offset = offsetof(SpcPeImageData, flags),
+	.sub = NULL,
+	.size = 1
+	},
+	{
+	.kind = SEC_ASN1_CONSTRUCTED |
+		SEC_ASN1_CONTEXT_SPECIFIC | 0 |
+		SEC_ASN1_EXPLICIT,
+	.offset = offsetof(SpcPeImageData, link),
+	.sub = &SpcLinkTemplate,
+	.size = sizeof (SpcLink),
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template SpcSerializedObjectTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (SpcSerializedObject),
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING,
+	.offset = offsetof(SpcSerializedObject, classId),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING,
+	.offset = offsetof(SpcSerializedObject, serializedData),
+	.sub = NULL,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template SpcAttributeTypeAndOptionalValueTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (SpcAttributeTypeAndOptionalValue)
+	},
+	{
+	.kind = SEC_ASN1_OBJECT_ID,
+	.offset = offsetof(SpcAttributeTypeAndOptionalValue, contentType),
+	.sub = &SEC_ObjectIDTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_OPTIONAL |
+		SEC_ASN1_ANY,
+	.offset = offsetof(SpcAttributeTypeAndOptionalValue, value),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template SetOfOctetStringTemplate[] = {
+	{
+	.kind = SEC_ASN1_SET_OF,
+	.offset = 0,
+	.sub = &SEC_OctetStringTemplate,
+	.size = sizeof (SECItem **),
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template SetOfAttributeTypeAndOptionalValueTemplate[] = {
+	{
+	.kind = SEC_ASN1_SET_OF,
+	.offset = 0,
+	.sub = &SpcAttributeTypeAndOptionalValueTemplate,
+	.size = sizeof (SpcAttributeTypeAndOptionalValue **),
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template SpcIndirectDataContentTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = 0,
+	},
+	{
+	.kind = SEC_ASN1_ANY |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(SpcIndirectDataContent, data),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_ANY |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(SpcIndirectDataContent, messageDigest),
+	.sub = &DigestInfoTemplate,
+	.size = sizeof (SECItem)
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template SignedDataTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (SignedData)
+	},
+	{
+	.kind = SEC_ASN1_INTEGER,
+	.offset = offsetof(SignedData, version),
+	.sub = &SEC_IntegerTemplate,
+	.size = sizeof (SECItem)
+	},
+	{
+	.kind = SEC_ASN1_SET_OF,
+	.offset = offsetof(SignedData, algorithms),
+	.sub = &SECOID_AlgorithmIDTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_INLINE,
+	.offset = offsetof(SignedData, cinfo),
+	.sub = &SpcContentInfoTemplate,
+	.size = sizeof (SpcContentInfo),
+	},
+	{
+	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 0 |
+		SEC_ASN1_CONSTRUCTED |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(SignedData, certificates),
+	.sub = &SEC_SetOfAnyTemplate,
+	.size = sizeof(SECItem**),
+	},
+	{
+	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 1 |
+		SEC_ASN1_CONSTRUCTED |
+		SEC_ASN1_OPTIONAL,
+	.offset = offsetof(SignedData, crls),
+	.sub = &SEC_SetOfAnyTemplate,
+	.size = sizeof (SECItem **),
+	},
+	{
+	.kind = SEC_ASN1_SET_OF,
+	.offset = offsetof(SignedData, signerInfos),
+	.sub = &SpcSignerInfoTemplate,
+	.size = 0,
+	},
+	{ 0, }
+};
+
+static SEC_ASN1Template ContentInfoTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (ContentInfo),
+	},
+	{
+	.kind = SEC_ASN1_OBJECT_ID,
+	.offset = offsetof(ContentInfo, contentType),
+	.sub = &SEC_ObjectIDTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 0 |
+		SEC_ASN1_CONSTRUCTED |
+		SEC_ASN1_EXPLICIT,
+	.offset = offsetof(ContentInfo, content),
+	.sub = &SEC_AnyTemplate,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+/*
+ * SpcIndirectDataContent the old way: one SEC_ASN1EncodeItem() per level,
+ * with the tags the templates couldn't manage banged in afterwards.
+ */
+static int
+template_page_hash_link(cms_context *cms, SpcLink *slp)
+{
+	static uint8_t class_id[] = {
+		0xa6, 0xb5, 0x86, 0xd5, 0xb4, 0xa1, 0x24, 0x66,
+		0xae, 0x05, 0xa2, 0x17, 0xda, 0x8e, 0x60, 0xd6
+	};
+	SpcAttributeTypeAndOptionalValue ataov;
+	SpcSerializedObject so;
+	SECItem encoded;
+
+	memset(&ataov, '\0', sizeof (ataov));
+	ms_oid_t moid = digest_get_digest_oid(cms) == SEC_OID_SHA1 ?
+			SPC_PE_IMAGE_PAGE_HASHES_V1 :
+			SPC_PE_IMAGE_PAGE_HASHES_V2;
+	if (get_ms_oid_secitem(moid, &ataov.contentType) < 0)
+		cmsreterr(-1, cms, "could not get page hash OID");
+
+	SECItem *tables[2] = { &cms->page_hash_table, NULL };
+	SECItem **tablesp = tables;
+	if (SEC_ASN1EncodeItem(cms->arena, &ataov.value, &tablesp,
+			       SetOfOctetStringTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode page hash table");
+
+	SpcAttributeTypeAndOptionalValue *attrs[2] = { &ataov, NULL };
+	SpcAttributeTypeAndOptionalValue **attrsp = attrs;
+	memset(&so, '\0', sizeof (so));
+	if (SEC_ASN1EncodeItem(cms->arena, &so.serializedData, &attrsp,
+			SetOfAttributeTypeAndOptionalValueTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode page hash attribute");
+
+	so.classId.type = siBuffer;
+	so.classId.data = class_id;
+	so.classId.len = sizeof (class_id);
+	if (SEC_ASN1EncodeItem(cms->arena, &encoded, &so,
+			       SpcSerializedObjectTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode SpcSerializedObject");
+	encoded.data[0] = SEC_ASN1_CONTEXT_SPECIFIC | SEC_ASN1_CONSTRUCTED | 1;
+
+	return generate_spc_link(cms, slp, SpcLinkTypeMoniker, encoded.data,
+				 encoded.len);
+}
+
+static int
+template_spc_indirect_data_content(cms_context *cms, SECItem *idcp,
+				   SECItem *digest)
+{
+	SpcAttributeTypeAndOptionalValue ataov;
+	SpcPeImageData spid;
+	SpcIndirectDataContent idc;
+	DigestInfo di;
+	SECItem contents;
+	char obsolete[28] = "";
+	int rc;
+
+	memset(&spid, '\0', sizeof (spid));
+	if (!SECITEM_AllocItem(cms->arena, &spid.flags, 1))
+		return -1;
+	spid.flags.data[0] = 0;
+
+	if (cms->page_hash_table.data)
+		rc = template_page_hash_link(cms, &spid.link);
+	else
+		rc = generate_spc_link(cms, &spid.link, SpcLinkTypeFile,
+				       obsolete, 0);
+	if (rc < 0)
+		return rc;
+
+	memset(&ataov, '\0', sizeof (ataov));
+	if (SEC_ASN1EncodeItem(cms->arena, &ataov.value, &spid,
+			       SpcPeImageDataTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode SpcPeImageData");
+	if (der_contents(&ataov.value, &contents) < 0)
+		return -1;
+	contents.data[0] = DER_BIT_STRING;
+
+	if (get_ms_oid_secitem(SPC_PE_IMAGE_DATA_OBJID, &ataov.contentType) < 0)
+		cmsreterr(-1, cms, "could not get SPC_PE_IMAGE_DATA_OBJID");
+
+	memset(&idc, '\0', sizeof (idc));
+	if (SEC_ASN1EncodeItem(cms->arena, &idc.data, &ataov,
+			SpcAttributeTypeAndOptionalValueTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode "
+			  "SpcAttributeTypeAndOptionalValue");
+
+	memset(&di, '\0', sizeof (di));
+	if (generate_algorithm_id(cms, &di.digestAlgorithm,
+				  digest_get_digest_oid(cms)) < 0)
+		return -1;
+	memcpy(&di.digest, digest, sizeof (di.digest));
+	if (SEC_ASN1EncodeItem(cms->arena, &idc.messageDigest, &di,
+			       DigestInfoTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode DigestInfo");
+
+	if (SEC_ASN1EncodeItem(cms->arena, idcp, &idc,
+			       SpcIndirectDataContentTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode SpcIndirectDataContent");
+	return 0;
+}
+
+/* And SignedData, inside its ContentInfo. */
+static int
+template_signed_data(cms_context *cms, SignedData *sd, SECItem *sdp)
+{
+	SECOidData *oid = SECOID_FindOIDByTag(SEC_OID_PKCS7_SIGNED_DATA);
+	ContentInfo sdw;
+
+	if (!oid)
+		cmsreterr(-1, cms, "could not find OID for SignedData");
+
+	memset(&sdw, '\0', sizeof (sdw));
+	if (SEC_ASN1EncodeItem(cms->arena, &sdw.content, sd,
+			       SignedDataTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode SignedData");
+	memcpy(&sdw.contentType, &oid->oid, sizeof (sdw.contentType));
+
+	if (SEC_ASN1EncodeItem(cms->arena, sdp, &sdw,
+			       ContentInfoTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode ContentInfo");
+	return 0;
+}
+
+typedef enum {
+	PE_SIGNED_DATA,
+	CATALOG_SIGNED_DATA,
+	AUTHVAR_SIGNED_DATA,
+} signed_data_kind;
+
+/* What generate_*_signed_data() do, short of encoding it. */
+static int
+build_signed_data(cms_context *cms, signed_data_kind kind, SignedData *sd)
+{
+	/* any valid DER will do for the catalog's contents */
+	static uint8_t ctl_der[] = { 0x30, 0x03, 0x02, 0x01, 0x05 };
+	SECItem ctl = { siBuffer, ctl_der, sizeof (ctl_der) };
+	SignerInfoType type = PE_SIGNER_INFO;
+
+	memset(sd, '\0', sizeof (*sd));
+	if (SEC_ASN1EncodeInteger(cms->arena, &sd->version, 1) == NULL)
+		cmsreterr(-1, cms, "could not encode integer");
+	if (generate_algorithm_id_list(cms, &sd->algorithms) < 0)
+		return -1;
+
+	switch (kind) {
+	case PE_SIGNED_DATA:
+		if (generate_spc_content_info(cms, &sd->cinfo) < 0)
+			return -1;
+		break;
+	case CATALOG_SIGNED_DATA:
+		if (get_ms_oid_secitem(szOID_CTL, &sd->cinfo.contentType) < 0)
+			cmsreterr(-1, cms, "could not get OID for szOID_CTL");
+		memcpy(&sd->cinfo.content, &ctl, sizeof (sd->cinfo.content));
+		cms->ci_digest = SECITEM_AllocItem(cms->arena, NULL,
+						digest_get_digest_size(cms));
+		if (!cms->ci_digest ||
+		    generate_catalog_digest(&ctl, digest_get_digest_oid(cms),
+					    cms->ci_digest) < 0)
+			cmsreterr(-1, cms, "could not digest catalog");
+		type = CATALOG_SIGNER_INFO;
+		break;
+	case AUTHVAR_SIGNED_DATA:
+		/* the signer info needs a real key, so it's the PE one */
+		if (generate_spc_content_info(cms, &sd->cinfo) < 0 ||
+		    generate_authvar_content_info(cms, &sd->cinfo) < 0)
+			return -1;
+		break;
+	}
+
+	if (generate_certificate_list(cms, &sd->certificates) < 0)
+		return -1;
+	sd->crls = NULL;
+	return generate_signerInfo_list(cms, &sd->signerInfos, type);
+}
+
+static int
+compare(const char *name, const char *what, SECItem *old, SECItem *new)
+{
+	unsigned int len = old->len < new->len ? old->len : new->len;
+
+	for (unsigned int i = 0; i < len; i++) {
+		if (old->data[i] != new->data[i]) {
+			printf("%s: %s differs at offset %u: %02x from the "
+			       "templates, %02x written directly\n", name,
+			       what, i, old->data[i], new->data[i]);
+			return -1;
+		}
+	}
+	if (old->len != new->len) {
+		printf("%s: %s is %u bytes from the templates, %u written "
+		       "directly\n", name, what, old->len, new->len);
+		return -1;
+	}
+	printf("%s: %s matches (%u bytes)\n", name, what, old->len);
+	return 0;
+}
+
+static int
+logger(cms_context *cms __attribute__((__unused__)),
+       int priority __attribute__((__unused__)), char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	return 0;
+}
+
+static SECItem *
+read_der(const char *path)
+{
+	SECItem *der = calloc(1, sizeof (*der));
+	char *buf;
+	size_t len;
+
+	if (!der)
+		err(1, "could not allocate memory");
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		err(1, "could not open \"%s\"", path);
+	if (read_file(fd, &buf, &len) < 0)
+		err(1, "could not read \"%s\"", path);
+	close(fd);
+
+	der->type = siBuffer;
+	der->data = (unsigned char *)buf;
+	der->len = len;
+	return der;
+}
+
+typedef struct {
+	const char *name;
+	const char *digest;
+	int ncerts;
+	size_t page_hash_len;
+	size_t timestamp_len;
+	signed_data_kind kind;
+} der_case;
+
+static der_case cases[] = {
+	{ "sha256, 1 cert", "sha256", 1, 0, 0, PE_SIGNED_DATA },
+	{ "sha256, 2 certs", "sha256", 2, 0, 0, PE_SIGNED_DATA },
+	{ "sha1, 2 certs", "sha1", 2, 0, 0, PE_SIGNED_DATA },
+	{ "small page hashes", "sha256", 2, 40, 0, PE_SIGNED_DATA },
+	{ "large page hashes", "sha256", 2, 70000, 0, PE_SIGNED_DATA },
+	{ "timestamp", "sha256", 2, 0, 2204, PE_SIGNED_DATA },
+	{ "timestamp, page hashes", "sha1", 1, 3000, 600, PE_SIGNED_DATA },
+	{ "catalog", "sha256", 2, 0, 0, CATALOG_SIGNED_DATA },
+	{ "authvar", "sha256", 1, 0, 0, AUTHVAR_SIGNED_DATA },
+};
+
+static int
+run_case(der_case *c, SECItem **certs)
+{
+	static signer_helper helper;
+	cms_context *cms = NULL;
+	SECItem *chain[3] = { certs[0], c->ncerts > 1 ? certs[1] : NULL, NULL };
+	SECItem old, new, *digest;
+	SignedData sd;
+	int rc = -1;
+
+	if (cms_context_alloc(&cms) < 0)
+		errx(1, "could not allocate cms context");
+	cms->log = logger;
+	if (register_oids(cms) != SECSuccess)
+		errx(1, "could not register OIDs");
+	if (set_digest_parameters(cms, (char *)c->digest) < 0)
+		errx(1, "unknown digest \"%s\"", c->digest);
+	if (generate_signer_template_from_der(cms, chain) < 0)
+		errx(1, "could not use the certificates given");
+	cms->helper = &helper;
+
+	if (generate_digest_begin(cms) < 0)
+		goto out;
+	generate_digest_step(cms, (void *)c->name, strlen(c->name));
+	if (generate_digest_finish(cms) < 0)
+		goto out;
+	digest = cms->digests[cms->selected_digest].pe_digest;
+
+	if (c->page_hash_len) {
+		SECItem *table = &cms->page_hash_table;
+
+		table->type = siBuffer;
+		table->data = PORT_ArenaAlloc(cms->arena, c->page_hash_len);
+		if (!table->data)
+			goto out;
+		for (size_t i = 0; i < c->page_hash_len; i++)
+			table->data[i] = i * 7;
+		table->len = c->page_hash_len;
+	}
+
+	/* only sizing, so nothing ever gets sent to the TSA */
+	if (c->timestamp_len) {
+		if (timestamp_client_new(cms, "http://127.0.0.1:1/") < 0)
+			goto out;
+		cms->tsa->max_token_len = c->timestamp_len;
+		cms->timestamp_sizing = 1;
+	}
+
+	if (build_signed_data(cms, c->kind, &sd) < 0 ||
+	    template_signed_data(cms, &sd, &old) < 0 ||
+	    encode_signed_data(cms, &sd, &new) < 0)
+		goto out;
+	rc = compare(c->name, "SignedData", &old, &new);
+
+	if (template_spc_indirect_data_content(cms, &old, digest) < 0 ||
+	    generate_spc_indirect_data_content(cms, &new, digest) < 0) {
+		rc = -1;
+		goto out;
+	}
+	if (compare(c->name, "SpcIndirectDataContent", &old, &new) < 0)
+		rc = -1;
+out:
+	cms_context_fini(cms);
+	return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+	SECItem *certs[2];
+	int failed = 0;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: der_diff <signer.der> <issuer.der>\n");
+		exit(1);
+	}
+	certs[0] = read_der(argv[1]);
+	certs[1] = read_der(argv[2]);
+
+	if (NSS_NoDB_Init(NULL) != SECSuccess)
+		errx(1, "could not initialize NSS");
+
+	for (unsigned int i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+		if (run_case(&cases[i], certs) < 0)
+			failed = 1;
+	}
+
+	NSS_Shutdown();
+	if (failed) {
+		printf("the direct writer doesn't match the templates\n");
+		return 1;
+	}
+	return 0;
+}
@@ -28,8 +28,9 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include <libpesign/libpesign.h>
+
 #include "efitypes.h"
-#include "siglist.h"
 
 struct hash_param {
 	char *name;
@@ -270,91 +271,58 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (add) {
+	if (add && (hash || certfile)) {
+		const efi_guid_t *sig_type = &efi_guid_x509_cert;
+		uint8_t *data = cert_data;
+		size_t size = cert_size;
+
 		if (hash) {
-			signature_list *sl = signature_list_new(
-					hash_params[hash_index].guid);
-			if (!sl) {
-				fprintf(stderr, "efisiglist: could not "
-					"allocate signature list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
-			uint8_t *binary_hash = hex_to_bin(hash,
-				hash_params[hash_index].size);
-			if (!binary_hash) {
+			sig_type = hash_params[hash_index].guid;
+			size = hash_params[hash_index].size;
+			data = hex_to_bin(hash, size);
+			if (!data) {
 				fprintf(stderr, "efisiglist: could not "
 					"parse hash \"%s\": %m\n", hash);
 				unlink(outfile);
 				exit(1);
 			}
-			rc = signature_list_add_sig(sl, owner, binary_hash,
-				hash_params[hash_index].size);
-			if (rc < 0) {
-				fprintf(stderr,"efisiglist: could not add "
-					"hash to list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
+		}
 
-			void *blah;
-			size_t size = 0;
-			rc = signature_list_realize(sl, &blah, &size);
-			if (rc < 0) {
-				fprintf(stderr, "efisiglist: Could not realize "
-					"signature list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
-			rc = write(outfd, blah, size);
-			if (rc < 0) {
-				fprintf(stderr, "efisiglist: Could not write "
-					"signature list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
-			close(outfd);
-			exit(0);
-		} else if (certfile) {
-			efi_guid_t sig_type = efi_guid_x509_cert;
-			signature_list *sl = signature_list_new(&sig_type);
-			if (!sl) {
-				fprintf(stderr, "efisiglist: could not "
-					"allocate signature list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
-			rc = signature_list_add_sig(sl, owner, cert_data,
-				cert_size);
-			if (rc < 0) {
-				fprintf(stderr,"efisiglist: could not add "
-					"cert to list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
+		libpesign_esl *esl = libpesign_esl_new(sig_type);
+		if (!esl || libpesign_esl_add(esl, &owner, data, size) < 0) {
+			fprintf(stderr, "efisiglist: could not add %s to "
+				"list: %s\n", hash ? "hash" : "cert",
+				libpesign_error());
+			unlink(outfile);
+			exit(1);
+		}
 
-			void *blah;
-			size_t size = 0;
-			rc = signature_list_realize(sl, &blah, &size);
-			if (rc < 0) {
-				fprintf(stderr, "efisiglist: Could not realize "
-					"signature list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
-			rc = write(outfd, blah, size);
-			if (rc < 0) {
-				fprintf(stderr, "efisiglist: Could not write "
-					"signature list: %m\n");
-				unlink(outfile);
-				exit(1);
-			}
+		const void *list;
+		size_t list_size = 0;
+		rc = libpesign_esl_realize(esl, &list, &list_size);
+		if (rc < 0) {
+			fprintf(stderr, "efisiglist: Could not realize "
+				"signature list: %s\n", libpesign_error());
+			unlink(outfile);
+			exit(1);
+		}
+		rc = write(outfd, list, list_size);
+		if (rc < 0) {
+			fprintf(stderr, "efisiglist: Could not write "
+				"signature list: %m\n");
+			unlink(outfile);
+			exit(1);
+		}
 
+		libpesign_esl_free(esl);
+		if (hash) {
+			free(data);
+		} else {
 			munmap(cert_data, cert_size);
 			close(certfd);
-			close(outfd);
-			exit(0);
 		}
+		close(outfd);
+		exit(0);
 	}
 	exit(1);
 
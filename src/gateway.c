@@ -0,0 +1,966 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <popt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "pesign.h"
+
+#include <nss.h>
+#include <pk11pub.h>
+#include <prerror.h>
+#include <prnetdb.h>
+#include <ssl.h>
+#include <sslproto.h>
+
+/*
+ * pesign-gateway terminates TLS for remote build machines and hands their
+ * requests to the local pesignd, exactly as pesign-client would, so the
+ * daemon's queues, audit log, and token handling all apply to them too.
+ * Each connection gets a thread of its own; the daemon still only signs
+ * one thing at a time.
+ */
+/*
+ * Which clients may use which keys comes from GATEWAY_CLIENTS; anybody
+ * who isn't listed there gets nothing, even with a certificate we trust.
+ * The file is a series of stanzas:
+ *
+ *	client sha256:<fingerprint of the client's certificate>
+ *	client <subject of the client's certificate>
+ *	allow <token>:<certificate nickname>
+ *	allow <token>:*
+ *
+ * Each "client" line starts a new client, and the "allow" lines after it
+ * say what it may sign with.
+ */
+typedef struct {
+	char *tokenname;
+	char *certname;			/* NULL for any */
+} gateway_key;
+
+typedef struct {
+	char *fingerprint;		/* lower case hex, without colons */
+	char *subject;
+	gateway_key *keys;
+	int nkeys;
+} gateway_client;
+
+typedef struct {
+	char *sockpath;
+	int max_connections;
+	int connections;
+	gateway_client *clients;
+	int nclients;
+} gateway;
+
+typedef struct {
+	gateway *gw;
+	PRFileDesc *fd;
+	char *peer;
+	gateway_client *client;
+} connection;
+
+static char *
+parse_fingerprint(const char *s)
+{
+	char *fp = calloc(1, strlen(s) + 1);
+	char *p = fp;
+
+	if (!fp)
+		err(1, "could not allocate memory");
+	for (; *s; s++) {
+		if (*s == ':')
+			continue;
+		if (!isxdigit(*s)) {
+			free(fp);
+			return NULL;
+		}
+		*p++ = tolower(*s);
+	}
+	if (p - fp != SHA256_LENGTH * 2) {
+		free(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+static void
+read_clients(gateway *gw, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		err(1, "could not open \"%s\"", path);
+
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+
+	while (getline(&line, &linesize, f) >= 0) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		char *word = line + strspn(line, " \t");
+		if (!*word || *word == '#')
+			continue;
+		char *value = word + strcspn(word, " \t");
+		if (*value)
+			*value++ = '\0';
+		value += strspn(value, " \t");
+		if (!*value)
+			errx(1, "%s:%d: invalid line", path, lineno);
+
+		if (!strcmp(word, "client")) {
+			gateway_client *clients = realloc(gw->clients,
+				sizeof (*clients) * (gw->nclients + 1));
+			if (!clients)
+				err(1, "could not allocate memory");
+			gw->clients = clients;
+
+			gateway_client *client = &clients[gw->nclients++];
+			memset(client, '\0', sizeof (*client));
+			if (!strncasecmp(value, "sha256:", 7)) {
+				client->fingerprint =
+					parse_fingerprint(value + 7);
+				if (!client->fingerprint)
+					errx(1, "%s:%d: invalid fingerprint",
+						path, lineno);
+			} else if (!(client->subject = strdup(value))) {
+				err(1, "could not allocate memory");
+			}
+		} else if (!strcmp(word, "allow")) {
+			if (gw->nclients == 0)
+				errx(1, "%s:%d: \"allow\" without a client",
+					path, lineno);
+			gateway_client *client = &gw->clients[gw->nclients - 1];
+
+			char *certname = strchr(value, ':');
+			if (!certname || certname == value || !certname[1])
+				errx(1, "%s:%d: expected <token>:<certificate>",
+					path, lineno);
+			*certname++ = '\0';
+
+			gateway_key *keys = realloc(client->keys,
+				sizeof (*keys) * (client->nkeys + 1));
+			if (!keys)
+				err(1, "could not allocate memory");
+			client->keys = keys;
+
+			gateway_key *key = &keys[client->nkeys++];
+			key->tokenname = strdup(value);
+			key->certname = strcmp(certname, "*")
+					? strdup(certname) : NULL;
+			if (!key->tokenname ||
+					(!key->certname && strcmp(certname, "*")))
+				err(1, "could not allocate memory");
+		} else {
+			errx(1, "%s:%d: invalid line", path, lineno);
+		}
+	}
+	free(line);
+	fclose(f);
+
+	if (gw->nclients == 0)
+		errx(1, "no clients are allowed in \"%s\"", path);
+}
+
+/* Look the peer up by its certificate's fingerprint, or failing that, by
+ * its subject. */
+static gateway_client *
+find_client(gateway *gw, CERTCertificate *cert)
+{
+	uint8_t hash[SHA256_LENGTH];
+	char fp[SHA256_LENGTH * 2 + 1];
+
+	if (PK11_HashBuf(SEC_OID_SHA256, hash, cert->derCert.data,
+			 cert->derCert.len) != SECSuccess)
+		return NULL;
+	for (int i = 0; i < SHA256_LENGTH; i++)
+		snprintf(fp + i * 2, 3, "%02x", hash[i]);
+
+	for (int i = 0; i < gw->nclients; i++) {
+		if (gw->clients[i].fingerprint &&
+				!strcmp(gw->clients[i].fingerprint, fp))
+			return &gw->clients[i];
+	}
+	for (int i = 0; i < gw->nclients; i++) {
+		if (gw->clients[i].subject &&
+				!strcmp(gw->clients[i].subject,
+					cert->subjectName))
+			return &gw->clients[i];
+	}
+	return NULL;
+}
+
+static int
+client_may_use(gateway_client *client, const char *tokenname,
+	       const char *certname)
+{
+	for (int i = 0; i < client->nkeys; i++) {
+		gateway_key *key = &client->keys[i];
+
+		if (!strcmp(key->tokenname, tokenname) &&
+				(!key->certname ||
+				 !strcmp(key->certname, certname)))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+send_fd(int sd, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char buf[2] = "\0";
+	union {
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	memset(&msg, '\0', sizeof(msg));
+	memset(&control, '\0', sizeof(control));
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.control;
+	msg.msg_controllen = sizeof(control.control);
+
+	struct cmsghdr *cme = CMSG_FIRSTHDR(&msg);
+	cme->cmsg_len = CMSG_LEN(sizeof(int));
+	cme->cmsg_level = SOL_SOCKET;
+	cme->cmsg_type = SCM_RIGHTS;
+	*(int *)CMSG_DATA(cme) = fd;
+
+	return sendmsg(sd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int
+connect_to_daemon(const char *sockpath)
+{
+	struct sockaddr_un addr_un = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(sockpath) >= sizeof(addr_un.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr_un.sun_path, sockpath);
+
+	int sd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	socklen_t len = strlen(addr_un.sun_path) +
+			sizeof(addr_un.sun_family);
+	if (connect(sd, (struct sockaddr *)&addr_un, len) < 0) {
+		save_errno(close(sd));
+		return -1;
+	}
+	return sd;
+}
+
+/* Read until "len" bytes have arrived or pesignd hangs up; returns how
+ * many we got. */
+static ssize_t
+recv_all(int sd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	size_t got = 0;
+
+	while (got < len) {
+		ssize_t n = recv(sd, p + got, len - got, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+/*
+ * Hand one request to pesignd: "infd" (if there is one) is a memfd
+ * standing in for the input file, and the result comes back in another,
+ * which is returned in *outfdp.  "key" is the pesignd_strings at the front
+ * of the request, which are exactly what the daemon expects to be sent,
+ * and after them goes who the request is from, for pesignd's audit log.
+ */
+static int
+forward_request(gateway *gw, uint32_t command, uint8_t *key, uint32_t keylen,
+		const char *requester, int infd, char **errmsg, int *outfdp)
+{
+	uint8_t *payload = NULL;
+	int sd = -1;
+	int outfd = -1;
+	int rc = -1;
+
+	*errmsg = NULL;
+	*outfdp = -1;
+
+	outfd = memfd_create("pesign-gateway-out", MFD_CLOEXEC);
+	if (outfd < 0)
+		goto err;
+
+	sd = connect_to_daemon(gw->sockpath);
+	if (sd < 0)
+		goto err;
+
+	uint32_t reqlen = pesignd_string_size((char *)requester);
+	pesignd_string *req = calloc(1, reqlen);
+	if (!req)
+		goto err;
+	pesignd_string_set(req, (char *)requester);
+
+	pesignd_msghdr pm = {
+		.version = PESIGND_VERSION,
+		.command = command,
+		.size = keylen + reqlen,
+	};
+	if (send(sd, &pm, sizeof(pm), MSG_NOSIGNAL) < 0 ||
+			send(sd, key, keylen, MSG_NOSIGNAL) < 0 ||
+			send(sd, req, reqlen, MSG_NOSIGNAL) < 0) {
+		save_errno(free(req));
+		goto err;
+	}
+	free(req);
+	if (infd >= 0 && send_fd(sd, infd) < 0)
+		goto err;
+	if (send_fd(sd, outfd) < 0)
+		goto err;
+
+	pesignd_msghdr resp_hdr;
+	ssize_t n = recv_all(sd, &resp_hdr, sizeof(resp_hdr));
+	if (n < 0)
+		goto err;
+	if ((size_t)n < sizeof(resp_hdr)) {
+		*errmsg = strdup("pesignd closed the connection");
+		rc = PESIGND_RETRY;
+		goto out;
+	}
+
+	if (resp_hdr.version != PESIGND_VERSION ||
+			resp_hdr.command != CMD_RESPONSE ||
+			resp_hdr.size < sizeof(int32_t) ||
+			resp_hdr.size > GATEWAY_MAX_RESPONSE) {
+		*errmsg = strdup("unexpected response from pesignd");
+		goto out;
+	}
+
+	payload = calloc(1, resp_hdr.size + 1);
+	if (!payload)
+		goto err;
+	n = recv_all(sd, payload, resp_hdr.size);
+	if (n < 0)
+		goto err;
+	if ((size_t)n < resp_hdr.size) {
+		*errmsg = strdup("pesignd closed the connection");
+		rc = PESIGND_RETRY;
+		goto out;
+	}
+
+	pesignd_cmd_response *resp = (pesignd_cmd_response *)payload;
+	rc = resp->rc;
+	if (rc != 0) {
+		*errmsg = strdup(resp_hdr.size > sizeof(resp->rc)
+				 ? (char *)resp->errmsg : "failed");
+		goto out;
+	}
+
+	*outfdp = outfd;
+	outfd = -1;
+	goto out;
+err:
+	if (asprintf(errmsg, "could not forward request to pesignd: %m") < 0)
+		*errmsg = NULL;
+	rc = -1;
+out:
+	xfree(payload);
+	if (sd >= 0)
+		close(sd);
+	if (outfd >= 0)
+		close(outfd);
+	return rc;
+}
+
+/*
+ * The result goes back to the client straight out of the memfd pesignd
+ * wrote it to, a chunk at a time.
+ */
+static int
+send_reply(PRFileDesc *fd, int32_t rc, char *errmsg, int outfd)
+{
+	uint32_t msglen = errmsg ? strlen(errmsg) + 1 : 0;
+	off_t outlen = 0;
+
+	if (outfd >= 0) {
+		struct stat sb;
+
+		if (fstat(outfd, &sb) < 0)
+			return -1;
+		outlen = sb.st_size;
+	}
+	if (outlen > GATEWAY_MAX_MESSAGE)
+		return -1;
+
+	pesignd_msghdr pm = {
+		.version = PESIGND_VERSION,
+		.command = CMD_RESPONSE,
+		.size = sizeof(rc) + sizeof(msglen) + msglen + outlen,
+	};
+
+	if (remote_write(fd, &pm, sizeof(pm)) < 0 ||
+			remote_write(fd, &rc, sizeof(rc)) < 0 ||
+			remote_write(fd, &msglen, sizeof(msglen)) < 0 ||
+			remote_write(fd, errmsg, msglen) < 0)
+		return -1;
+
+	uint8_t buf[GATEWAY_CHUNK];
+	for (off_t pos = 0; pos < outlen; ) {
+		ssize_t n = pread(outfd, buf, sizeof(buf), pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if (remote_write(fd, buf, n) < 0)
+			return -1;
+		pos += n;
+	}
+	return 0;
+}
+
+/*
+ * Read the pesignd_strings at the front of a request one at a time, so we
+ * know where they end without reading the binary behind them.  They're
+ * names and at most a digest, so anything big is malformed.
+ */
+static int
+read_key(PRFileDesc *fd, uint32_t size, int nstrings, uint8_t **keyp,
+	 uint32_t *keylenp)
+{
+	uint8_t *key = NULL;
+	uint32_t keylen = 0;
+
+	for (int i = 0; i < nstrings; i++) {
+		uint32_t len;
+
+		if (size - keylen < sizeof(len) ||
+				remote_read(fd, &len, sizeof(len)) < 0)
+			goto err;
+		/* in 64 bits, so none of this can wrap */
+		uint64_t total = (uint64_t)keylen + sizeof(len) + len;
+		if (total > size || total > GATEWAY_MAX_KEY)
+			goto err;
+
+		uint8_t *new_key = realloc(key, keylen + sizeof(len) + len);
+		if (!new_key)
+			goto err;
+		key = new_key;
+
+		uint8_t *value = key + keylen + sizeof(len);
+		memcpy(key + keylen, &len, sizeof(len));
+		if (remote_read(fd, value, len) < 0)
+			goto err;
+
+		/* the names have to be terminated; the digest doesn't */
+		if (i < 3 && (len == 0 || value[len - 1] != '\0'))
+			goto err;
+		keylen += sizeof(len) + len;
+	}
+
+	*keyp = key;
+	*keylenp = keylen;
+	return 0;
+err:
+	xfree(key);
+	return -1;
+}
+
+/* Copy the binary behind the key into a memfd for pesignd to read. */
+static int
+read_image(PRFileDesc *fd, int infd, uint32_t len)
+{
+	uint8_t buf[GATEWAY_CHUNK];
+
+	while (len) {
+		uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (remote_read(fd, buf, n) < 0 || write_all(infd, buf, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return lseek(infd, 0, SEEK_SET) < 0 ? -1 : 0;
+}
+
+static int
+handle_request(connection *conn, pesignd_msghdr *pm)
+{
+	PRFileDesc *fd = conn->fd;
+	uint8_t *key = NULL;
+	char *errmsg = NULL;
+	uint32_t keylen = 0;
+	int infd = -1;
+	int outfd = -1;
+	int ret = -1;
+	int32_t rc;
+
+	if (pm->version != PESIGND_VERSION) {
+		syslog(LOG_WARNING, "%s: got version %x, expected %x",
+			conn->peer, pm->version, PESIGND_VERSION);
+		return -1;
+	}
+
+	if (pm->command != CMD_SIGN_ATTACHED &&
+			pm->command != CMD_SIGN_DETACHED &&
+			pm->command != CMD_SIGN_DIGEST) {
+		syslog(LOG_WARNING, "%s: got unexpected command 0x%x",
+			conn->peer, pm->command);
+		return -1;
+	}
+
+	if (pm->size > GATEWAY_MAX_MESSAGE) {
+		syslog(LOG_WARNING, "%s: request of %u bytes is too big",
+			conn->peer, pm->size);
+		send_reply(fd, -1, "request is too big", -1);
+		return -1;
+	}
+
+	int nstrings = pm->command == CMD_SIGN_DIGEST ? 4 : 2;
+	if (read_key(fd, pm->size, nstrings, &key, &keylen) < 0 ||
+			(pm->command == CMD_SIGN_DIGEST &&
+			 keylen != pm->size)) {
+		syslog(LOG_WARNING, "%s: malformed request", conn->peer);
+		goto out;
+	}
+
+	if (pm->command != CMD_SIGN_DIGEST) {
+		infd = memfd_create("pesign-gateway-in", MFD_CLOEXEC);
+		if (infd < 0) {
+			syslog(LOG_ERR, "could not create memfd: %m");
+			goto out;
+		}
+		if (read_image(fd, infd, pm->size - keylen) < 0) {
+			syslog(LOG_WARNING, "%s: could not read request: %s",
+				conn->peer,
+				PORT_ErrorToString(PORT_GetError()));
+			goto out;
+		}
+	}
+
+	pesignd_string *tn = (pesignd_string *)key;
+	pesignd_string *cn = pesignd_string_next(tn);
+
+	if (!client_may_use(conn->client, (char *)tn->value,
+			    (char *)cn->value)) {
+		rc = -1;
+		if (asprintf(&errmsg, "not authorized to sign with "
+			     "\"%s:%s\"", tn->value, cn->value) < 0)
+			errmsg = NULL;
+	} else {
+		rc = forward_request(conn->gw, pm->command, key, keylen,
+				     conn->peer, infd, &errmsg, &outfd);
+	}
+
+	syslog(LOG_NOTICE, "%s: %s request for \"%s:%s\" (%u bytes): %s",
+		conn->peer,
+		pm->command == CMD_SIGN_DIGEST ? "digest" :
+		pm->command == CMD_SIGN_ATTACHED ? "attached" : "detached",
+		tn->value, cn->value, pm->size - keylen,
+		rc == 0 ? "signed" : errmsg ? errmsg : "failed");
+
+	ret = send_reply(fd, rc, errmsg, outfd);
+	if (ret < 0)
+		syslog(LOG_WARNING, "%s: could not send reply: %s",
+			conn->peer, PORT_ErrorToString(PORT_GetError()));
+out:
+	if (infd >= 0)
+		close(infd);
+	if (outfd >= 0)
+		close(outfd);
+	xfree(key);
+	xfree(errmsg);
+	return ret;
+}
+
+static void *
+serve_connection(void *data)
+{
+	connection *conn = data;
+	PRFileDesc *fd = conn->fd;
+
+	SECStatus status = SSL_ForceHandshakeWithTimeout(fd,
+				PR_SecondsToInterval(GATEWAY_TIMEOUT));
+	if (status != SECSuccess) {
+		syslog(LOG_WARNING, "TLS handshake failed: %s",
+			PORT_ErrorToString(PORT_GetError()));
+		goto out;
+	}
+
+	CERTCertificate *peer = SSL_PeerCertificate(fd);
+	if (!peer) {
+		syslog(LOG_WARNING, "client did not present a certificate");
+		goto out;
+	}
+	conn->client = find_client(conn->gw, peer);
+	conn->peer = strdup(peer->subjectName);
+	CERT_DestroyCertificate(peer);
+	if (!conn->peer) {
+		syslog(LOG_ERR, "could not allocate memory: %m");
+		goto out;
+	}
+	if (!conn->client) {
+		syslog(LOG_WARNING, "%s: not an allowed client", conn->peer);
+		goto out;
+	}
+
+	while (1) {
+		pesignd_msghdr pm;
+
+		if (remote_read(fd, &pm, sizeof(pm)) < 0) {
+			if (PORT_GetError() != PR_END_OF_FILE_ERROR)
+				syslog(LOG_WARNING, "%s: %s", conn->peer,
+					PORT_ErrorToString(PORT_GetError()));
+			break;
+		}
+		if (handle_request(conn, &pm) < 0)
+			break;
+	}
+out:
+	PR_Close(fd);
+	__atomic_sub_fetch(&conn->gw->connections, 1, __ATOMIC_RELAXED);
+	xfree(conn->peer);
+	free(conn);
+	return NULL;
+}
+
+static PRFileDesc *
+set_up_model(char *certname, secuPWData *pwdata)
+{
+	CERTCertificate *cert = PK11_FindCertFromNickname(certname, pwdata);
+	if (!cert)
+		errx(1, "could not find certificate \"%s\": %s", certname,
+			PORT_ErrorToString(PORT_GetError()));
+
+	SECKEYPrivateKey *key = PK11_FindKeyByAnyCert(cert, pwdata);
+	if (!key)
+		errx(1, "could not find private key for \"%s\": %s", certname,
+			PORT_ErrorToString(PORT_GetError()));
+
+	PRFileDesc *model = SSL_ImportFD(NULL, PR_NewTCPSocket());
+	if (!model)
+		errx(1, "could not set up TLS: %s",
+			PORT_ErrorToString(PORT_GetError()));
+
+	SSLVersionRange range = {
+		.min = SSL_LIBRARY_VERSION_TLS_1_2,
+		.max = SSL_LIBRARY_VERSION_TLS_1_3,
+	};
+
+	/* the default certificate hook checks the client's certificate
+	 * chain against the trust in our database */
+	if (SSL_OptionSet(model, SSL_SECURITY, PR_TRUE) != SECSuccess ||
+	    SSL_OptionSet(model, SSL_HANDSHAKE_AS_SERVER,
+			  PR_TRUE) != SECSuccess ||
+	    SSL_OptionSet(model, SSL_REQUEST_CERTIFICATE,
+			  PR_TRUE) != SECSuccess ||
+	    SSL_OptionSet(model, SSL_REQUIRE_CERTIFICATE,
+			  SSL_REQUIRE_ALWAYS) != SECSuccess ||
+	    SSL_VersionRangeSet(model, &range) != SECSuccess ||
+	    SSL_ConfigServerCert(model, cert, key, NULL, 0) != SECSuccess)
+		errx(1, "could not set up TLS: %s",
+			PORT_ErrorToString(PORT_GetError()));
+
+	SECKEY_DestroyPrivateKey(key);
+	CERT_DestroyCertificate(cert);
+	return model;
+}
+
+static PRFileDesc *
+set_up_listener(char *listen_addr)
+{
+	char *host = NULL;
+	PRUint16 port = 0;
+	PRNetAddr addr;
+
+	if (remote_parse_address(listen_addr, &host, &port) < 0)
+		errx(1, "invalid listen address \"%s\"", listen_addr);
+
+	if (host) {
+		if (PR_StringToNetAddr(host, &addr) != PR_SUCCESS)
+			errx(1, "invalid listen address \"%s\"", host);
+		PR_SetNetAddr(PR_IpAddrNull, PR_NetAddrFamily(&addr), port,
+			      &addr);
+		free(host);
+	} else {
+		PR_SetNetAddr(PR_IpAddrAny, PR_AF_INET6, port, &addr);
+	}
+
+	PRFileDesc *sd = PR_OpenTCPSocket(PR_NetAddrFamily(&addr));
+	if (!sd)
+		errx(1, "could not create socket: %s",
+			PORT_ErrorToString(PORT_GetError()));
+
+	PRSocketOptionData opt = {
+		.option = PR_SockOpt_Reuseaddr,
+		.value.reuse_addr = PR_TRUE,
+	};
+	PR_SetSocketOption(sd, &opt);
+
+	if (PR_Bind(sd, &addr) != PR_SUCCESS)
+		errx(1, "could not bind to \"%s\": %s", listen_addr,
+			PORT_ErrorToString(PORT_GetError()));
+	if (PR_Listen(sd, 16) != PR_SUCCESS)
+		errx(1, "could not listen on \"%s\": %s", listen_addr,
+			PORT_ErrorToString(PORT_GetError()));
+	return sd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rc;
+	char *listen_addr = NULL;
+	char *certdir = GATEWAY_CERTDIR;
+	char *certname = NULL;
+	char *pinfile = NULL;
+	char *clients = GATEWAY_CLIENTS;
+	gateway gw = {
+		.sockpath = SOCKPATH,
+		.max_connections = 32,
+	};
+
+	poptContext optCon;
+	struct poptOption options[] = {
+		{.argInfo = POPT_ARG_INTL_DOMAIN,
+		 .arg = "pesign" },
+		{.longName = "listen",
+		 .shortName = 'l',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &listen_addr,
+		 .descrip = "address and port to listen on",
+		 .argDescrip = "[<address>:]<port>" },
+		{.longName = "certdir",
+		 .shortName = 'n',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &certdir,
+		 .descrip = "NSS database with our certificate and the CAs "
+			    "we accept clients from",
+		 .argDescrip = "<directory>" },
+		{.longName = "certificate",
+		 .shortName = 'c',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &certname,
+		 .descrip = "our TLS certificate's nickname",
+		 .argDescrip = "<nickname>" },
+		{.longName = "pinfile",
+		 .shortName = 'F',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &pinfile,
+		 .descrip = "read named file for pin information",
+		 .argDescrip = "<pin file name>" },
+		{.longName = "clients",
+		 .shortName = 'C',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &clients,
+		 .descrip = "which clients may sign with which keys",
+		 .argDescrip = "<file>" },
+		{.longName = "socket",
+		 .shortName = 'S',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &gw.sockpath,
+		 .descrip = "pesignd socket to forward requests to",
+		 .argDescrip = "<socket>" },
+		{.longName = "max-connections",
+		 .shortName = 'm',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &gw.max_connections,
+		 .descrip = "most clients to serve at once",
+		 .argDescrip = "<count>" },
+		POPT_AUTOALIAS
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+
+	optCon = poptGetContext("pesign", argc, (const char **)argv, options,0);
+
+	rc = poptReadDefaultConfig(optCon, 0);
+	if (rc < 0 && !(rc == POPT_ERROR_ERRNO && errno == ENOENT)) {
+		fprintf(stderr,
+			"pesign-gateway: poptReadDefaultConfig failed: %s\n",
+			poptStrerror(rc));
+		exit(1);
+	}
+
+	while ((rc = poptGetNextOpt(optCon)) > 0)
+		;
+
+	if (rc < -1) {
+		fprintf(stderr, "pesign-gateway: Invalid argument: %s: %s\n",
+			poptBadOption(optCon, 0), poptStrerror(rc));
+		exit(1);
+	}
+
+	if (poptPeekArg(optCon)) {
+		fprintf(stderr, "pesign-gateway: Invalid Argument: \"%s\"\n",
+			poptPeekArg(optCon));
+		exit(1);
+	}
+
+	if (!listen_addr) {
+		fprintf(stderr, "pesign-gateway: no listen address specified\n");
+		exit(1);
+	}
+
+	if (!certname) {
+		fprintf(stderr, "pesign-gateway: no certificate specified\n");
+		exit(1);
+	}
+
+	if (gw.max_connections < 1) {
+		fprintf(stderr, "pesign-gateway: invalid connection limit\n");
+		exit(1);
+	}
+
+	poptFreeContext(optCon);
+
+	read_clients(&gw, clients);
+
+	SECStatus status = NSS_Init(certdir);
+	if (status != SECSuccess)
+		errx(1, "could not open NSS database \"%s\": %s", certdir,
+			PORT_ErrorToString(PORT_GetError()));
+
+	if (NSS_SetDomesticPolicy() != SECSuccess ||
+	    SSL_ConfigServerSessionIDCache(0, 0, 0, NULL) != SECSuccess)
+		errx(1, "could not set up TLS: %s",
+			PORT_ErrorToString(PORT_GetError()));
+
+	secuPWData pwdata = {
+		.source = pinfile ? PW_FROMFILE : PW_NONE,
+		.data = pinfile,
+	};
+	PK11_SetPasswordFunc(SECU_GetModulePassword);
+
+	PRFileDesc *model = set_up_model(certname, &pwdata);
+	PRFileDesc *listener = set_up_listener(listen_addr);
+
+	openlog("pesign-gateway", LOG_PID, LOG_DAEMON);
+	syslog(LOG_NOTICE, "listening on %s, forwarding to %s", listen_addr,
+		gw.sockpath);
+
+	/* a client hanging up mid-reply shouldn't take everybody with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (1) {
+		PRNetAddr peer;
+		PRFileDesc *fd = PR_Accept(listener, &peer,
+					   PR_INTERVAL_NO_TIMEOUT);
+		if (!fd) {
+			if (PORT_GetError() == PR_PENDING_INTERRUPT_ERROR)
+				break;
+			syslog(LOG_WARNING, "accept failed: %s",
+				PORT_ErrorToString(PORT_GetError()));
+			continue;
+		}
+
+		if (__atomic_add_fetch(&gw.connections, 1,
+				       __ATOMIC_RELAXED) > gw.max_connections) {
+			__atomic_sub_fetch(&gw.connections, 1,
+					   __ATOMIC_RELAXED);
+			syslog(LOG_WARNING, "too many connections; "
+				"dropping one");
+			PR_Close(fd);
+			continue;
+		}
+
+		connection *conn = calloc(1, sizeof (*conn));
+		PRFileDesc *sslfd = conn ? SSL_ImportFD(model, fd) : NULL;
+		if (!sslfd) {
+			syslog(LOG_ERR, "could not set up connection: %s",
+				PORT_ErrorToString(PORT_GetError()));
+			free(conn);
+			PR_Close(fd);
+			__atomic_sub_fetch(&gw.connections, 1,
+					   __ATOMIC_RELAXED);
+			continue;
+		}
+		SSL_ResetHandshake(sslfd, PR_TRUE);
+
+		conn->gw = &gw;
+		conn->fd = sslfd;
+
+		pthread_t thread;
+		rc = pthread_create(&thread, &attr, serve_connection, conn);
+		if (rc != 0) {
+			syslog(LOG_ERR, "could not start thread: %s",
+				strerror(rc));
+			PR_Close(sslfd);
+			free(conn);
+			__atomic_sub_fetch(&gw.connections, 1,
+					   __ATOMIC_RELAXED);
+		}
+	}
+
+	PR_Close(listener);
+	PR_Close(model);
+	NSS_Shutdown();
+	return 0;
+}
@@ -0,0 +1,873 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "ingest.h"
+
+/* smallest buffer worth keeping around */
+#define INGEST_MIN_BUFFER	(64 * 1024)
+
+static int
+map_fd(ingest_buffer *buf, int fd, size_t size)
+{
+	/* this one's too big to be worth pooling anyway */
+	free(buf->data);
+	buf->alloc = 0;
+
+	buf->mapped = 1;
+	buf->size = size;
+	buf->data = NULL;
+	if (size == 0)
+		return 0;
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		buf->mapped = 0;
+		buf->size = 0;
+		return -1;
+	}
+	buf->data = map;
+	return 0;
+}
+
+static void
+unmap_buffer(ingest_buffer *buf)
+{
+	if (!buf->mapped)
+		return;
+	if (buf->data)
+		munmap(buf->data, buf->size);
+	buf->data = NULL;
+	buf->mapped = 0;
+}
+
+/*
+ * Make sure the buffer can hold the whole file; we keep whatever we had
+ * if it's already big enough, which is the point of having a pool.
+ */
+static int
+grow_buffer(ingest_buffer *buf, size_t size)
+{
+	if (size <= buf->alloc)
+		return 0;
+
+	size_t alloc = buf->alloc ? buf->alloc : INGEST_MIN_BUFFER;
+	while (alloc < size)
+		alloc *= 2;
+
+	/* nothing in there we need to keep */
+	free(buf->data);
+	buf->data = malloc(alloc);
+	if (!buf->data) {
+		buf->alloc = 0;
+		return -1;
+	}
+	buf->alloc = alloc;
+	return 0;
+}
+
+/*
+ * One file, the way the thread pool and INGEST_MMAP do it.
+ */
+static void
+read_whole_file(ingest_buffer *buf, int use_mmap)
+{
+	struct stat sb;
+
+	buf->error = 0;
+	buf->size = 0;
+
+	int fd = open(buf->path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		buf->error = errno;
+		return;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		buf->error = errno;
+		goto out;
+	}
+
+	if (use_mmap || sb.st_size > INGEST_MAX_BUFFER) {
+		if (map_fd(buf, fd, sb.st_size) < 0)
+			buf->error = errno;
+		goto out;
+	}
+
+	if (grow_buffer(buf, sb.st_size) < 0) {
+		buf->error = errno;
+		goto out;
+	}
+
+	while (buf->size < (size_t)sb.st_size) {
+		ssize_t n = pread(fd, buf->data + buf->size,
+				  sb.st_size - buf->size, buf->size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			buf->error = errno;
+			break;
+		}
+		/* it got shorter while we were reading it */
+		if (n == 0)
+			break;
+		buf->size += n;
+	}
+out:
+	close(fd);
+}
+
+static ingest_buffer *
+take_free(ingest *ing)
+{
+	ingest_buffer *buf = ing->free;
+
+	if (buf) {
+		ing->free = buf->next;
+		buf->next = NULL;
+		buf->index = ing->next_path;
+		buf->path = ing->paths[ing->next_path++];
+		buf->error = 0;
+		buf->size = 0;
+	}
+	return buf;
+}
+
+static ingest_buffer *
+take_done(ingest *ing)
+{
+	for (ingest_buffer **bufp = &ing->done; *bufp; bufp = &(*bufp)->next) {
+		ingest_buffer *buf = *bufp;
+
+		if (buf->index != ing->next_out)
+			continue;
+		*bufp = buf->next;
+		buf->next = NULL;
+		ing->next_out++;
+		if (!buf->error) {
+			ing->files++;
+			ing->bytes += buf->size;
+		}
+		return buf;
+	}
+	return NULL;
+}
+
+static void
+put_done(ingest *ing, ingest_buffer *buf)
+{
+	buf->state = INGEST_DONE;
+	buf->next = ing->done;
+	ing->done = buf;
+}
+
+/*
+ * The pread() pool.
+ */
+static void *
+ingest_worker(void *arg)
+{
+	ingest *ing = arg;
+
+	pthread_mutex_lock(&ing->lock);
+	while (1) {
+		while (!ing->stopping && ing->next_path < ing->npaths &&
+				!ing->free)
+			pthread_cond_wait(&ing->cond, &ing->lock);
+		if (ing->stopping || ing->next_path >= ing->npaths)
+			break;
+
+		ingest_buffer *buf = take_free(ing);
+		pthread_mutex_unlock(&ing->lock);
+
+		read_whole_file(buf, 0);
+
+		pthread_mutex_lock(&ing->lock);
+		put_done(ing, buf);
+		pthread_cond_broadcast(&ing->cond);
+	}
+	pthread_mutex_unlock(&ing->lock);
+	return NULL;
+}
+
+static int
+start_threads(ingest *ing)
+{
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = nproc < 2 ? 2 : nproc;
+
+	if (nthreads > ing->nbuffers)
+		nthreads = ing->nbuffers;
+
+	ing->threads = calloc(nthreads, sizeof (pthread_t));
+	if (!ing->threads)
+		return -1;
+
+	for (int i = 0; i < nthreads; i++) {
+		int rc = pthread_create(&ing->threads[i], NULL, ingest_worker,
+					ing);
+		if (rc != 0) {
+			errno = rc;
+			if (i == 0)
+				return -1;
+			/* fewer threads is still better than none */
+			break;
+		}
+		ing->nthreads++;
+	}
+	return 0;
+}
+
+/*
+ * io_uring, spoken directly; it's only four opcodes, and that isn't
+ * worth another library dependency.
+ */
+struct ingest_ring {
+	int fd;
+	unsigned entries;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned to_submit;
+	unsigned inflight;
+};
+
+enum {
+	RING_OPEN = 0,
+	RING_STAT = 1,
+	RING_READ = 2,
+	RING_CLOSE = 3,
+	RING_OP_MASK = 3,
+};
+
+static void
+ring_free(struct ingest_ring *ring)
+{
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+static int
+ring_supports(int fd, const int *ops, int nops)
+{
+	size_t size = sizeof (struct io_uring_probe)
+		      + 256 * sizeof (struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int ret = 0;
+
+	if (!probe)
+		return 0;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		    probe, 256) < 0)
+		goto out;
+
+	for (int i = 0; i < nops; i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	}
+	ret = 1;
+out:
+	free(probe);
+	return ret;
+}
+
+static struct ingest_ring *
+ring_setup(unsigned depth)
+{
+	static const int ops[] = {
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+		IORING_OP_CLOSE,
+	};
+	struct io_uring_params p;
+	struct ingest_ring *ring = calloc(1, sizeof (*ring));
+
+	if (!ring)
+		return NULL;
+	ring->fd = -1;
+
+	/* each buffer has at most two things going at once, and there can
+	 * be a close for each of them as well */
+	unsigned entries = 1;
+	while (entries < depth * 3)
+		entries <<= 1;
+
+	memset(&p, '\0', sizeof (p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		goto err;
+	ring->entries = p.sq_entries;
+
+	if (!ring_supports(ring->fd, ops, sizeof (ops) / sizeof (ops[0]))) {
+		errno = ENOSYS;
+		goto err;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	ring->cq_ring_size = p.cq_off.cqes
+			     + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+			     MAP_SHARED|MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ|PROT_WRITE,
+				     MAP_SHARED|MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return ring;
+err:
+	{
+		int errno_save = errno;
+		ring_free(ring);
+		errno = errno_save;
+	}
+	return NULL;
+}
+
+static int
+ring_enter(struct ingest_ring *ring, unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+	while (1) {
+		int rc = syscall(__NR_io_uring_enter, ring->fd,
+				 ring->to_submit, min_complete, flags, NULL, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -1;
+		ring->to_submit -= rc;
+		return 0;
+	}
+}
+
+static struct io_uring_sqe *
+ring_get_sqe(struct ingest_ring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+
+	if (tail - head >= ring->entries) {
+		if (ring_enter(ring, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, '\0', sizeof (*sqe));
+	ring->sq_array[idx] = idx;
+	return sqe;
+}
+
+static void
+ring_queue_sqe(struct ingest_ring *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	ring->inflight++;
+}
+
+static inline uint64_t
+ring_tag(ingest_buffer *buf, int op)
+{
+	return (uint64_t)(uintptr_t)buf | op;
+}
+
+static int
+ring_open(struct ingest_ring *ring, ingest_buffer *buf)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)buf->path;
+	sqe->open_flags = O_RDONLY|O_CLOEXEC;
+	sqe->user_data = ring_tag(buf, RING_OPEN);
+	ring_queue_sqe(ring);
+
+	sqe = ring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)buf->path;
+	sqe->len = STATX_SIZE;
+	sqe->off = (uint64_t)(uintptr_t)buf->stx;
+	sqe->user_data = ring_tag(buf, RING_STAT);
+	ring_queue_sqe(ring);
+
+	buf->state = INGEST_OPENING;
+	buf->fd = -1;
+	buf->pending = 2;
+	buf->done = 0;
+	return 0;
+}
+
+static int
+ring_read(struct ingest_ring *ring, ingest_buffer *buf)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = buf->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(buf->data + buf->done);
+	sqe->len = buf->size - buf->done;
+	sqe->off = buf->done;
+	sqe->user_data = ring_tag(buf, RING_READ);
+	ring_queue_sqe(ring);
+
+	buf->state = INGEST_READING;
+	buf->pending = 1;
+	return 0;
+}
+
+/*
+ * Nobody waits for the close; the buffer can go straight to the consumer.
+ */
+static void
+ring_close(struct ingest_ring *ring, int fd)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+	if (!sqe) {
+		close(fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = ring_tag(NULL, RING_CLOSE);
+	ring_queue_sqe(ring);
+}
+
+static void
+ring_finish_buffer(ingest *ing, ingest_buffer *buf)
+{
+	if (buf->fd >= 0)
+		ring_close(ing->ring, buf->fd);
+	buf->fd = -1;
+	put_done(ing, buf);
+}
+
+/*
+ * Both the open and the statx are back; decide what to do with the file.
+ */
+static void
+ring_opened(ingest *ing, ingest_buffer *buf)
+{
+	if (buf->error) {
+		ring_finish_buffer(ing, buf);
+		return;
+	}
+
+	size_t size = buf->stx->stx_size;
+	if (size > INGEST_MAX_BUFFER) {
+		if (map_fd(buf, buf->fd, size) < 0)
+			buf->error = errno;
+		ring_finish_buffer(ing, buf);
+		return;
+	}
+
+	if (grow_buffer(buf, size) < 0) {
+		buf->error = errno;
+		ring_finish_buffer(ing, buf);
+		return;
+	}
+
+	buf->size = size;
+	if (size == 0 || ring_read(ing->ring, buf) < 0) {
+		if (size != 0)
+			buf->error = errno;
+		ring_finish_buffer(ing, buf);
+	}
+}
+
+static void
+ring_complete(ingest *ing, struct io_uring_cqe *cqe)
+{
+	ingest_buffer *buf = (ingest_buffer *)(uintptr_t)
+				(cqe->user_data & ~(uint64_t)RING_OP_MASK);
+	int op = cqe->user_data & RING_OP_MASK;
+	int res = cqe->res;
+
+	ing->ring->inflight--;
+
+	switch (op) {
+	case RING_OPEN:
+		if (res < 0)
+			buf->error = -res;
+		else
+			buf->fd = res;
+		break;
+	case RING_STAT:
+		if (res < 0 && !buf->error)
+			buf->error = -res;
+		break;
+	case RING_READ:
+		buf->pending--;
+		if (res == -EINTR || res == -EAGAIN) {
+			if (ring_read(ing->ring, buf) < 0) {
+				buf->error = errno;
+				ring_finish_buffer(ing, buf);
+			}
+			return;
+		}
+		if (res < 0) {
+			buf->error = -res;
+		} else if (res == 0) {
+			/* it got shorter while we were reading it */
+			buf->size = buf->done;
+		} else {
+			buf->done += res;
+			if (buf->done < buf->size) {
+				if (ring_read(ing->ring, buf) < 0) {
+					buf->error = errno;
+					ring_finish_buffer(ing, buf);
+				}
+				return;
+			}
+		}
+		ring_finish_buffer(ing, buf);
+		return;
+	case RING_CLOSE:
+	default:
+		return;
+	}
+
+	if (--buf->pending == 0)
+		ring_opened(ing, buf);
+}
+
+static int
+ring_reap(ingest *ing, unsigned wait)
+{
+	struct ingest_ring *ring = ing->ring;
+
+	if ((ring->to_submit || wait) && ring_enter(ring, wait) < 0)
+		return -1;
+
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		ring_complete(ing, &cqe);
+	}
+	return 0;
+}
+
+static ingest_buffer *
+ring_next(ingest *ing)
+{
+	while (1) {
+		ingest_buffer *buf;
+
+		while (ing->next_path < ing->npaths && ing->free) {
+			buf = take_free(ing);
+			if (ring_open(ing->ring, buf) < 0) {
+				buf->error = errno;
+				put_done(ing, buf);
+			}
+		}
+
+		buf = take_done(ing);
+		if (buf)
+			return buf;
+
+		if (ring_reap(ing, 1) < 0) {
+			/* nothing sensible left to do but stop */
+			ing->error = errno ? errno : EIO;
+			return NULL;
+		}
+	}
+}
+
+int
+ingest_start(ingest *ing, char **paths, int npaths, ingest_method method,
+	     int depth)
+{
+	memset(ing, '\0', sizeof (*ing));
+	ing->paths = paths;
+	ing->npaths = npaths;
+
+	if (depth <= 0)
+		depth = INGEST_DEFAULT_DEPTH;
+
+	ing->buffers = calloc(depth, sizeof (ingest_buffer));
+	if (!ing->buffers)
+		return -1;
+	ing->nbuffers = depth;
+
+	for (int i = 0; i < depth; i++) {
+		ingest_buffer *buf = &ing->buffers[i];
+
+		buf->fd = -1;
+		buf->stx = calloc(1, sizeof (struct statx));
+		if (!buf->stx)
+			goto err;
+		buf->next = ing->free;
+		ing->free = buf;
+	}
+
+	if (method == INGEST_AUTO || method == INGEST_URING) {
+		ing->ring = ring_setup(depth);
+		if (ing->ring) {
+			ing->method = INGEST_URING;
+			return 0;
+		}
+		if (method == INGEST_URING)
+			goto err;
+		method = INGEST_THREADS;
+	}
+
+	ing->method = method;
+	if (method == INGEST_MMAP)
+		return 0;
+
+	pthread_mutex_init(&ing->lock, NULL);
+	pthread_cond_init(&ing->cond, NULL);
+	if (start_threads(ing) < 0) {
+		int errno_save = errno;
+		ingest_finish(ing);
+		errno = errno_save;
+		return -1;
+	}
+	return 0;
+err:
+	{
+		int errno_save = errno;
+		for (int i = 0; i < depth; i++)
+			free(ing->buffers[i].stx);
+		free(ing->buffers);
+		ing->buffers = NULL;
+		errno = errno_save;
+	}
+	return -1;
+}
+
+/*
+ * The next file, in the order they were given, or NULL when we've been
+ * through all of them.  Check buf->error before using it.  Don't sit on
+ * every buffer in the pool while asking for another one; nothing else
+ * can finish until you give one back.  If this returns NULL before every
+ * file has been handed back, ing->error says why.
+ */
+ingest_buffer *
+ingest_next(ingest *ing)
+{
+	ingest_buffer *buf = NULL;
+
+	if (ing->next_out >= ing->npaths)
+		return NULL;
+
+	switch (ing->method) {
+	case INGEST_URING:
+		return ring_next(ing);
+	case INGEST_THREADS:
+		pthread_mutex_lock(&ing->lock);
+		while (!(buf = take_done(ing)))
+			pthread_cond_wait(&ing->cond, &ing->lock);
+		pthread_mutex_unlock(&ing->lock);
+		return buf;
+	case INGEST_MMAP:
+	default:
+		buf = take_free(ing);
+		if (!buf) {
+			ing->error = ENOBUFS;
+			return NULL;
+		}
+		read_whole_file(buf, 1);
+		put_done(ing, buf);
+		return take_done(ing);
+	}
+}
+
+void
+ingest_release(ingest *ing, ingest_buffer *buf)
+{
+	unmap_buffer(buf);
+	buf->state = INGEST_FREE;
+
+	if (ing->method == INGEST_THREADS)
+		pthread_mutex_lock(&ing->lock);
+	buf->next = ing->free;
+	ing->free = buf;
+	if (ing->method == INGEST_THREADS) {
+		pthread_cond_broadcast(&ing->cond);
+		pthread_mutex_unlock(&ing->lock);
+	}
+}
+
+void
+ingest_finish(ingest *ing)
+{
+	if (ing->method == INGEST_THREADS) {
+		pthread_mutex_lock(&ing->lock);
+		ing->stopping = 1;
+		pthread_cond_broadcast(&ing->cond);
+		pthread_mutex_unlock(&ing->lock);
+
+		for (int i = 0; i < ing->nthreads; i++)
+			pthread_join(ing->threads[i], NULL);
+		free(ing->threads);
+		ing->threads = NULL;
+		pthread_cond_destroy(&ing->cond);
+		pthread_mutex_destroy(&ing->lock);
+	}
+
+	if (ing->ring) {
+		/* the kernel may still be writing into our buffers */
+		while (ing->ring->inflight) {
+			if (ring_reap(ing, 1) < 0)
+				break;
+		}
+		/* and whatever it opened for us, it's our job to close */
+		for (int i = 0; i < ing->nbuffers; i++) {
+			if (ing->buffers[i].fd >= 0)
+				close(ing->buffers[i].fd);
+		}
+		ring_free(ing->ring);
+		ing->ring = NULL;
+	}
+
+	for (int i = 0; i < ing->nbuffers; i++) {
+		ingest_buffer *buf = &ing->buffers[i];
+
+		if (buf->mapped)
+			unmap_buffer(buf);
+		else
+			free(buf->data);
+		free(buf->stx);
+	}
+	free(ing->buffers);
+	ing->buffers = NULL;
+	ing->nbuffers = 0;
+	ing->free = ing->done = NULL;
+}
+
+const char *
+ingest_method_name(ingest_method method)
+{
+	switch (method) {
+	case INGEST_AUTO:
+		return "auto";
+	case INGEST_URING:
+		return "io_uring";
+	case INGEST_THREADS:
+		return "threads";
+	case INGEST_MMAP:
+		return "mmap";
+	}
+	return "unknown";
+}
+
+int
+ingest_parse_method(const char *name, ingest_method *method)
+{
+	static const ingest_method methods[] = {
+		INGEST_AUTO, INGEST_URING, INGEST_THREADS, INGEST_MMAP,
+	};
+
+	for (unsigned i = 0; i < sizeof (methods) / sizeof (methods[0]); i++) {
+		if (!strcmp(name, ingest_method_name(methods[i]))) {
+			*method = methods[i];
+			return 0;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef INGEST_H
+#define INGEST_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reading lots of small binaries one at a time through pe_begin() spends
+ * most of its time in open/mmap/page fault/munmap rather than hashing.
+ * This reads a list of files ahead of whoever is consuming them, several
+ * at once, into a fixed pool of buffers which get reused as soon as the
+ * consumer is done with each one; pe_memory() then parses them in place.
+ *
+ * Reads go through io_uring when the kernel lets us have one, and through
+ * a few threads doing pread() when it doesn't.  INGEST_MMAP is the old way,
+ * one file at a time, and is there to compare against.  Files bigger than
+ * INGEST_MAX_BUFFER are always mapped, since copying them buys nothing.
+ *
+ * Buffers come back from ingest_next() in the order the files were given,
+ * whatever order the reads finish in.
+ */
+typedef enum {
+	INGEST_AUTO,
+	INGEST_URING,
+	INGEST_THREADS,
+	INGEST_MMAP,
+} ingest_method;
+
+#define INGEST_MAX_BUFFER	(64 * 1024 * 1024)
+#define INGEST_DEFAULT_DEPTH	32
+
+typedef enum {
+	INGEST_FREE,
+	INGEST_OPENING,
+	INGEST_READING,
+	INGEST_DONE,
+} ingest_state;
+
+typedef struct ingest_buffer {
+	struct ingest_buffer *next;
+	int index;			/* which of the paths this is */
+	const char *path;
+	int error;			/* an errno, or 0 */
+	char *data;
+	size_t size;
+	size_t alloc;
+	int mapped;			/* data is an mmap of the file */
+
+	/* io_uring bookkeeping */
+	ingest_state state;
+	int fd;
+	int pending;
+	size_t done;
+	struct statx *stx;
+} ingest_buffer;
+
+struct ingest_ring;
+
+typedef struct {
+	ingest_method method;
+	char **paths;
+	int npaths;
+	int next_path;			/* next one to start reading */
+	int next_out;			/* next one to hand back */
+	int error;			/* why ingest_next() gave up early */
+
+	ingest_buffer *buffers;
+	int nbuffers;
+	ingest_buffer *free;
+	ingest_buffer *done;
+
+	/* INGEST_THREADS */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	int stopping;
+
+	/* INGEST_URING */
+	struct ingest_ring *ring;
+
+	uint64_t bytes;
+	uint64_t files;
+} ingest;
+
+extern int ingest_start(ingest *ing, char **paths, int npaths,
+			ingest_method method, int depth);
+extern ingest_buffer *ingest_next(ingest *ing);
+extern void ingest_release(ingest *ing, ingest_buffer *buf);
+extern void ingest_finish(ingest *ing);
+extern const char *ingest_method_name(ingest_method method);
+extern int ingest_parse_method(const char *name, ingest_method *method);
+
+#endif /* INGEST_H */
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+/*
+ * How much does the ingest code buy us?  This digests every file it's given
+ * the old way (pe_begin() with PE_C_READ_MMAP, one file at a time), and then
+ * again through each ingest method, and says how long each took.  It also
+ * checks that every method got the same digest for every file.
+ *
+ * It isn't built by default; "make ingest_bench" in src/.  Point it at a
+ * large pile of small binaries, and remember the page cache: either drop
+ * it between runs or use --rounds and throw the first one away.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <popt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pesign.h"
+
+#include <nss.h>
+#include <prerror.h>
+
+typedef struct {
+	cms_context *cms;
+	char **paths;
+	int npaths;
+	uint8_t *digests;		/* what the first run got */
+	size_t digest_size;
+	int mismatches;
+} bench;
+
+static int
+digest_pe(bench *b, int index, Pe *pe, int first)
+{
+	cms_context *cms = b->cms;
+
+	if (generate_digest(cms, pe, 1) < 0)
+		return -1;
+
+	SECItem *digest = cms->digests[cms->selected_digest].pe_digest;
+	uint8_t *saved = b->digests + index * b->digest_size;
+	if (first) {
+		memcpy(saved, digest->data, b->digest_size);
+	} else if (memcmp(saved, digest->data, b->digest_size)) {
+		warnx("\"%s\": digest differs from the first run",
+		      b->paths[index]);
+		b->mismatches++;
+	}
+	return 0;
+}
+
+static int
+run_mmap(bench *b, int first)
+{
+	int ok = 0;
+
+	for (int i = 0; i < b->npaths; i++) {
+		int fd = open(b->paths[i], O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			warn("\"%s\"", b->paths[i]);
+			continue;
+		}
+		Pe *pe = pe_begin(fd, PE_C_READ_MMAP, NULL);
+		if (pe) {
+			if (digest_pe(b, i, pe, first) >= 0)
+				ok++;
+			pe_end(pe);
+		}
+		close(fd);
+	}
+	return ok;
+}
+
+static int
+run_ingest(bench *b, ingest_method method, int depth)
+{
+	ingest ing;
+	ingest_buffer *buf;
+	int ok = 0;
+
+	if (ingest_start(&ing, b->paths, b->npaths, method, depth) < 0) {
+		warn("could not start %s reader", ingest_method_name(method));
+		return -1;
+	}
+
+	while ((buf = ingest_next(&ing))) {
+		if (!buf->error) {
+			Pe *pe = pe_memory(buf->data, buf->size);
+			if (pe) {
+				if (digest_pe(b, buf->index, pe, 0) >= 0)
+					ok++;
+				pe_end(pe);
+			}
+		}
+		ingest_release(&ing, buf);
+	}
+	ingest_finish(&ing);
+	return ok;
+}
+
+static double
+elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec)
+	       + (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int depth = INGEST_DEFAULT_DEPTH;
+	int rounds = 1;
+	char *digest_name = "sha256";
+	bench b;
+	int rc;
+
+	memset(&b, '\0', sizeof (b));
+
+	poptContext optCon;
+	struct poptOption options[] = {
+		{.argInfo = POPT_ARG_INTL_DOMAIN,
+		 .arg = "pesign" },
+		{.longName = "read-ahead",
+		 .shortName = 'a',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &depth,
+		 .descrip = "how many files to read ahead",
+		 .argDescrip = "<count>" },
+		{.longName = "rounds",
+		 .shortName = 'r',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &rounds,
+		 .descrip = "how many times to run each method",
+		 .argDescrip = "<count>" },
+		{.longName = "digest-type",
+		 .shortName = 'd',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &digest_name,
+		 .descrip = "digest type to use",
+		 .argDescrip = "<digest>" },
+		POPT_AUTOALIAS
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+
+	optCon = poptGetContext("ingest_bench", argc, (const char **)argv,
+				options, 0);
+	while ((rc = poptGetNextOpt(optCon)) > 0)
+		;
+	if (rc < -1)
+		errx(1, "invalid argument: %s: %s",
+		     poptBadOption(optCon, 0), poptStrerror(rc));
+
+	while (poptPeekArg(optCon)) {
+		char **paths = realloc(b.paths,
+				       sizeof (char *) * (b.npaths + 1));
+		if (!paths)
+			err(1, "could not allocate memory");
+		b.paths = paths;
+		b.paths[b.npaths] = strdup(poptGetArg(optCon));
+		if (!b.paths[b.npaths])
+			err(1, "could not allocate memory");
+		b.npaths++;
+	}
+	poptFreeContext(optCon);
+
+	if (!b.npaths)
+		errx(1, "no input files");
+	if (depth < 1 || rounds < 1)
+		errx(1, "--read-ahead and --rounds have to be at least 1");
+
+	SECStatus status = NSS_NoDB_Init(NULL);
+	if (status != SECSuccess)
+		errx(1, "could not initialize nss: %s",
+		     PORT_ErrorToString(PORT_GetError()));
+
+	if (cms_context_alloc(&b.cms) < 0)
+		err(1, "could not allocate cms context");
+	if (set_digest_parameters(b.cms, digest_name) < 0)
+		errx(1, "unknown digest type \"%s\"", digest_name);
+
+	b.digest_size = digest_get_digest_size(b.cms);
+	b.digests = calloc(b.npaths, b.digest_size);
+	if (!b.digests)
+		err(1, "could not allocate memory");
+
+	static const ingest_method methods[] = {
+		INGEST_MMAP, INGEST_THREADS, INGEST_URING,
+	};
+
+	printf("%-10s %8s %12s %10s %10s %10s\n", "method", "files",
+	       "bytes", "seconds", "files/s", "MiB/s");
+
+	for (unsigned m = 0; m < sizeof (methods) / sizeof (methods[0]); m++) {
+		for (int round = 0; round < rounds; round++) {
+			struct timespec start;
+			uint64_t bytes = 0;
+			int ok;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (methods[m] == INGEST_MMAP) {
+				/* the way everything worked before, rather
+				 * than the ingest code's own mmap mode */
+				ok = run_mmap(&b, round == 0);
+			} else {
+				ok = run_ingest(&b, methods[m], depth);
+			}
+			double secs = elapsed(&start);
+			if (ok < 0)
+				break;
+
+			for (int i = 0; i < b.npaths; i++) {
+				struct stat sb;
+				if (stat(b.paths[i], &sb) == 0)
+					bytes += sb.st_size;
+			}
+
+			printf("%-10s %8d %12llu %10.3f %10.0f %10.1f\n",
+			       ingest_method_name(methods[m]), ok,
+			       (unsigned long long)bytes, secs, ok / secs,
+			       bytes / secs / (1024 * 1024));
+		}
+	}
+
+	for (int i = 0; i < b.npaths; i++)
+		free(b.paths[i]);
+	free(b.paths);
+	free(b.digests);
+	cms_context_fini(b.cms);
+	NSS_Shutdown();
+
+	return b.mismatches != 0;
+}
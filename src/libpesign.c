@@ -0,0 +1,753 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nss.h>
+#include <prerror.h>
+#include <pk11pub.h>
+
+#include "pesigcheck.h"
+#include "siglist.h"
+
+#include <libpesign/libpesign.h>
+
+/*
+ * The things pesign, pesigcheck and efisiglist do, for programs that would
+ * otherwise run them thousands of times, and for pesigcheck and efisiglist
+ * themselves.  NSS is set up once per libpesign
+ * handle and the OIDs we need are registered once per process; after that
+ * an image costs a parse and a digest, and a signer is looked up once and
+ * used for as many images as you like.
+ *
+ * A libpesign handle may be shared between threads once its databases are
+ * loaded.  Images and signers may each be used by one thread at a time.
+ */
+struct libpesign {
+	NSSInitContext *nss;
+	pthread_mutex_t lock;
+
+	/* only db and dbx are used; images bring their own cms_ctx */
+	pesigcheck_context *dbs;
+};
+
+struct libpesign_image {
+	libpesign *lib;
+	Pe *pe;
+	cms_context *cms;
+};
+
+struct libpesign_signer {
+	libpesign *lib;
+	cms_context *cms;
+	char *pin;
+};
+
+struct libpesign_esl {
+	signature_list *sl;
+};
+
+static __thread char last_error[1024];
+
+static void
+set_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(last_error, sizeof (last_error), fmt, ap);
+	va_end(ap);
+}
+
+static int
+lib_log(cms_context *cms __attribute__((__unused__)), int priority,
+	char *fmt, ...)
+{
+	va_list ap;
+	int rc = 0;
+
+	if (LOG_PRI(priority) > LOG_ERR)
+		return 0;
+
+	va_start(ap, fmt);
+	rc = vsnprintf(last_error, sizeof (last_error), fmt, ap);
+	va_end(ap);
+	return rc;
+}
+
+const char *
+libpesign_error(void)
+{
+	return last_error[0] ? last_error : NULL;
+}
+
+static int
+new_cms(cms_context **cmsp)
+{
+	if (cms_context_alloc(cmsp) < 0) {
+		set_error("could not allocate cms context: %m");
+		return -1;
+	}
+	(*cmsp)->log = lib_log;
+	return 0;
+}
+
+static pthread_once_t oids_once = PTHREAD_ONCE_INIT;
+static SECStatus oids_status = SECFailure;
+
+static void
+register_oids_once(void)
+{
+	cms_context *cms = NULL;
+
+	if (new_cms(&cms) < 0)
+		return;
+	oids_status = register_oids(cms);
+	cms_context_fini(cms);
+}
+
+libpesign *
+libpesign_new(const char *certdir)
+{
+	libpesign *lib = calloc(1, sizeof (*lib));
+	if (!lib) {
+		set_error("could not allocate memory: %m");
+		return NULL;
+	}
+	pthread_mutex_init(&lib->lock, NULL);
+
+	/* NSS_InitContext() is reference counted, so this coexists with
+	 * whatever else in the process is using NSS */
+	PRUint32 flags = NSS_INIT_READONLY;
+	if (!certdir)
+		flags |= NSS_INIT_NOCERTDB | NSS_INIT_NOMODDB |
+			 NSS_INIT_FORCEOPEN | NSS_INIT_NOROOTINIT;
+	lib->nss = NSS_InitContext(certdir ? certdir : "", "", "", "",
+				   NULL, flags);
+	if (!lib->nss) {
+		set_error("could not initialize nss: %s",
+			  PORT_ErrorToString(PORT_GetError()));
+		goto err;
+	}
+
+	pthread_once(&oids_once, register_oids_once);
+	if (oids_status != SECSuccess) {
+		set_error("could not register OIDs");
+		goto err;
+	}
+
+	if (pesigcheck_context_new(&lib->dbs) < 0) {
+		set_error("could not allocate database context: %m");
+		goto err;
+	}
+	lib->dbs->cms_ctx->log = lib_log;
+
+	return lib;
+err:
+	libpesign_free(lib);
+	return NULL;
+}
+
+void
+libpesign_free(libpesign *lib)
+{
+	if (!lib)
+		return;
+
+	if (lib->dbs)
+		pesigcheck_context_free(lib->dbs);
+	if (lib->nss)
+		NSS_ShutdownContext(lib->nss);
+	pthread_mutex_destroy(&lib->lock);
+	free(lib);
+}
+
+static int
+add_db(libpesign *lib, const char *path,
+       int (*add)(pesigcheck_context *, const char *))
+{
+	pthread_mutex_lock(&lib->lock);
+	int rc = add(lib->dbs, path);
+	pthread_mutex_unlock(&lib->lock);
+	if (rc < 0)
+		set_error("could not load \"%s\": %m", path);
+	return rc;
+}
+
+int
+libpesign_add_db(libpesign *lib, const char *path)
+{
+	return add_db(lib, path, add_cert_db);
+}
+
+int
+libpesign_add_dbx(libpesign *lib, const char *path)
+{
+	return add_db(lib, path, add_cert_dbx);
+}
+
+int
+libpesign_add_cert(libpesign *lib, const char *path)
+{
+	return add_db(lib, path, add_cert_file);
+}
+
+int
+libpesign_add_system_dbs(libpesign *lib)
+{
+	const char *path = NULL;
+
+	pthread_mutex_lock(&lib->lock);
+	int rc = add_system_dbs(lib->dbs, &path);
+	pthread_mutex_unlock(&lib->lock);
+	if (rc < 0)
+		set_error("could not load \"%s\": %m", path);
+	return rc;
+}
+
+int
+libpesign_add_catalog(libpesign *lib, const char *path)
+{
+	char *data = NULL;
+	size_t len = 0;
+	int rc = -1;
+
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || read_file(fd, &data, &len) < 0) {
+		set_error("could not read \"%s\": %m", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+
+	pthread_mutex_lock(&lib->lock);
+	pesigcheck_context *dbs = lib->dbs;
+	if (check_catalog(dbs, data, len) < 0) {
+		set_error("\"%s\" is not signed by anything in db, or is "
+			  "forbidden by dbx", path);
+		rc = 1;
+		goto out;
+	}
+
+	SECItem der = {
+		.type = siBuffer,
+		.data = (unsigned char *)data,
+		.len = len,
+	};
+	SEC_PKCS7ContentInfo *cinfo = SEC_PKCS7DecodeItem(&der, NULL, NULL,
+					NULL, NULL, NULL, NULL, NULL);
+	if (!cinfo) {
+		set_error("could not parse \"%s\"", path);
+		goto out;
+	}
+	if (!dbs->catalogs)
+		dbs->catalogs = catalog_index_new();
+	errno = 0;
+	if (!dbs->catalogs || catalog_index_add(dbs->catalogs,
+			cinfo->content.signedData->contentInfo.content.data)
+			< 0) {
+		if (errno == E2BIG)
+			set_error("\"%s\" would need more than %d kinds of "
+				  "digest between the loaded catalogs", path,
+				  MAX_CATALOG_DIGEST_TYPES);
+		else
+			set_error("could not parse \"%s\"", path);
+	} else {
+		rc = 0;
+	}
+	SEC_PKCS7DestroyContentInfo(cinfo);
+out:
+	pthread_mutex_unlock(&lib->lock);
+	free(data);
+	return rc;
+}
+
+static libpesign_image *
+new_image(libpesign *lib, Pe *pe)
+{
+	libpesign_image *image = calloc(1, sizeof (*image));
+	if (!image) {
+		set_error("could not allocate memory: %m");
+		pe_end(pe);
+		return NULL;
+	}
+	image->lib = lib;
+	image->pe = pe;
+
+	if (new_cms(&image->cms) < 0) {
+		libpesign_image_close(image);
+		return NULL;
+	}
+	return image;
+}
+
+libpesign_image *
+libpesign_image_open_fd(libpesign *lib, int fd)
+{
+	Pe *pe = pe_begin(fd, PE_C_READ_MMAP, NULL);
+	if (!pe)
+		pe = pe_begin(fd, PE_C_READ, NULL);
+	if (!pe) {
+		set_error("could not parse PE binary: %s",
+			  pe_errmsg(pe_errno()));
+		return NULL;
+	}
+	return new_image(lib, pe);
+}
+
+libpesign_image *
+libpesign_image_open_memory(libpesign *lib, void *data, size_t size)
+{
+	Pe *pe = pe_memory(data, size);
+	if (!pe) {
+		set_error("could not parse PE binary: %s",
+			  pe_errmsg(pe_errno()));
+		return NULL;
+	}
+	return new_image(lib, pe);
+}
+
+void
+libpesign_image_close(libpesign_image *image)
+{
+	if (!image)
+		return;
+
+	if (image->cms)
+		cms_context_fini(image->cms);
+	pe_end(image->pe);
+	free(image);
+}
+
+int
+libpesign_image_num_signatures(libpesign_image *image)
+{
+	cert_iter iter;
+	void *data;
+	ssize_t datalen;
+	int n = 0;
+
+	if (cert_iter_init(&iter, image->pe) < 0) {
+		set_error("could not read certificate table");
+		return -1;
+	}
+	while (next_cert(&iter, &data, &datalen) > 0)
+		n++;
+	return n;
+}
+
+static int
+digest_image(cms_context *cms, Pe *pe, const char *digest_name)
+{
+	if (set_digest_parameters(cms, (char *)digest_name) < 0) {
+		set_error("unknown digest type \"%s\"", digest_name);
+		return -1;
+	}
+	return generate_digest(cms, pe, 1);
+}
+
+int
+libpesign_image_digest(libpesign_image *image, const char *digest_name,
+		       uint8_t *digest, size_t *size)
+{
+	cms_context *cms = image->cms;
+
+	if (digest_image(cms, image->pe, digest_name) < 0)
+		return -1;
+
+	SECItem *pe_digest = cms->digests[cms->selected_digest].pe_digest;
+	if (*size < pe_digest->len) {
+		set_error("%s digest needs %u bytes", digest_name,
+			  pe_digest->len);
+		*size = pe_digest->len;
+		return -1;
+	}
+	memcpy(digest, pe_digest->data, pe_digest->len);
+	*size = pe_digest->len;
+	return 0;
+}
+
+static int
+verify_image(libpesign_image *image, const char *which)
+{
+	pesigcheck_context ctx;
+
+	/* the databases are shared; everything that changes is ours */
+	memset(&ctx, '\0', sizeof (ctx));
+	ctx.infd = -1;
+	ctx.inpe = image->pe;
+	ctx.cms_ctx = image->cms;
+	ctx.db = image->lib->dbs->db;
+	ctx.dbx = image->lib->dbs->dbx;
+	ctx.catalogs = image->lib->dbs->catalogs;
+	ctx.verify_pages = (char *)which;
+
+	last_error[0] = '\0';
+	int rc = check_signature(&ctx);
+	if (rc < 0 && !last_error[0])
+		set_error("image is not signed by anything in db, or is "
+			  "forbidden by dbx");
+	return rc;
+}
+
+int
+libpesign_image_verify(libpesign_image *image)
+{
+	return verify_image(image, NULL);
+}
+
+int
+libpesign_image_verify_pages(libpesign_image *image, const char *which)
+{
+	return verify_image(image, which);
+}
+
+libpesign_signer *
+libpesign_signer_new(libpesign *lib, const char *token,
+		     const char *certname, const char *pin)
+{
+	libpesign_signer *signer = calloc(1, sizeof (*signer));
+	if (!signer) {
+		set_error("could not allocate memory: %m");
+		return NULL;
+	}
+	signer->lib = lib;
+
+	if (new_cms(&signer->cms) < 0)
+		goto err;
+	cms_context *cms = signer->cms;
+
+	cms->tokenname = PORT_ArenaStrdup(cms->arena,
+					  token ? token : "NSS Certificate DB");
+	cms->certname = PORT_ArenaStrdup(cms->arena, certname);
+	if (!cms->tokenname || !cms->certname) {
+		set_error("could not allocate memory: %m");
+		goto err;
+	}
+
+	if (pin) {
+		signer->pin = strdup(pin);
+		if (!signer->pin) {
+			set_error("could not allocate memory: %m");
+			goto err;
+		}
+		cms_set_pw_callback(cms, get_password_passthrough);
+		cms_set_pw_data(cms, signer->pin);
+	} else {
+		cms_set_pw_callback(cms, get_password_fail);
+	}
+
+	/* find_certificate() sets NSS's process-wide password callback */
+	pthread_mutex_lock(&lib->lock);
+	int rc = find_certificate(cms, 1);
+	pthread_mutex_unlock(&lib->lock);
+	if (rc < 0)
+		goto err;
+
+	return signer;
+err:
+	libpesign_signer_free(signer);
+	return NULL;
+}
+
+void
+libpesign_signer_free(libpesign_signer *signer)
+{
+	if (!signer)
+		return;
+
+	if (signer->cms)
+		cms_context_fini(signer->cms);
+	if (signer->pin) {
+		free_poison(signer->pin, strlen(signer->pin));
+		free(signer->pin);
+	}
+	free(signer);
+}
+
+static int
+take_newsig(cms_context *cms, void **sig, size_t *siglen)
+{
+	*sig = malloc(cms->newsig.len);
+	if (!*sig) {
+		set_error("could not allocate memory: %m");
+		return -1;
+	}
+	memcpy(*sig, cms->newsig.data, cms->newsig.len);
+	*siglen = cms->newsig.len;
+
+	free_poison(cms->newsig.data, cms->newsig.len);
+	xfree(cms->newsig.data);
+	cms->newsig.len = 0;
+	return 0;
+}
+
+int
+libpesign_sign_detached(libpesign_signer *signer, libpesign_image *image,
+			const char *digest_name, void **sig, size_t *siglen)
+{
+	cms_context *cms = signer->cms;
+
+	if (digest_image(cms, image->pe, digest_name) < 0)
+		return -1;
+	if (generate_signature(cms) < 0)
+		return -1;
+	return take_newsig(cms, sig, siglen);
+}
+
+/*
+ * Copy the image to outfd, with an empty certificate table, and parse the
+ * signatures it had into cms so they can be put back along with a new one.
+ */
+static int
+set_up_output(cms_context *cms, libpesign_image *image, int outfd,
+	      Pe **outpe)
+{
+	size_t size = 0;
+	char *addr = pe_rawfile(image->pe, &size);
+
+	if (!addr) {
+		set_error("could not read image: %s", pe_errmsg(pe_errno()));
+		return -1;
+	}
+
+	if (parse_signatures(&cms->signatures, &cms->num_signatures,
+			     image->pe) < 0) {
+		set_error("could not parse signature list");
+		return -1;
+	}
+
+	if (lseek(outfd, 0, SEEK_SET) < 0 || ftruncate(outfd, size) < 0) {
+		set_error("could not set up output file: %m");
+		return -1;
+	}
+	for (size_t written = 0; written < size; ) {
+		ssize_t rc = write(outfd, addr + written, size - written);
+		if (rc < 0) {
+			set_error("could not write output file: %m");
+			return -1;
+		}
+		written += rc;
+	}
+
+	*outpe = pe_begin(outfd, PE_C_RDWR_MMAP, NULL);
+	if (!*outpe)
+		*outpe = pe_begin(outfd, PE_C_RDWR, NULL);
+	if (!*outpe) {
+		set_error("could not set up output: %s",
+			  pe_errmsg(pe_errno()));
+		return -1;
+	}
+	pe_clearcert(*outpe);
+	return 0;
+}
+
+static int
+add_signature(cms_context *cms, const void *sig, size_t siglen)
+{
+	SECItem **signatures = realloc(cms->signatures,
+			sizeof (SECItem *) * (cms->num_signatures + 1));
+	if (!signatures)
+		goto oom;
+	cms->signatures = signatures;
+
+	SECItem *newsig = calloc(1, sizeof (*newsig));
+	if (!newsig)
+		goto oom;
+	newsig->type = siBuffer;
+	newsig->data = malloc(siglen);
+	if (!newsig->data) {
+		free(newsig);
+		goto oom;
+	}
+	memcpy(newsig->data, sig, siglen);
+	newsig->len = siglen;
+	cms->signatures[cms->num_signatures++] = newsig;
+	return 0;
+oom:
+	set_error("could not allocate memory: %m");
+	return -1;
+}
+
+static void
+drop_signatures(cms_context *cms)
+{
+	for (int i = 0; i < cms->num_signatures; i++) {
+		free(cms->signatures[i]->data);
+		free(cms->signatures[i]);
+	}
+	xfree(cms->signatures);
+	cms->num_signatures = 0;
+}
+
+static int
+finish_output(cms_context *cms, Pe *outpe, int outfd)
+{
+	/* this writes the certificate table straight into the shared map,
+	 * so there's nothing left for pe_update() to do */
+	int rc = finalize_signatures(cms->signatures, cms->num_signatures,
+				     outpe);
+	if (rc < 0)
+		set_error("could not write certificate table");
+	pe_end(outpe);
+	if (rc < 0)
+		ftruncate(outfd, 0);
+	return rc;
+}
+
+int
+libpesign_sign(libpesign_signer *signer, libpesign_image *image,
+	       const char *digest_name, int outfd)
+{
+	cms_context *cms = signer->cms;
+	Pe *outpe = NULL;
+	void *sig = NULL;
+	size_t siglen = 0;
+	int rc = -1;
+
+	if (set_up_output(cms, image, outfd, &outpe) < 0)
+		goto out;
+
+	/* the digest covers the certificate table's directory entry, so
+	 * it has to be taken again once the space is allocated */
+	if (digest_image(cms, outpe, digest_name) < 0)
+		goto err;
+	ssize_t sigspace = calculate_signature_space(cms, outpe);
+	if (sigspace < 0 || pe_alloccert(outpe, sigspace) < 0) {
+		set_error("could not allocate space for signature");
+		goto err;
+	}
+	if (generate_digest(cms, outpe, 1) < 0 ||
+	    generate_signature(cms) < 0 ||
+	    take_newsig(cms, &sig, &siglen) < 0 ||
+	    add_signature(cms, sig, siglen) < 0)
+		goto err;
+
+	rc = finish_output(cms, outpe, outfd);
+	outpe = NULL;
+err:
+	if (outpe) {
+		pe_end(outpe);
+		ftruncate(outfd, 0);
+	}
+out:
+	if (sig) {
+		free_poison(sig, siglen);
+		free(sig);
+	}
+	drop_signatures(cms);
+	return rc;
+}
+
+int
+libpesign_embed(libpesign_image *image, const void *sig, size_t siglen,
+		int outfd)
+{
+	cms_context *cms = image->cms;
+	Pe *outpe = NULL;
+	int rc = -1;
+
+	if (set_up_output(cms, image, outfd, &outpe) < 0)
+		goto out;
+
+	SECItem newsig = {
+		.type = siBuffer,
+		.data = (unsigned char *)sig,
+		.len = siglen,
+	};
+	ssize_t sigspace = get_sigspace_extend_amount(cms, outpe, &newsig);
+	if (sigspace < 0 || pe_alloccert(outpe, sigspace) < 0) {
+		set_error("could not allocate space for signature");
+		goto err;
+	}
+	if (add_signature(cms, sig, siglen) < 0)
+		goto err;
+
+	rc = finish_output(cms, outpe, outfd);
+	outpe = NULL;
+err:
+	if (outpe) {
+		pe_end(outpe);
+		ftruncate(outfd, 0);
+	}
+out:
+	drop_signatures(cms);
+	return rc;
+}
+
+libpesign_esl *
+libpesign_esl_new(const efi_guid_t *type)
+{
+	libpesign_esl *esl = calloc(1, sizeof (*esl));
+	if (!esl) {
+		set_error("could not allocate memory: %m");
+		return NULL;
+	}
+
+	esl->sl = signature_list_new(type);
+	if (!esl->sl) {
+		set_error("could not allocate signature list: %m");
+		free(esl);
+		return NULL;
+	}
+	return esl;
+}
+
+int
+libpesign_esl_add(libpesign_esl *esl, const efi_guid_t *owner,
+		  const void *data, size_t size)
+{
+	int rc = signature_list_add_sig(esl->sl, *owner, (uint8_t *)data,
+					size);
+	if (rc < 0)
+		set_error("could not add to signature list: %m");
+	return rc;
+}
+
+int
+libpesign_esl_realize(libpesign_esl *esl, const void **data, size_t *size)
+{
+	void *out = NULL;
+
+	int rc = signature_list_realize(esl->sl, &out, size);
+	if (rc < 0) {
+		set_error("could not build signature list: %m");
+		return rc;
+	}
+	*data = out;
+	return 0;
+}
+
+void
+libpesign_esl_free(libpesign_esl *esl)
+{
+	if (!esl)
+		return;
+
+	signature_list_free(esl->sl);
+	free(esl);
+}
@@ -35,6 +35,23 @@ static uint8_t oiddata[] = {
 	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x15, 0x01,
 };
 
+/* the ones catalogs (certificate trust lists) need */
+static uint8_t ctloiddata[] = {
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0a, 0x01,
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0c, 0x01, 0x01,
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0c, 0x01, 0x02,
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0c, 0x02, 0x01,
+};
+
+static uint8_t pagehashoiddata[] = {
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x03, 0x01,
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x03, 0x02,
+};
+
+static uint8_t timestampoiddata[] = {
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x03, 0x03, 0x01,
+};
+
 #define OID(num, desc_s, oidtype, length, value)		\
 	{ num, .sod = {						\
 		.desc = desc_s, .oid = {			\
@@ -58,6 +75,20 @@ static struct {
 		10, &oiddata[40]),
 	OID(szOID_CERTSRV_CA_VERSION, "Certification server CA version",
 		siAsciiString, 9, &oiddata[50]),
+	OID(szOID_CTL, "Certificate Trust List", siDEROID, 9,
+		&ctloiddata[0]),
+	OID(szOID_CATALOG_LIST, "Catalog List", siDEROID, 10,
+		&ctloiddata[9]),
+	OID(szOID_CATALOG_LIST_MEMBER, "Catalog List Member", siDEROID, 10,
+		&ctloiddata[19]),
+	OID(CAT_NAMEVALUE_OBJID, "Catalog Name Value", siDEROID, 10,
+		&ctloiddata[29]),
+	OID(SPC_PE_IMAGE_PAGE_HASHES_V1, "Page Hashes (SHA-1)", siDEROID, 10,
+		&pagehashoiddata[0]),
+	OID(SPC_PE_IMAGE_PAGE_HASHES_V2, "Page Hashes (SHA-256)", siDEROID,
+		10, &pagehashoiddata[10]),
+	OID(szOID_RFC3161_counterSign, "RFC 3161 Countersignature", siDEROID,
+		10, &timestampoiddata[0]),
 	{ .oid = END_OID_LIST }
 };
 
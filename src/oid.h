@@ -25,6 +25,13 @@ typedef enum {
 	SPC_PE_IMAGE_DATA_OBJID,		/* 1.3.6.1.4.1.311.2.1.15 */
 	SPC_INDIVIDUAL_SP_KEY_PURPOSE_OBJID,	/* 1.3.6.1.4.1.311.2.1.21 */
 	szOID_CERTSRV_CA_VERSION,		/* 1.3.6.1.4.1.311.21.1 */
+	szOID_CTL,				/* 1.3.6.1.4.1.311.10.1 */
+	szOID_CATALOG_LIST,			/* 1.3.6.1.4.1.311.12.1.1 */
+	szOID_CATALOG_LIST_MEMBER,		/* 1.3.6.1.4.1.311.12.1.2 */
+	CAT_NAMEVALUE_OBJID,			/* 1.3.6.1.4.1.311.12.2.1 */
+	SPC_PE_IMAGE_PAGE_HASHES_V1,		/* 1.3.6.1.4.1.311.2.3.1 */
+	SPC_PE_IMAGE_PAGE_HASHES_V2,		/* 1.3.6.1.4.1.311.2.3.2 */
+	szOID_RFC3161_counterSign,		/* 1.3.6.1.4.1.311.3.3.1 */
 	END_OID_LIST
 } ms_oid_t;
 
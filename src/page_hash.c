@@ -0,0 +1,562 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "pesign.h"
+
+#include <prerror.h>
+#include <pk11pub.h>
+#include <sechash.h>
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+	int index;		/* in the table, less the header page */
+} page;
+
+static size_t
+image_header_size(Pe *pe)
+{
+	switch (pe_kind(pe)) {
+	case PE_K_PE_EXE: {
+		struct pe32_opt_hdr *opthdr = pe_getopthdr(pe);
+		return opthdr->header_size;
+	}
+	case PE_K_PE64_EXE: {
+		struct pe32plus_opt_hdr *opthdr = pe_getopthdr(pe);
+		return opthdr->header_size;
+	}
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Every page of section data, in section table order, and where the last
+ * section ends.  That order is the order they go in the table.
+ */
+static int
+list_pages(Pe *pe, page **pagesp, size_t *npagesp, uint32_t *endp)
+{
+	struct section_header shdr;
+	size_t map_size = 0;
+	size_t npages = 0;
+	Pe_Scn *scn;
+
+	if (!pe_rawfile(pe, &map_size))
+		return -1;
+
+	for (scn = pe_nextscn(pe, NULL); scn; scn = pe_nextscn(pe, scn)) {
+		pe_getshdr(scn, &shdr);
+		if (shdr.data_addr > map_size ||
+		    shdr.raw_data_size > map_size - shdr.data_addr)
+			return -1;
+		npages += (shdr.raw_data_size + PAGE_HASH_PAGE_SIZE - 1) /
+			  PAGE_HASH_PAGE_SIZE;
+	}
+
+	page *pages = calloc(npages ? npages : 1, sizeof (*pages));
+	if (!pages)
+		return -1;
+
+	size_t n = 0;
+	uint32_t end = 0;
+	for (scn = pe_nextscn(pe, NULL); scn; scn = pe_nextscn(pe, scn)) {
+		pe_getshdr(scn, &shdr);
+		for (uint32_t l = 0; l < shdr.raw_data_size;
+		     l += PAGE_HASH_PAGE_SIZE) {
+			pages[n].offset = shdr.data_addr + l;
+			pages[n].size = shdr.raw_data_size - l;
+			if (pages[n].size > PAGE_HASH_PAGE_SIZE)
+				pages[n].size = PAGE_HASH_PAGE_SIZE;
+			pages[n].index = n;
+			n++;
+		}
+		end = shdr.data_addr + shdr.raw_data_size;
+	}
+
+	*pagesp = pages;
+	*npagesp = npages;
+	*endp = end;
+	return 0;
+}
+
+/*
+ * The headers, less the parts the image digest leaves out, padded with
+ * zeros to a page.
+ */
+static int
+hash_header_page(Pe *pe, SECOidTag digest_tag, uint8_t *digest,
+		 unsigned int digest_size)
+{
+	static const uint8_t zeroes[PAGE_HASH_PAGE_SIZE];
+	const Pe_HashRegion *regions;
+	size_t nregions;
+	size_t map_size = 0;
+	unsigned int len = 0;
+	int rc = -1;
+
+	char *map = pe_rawfile(pe, &map_size);
+	size_t header_size = image_header_size(pe);
+	if (!map || header_size == 0 || header_size > PAGE_HASH_PAGE_SIZE ||
+	    header_size > map_size)
+		return -1;
+
+	if (pe_hashregions(pe, &regions, &nregions) < 0)
+		return -1;
+
+	PK11Context *ctx = PK11_CreateDigestContext(digest_tag);
+	if (!ctx)
+		return -1;
+	if (PK11_DigestBegin(ctx) != SECSuccess)
+		goto out;
+
+	/* the regions for the headers come first, and end at header_size */
+	for (size_t i = 0; i < nregions && regions[i].offset < header_size;
+	     i++) {
+		size_t size = regions[i].size;
+		if (size > header_size - regions[i].offset)
+			size = header_size - regions[i].offset;
+		if (PK11_DigestOp(ctx, (uint8_t *)map + regions[i].offset,
+				  size) != SECSuccess)
+			goto out;
+	}
+	if (header_size < PAGE_HASH_PAGE_SIZE &&
+	    PK11_DigestOp(ctx, zeroes, PAGE_HASH_PAGE_SIZE - header_size)
+			!= SECSuccess)
+		goto out;
+
+	if (PK11_DigestFinal(ctx, digest, &len, digest_size) != SECSuccess ||
+	    len != digest_size)
+		goto out;
+	rc = 0;
+out:
+	PK11_DestroyContext(ctx, PR_TRUE);
+	return rc;
+}
+
+/* a page of section data, padded with zeros if the section ends first */
+static int
+hash_page(char *map, page *pg, SECOidTag digest_tag, uint8_t *digest)
+{
+	uint8_t buf[PAGE_HASH_PAGE_SIZE];
+	uint8_t *data = (uint8_t *)map + pg->offset;
+
+	if (pg->size < PAGE_HASH_PAGE_SIZE) {
+		memcpy(buf, data, pg->size);
+		memset(buf + pg->size, '\0', sizeof (buf) - pg->size);
+		data = buf;
+	}
+	if (PK11_HashBuf(digest_tag, digest, data,
+			 PAGE_HASH_PAGE_SIZE) != SECSuccess)
+		return -1;
+	return 0;
+}
+
+/*
+ * The pages are independent of each other, so they're handed out to as
+ * many threads as there are processors, a batch at a time.
+ */
+#define PAGES_PER_BATCH 64
+
+typedef struct {
+	char *map;
+	SECOidTag digest_tag;
+	page *pages;
+	size_t npages;
+	uint8_t *entries;	/* where the first section page's entry goes */
+	size_t entry_size;
+
+	pthread_mutex_t lock;
+	size_t next;
+	int failures;
+} page_job;
+
+static void *
+page_worker(void *arg)
+{
+	page_job *job = arg;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		size_t first = job->next;
+		job->next += PAGES_PER_BATCH;
+		pthread_mutex_unlock(&job->lock);
+		if (first >= job->npages)
+			break;
+
+		size_t last = first + PAGES_PER_BATCH;
+		if (last > job->npages)
+			last = job->npages;
+
+		for (size_t i = first; i < last; i++) {
+			uint8_t *entry = job->entries + i * job->entry_size;
+			if (hash_page(job->map, &job->pages[i],
+				      job->digest_tag, entry + 4) < 0) {
+				pthread_mutex_lock(&job->lock);
+				job->failures++;
+				pthread_mutex_unlock(&job->lock);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+put_offset(uint8_t *entry, uint32_t offset)
+{
+	offset = cpu_to_le32(offset);
+	memcpy(entry, &offset, sizeof (offset));
+}
+
+static uint32_t
+get_offset(uint8_t *entry)
+{
+	uint32_t offset;
+	memcpy(&offset, entry, sizeof (offset));
+	return le32_to_cpu(offset);
+}
+
+/*
+ * Make the page hash table for pe with cms's selected digest, and keep it
+ * in cms->page_hash_table for generate_spc_content_info() to put in the
+ * signature.
+ */
+int
+generate_page_hashes(cms_context *cms, Pe *pe)
+{
+	SECOidTag digest_tag = digest_get_digest_oid(cms);
+	unsigned int digest_size = digest_get_digest_size(cms);
+	size_t map_size = 0;
+	page *pages = NULL;
+	size_t npages = 0;
+	uint32_t end = 0;
+
+	char *map = pe_rawfile(pe, &map_size);
+	if (!map)
+		cmsreterr(-1, cms, "could not get raw file address");
+
+	if (list_pages(pe, &pages, &npages, &end) < 0)
+		cmsreterr(-1, cms, "could not list image pages");
+
+	size_t entry_size = sizeof (uint32_t) + digest_size;
+	size_t table_size = (npages + 2) * entry_size;
+	uint8_t *table = PORT_ArenaZAlloc(cms->arena, table_size);
+	if (!table) {
+		free(pages);
+		cmsreterr(-1, cms, "could not allocate page hash table");
+	}
+
+	put_offset(table, 0);
+	if (hash_header_page(pe, digest_tag, table + sizeof (uint32_t),
+			     digest_size) < 0) {
+		free(pages);
+		cmsreterr(-1, cms, "could not hash image headers");
+	}
+
+	page_job job = {
+		.map = map,
+		.digest_tag = digest_tag,
+		.pages = pages,
+		.npages = npages,
+		.entries = table + entry_size,
+		.entry_size = entry_size,
+	};
+	for (size_t i = 0; i < npages; i++)
+		put_offset(job.entries + i * entry_size, pages[i].offset);
+	/* and the end, whose digest is left as zeros */
+	put_offset(table + (npages + 1) * entry_size, end);
+
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nbatches = (npages + PAGES_PER_BATCH - 1) / PAGES_PER_BATCH;
+	size_t jobs = nproc > 0 ? (size_t)nproc : 1;
+	if (jobs > nbatches)
+		jobs = nbatches;
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_t *threads = calloc(jobs ? jobs : 1, sizeof (pthread_t));
+	size_t nthreads = 0;
+	for (size_t i = 1; threads && i < jobs; i++) {
+		if (pthread_create(&threads[nthreads], NULL, page_worker,
+				   &job) != 0)
+			break;
+		nthreads++;
+	}
+	page_worker(&job);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+	free(pages);
+
+	if (job.failures)
+		cmsreterr(-1, cms, "could not hash image pages");
+
+	cms->page_hash_table.type = siBuffer;
+	cms->page_hash_table.data = table;
+	cms->page_hash_table.len = table_size;
+	return 0;
+}
+
+static int
+oid_is(SECItem *oid, ms_oid_t moid)
+{
+	SECItem want;
+
+	if (get_ms_oid_secitem(moid, &want) < 0)
+		return 0;
+	return SECITEM_ItemsAreEqual(oid, &want);
+}
+
+/*
+ * Find the page hash table in an SpcIndirectDataContent: its SpcPeImageData
+ * links to a serialized object holding a SET of one attribute, which holds
+ * the table.  0 if it's there, -1 if not.
+ */
+int
+find_page_hashes(SECItem *idc, SECOidTag *digest_tag, SECItem *table)
+{
+	static const uint8_t class_id[] = {
+		0xa6, 0xb5, 0x86, 0xd5, 0xb4, 0xa1, 0x24, 0x66,
+		0xae, 0x05, 0xa2, 0x17, 0xda, 0x8e, 0x60, 0xd6
+	};
+	SECItem der = *idc;
+	SECItem seq, attr, oid, pid, flags, link, moniker, classid;
+	SECItem serialized, set, values;
+
+	if (der_take(&der, 0x30, &seq) < 0 ||
+	    der_take(&seq, 0x30, &attr) < 0 ||
+	    der_take(&attr, 0x06, &oid) < 0 ||
+	    !oid_is(&oid, SPC_PE_IMAGE_DATA_OBJID) ||
+	    der_take(&attr, 0x30, &pid) < 0 ||
+	    der_take(&pid, 0x03, &flags) < 0 ||
+	    der_take(&pid, 0xa0, &link) < 0 ||
+	    der_take(&link, 0xa1, &moniker) < 0 ||
+	    der_take(&moniker, 0x04, &classid) < 0 ||
+	    classid.len != sizeof (class_id) ||
+	    memcmp(classid.data, class_id, sizeof (class_id)) ||
+	    der_take(&moniker, 0x04, &serialized) < 0 ||
+	    der_take(&serialized, 0x31, &set) < 0 ||
+	    der_take(&set, 0x30, &attr) < 0 ||
+	    der_take(&attr, 0x06, &oid) < 0)
+		return -1;
+
+	if (oid_is(&oid, SPC_PE_IMAGE_PAGE_HASHES_V1))
+		*digest_tag = SEC_OID_SHA1;
+	else if (oid_is(&oid, SPC_PE_IMAGE_PAGE_HASHES_V2))
+		*digest_tag = SEC_OID_SHA256;
+	else
+		return -1;
+
+	if (der_take(&attr, 0x31, &values) < 0 ||
+	    der_take(&values, 0x04, table) < 0)
+		return -1;
+	return 0;
+}
+
+static int
+add_range(page_range **ranges, int *nranges, size_t start, size_t end)
+{
+	page_range *new = realloc(*ranges, sizeof (*new) * (*nranges + 1));
+	if (!new)
+		return -1;
+	new[*nranges].start = start;
+	new[*nranges].end = end;
+	*ranges = new;
+	(*nranges)++;
+	return 0;
+}
+
+/*
+ * Turn a comma separated list of section names and file offsets into the
+ * parts of pe they mean.  An offset means the page it's in.
+ */
+int
+select_pages(Pe *pe, const char *selection, page_range **ranges,
+	     int *nranges)
+{
+	char *list = strdup(selection);
+	char *saveptr = NULL;
+	int rc = -1;
+
+	*ranges = NULL;
+	*nranges = 0;
+	if (!list)
+		return -1;
+
+	for (char *item = strtok_r(list, ",", &saveptr); item;
+	     item = strtok_r(NULL, ",", &saveptr)) {
+		char *end = NULL;
+		unsigned long offset = strtoul(item, &end, 0);
+		if (end != item && *end == '\0') {
+			if (add_range(ranges, nranges, offset,
+				      offset + 1) < 0)
+				goto out;
+			continue;
+		}
+
+		int found = 0;
+		Pe_Scn *scn = NULL;
+		struct section_header shdr;
+		while ((scn = pe_nextscn(pe, scn))) {
+			pe_getshdr(scn, &shdr);
+			if (strlen(item) > sizeof (shdr.name) ||
+			    strncmp(shdr.name, item, sizeof (shdr.name)))
+				continue;
+			if (add_range(ranges, nranges, shdr.data_addr,
+				      (size_t)shdr.data_addr +
+				      shdr.raw_data_size) < 0)
+				goto out;
+			found = 1;
+		}
+		if (!found) {
+			errno = ENOENT;
+			goto out;
+		}
+	}
+	rc = 0;
+out:
+	if (rc < 0) {
+		xfree(*ranges);
+		*nranges = 0;
+	}
+	free(list);
+	return rc;
+}
+
+static int
+compare_pages(const void *a, const void *b)
+{
+	const page *pa = a, *pb = b;
+
+	if (pa->offset > pb->offset)
+		return 1;
+	if (pa->offset < pb->offset)
+		return -1;
+	return 0;
+}
+
+/* the page holding offset, in pages sorted by offset */
+static page *
+find_page(page *pages, size_t npages, size_t offset)
+{
+	size_t lo = 0, hi = npages;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (offset < pages[mid].offset)
+			hi = mid;
+		else if (offset >= (size_t)pages[mid].offset + pages[mid].size)
+			lo = mid + 1;
+		else
+			return &pages[mid];
+	}
+	return NULL;
+}
+
+/*
+ * Check the parts of pe in ranges - and the headers, which say where
+ * everything else is - against a page hash table, without reading any of
+ * the rest of the image.  The table has to come from a signature that's
+ * already been checked.  0 if they all match, -1 if anything doesn't or
+ * a range isn't covered by the table.
+ */
+int
+check_page_hashes(Pe *pe, SECOidTag digest_tag, SECItem *table,
+		  page_range *ranges, int nranges)
+{
+	uint8_t digest[HASH_LENGTH_MAX];
+	page *pages = NULL;
+	uint8_t *checked = NULL;
+	size_t npages = 0;
+	size_t map_size = 0;
+	uint32_t end = 0;
+	int rc = -1;
+
+	HASH_HashType type = HASH_GetHashTypeByOidTag(digest_tag);
+	if (type == HASH_AlgNULL)
+		return -1;
+	unsigned int digest_size = HASH_ResultLen(type);
+	size_t entry_size = sizeof (uint32_t) + digest_size;
+
+	char *map = pe_rawfile(pe, &map_size);
+	if (!map)
+		return -1;
+
+	/* first the headers; nothing else can be trusted until they are */
+	if (table->len < entry_size || get_offset(table->data) != 0 ||
+	    hash_header_page(pe, digest_tag, digest, digest_size) < 0 ||
+	    memcmp(digest, table->data + sizeof (uint32_t), digest_size))
+		return -1;
+
+	/* then the table has to list exactly the pages they describe */
+	if (list_pages(pe, &pages, &npages, &end) < 0)
+		return -1;
+	if (table->len != (npages + 2) * entry_size)
+		goto out;
+	for (size_t i = 0; i < npages; i++) {
+		if (get_offset(table->data + (i + 1) * entry_size) !=
+		    pages[i].offset)
+			goto out;
+	}
+	if (get_offset(table->data + (npages + 1) * entry_size) != end)
+		goto out;
+
+	checked = calloc(npages ? npages : 1, 1);
+	if (!checked)
+		goto out;
+	qsort(pages, npages, sizeof (*pages), compare_pages);
+
+	size_t header_size = image_header_size(pe);
+	for (int i = 0; i < nranges; i++) {
+		size_t pos = ranges[i].start;
+
+		while (pos < ranges[i].end) {
+			if (pos < header_size) {
+				pos = header_size;
+				continue;
+			}
+
+			page *pg = find_page(pages, npages, pos);
+			if (!pg)
+				goto out;
+			pos = (size_t)pg->offset + pg->size;
+			if (checked[pg->index])
+				continue;
+
+			uint8_t *entry = table->data +
+					 (pg->index + 1) * entry_size;
+			if (hash_page(map, pg, digest_tag, digest) < 0 ||
+			    memcmp(digest, entry + sizeof (uint32_t),
+				   digest_size))
+				goto out;
+			checked[pg->index] = 1;
+		}
+	}
+	rc = 0;
+out:
+	free(checked);
+	free(pages);
+	return rc;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef PAGE_HASH_H
+#define PAGE_HASH_H 1
+
+/*
+ * Authenticode page hashes: besides the digest of the whole image, a
+ * signature can carry a table with a digest of each 4kB page - the headers
+ * as the first page, then each section's raw data a page at a time - so
+ * that something which only needs part of an image can check just that
+ * part.  Each entry is the page's 32-bit file offset followed by its
+ * digest; the last entry is the end of the last section, with a digest of
+ * all zeros.
+ */
+#define PAGE_HASH_PAGE_SIZE	4096
+
+extern int generate_page_hashes(cms_context *cms, Pe *pe);
+
+/* the parts of a file a lazy check has been asked to look at */
+typedef struct {
+	size_t start;
+	size_t end;
+} page_range;
+
+extern int find_page_hashes(SECItem *idc, SECOidTag *digest_tag,
+			    SECItem *table);
+extern int select_pages(Pe *pe, const char *selection, page_range **ranges,
+			int *nranges);
+extern int check_page_hashes(Pe *pe, SECOidTag digest_tag, SECItem *table,
+			     page_range *ranges, int nranges);
+
+#endif /* PAGE_HASH_H */
@@ -22,155 +22,172 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <nss.h>
 
 #include <popt.h>
 
-#include <prerror.h>
-#include <cert.h>
-#include <pkcs7t.h>
-#include <pk11pub.h>
+#include <libpesign/libpesign.h>
 
-#include "pesigcheck.h"
+#include "archive.h"
+#include "ingest.h"
 
-static void
-open_input(pesigcheck_context *ctx)
+typedef struct {
+	libpesign *lib;
+
+	char *infile;
+	char **infiles;
+	int ninfiles;
+
+	char **catalogs;
+	int ncatalogs;
+
+	/* how many db lists and certificates we were given */
+	int ndbs;
+
+	/* check only these sections or offsets, against page hashes */
+	char *verify_pages;
+
+	/* a cpio or tar stream to check the PE members of */
+	char *archive;
+
+	int quiet;
+} checker;
+
+static int
+check_image(checker *chk, const char *path, void *data, size_t size)
 {
-	if (!ctx->infile) {
-		fprintf(stderr, "pesigcheck: No input file specified.\n");
-		exit(1);
+	libpesign_image *image;
+	int rc;
+
+	image = libpesign_image_open_memory(chk->lib, data, size);
+	if (!image) {
+		fprintf(stderr, "pesigcheck: could not load \"%s\": %s\n",
+			path, libpesign_error());
+		return -1;
 	}
 
-	ctx->infd = open(ctx->infile, O_RDONLY|O_CLOEXEC);
+	if (chk->verify_pages)
+		rc = libpesign_image_verify_pages(image, chk->verify_pages);
+	else
+		rc = libpesign_image_verify(image);
+	if (rc < 0 && !chk->quiet)
+		fprintf(stderr, "pesigcheck: \"%s\": %s\n", path,
+			libpesign_error());
 
-	if (ctx->infd < 0) {
-		fprintf(stderr, "pesigcheck: Error opening input: %m\n");
-		exit(1);
+	libpesign_image_close(image);
+	return rc;
+}
+
+/*
+ * Check each PE member of a cpio or tar stream as it goes past, without
+ * putting anything on disk.  Returns how many of them weren't valid.
+ */
+static int
+check_archive(checker *chk)
+{
+	int fd = STDIN_FILENO;
+	archive ar;
+	archive_member member;
+	int ninvalid = 0;
+	int rc;
+
+	if (strcmp(chk->archive, "-")) {
+		fd = open(chk->archive, O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "pesigcheck: Error opening \"%s\": %m\n",
+				chk->archive);
+			return 1;
+		}
 	}
 
-	Pe_Cmd cmd = ctx->infd == STDIN_FILENO ? PE_C_READ : PE_C_READ_MMAP;
-	ctx->inpe = pe_begin(ctx->infd, cmd, NULL);
-	if (!ctx->inpe) {
-		fprintf(stderr, "pesigcheck: could not load input file: %s\n",
-			pe_errmsg(pe_errno()));
-		exit(1);
+	if (archive_open(&ar, fd) < 0) {
+		fprintf(stderr, "pesigcheck: could not read archive \"%s\": "
+			"%m\n", chk->archive);
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return 1;
 	}
 
-	int rc = parse_signatures(&ctx->cms_ctx->signatures,
-					&ctx->cms_ctx->num_signatures,
-					ctx->inpe);
+	while ((rc = archive_next(&ar, &member)) > 0) {
+		if (member.error) {
+			fprintf(stderr, "pesigcheck: could not read \"%s\": "
+				"%s\n", member.path, strerror(member.error));
+			rc = -1;
+		} else {
+			rc = check_image(chk, member.path, member.data,
+					 member.size);
+		}
+
+		if (rc < 0)
+			ninvalid++;
+		if (!chk->quiet)
+			printf("pesigcheck: \"%s\" is %s.\n", member.path,
+				rc >= 0 ? "valid" : "invalid");
+	}
 	if (rc < 0) {
-		fprintf(stderr, "pesigcheck: could not parse signature list in "
-			"EFI binary\n");
-		exit(1);
+		fprintf(stderr, "pesigcheck: could not read archive \"%s\": "
+			"%m\n", chk->archive);
+		ninvalid++;
 	}
+
+	archive_close(&ar);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return ninvalid;
 }
 
 static void
-close_input(pesigcheck_context *ctx)
+check_inputs(checker *chk)
 {
-	pe_end(ctx->inpe);
-	ctx->inpe = NULL;
-
-	close(ctx->infd);
-	ctx->infd = -1;
+	if (!chk->ninfiles && !chk->archive) {
+		fprintf(stderr, "pesigcheck: No input file specified.\n");
+		exit(1);
+	}
 }
 
 static void
-check_inputs(pesigcheck_context *ctx)
+add_string(char ***list, int *n, const char *s)
 {
-	if (!ctx->infile) {
-		fprintf(stderr, "pesign: No input file specified.\n");
+	char **strings = realloc(*list, sizeof (char *) * (*n + 1));
+	if (!strings)
+		goto oom;
+	*list = strings;
+
+	strings[*n] = strdup(s);
+	if (!strings[*n]) {
+oom:
+		fprintf(stderr, "pesigcheck: could not allocate memory: %m\n");
 		exit(1);
 	}
+	(*n)++;
 }
 
-static int
-cert_matches_digest(pesigcheck_context *ctx, void *data, ssize_t datalen)
+static void
+free_strings(char **list, int n)
 {
-	SECItem sig, *pe_digest, *content;
-	uint8_t *digest;
-	SEC_PKCS7ContentInfo *cinfo = NULL;
-	int ret = -1;
-
-	sig.data = data;
-	sig.len = datalen;
-	sig.type = siBuffer;
-
-	cinfo = SEC_PKCS7DecodeItem(&sig, NULL, NULL, NULL, NULL, NULL,
-				    NULL, NULL);
-
-	if (!SEC_PKCS7ContentIsSigned(cinfo))
-		goto out;
-
-	/* TODO Find out the digest type in spc_content */
-	pe_digest = ctx->cms_ctx->digests[0].pe_digest;
-	content = cinfo->content.signedData->contentInfo.content.data;
-	digest = content->data + content->len - pe_digest->len;
-	if (memcmp(pe_digest->data, digest, pe_digest->len) != 0)
-		goto out;
-
-	ret = 0;
-out:
-	if (cinfo)
-		SEC_PKCS7DestroyContentInfo(cinfo);
-
-	return ret;
+	for (int i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
 }
 
-static int
-check_signature(pesigcheck_context *ctx)
+/*
+ * Add every catalog we were given that's signed by something in db (and
+ * not dbx).  One that isn't trusted is only a warning; the binaries it
+ * lists will still pass if they're signed some other way.
+ */
+static void
+load_catalogs(checker *chk)
 {
-	int has_valid_cert = 0;
-	int has_invalid_cert = 0;
-	int rc = 0;
-
-	cert_iter iter;
-
-	generate_digest(ctx->cms_ctx, ctx->inpe, 1);
-	
-	if (check_db_hash(DBX, ctx) == FOUND)
-		return -1;
-
-	if (check_db_hash(DB, ctx) == FOUND)
-		has_valid_cert = 1;
-
-	rc = cert_iter_init(&iter, ctx->inpe);
-	if (rc < 0)
-		goto err;
-
-	void *data;
-	ssize_t datalen;
-
-	while (1) {
-		rc = next_cert(&iter, &data, &datalen);
-		if (rc <= 0)
-			break;
-
-		if (cert_matches_digest(ctx, data, datalen) < 0) {
-			has_invalid_cert = 1;
-			break;
-		}
-
-		if (check_db_cert(DBX, ctx, data, datalen) == FOUND) {
-			has_invalid_cert = 1;
-			break;
+	for (int i = 0; i < chk->ncatalogs; i++) {
+		int rc = libpesign_add_catalog(chk->lib, chk->catalogs[i]);
+		if (rc < 0) {
+			fprintf(stderr, "pesigcheck: could not load catalog: "
+				"%s\n", libpesign_error());
+			exit(1);
+		} else if (rc > 0) {
+			fprintf(stderr, "pesigcheck: warning: catalog \"%s\" "
+				"is not trusted\n", chk->catalogs[i]);
 		}
-
-		if (check_db_cert(DB, ctx, data, datalen) == FOUND)
-			has_valid_cert = 1;
 	}
-
-err:
-	if (has_invalid_cert)
-		return -1;
-
-	if (has_valid_cert)
-		return 0;
-
-	return -1;
 }
 
 void
@@ -179,20 +196,26 @@ callback(poptContext con __attribute__((__unused__)),
 	 const struct poptOption *opt,
 	 const char *arg, const void *data)
 {
-	pesigcheck_context *ctx = (pesigcheck_context *)data;
+	checker *chk = (checker *)data;
 	int rc = 0;
 	if (!opt)
 		return;
 	if (opt->shortName == 'D') {
-		rc = add_cert_db(ctx, arg);
+		rc = libpesign_add_db(chk->lib, arg);
+		chk->ndbs++;
 	} else if (opt->shortName == 'X') {
-		rc = add_cert_dbx(ctx, arg);
+		rc = libpesign_add_dbx(chk->lib, arg);
 	} else if (opt->shortName == 'c') {
-		rc = add_cert_file(ctx, arg);
+		rc = libpesign_add_cert(chk->lib, arg);
+		chk->ndbs++;
+	} else if (opt->shortName == 'C') {
+		add_string(&chk->catalogs, &chk->ncatalogs, arg);
 	}
 	if (rc != 0) {
-		fprintf(stderr, "Could not add %s from file \"%s\": %m\n",
-			opt->shortName == 'D' ? "DB" : "DBX", arg);
+		fprintf(stderr, "pesigcheck: Could not add %s: %s\n",
+			opt->shortName == 'X' ? "DBX" :
+			opt->shortName == 'c' ? "certificate" : "DB",
+			libpesign_error());
 		exit(1);
 	}
 }
@@ -202,14 +225,16 @@ main(int argc, char *argv[])
 {
 	int rc;
 
-	pesigcheck_context ctx, *ctxp = &ctx;
+	checker chk;
 
+	int use_system_dbs = 1;
 	char *dbfile = NULL;
 	char *dbxfile = NULL;
 	char *certfile = NULL;
-	int use_system_dbs = 1;
-
-	SECStatus status;
+	char *reader = "auto";
+	int read_ahead = INGEST_DEFAULT_DEPTH;
+	ingest_method method;
+	ingest ing;
 
 	poptContext optCon;
 	struct poptOption options[] = {
@@ -219,22 +244,54 @@ main(int argc, char *argv[])
 		 .shortName = 'D',
 		 .argInfo = POPT_ARG_CALLBACK|POPT_CBFLAG_POST,
 		 .arg = (void *)callback,
-		 .descrip = (void *)ctxp },
+		 .descrip = (void *)&chk },
 		{.longName = "dbxfile",
 		 .shortName = 'X',
 		 .argInfo = POPT_ARG_CALLBACK|POPT_CBFLAG_POST,
 		 .arg = (void *)callback,
-		 .descrip = (void *)ctxp },
+		 .descrip = (void *)&chk },
+		{.longName = "catalog",
+		 .shortName = 'C',
+		 .argInfo = POPT_ARG_CALLBACK|POPT_CBFLAG_POST,
+		 .arg = (void *)callback,
+		 .descrip = (void *)&chk },
 		{.longName = "in",
 		 .shortName = 'i',
 		 .argInfo = POPT_ARG_STRING,
-		 .arg = &ctx.infile,
+		 .arg = &chk.infile,
 		 .descrip = "specify input file",
 		 .argDescrip = "<infile>"},
+		{.longName = "reader",
+		 .shortName = 'r',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &reader,
+		 .descrip = "how to read the input files "
+			    "(auto, io_uring, threads, or mmap)",
+		 .argDescrip = "<method>" },
+		{.longName = "read-ahead",
+		 .shortName = 'a',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &read_ahead,
+		 .descrip = "how many input files to read ahead",
+		 .argDescrip = "<count>" },
+		{.longName = "verify-pages",
+		 .shortName = 'p',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &chk.verify_pages,
+		 .descrip = "check only these sections or file offsets, "
+			    "against the signature's page hashes",
+		 .argDescrip = "<section|offset>[,...]" },
+		{.longName = "archive",
+		 .shortName = 'A',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &chk.archive,
+		 .descrip = "check the PE binaries in a cpio or tar stream "
+			    "(\"-\" for stdin)",
+		 .argDescrip = "<archive>" },
 		{.longName = "quiet",
 		 .shortName = 'q',
 		 .argInfo = POPT_BIT_SET,
-		 .arg = &ctx.quiet,
+		 .arg = &chk.quiet,
 		 .val = 1,
 		 .descrip = "return only; no text output." },
 		{.longName = "no-system-db",
@@ -260,14 +317,21 @@ main(int argc, char *argv[])
 		 .arg = &certfile,
 		 .descrip = "the certificate (in DER form) for verification ",
 		 .argDescrip = "<certfile>" },
+		{.longName = "catalog",
+		 .shortName = 'C',
+		 .argInfo = POPT_ARG_STRING,
+		 .descrip = "accept binaries listed in a signed catalog",
+		 .argDescrip = "<catalog>" },
 		POPT_AUTOALIAS
 		POPT_AUTOHELP
 		POPT_TABLEEND
 	};
 
-	rc = pesigcheck_context_init(ctxp);
-	if (rc < 0) {
-		fprintf(stderr, "pesigcheck: Could not initialize context: %m\n");
+	memset(&chk, '\0', sizeof (chk));
+	chk.lib = libpesign_new(NULL);
+	if (!chk.lib) {
+		fprintf(stderr, "pesigcheck: Could not initialize: %s\n",
+			libpesign_error());
 		exit(1);
 	}
 
@@ -283,35 +347,79 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (poptPeekArg(optCon)) {
-		fprintf(stderr, "pesigcheck: Invalid Argument: \"%s\"\n",
-				poptPeekArg(optCon));
+	if (chk.infile)
+		add_string(&chk.infiles, &chk.ninfiles, chk.infile);
+	while (poptPeekArg(optCon))
+		add_string(&chk.infiles, &chk.ninfiles, poptGetArg(optCon));
+
+	if (ingest_parse_method(reader, &method) < 0) {
+		fprintf(stderr, "pesigcheck: Invalid reader \"%s\"\n", reader);
+		exit(1);
+	}
+	if (read_ahead < 1) {
+		fprintf(stderr, "pesigcheck: Invalid read-ahead %d\n",
+			read_ahead);
 		exit(1);
 	}
 
 	poptFreeContext(optCon);
 
-	check_inputs(ctxp);
-	open_input(ctxp);
+	check_inputs(&chk);
 
-	init_cert_db(ctxp, use_system_dbs);
+	if (use_system_dbs) {
+		rc = libpesign_add_system_dbs(chk.lib);
+		if (rc < 0) {
+			fprintf(stderr, "pesigcheck: Could not add key "
+				"database: %s\n", libpesign_error());
+			exit(1);
+		}
+		if (rc == 0 && chk.ndbs == 0)
+			fprintf(stderr, "pesigcheck: warning: "
+				"No key database available\n");
+	}
 
-	status = NSS_NoDB_Init(NULL);
-	if (status != SECSuccess) {
-		fprintf(stderr, "Could not initialize nss: %s\n",
-			PORT_ErrorToString(PORT_GetError()));
+	load_catalogs(&chk);
+
+	rc = ingest_start(&ing, chk.infiles, chk.ninfiles, method,
+			  read_ahead);
+	if (rc < 0) {
+		fprintf(stderr, "pesigcheck: could not start %s reader: %m\n",
+			ingest_method_name(method));
 		exit(1);
 	}
 
-	rc = check_signature(ctxp);
+	int ninvalid = 0;
+	ingest_buffer *buf;
+	while ((buf = ingest_next(&ing))) {
+		if (buf->error) {
+			fprintf(stderr, "pesigcheck: Error opening \"%s\": "
+				"%s\n", buf->path, strerror(buf->error));
+			rc = -1;
+		} else {
+			rc = check_image(&chk, buf->path, buf->data,
+					 buf->size);
+		}
+
+		if (rc < 0)
+			ninvalid++;
+		if (!chk.quiet)
+			printf("pesigcheck: \"%s\" is %s.\n", buf->path,
+				rc >= 0 ? "valid" : "invalid");
+		ingest_release(&ing, buf);
+	}
+	if (ing.next_out < chk.ninfiles) {
+		fprintf(stderr, "pesigcheck: could not read \"%s\": %s\n",
+			chk.infiles[ing.next_out], strerror(ing.error));
+		ninvalid++;
+	}
+	ingest_finish(&ing);
 
-	close_input(ctxp);
-	if (!ctx.quiet)
-		printf("pesigcheck: \"%s\" is %s.\n", ctx.infile,
-			rc >= 0 ? "valid" : "invalid");
-	pesigcheck_context_fini(&ctx);
+	if (chk.archive)
+		ninvalid += check_archive(&chk);
 
-	NSS_Shutdown();
+	free_strings(chk.infiles, chk.ninfiles);
+	free_strings(chk.catalogs, chk.ncatalogs);
+	libpesign_free(chk.lib);
 
-	return (rc < 0);
+	return (ninvalid != 0);
 }
@@ -24,13 +24,17 @@
 
 #include "efitypes.h"
 #include "cms_common.h"
+#include "catalog.h"
 #include "pesigcheck_context.h"
 #include "certdb.h"
+#include "ingest.h"
+#include "archive.h"
 
 #include "util.h"
 #include "endian.h"
 #include "oid.h"
 #include "wincert.h"
+#include "page_hash.h"
 #include "content_info.h"
 #include "signer_info.h"
 #include "signed_data.h"
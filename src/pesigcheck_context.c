@@ -69,7 +69,15 @@ pesigcheck_context_fini(pesigcheck_context *ctx)
 
 	cms_context_fini(ctx->cms_ctx);
 
-	xfree(ctx->infile);
+	catalog_index_free(ctx->catalogs);
+	ctx->catalogs = NULL;
+
+	while (ctx->chains) {
+		chain_memo *memo = ctx->chains;
+		ctx->chains = memo->next;
+		free(memo);
+	}
+	ctx->nchains = 0;
 
 	if (ctx->inpe) {
 		pe_end(ctx->inpe);
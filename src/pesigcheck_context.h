@@ -20,6 +20,7 @@
 #define pesigcheck_CONTEXT_H 1
 
 #include <cert.h>
+#include <prerror.h>
 #include <secpkcs7.h>
 
 enum {
@@ -52,20 +53,36 @@ struct hashlist {
 };
 typedef struct hashlist hashlist;
 
+/* how checking a signer's chain to one db entry came out; see certdb.c */
+struct chain_memo {
+	uint8_t key[32];
+	PRTime not_before;
+	PRTime not_after;
+	int trusted;
+	PRErrorCode error;
+	struct chain_memo *next;
+};
+typedef struct chain_memo chain_memo;
+
 typedef struct pesigcheck_context {
 	int flags;
 
-	char *infile;
 	int infd;
 	Pe *inpe;
 
-	int quiet;
+	/* check only these sections or offsets, against page hashes */
+	char *verify_pages;
 
 	hashlist *hashes;
 
 	dblist *db;
 	dblist *dbx;
 
+	chain_memo *chains;
+	int nchains;
+
+	catalog_index *catalogs;
+
 	cms_context *cms_ctx;
 } pesigcheck_context;
 
@@ -50,7 +50,10 @@
 #define EXPORT_PUBKEY		0x400
 #define EXPORT_CERT		0x800
 #define DAEMONIZE		0x1000
-#define FLAG_LIST_END		0x2000
+#define IMPORT_SESSION		0x2000
+#define EXPORT_SESSION		0x4000
+#define EXPORT_CATALOG		0x8000
+#define FLAG_LIST_END		0x10000
 
 static struct {
 	int flag;
@@ -63,11 +66,14 @@ static struct {
 	{IMPORT_SIGNATURE, "import-sig"},
 	{IMPORT_SATTRS, "import-sattrs" },
 	{EXPORT_SATTRS, "export-sattrs" },
+	{IMPORT_SESSION, "import-session" },
+	{EXPORT_SESSION, "export-session" },
 	{EXPORT_SIGNATURE, "export-sig"},
 	{EXPORT_PUBKEY, "export-pubkey"},
 	{EXPORT_CERT, "export-cert"},
 	{REMOVE_SIGNATURE, "remove"},
 	{LIST_SIGNATURES, "list"},
+	{EXPORT_CATALOG, "export-catalog"},
 	{FLAG_LIST_END, NULL},
 };
 
@@ -90,8 +96,8 @@ open_input(pesign_context *ctx)
 
 	struct stat statbuf;
 	ctx->infd = open(ctx->infile, O_RDONLY|O_CLOEXEC);
-	stat(ctx->infile, &statbuf);
-	ctx->outmode = statbuf.st_mode;
+	if (ctx->infd >= 0 && fstat(ctx->infd, &statbuf) == 0)
+		ctx->outmode = statbuf.st_mode;
 
 	if (ctx->infd < 0) {
 		fprintf(stderr, "pesign: Error opening input: %m\n");
@@ -258,6 +264,60 @@ close_sattr_output(pesign_context *ctx)
 	ctx->outsattrsfd = -1;
 }
 
+static void
+open_session_input(pesign_context *ctx)
+{
+	if (!ctx->insession) {
+		fprintf(stderr, "pesign: No input file specified.\n");
+		exit(1);
+	}
+
+	ctx->insessionfd = open(ctx->insession, O_RDONLY|O_CLOEXEC);
+	if (ctx->insessionfd < 0) {
+		fprintf(stderr, "pesign: Error opening signing session "
+				"for input: %m\n");
+		exit(1);
+	}
+}
+
+static void
+close_session_input(pesign_context *ctx)
+{
+	close(ctx->insessionfd);
+	ctx->insessionfd = -1;
+}
+
+static void
+open_session_output(pesign_context *ctx)
+{
+	if (!ctx->outsession) {
+		fprintf(stderr, "pesign: No output file specified.\n");
+		exit(1);
+	}
+
+	if (access(ctx->outsession, F_OK) == 0 && ctx->force == 0) {
+		fprintf(stderr, "pesign: \"%s\" exists and --force "
+				"was not given.\n", ctx->outsession);
+		exit(1);
+	}
+
+	ctx->outsessionfd = open(ctx->outsession,
+			O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,
+			ctx->outmode);
+	if (ctx->outsessionfd < 0) {
+		fprintf(stderr, "pesign: Error opening signing session "
+				"for output: %m\n");
+		exit(1);
+	}
+}
+
+static void
+close_session_output(pesign_context *ctx)
+{
+	close(ctx->outsessionfd);
+	ctx->outsessionfd = -1;
+}
+
 static void
 open_sig_input(pesign_context *ctx)
 {
@@ -311,6 +371,25 @@ close_sig_output(pesign_context *ctx)
 	ctx->outsigfd = -1;
 }
 
+static void
+open_catalog_output(pesign_context *ctx)
+{
+	if (access(ctx->outcatalog, F_OK) == 0 && ctx->force == 0) {
+		fprintf(stderr, "pesign: \"%s\" exists and --force "
+				"was not given.\n", ctx->outcatalog);
+		exit(1);
+	}
+
+	ctx->outcatalogfd = open(ctx->outcatalog,
+				 O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,
+				 ctx->outmode);
+	if (ctx->outcatalogfd < 0) {
+		fprintf(stderr, "pesign: Error opening catalog for output: "
+				"%m\n");
+		exit(1);
+	}
+}
+
 static void
 open_pubkey_output(pesign_context *ctx)
 {
@@ -377,8 +456,63 @@ check_inputs(pesign_context *ctx)
 	}
 }
 
+/*
+ * Sign with a running pesignd, if it has the key we want.  The output is
+ * opened (and refused) the same way as when we sign ourselves, and if the
+ * daemon won't do it, whatever we created is cleaned up again so the local
+ * path finds things as they were.
+ */
+static int
+try_daemon(pesign_context *ctx, char *sockpath, char *tokenname,
+	   char *certname, int attached)
+{
+	char *outfile = attached ? ctx->outfile : ctx->outsig;
+	struct stat statbuf;
+
+	if (attached)
+		check_inputs(ctx);
+	if (!ctx->infile || !outfile)
+		return DELEGATE_DECLINED;
+
+	/* the daemon needs something it can map */
+	if (stat(ctx->infile, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+		return DELEGATE_DECLINED;
+	/* what open_input() would have set it to */
+	ctx->outmode = statbuf.st_mode;
+
+	int exists = access(outfile, F_OK) == 0;
+	if (exists) {
+		if (ctx->force == 0) {
+			fprintf(stderr, "pesign: \"%s\" exists and --force "
+					"was not given.\n", outfile);
+			exit(1);
+		}
+		if (stat(outfile, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+			return DELEGATE_DECLINED;
+	}
+
+	int infd = open(ctx->infile, O_RDONLY|O_CLOEXEC);
+	if (infd < 0)
+		return DELEGATE_DECLINED;
+
+	int outfd = open(outfile, O_RDWR|O_CREAT|O_CLOEXEC, ctx->outmode);
+	if (outfd < 0) {
+		close(infd);
+		return DELEGATE_DECLINED;
+	}
+
+	int rc = delegate_sign(sockpath ? sockpath : SOCKPATH, infd, outfd,
+			       tokenname, certname, attached, ctx->verbose);
+	close(infd);
+	close(outfd);
+
+	if (rc == DELEGATE_DECLINED && !exists)
+		unlink(outfile);
+	return rc;
+}
+
 static void
-print_digest(pesign_context *pctx)
+print_digest(pesign_context *pctx, const char *path)
 {
 	if (!pctx)
 		return;
@@ -392,9 +526,76 @@ print_digest(pesign_context *pctx)
 	for (unsigned int i = 0; i < ctx->digests[j].pe_digest->len; i++)
 		printf("%02x",
 			(unsigned char)ctx->digests[j].pe_digest->data[i]);
+	if (path)
+		printf(" %s", path);
 	printf("\n");
 }
 
+/*
+ * Print the digest of every PE binary in a cpio or tar stream, straight
+ * from the stream, without putting anything on disk.
+ */
+static int
+hash_archive(pesign_context *ctx, const char *name, int padding)
+{
+	int fd = STDIN_FILENO;
+	archive ar;
+	archive_member member;
+	int nfailed = 0;
+	int rc;
+
+	if (strcmp(name, "-")) {
+		fd = open(name, O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "pesign: Error opening archive "
+				"\"%s\": %m\n", name);
+			exit(1);
+		}
+	}
+
+	if (archive_open(&ar, fd) < 0) {
+		fprintf(stderr, "pesign: could not read archive \"%s\": %m\n",
+			name);
+		exit(1);
+	}
+
+	while ((rc = archive_next(&ar, &member)) > 0) {
+		if (member.error) {
+			fprintf(stderr, "pesign: could not read \"%s\": %s\n",
+				member.path, strerror(member.error));
+			nfailed++;
+			continue;
+		}
+
+		Pe *pe = pe_memory(member.data, member.size);
+		if (!pe) {
+			fprintf(stderr, "pesign: could not load \"%s\": %s\n",
+				member.path, pe_errmsg(pe_errno()));
+			nfailed++;
+			continue;
+		}
+
+		if (generate_digest(ctx->cms_ctx, pe, padding) < 0) {
+			fprintf(stderr, "pesign: could not hash \"%s\"\n",
+				member.path);
+			nfailed++;
+		} else {
+			print_digest(ctx, member.path);
+		}
+		pe_end(pe);
+	}
+	if (rc < 0) {
+		fprintf(stderr, "pesign: could not read archive \"%s\": %m\n",
+			name);
+		nfailed++;
+	}
+
+	archive_close(&ar);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return nfailed ? -1 : 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -403,9 +604,14 @@ main(int argc, char *argv[])
 	pesign_context *ctxp;
 
 	int list = 0;
+	char *list_format = "text";
 	int remove = 0;
 	int daemon = 0;
-	int fork = 1;
+	daemon_options daemon_opts = {
+		.do_fork = 1,
+		.token_interval = 60,
+		.audit_wait = AUDIT_FULL_WAIT_MSECS,
+	};
 	int padding = 0;
 	int need_db = 0;
 
@@ -413,8 +619,14 @@ main(int argc, char *argv[])
 	char *tokenname = "NSS Certificate DB";
 	char *origtoken = tokenname;
 	char *certname = NULL;
-	char *certdir = "/etc/pki/pesign";
+	char *certdir = DEFAULT_CERTDIR;
+	char *sockpath = NULL;
+	int local = 0;
+	int page_hashes = 0;
+	char *archive_name = NULL;
 	char *signum = NULL;
+	char *helper = NULL;
+	char *tsa_url = NULL;
 
 	rc = pesign_context_new(&ctxp);
 	if (rc < 0) {
@@ -468,6 +680,12 @@ main(int argc, char *argv[])
 		 .arg = &ctxp->hash,
 		 .val = 1,
 		 .descrip = "hash binary" },
+		{.longName = "archive",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &archive_name,
+		 .descrip = "with --hash, hash the binaries in a cpio or tar "
+			    "stream (\"-\" for stdin)",
+		 .argDescrip = "<archive>" },
 		{.longName = "digest_type",
 		 .shortName = 'd',
 		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
@@ -490,12 +708,52 @@ main(int argc, char *argv[])
 		 .arg = &ctxp->insattrs,
 		 .descrip = "import signed attributes from file",
 		 .argDescrip = "<signed_attributes_file>" },
+		{.longName = "export-session",
+		 .shortName = 'X',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_DOC_HIDDEN,
+		 .arg = &ctxp->outsession,
+		 .descrip = "export signing session to file",
+		 .argDescrip = "<session_file>" },
+		{.longName = "import-session",
+		 .shortName = 'x',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_DOC_HIDDEN,
+		 .arg = &ctxp->insession,
+		 .descrip = "import signing session from file",
+		 .argDescrip = "<session_file>" },
 		{.longName = "import-raw-signature",
 		 .shortName = 'R',
 		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_DOC_HIDDEN,
 		 .arg = &ctxp->rawsig,
 		 .descrip = "import raw signature from file",
 		 .argDescrip = "<inraw>" },
+		{.longName = "signer-helper",
+		 .shortName = 'H',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &helper,
+		 .descrip = "use an external program to make signatures",
+		 .argDescrip = "<command>" },
+		{.longName = "timestamp-url",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &tsa_url,
+		 .descrip = "countersign signatures with a timestamp from this "
+			    "RFC 3161 server",
+		 .argDescrip = "<url>" },
+		{.longName = "socket",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &sockpath,
+		 .descrip = "sign with the pesignd listening on this socket "
+			    "if it can",
+		 .argDescrip = "<socket>" },
+		{.longName = "local",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &local,
+		 .val = 1,
+		 .descrip = "never hand signing to a running pesignd" },
+		{.longName = "page-hashes",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &page_hashes,
+		 .val = 1,
+		 .descrip = "also sign a hash of each page of the binary" },
 		{.longName = "signature-number",
 		 .shortName = 'u',
 		 .argInfo = POPT_ARG_STRING,
@@ -518,6 +776,23 @@ main(int argc, char *argv[])
 		 .arg = &list,
 		 .val = 1,
 		 .descrip = "show signature" },
+		{.longName = "format",
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &list_format,
+		 .descrip = "output format for --show-signature",
+		 .argDescrip = "{text|json}" },
+		{.longName = "no-verify",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &ctxp->list_verify,
+		 .val = 0,
+		 .descrip = "don't verify signatures while listing them" },
+		{.longName = "jobs",
+		 .shortName = 'j',
+		 .argInfo = POPT_ARG_INT,
+		 .arg = &ctxp->list_jobs,
+		 .descrip = "list signatures of, make a catalog of, or sign "
+			    "this many files at once",
+		 .argDescrip = "<count>" },
 		{.longName = "remove-signature",
 		 .shortName = 'r',
 		 .argInfo = POPT_ARG_VAL,
@@ -530,6 +805,19 @@ main(int argc, char *argv[])
 		 .arg = &ctxp->outsig,
 		 .descrip = "export signature to file",
 		 .argDescrip = "<outsig>" },
+		{.longName = "manifest",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &ctxp->manifest,
+		 .descrip = "with --sign, sign each input file listed in this "
+			    "file to the output file beside it (\"-\" for "
+			    "stdin)",
+		 .argDescrip = "<manifest>" },
+		{.longName = "catalog",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &ctxp->outcatalog,
+		 .descrip = "sign the input files with one catalog, and "
+			    "write it to this file",
+		 .argDescrip = "<outcat>" },
 		{.longName = "export-pubkey",
 		 .shortName = 'K',
 		 .argInfo = POPT_ARG_STRING,
@@ -557,8 +845,55 @@ main(int argc, char *argv[])
 		{.longName = "nofork",
 		 .shortName = 'N',
 		 .argInfo = POPT_ARG_VAL,
-		 .arg = &fork,
+		 .arg = &daemon_opts.do_fork,
 		 .descrip = "don't fork when daemonizing" },
+		{.longName = "idle-timeout",
+		 .shortName = 'T',
+		 .argInfo = POPT_ARG_INT,
+		 .arg = &daemon_opts.idle_timeout,
+		 .descrip = "exit after this many idle seconds when socket "
+			    "activated",
+		 .argDescrip = "<seconds>" },
+		{.longName = "audit-log",
+		 .shortName = 'A',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &daemon_opts.audit_log,
+		 .descrip = "write a binary audit record for every signing "
+			    "request to this file",
+		 .argDescrip = "<file>" },
+		{.longName = "audit-syslog",
+		 .shortName = 'y',
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &daemon_opts.audit_syslog,
+		 .val = 1,
+		 .descrip = "also send audit records to syslog" },
+		{.longName = "audit-wait",
+		 .shortName = 'W',
+		 .argInfo = POPT_ARG_INT,
+		 .arg = &daemon_opts.audit_wait,
+		 .descrip = "how long to wait for room in the audit log before "
+			    "dropping a record",
+		 .argDescrip = "<milliseconds>" },
+		{.longName = "log-requests",
+		 .shortName = 'g',
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &daemon_opts.log_requests,
+		 .val = 1,
+		 .descrip = "send routine messages about each request to "
+			    "syslog" },
+		{.longName = "token-check-interval",
+		 .shortName = 'L',
+		 .argInfo = POPT_ARG_INT,
+		 .arg = &daemon_opts.token_interval,
+		 .descrip = "check on unlocked tokens this often (0 to never)",
+		 .argDescrip = "<seconds>" },
+		{.longName = "keep-pins",
+		 .shortName = 'k',
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &daemon_opts.keep_pins,
+		 .val = 1,
+		 .descrip = "remember token PINs so logged out tokens can be "
+			    "logged back in to" },
 		{.longName = "verbose",
 		 .shortName = 'v',
 		 .argInfo = POPT_ARG_VAL,
@@ -594,14 +929,38 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (poptPeekArg(optCon)) {
-		fprintf(stderr, "pesign: Invalid Argument: \"%s\"\n",
-				poptPeekArg(optCon));
-		exit(1);
+	/* anything left over is more files to list signatures from, or to
+	 * put in a catalog */
+	while (poptPeekArg(optCon)) {
+		char **files = realloc(ctxp->listfiles,
+				sizeof (char *) * (ctxp->nlistfiles + 1));
+		if (!files) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			exit(1);
+		}
+		ctxp->listfiles = files;
+		ctxp->listfiles[ctxp->nlistfiles] = strdup(poptGetArg(optCon));
+		if (!ctxp->listfiles[ctxp->nlistfiles]) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			exit(1);
+		}
+		ctxp->nlistfiles++;
 	}
 
 	poptFreeContext(optCon);
 
+	if (!strcmp(list_format, "text")) {
+		ctxp->list_format = LIST_FORMAT_TEXT;
+	} else if (!strcmp(list_format, "json")) {
+		ctxp->list_format = LIST_FORMAT_JSON;
+	} else {
+		fprintf(stderr, "pesign: Invalid output format \"%s\"\n",
+			list_format);
+		exit(1);
+	}
+
 	if (signum) {
 		errno = 0;
 		ctxp->signum = strtol(signum, NULL, 0);
@@ -626,6 +985,17 @@ main(int argc, char *argv[])
 	if (ctxp->outsattrs)
 		action |= EXPORT_SATTRS;
 
+	if (ctxp->outsession) {
+		action |= EXPORT_SESSION;
+		need_db = 1;
+	}
+
+	/* everything we'd want from the database is in the session */
+	if (ctxp->insession) {
+		action |= IMPORT_SESSION;
+		need_db = 0;
+	}
+
 	if (ctxp->insig)
 		action |= IMPORT_SIGNATURE;
 
@@ -648,9 +1018,12 @@ main(int argc, char *argv[])
 	if (list != 0)
 		action |= LIST_SIGNATURES;
 
+	if (ctxp->outcatalog)
+		action |= EXPORT_CATALOG;
+
 	if (ctxp->sign) {
 		action |= GENERATE_SIGNATURE;
-		if (!(action & EXPORT_SIGNATURE))
+		if (!(action & (EXPORT_SIGNATURE|EXPORT_CATALOG)))
 			action |= IMPORT_SIGNATURE;
 		need_db = 1;
 	}
@@ -658,6 +1031,61 @@ main(int argc, char *argv[])
 	if (ctxp->hash)
 		action |= GENERATE_DIGEST|PRINT_DIGEST;
 
+	if (archive_name && action != (GENERATE_DIGEST|PRINT_DIGEST)) {
+		fprintf(stderr, "pesign: --archive only works with --hash\n");
+		exit(1);
+	}
+
+	/* signing a directory of files into another, or a manifest's worth */
+	struct stat statbuf;
+	int many = ctxp->manifest || (ctxp->infile &&
+				      stat(ctxp->infile, &statbuf) == 0 &&
+				      S_ISDIR(statbuf.st_mode));
+	if (many) {
+		if (action != (IMPORT_SIGNATURE|GENERATE_SIGNATURE)) {
+			fprintf(stderr, "pesign: %s only works with --sign\n",
+				ctxp->manifest ? "--manifest"
+					       : "an input directory");
+			exit(1);
+		}
+		if (ctxp->manifest && (ctxp->infile || ctxp->outfile)) {
+			fprintf(stderr, "pesign: --manifest can't be used with "
+				"--in or --out\n");
+			exit(1);
+		}
+		if (ctxp->signum >= 0) {
+			fprintf(stderr, "pesign: --signature-number can't be "
+				"used when signing many files\n");
+			exit(1);
+		}
+	}
+
+	if (ctxp->nlistfiles && action != LIST_SIGNATURES &&
+	    action != (EXPORT_CATALOG|GENERATE_SIGNATURE)) {
+		fprintf(stderr, "pesign: Invalid Argument: \"%s\"\n",
+			ctxp->listfiles[0]);
+		exit(1);
+	}
+
+	/*
+	 * The daemon on the default socket uses the default database, so
+	 * it only gets the job if we're using that too, or we were told
+	 * which daemon to use.
+	 */
+	if (!local && !many && !helper && !tsa_url && !page_hashes &&
+	    !strcmp(digest_name, "sha256") && certname &&
+	    (sockpath || !strcmp(certdir, DEFAULT_CERTDIR))) {
+		rc = DELEGATE_DECLINED;
+		if (action == (IMPORT_SIGNATURE|GENERATE_SIGNATURE) &&
+		    ctxp->signum < 0)
+			rc = try_daemon(ctxp, sockpath, tokenname, certname, 1);
+		else if (action == (EXPORT_SIGNATURE|GENERATE_SIGNATURE) &&
+			 !ctxp->ascii)
+			rc = try_daemon(ctxp, sockpath, tokenname, certname, 0);
+		if (rc != DELEGATE_DECLINED)
+			exit(rc < 0);
+	}
+
 	if (!daemon) {
 		SECStatus status;
 		if (need_db) {
@@ -711,6 +1139,8 @@ main(int argc, char *argv[])
 	if (tokenname != origtoken)
 		free(tokenname);
 
+	ctxp->cms_ctx->page_hashes = page_hashes;
+
 	ctxp->cms_ctx->certname = certname ?
 		PORT_ArenaStrdup(ctxp->cms_ctx->arena, certname) : NULL;
 	if (certname && !ctxp->cms_ctx->certname) {
@@ -721,6 +1151,26 @@ main(int argc, char *argv[])
 	if (certname)
 		free(certname);
 
+	if (helper) {
+		rc = signer_helper_new(ctxp->cms_ctx, helper);
+		if (rc < 0) {
+			fprintf(stderr, "pesign: could not set up signer "
+				"helper\n");
+			exit(1);
+		}
+		free(helper);
+	}
+
+	if (tsa_url) {
+		rc = timestamp_client_new(ctxp->cms_ctx, tsa_url);
+		if (rc < 0) {
+			fprintf(stderr, "pesign: could not set up timestamp "
+				"server \"%s\"\n", tsa_url);
+			exit(1);
+		}
+		free(tsa_url);
+	}
+
 
 	if (ctxp->sign) {
 		if (!ctxp->cms_ctx->certname) {
@@ -767,6 +1217,32 @@ main(int argc, char *argv[])
 			insert_signature(ctxp->cms_ctx, ctxp->signum);
 			close_output(ctxp);
 			break;
+		/* the same, but the signed attributes and certificate chain
+		 * come from the session saved when the signed attributes were
+		 * exported, so we don't need the signer's certificate in a
+		 * database.  The binary is only hashed once, to check that
+		 * it's the one the session is for.
+		 */
+		case IMPORT_RAW_SIGNATURE|IMPORT_SESSION:
+			check_inputs(ctxp);
+			open_session_input(ctxp);
+			import_session(ctxp);
+			close_session_input(ctxp);
+			open_rawsig_input(ctxp);
+			import_raw_signature(ctxp);
+			close_rawsig_input(ctxp);
+
+			open_input(ctxp);
+			open_output(ctxp);
+			close_input(ctxp);
+			check_session_digest(ctxp);
+			sigspace = calculate_signature_space(ctxp->cms_ctx,
+								ctxp->outpe);
+			allocate_signature_space(ctxp->outpe, sigspace);
+			generate_signature(ctxp->cms_ctx);
+			insert_signature(ctxp->cms_ctx, ctxp->signum);
+			close_output(ctxp);
+			break;
 		case EXPORT_SATTRS:
 			open_input(ctxp);
 			open_sattr_output(ctxp);
@@ -775,6 +1251,23 @@ main(int argc, char *argv[])
 			close_sattr_output(ctxp);
 			close_input(ctxp);
 			break;
+		case EXPORT_SATTRS|EXPORT_SESSION:
+			rc = find_certificate(ctxp->cms_ctx, 0);
+			if (rc < 0) {
+				fprintf(stderr, "pesign: Could not find "
+					"certificate %s\n",
+					ctxp->cms_ctx->certname);
+				exit(1);
+			}
+			open_input(ctxp);
+			open_sattr_output(ctxp);
+			open_session_output(ctxp);
+			generate_digest(ctxp->cms_ctx, ctxp->inpe, 1);
+			generate_sattr_blob(ctxp);
+			close_session_output(ctxp);
+			close_sattr_output(ctxp);
+			close_input(ctxp);
+			break;
 		/* add a signature from a file */
 		case IMPORT_SIGNATURE:
 			check_inputs(ctxp);
@@ -861,13 +1354,20 @@ main(int argc, char *argv[])
 			break;
 		/* list signatures in the binary */
 		case LIST_SIGNATURES:
-			open_input(ctxp);
-			list_signatures(ctxp);
+			rc = list_signatures(ctxp);
+			if (rc < 0)
+				exit(1);
 			break;
 		case GENERATE_DIGEST|PRINT_DIGEST:
+			if (archive_name) {
+				rc = hash_archive(ctxp, archive_name, padding);
+				if (rc < 0)
+					exit(1);
+				break;
+			}
 			open_input(ctxp);
 			generate_digest(ctxp->cms_ctx, ctxp->inpe, padding);
-			print_digest(ctxp);
+			print_digest(ctxp, NULL);
 			break;
 		/* generate a signature and save it in a separate file */
 		case EXPORT_SIGNATURE|GENERATE_SIGNATURE:
@@ -884,9 +1384,26 @@ main(int argc, char *argv[])
 			generate_signature(ctxp->cms_ctx);
 			export_signature(ctxp->cms_ctx, ctxp->outsigfd, ctxp->ascii);
 			break;
+		/* sign many binaries with one catalog */
+		case EXPORT_CATALOG|GENERATE_SIGNATURE:
+			rc = find_certificate(ctxp->cms_ctx, 1);
+			if (rc < 0) {
+				fprintf(stderr, "pesign: Could not find "
+					"certificate %s\n",
+					ctxp->cms_ctx->certname);
+				exit(1);
+			}
+			open_catalog_output(ctxp);
+			rc = sign_catalog(ctxp);
+			if (rc < 0) {
+				unlink(ctxp->outcatalog);
+				exit(1);
+			}
+			break;
 		/* generate a signature and embed it in the binary */
 		case IMPORT_SIGNATURE|GENERATE_SIGNATURE:
-			check_inputs(ctxp);
+			if (!many)
+				check_inputs(ctxp);
 			rc = find_certificate(ctxp->cms_ctx, 1);
 			if (rc < 0) {
 				fprintf(stderr, "pesign: Could not find "
@@ -894,6 +1411,12 @@ main(int argc, char *argv[])
 					ctxp->cms_ctx->certname);
 				exit(1);
 			}
+			if (many) {
+				rc = sign_files(ctxp);
+				if (rc < 0)
+					exit(1);
+				break;
+			}
 			if (ctxp->signum > ctxp->cms_ctx->num_signatures + 1) {
 				fprintf(stderr, "Invalid signature number.\n");
 				exit(1);
@@ -911,7 +1434,8 @@ main(int argc, char *argv[])
 			close_output(ctxp);
 			break;
 		case DAEMONIZE:
-			rc = daemonize(ctxp->cms_ctx, certdir, fork);
+			daemon_opts.certdir = certdir;
+			rc = daemonize(ctxp->cms_ctx, &daemon_opts);
 			break;
 		default:
 			fprintf(stderr, "Incompatible flags (0x%08x): ", action);
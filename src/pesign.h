@@ -23,15 +23,26 @@
 #include <libdpe/pe.h>
 
 #include "cms_common.h"
+#include "catalog.h"
+#include "signer_helper.h"
+#include "timestamp.h"
 #include "pesign_context.h"
 
 #include "daemon.h"
+#include "delegate.h"
+#include "audit_log.h"
+#include "scheduler.h"
+#include "token_monitor.h"
+#include "ingest.h"
+#include "archive.h"
+#include "remote.h"
 #include "util.h"
 #include "efitypes.h"
 #include "actions.h"
 #include "endian.h"
 #include "oid.h"
 #include "wincert.h"
+#include "page_hash.h"
 #include "content_info.h"
 #include "signer_info.h"
 #include "signed_data.h"
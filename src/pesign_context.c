@@ -62,11 +62,14 @@ pesign_context_init(pesign_context *ctx)
 	ctx->rawsigfd = -1;
 	ctx->insattrsfd = -1;
 	ctx->outsattrsfd = -1;
+	ctx->insessionfd = -1;
+	ctx->outsessionfd = -1;
 
 	ctx->insigfd = -1;
 	ctx->outsigfd = -1;
 	ctx->outkeyfd = -1;
 	ctx->outcertfd = -1;
+	ctx->outcatalogfd = -1;
 
 	ctx->signum = -1;
 
@@ -74,6 +77,8 @@ pesign_context_init(pesign_context *ctx)
 	ctx->sign = 0;
 	ctx->hash = 0;
 
+	ctx->list_verify = 1;
+
 	int rc = cms_context_alloc(&ctx->cms_ctx);
 	if (rc < 0)
 		return rc;
@@ -105,15 +110,24 @@ pesign_context_fini(pesign_context *ctx)
 	xfree(ctx->outfile);
 	xfree(ctx->infile);
 
+	for (int i = 0; i < ctx->nlistfiles; i++)
+		free(ctx->listfiles[i]);
+	xfree(ctx->listfiles);
+	ctx->nlistfiles = 0;
+	xfree(ctx->manifest);
+
 	xfree(ctx->rawsig);
 	xfree(ctx->insattrs);
 	xfree(ctx->outsattrs);
+	xfree(ctx->insession);
+	xfree(ctx->outsession);
 
 	xfree(ctx->insig);
 	xfree(ctx->outsig);
 
 	xfree(ctx->outkey);
 	xfree(ctx->outcert);
+	xfree(ctx->outcatalog);
 
 	if (ctx->rawsigfd >= 0) {
 		close(ctx->rawsigfd);
@@ -127,6 +141,14 @@ pesign_context_fini(pesign_context *ctx)
 		close(ctx->outsattrsfd);
 		ctx->outsattrsfd = -1;
 	}
+	if (ctx->insessionfd >= 0) {
+		close(ctx->insessionfd);
+		ctx->insessionfd = -1;
+	}
+	if (ctx->outsessionfd >= 0) {
+		close(ctx->outsessionfd);
+		ctx->outsessionfd = -1;
+	}
 
 	if (ctx->insigfd >= 0) {
 		close(ctx->insigfd);
@@ -148,6 +170,11 @@ pesign_context_fini(pesign_context *ctx)
 		ctx->outcertfd = -1;
 	}
 
+	if (ctx->outcatalogfd >= 0) {
+		close(ctx->outcatalogfd);
+		ctx->outcatalogfd = -1;
+	}
+
 	if (ctx->cinfo) {
 		SEC_PKCS7DestroyContentInfo(ctx->cinfo);
 		ctx->cinfo = NULL;
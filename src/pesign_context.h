@@ -26,6 +26,11 @@ enum {
 	PESIGN_C_ALLOCATED = 1,
 };
 
+typedef enum {
+	LIST_FORMAT_TEXT,
+	LIST_FORMAT_JSON,
+} list_format;
+
 typedef struct {
 	int infd;
 	int outfd;
@@ -42,6 +47,10 @@ typedef struct {
 	int insattrsfd;
 	char *outsattrs;
 	int outsattrsfd;
+	char *insession;
+	int insessionfd;
+	char *outsession;
+	int outsessionfd;
 
 	char *insig;
 	int insigfd;
@@ -55,6 +64,9 @@ typedef struct {
 	char *outcert;
 	int outcertfd;
 
+	char *outcatalog;
+	int outcatalogfd;
+
 	Pe *inpe;
 	Pe *outpe;
 
@@ -67,6 +79,16 @@ typedef struct {
 	int ascii;
 	int sign;
 	int hash;
+
+	/* --list-signatures, and --catalog */
+	list_format list_format;
+	int list_verify;
+	int list_jobs;
+	char **listfiles;
+	int nlistfiles;
+
+	/* signing a directory, or the files a manifest lists */
+	char *manifest;
 } pesign_context;
 
 extern int pesign_context_new(pesign_context **ctx);
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <prerror.h>
+#include <prio.h>
+
+#include "pesign.h"
+
+/*
+ * Both of these give up if the other side goes quiet for GATEWAY_TIMEOUT
+ * seconds; the reason is left in the NSPR error.
+ */
+int
+remote_read(PRFileDesc *fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		PRInt32 n = PR_Recv(fd, p, len > INT32_MAX ? INT32_MAX : len,
+				    0, PR_SecondsToInterval(GATEWAY_TIMEOUT));
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			PR_SetError(PR_END_OF_FILE_ERROR, 0);
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+remote_write(PRFileDesc *fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		PRInt32 n = PR_Send(fd, p, len > INT32_MAX ? INT32_MAX : len,
+				    0, PR_SecondsToInterval(GATEWAY_TIMEOUT));
+		if (n < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * "host:port", "[v6 address]:port", or just "port", in which case *host is
+ * NULL.
+ */
+int
+remote_parse_address(const char *spec, char **host, PRUint16 *port)
+{
+	const char *colon = strrchr(spec, ':');
+	const char *portstr = colon ? colon + 1 : spec;
+	char *end = NULL;
+
+	errno = 0;
+	unsigned long val = strtoul(portstr, &end, 10);
+	if (errno || !*portstr || *end || val == 0 || val > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	*port = val;
+	*host = NULL;
+
+	if (!colon)
+		return 0;
+
+	const char *start = spec;
+	size_t len = colon - spec;
+	if (len >= 2 && spec[0] == '[' && spec[len - 1] == ']') {
+		start++;
+		len -= 2;
+	}
+	if (len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*host = strndup(start, len);
+	if (!*host)
+		return -1;
+	return 0;
+}
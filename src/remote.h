@@ -0,0 +1,55 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef REMOTE_H
+#define REMOTE_H 1
+
+#include <prio.h>
+
+/*
+ * pesign-gateway lets machines that can't reach pesignd's unix socket use
+ * it over TLS, with both ends authenticated by certificate.  It speaks the
+ * same messages as pesignd does, but since file descriptors can't be sent
+ * over the network, a request carries what they would have pointed to:
+ *
+ *   CMD_SIGN_ATTACHED, CMD_SIGN_DETACHED: the token name and certificate
+ *	nickname as pesignd_strings, and then the rest of the message is
+ *	the PE binary.
+ *   CMD_SIGN_DIGEST: the token name, certificate nickname, and digest name
+ *	as pesignd_strings, and then the Authenticode digest in the same
+ *	wrapper.  Only the digest ever crosses the network.
+ *
+ * The answer is a CMD_RESPONSE whose payload is the int32_t rc, the error
+ * message as a pesignd_string (of size 0 if there isn't one), and then the
+ * rest of the message is the signed binary or the detached signature.  A
+ * connection may carry any number of requests, one after another.
+ */
+#define GATEWAY_CERTDIR		"/etc/pki/pesign-gateway"
+#define GATEWAY_CLIENTS		"/etc/pesign/gateway-clients"
+#define GATEWAY_MAX_MESSAGE	(512 * 1024 * 1024)
+#define GATEWAY_MAX_KEY		4096
+#define GATEWAY_MAX_RESPONSE	65536
+#define GATEWAY_CHUNK		65536
+#define GATEWAY_TIMEOUT		60
+
+extern int remote_read(PRFileDesc *fd, void *buf, size_t len);
+extern int remote_write(PRFileDesc *fd, const void *buf, size_t len);
+extern int remote_parse_address(const char *spec, char **host,
+				PRUint16 *port);
+
+#endif /* REMOTE_H */
@@ -0,0 +1,436 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "pesign.h"
+
+/* a queue with weight 1 advances this much every time it's served */
+#define VTIME_SCALE 1000000ULL
+
+#define DEFAULT_WEIGHT		1
+#define DEFAULT_MAX_DEPTH	16
+#define DEFAULT_DEADLINE	0
+
+long long
+elapsed_usecs(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000LL
+		+ (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+void
+scheduler_init(request_scheduler *sched)
+{
+	memset(sched, '\0', sizeof (*sched));
+
+	sched->defaults.name = "default";
+	sched->defaults.kind = QUEUE_DEFAULT;
+	sched->defaults.weight = DEFAULT_WEIGHT;
+	sched->defaults.priority = QUEUE_PRIORITY_NORMAL;
+	sched->defaults.max_depth = DEFAULT_MAX_DEPTH;
+	sched->defaults.deadline = DEFAULT_DEADLINE;
+}
+
+void
+free_queued_request(queued_request *req)
+{
+	if (!req)
+		return;
+
+	if (req->infd >= 0)
+		close(req->infd);
+	if (req->outfd >= 0)
+		close(req->outfd);
+	xfree(req->tokenname);
+	xfree(req->certname);
+	xfree(req->digest_name);
+	xfree(req->digest);
+	free(req);
+}
+
+void
+scheduler_fini(request_scheduler *sched)
+{
+	request_queue *queue = sched->queues;
+
+	while (queue) {
+		request_queue *next = queue->next;
+
+		while (queue->head) {
+			queued_request *req = queue->head;
+			queue->head = req->next;
+			free_queued_request(req);
+		}
+		xfree(queue->name);
+		free(queue);
+		queue = next;
+	}
+	sched->queues = NULL;
+	sched->pending = 0;
+}
+
+static request_queue *
+new_queue(request_scheduler *sched, queue_kind kind, uint32_t id,
+	  const char *fmt, const char *name)
+{
+	request_queue *queue = calloc(1, sizeof (*queue));
+	if (!queue)
+		return NULL;
+
+	memcpy(queue, &sched->defaults, sizeof (*queue));
+	queue->name = NULL;
+	queue->kind = kind;
+	queue->id = id;
+
+	int rc;
+	if (name)
+		rc = asprintf(&queue->name, fmt, name);
+	else
+		rc = asprintf(&queue->name, fmt, id);
+	if (rc < 0) {
+		free(queue);
+		return NULL;
+	}
+
+	queue->tail = &queue->head;
+	queue->next = sched->queues;
+	sched->queues = queue;
+	return queue;
+}
+
+static int
+parse_setting(request_queue *queue, char *setting)
+{
+	char *value = strchr(setting, '=');
+	if (!value)
+		return -1;
+	*value++ = '\0';
+
+	if (!strcmp(setting, "priority")) {
+		if (!strcmp(value, "high"))
+			queue->priority = QUEUE_PRIORITY_HIGH;
+		else if (!strcmp(value, "normal"))
+			queue->priority = QUEUE_PRIORITY_NORMAL;
+		else if (!strcmp(value, "low"))
+			queue->priority = QUEUE_PRIORITY_LOW;
+		else
+			return -1;
+		return 0;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	unsigned long n = strtoul(value, &end, 10);
+	if (errno != 0 || !end || *end != '\0' || n > 100000)
+		return -1;
+
+	if (!strcmp(setting, "weight")) {
+		if (n == 0)
+			return -1;
+		queue->weight = n;
+	} else if (!strcmp(setting, "depth")) {
+		queue->max_depth = n;
+	} else if (!strcmp(setting, "deadline")) {
+		queue->deadline = n;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The config file has one queue per line:
+ *
+ *	<user|group> <name> [weight=<n>] [priority=<high|normal|low>]
+ *		[depth=<n>] [deadline=<seconds>]
+ *	default [weight=<n>] [priority=...] [depth=<n>] [deadline=<seconds>]
+ *
+ * "default" sets what every other queue starts with, so it should come
+ * first.  A depth or deadline of 0 means there's no limit.  This has to be
+ * read before we drop privileges, since /etc/pesign is only readable by
+ * root.
+ */
+int
+scheduler_read_config(request_scheduler *sched, const char *path,
+		      cms_context *cms, int priority)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		cms->log(cms, priority|LOG_WARNING, "could not open \"%s\": %m",
+			path);
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+
+	while (getline(&line, &linesize, f) >= 0) {
+		char *saveptr = NULL;
+		request_queue *queue = NULL;
+
+		lineno++;
+
+		char *kind = strtok_r(line, " \t\r\n", &saveptr);
+		if (!kind || kind[0] == '#')
+			continue;
+
+		if (!strcmp(kind, "default")) {
+			queue = &sched->defaults;
+		} else if (!strcmp(kind, "user") || !strcmp(kind, "group")) {
+			char *name = strtok_r(NULL, " \t\r\n", &saveptr);
+			if (!name)
+				goto bad_line;
+
+			if (kind[0] == 'u') {
+				struct passwd *pw = getpwnam(name);
+				if (!pw) {
+					cms->log(cms, priority|LOG_WARNING,
+						"%s:%d: unknown user \"%s\"",
+						path, lineno, name);
+					continue;
+				}
+				queue = new_queue(sched, QUEUE_USER, pw->pw_uid,
+						  "user:%s", name);
+			} else {
+				struct group *gr = getgrnam(name);
+				if (!gr) {
+					cms->log(cms, priority|LOG_WARNING,
+						"%s:%d: unknown group \"%s\"",
+						path, lineno, name);
+					continue;
+				}
+				queue = new_queue(sched, QUEUE_GROUP,
+						  gr->gr_gid, "group:%s", name);
+			}
+			if (!queue) {
+				cms->log(cms, priority|LOG_ERR,
+					"could not allocate memory: %m");
+				free(line);
+				fclose(f);
+				return -1;
+			}
+		} else {
+			goto bad_line;
+		}
+
+		char *setting;
+		while ((setting = strtok_r(NULL, " \t\r\n", &saveptr))) {
+			if (parse_setting(queue, setting) < 0)
+				cms->log(cms, priority|LOG_WARNING,
+					"%s:%d: ignoring invalid setting "
+					"\"%s\"", path, lineno, setting);
+		}
+		continue;
+bad_line:
+		cms->log(cms, priority|LOG_WARNING,
+			"%s:%d: ignoring invalid line", path, lineno);
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+request_queue *
+scheduler_find_queue(request_scheduler *sched, uid_t uid, gid_t gid)
+{
+	request_queue *queue;
+
+	for (queue = sched->queues; queue; queue = queue->next) {
+		if (queue->kind == QUEUE_USER && queue->id == uid)
+			return queue;
+	}
+	for (queue = sched->queues; queue; queue = queue->next) {
+		if (queue->kind == QUEUE_GROUP && queue->id == gid)
+			return queue;
+	}
+	for (queue = sched->queues; queue; queue = queue->next) {
+		if (queue->kind == QUEUE_DYNAMIC && queue->id == uid)
+			return queue;
+	}
+
+	return new_queue(sched, QUEUE_DYNAMIC, uid, "uid:%u", NULL);
+}
+
+int
+scheduler_add(request_scheduler *sched, request_queue *queue,
+	      queued_request *req)
+{
+	if (queue->max_depth && queue->depth >= queue->max_depth) {
+		queue->rejected++;
+		return -1;
+	}
+
+	req->queue = queue;
+	req->next = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &req->arrival);
+	memset(&req->deadline, '\0', sizeof (req->deadline));
+	if (queue->deadline) {
+		req->deadline = req->arrival;
+		req->deadline.tv_sec += queue->deadline;
+	}
+
+	/* a queue that's been idle doesn't get to bank its turns */
+	if (!queue->head && queue->vtime < sched->vclock[queue->priority])
+		queue->vtime = sched->vclock[queue->priority];
+
+	*queue->tail = req;
+	queue->tail = &req->next;
+	queue->depth++;
+	sched->pending++;
+	return 0;
+}
+
+/* A guess at when the queue will have room again, in seconds. */
+unsigned int
+scheduler_retry_hint(request_queue *queue)
+{
+	uint64_t average = 1000000;
+
+	if (queue->served)
+		average = queue->service_usecs / queue->served;
+
+	uint64_t hint = (queue->depth * average + 999999) / 1000000;
+	return hint ? hint : 1;
+}
+
+static void
+unlink_request(request_scheduler *sched, queued_request **prev)
+{
+	queued_request *req = *prev;
+	request_queue *queue = req->queue;
+
+	*prev = req->next;
+	if (queue->tail == &req->next)
+		queue->tail = prev;
+	req->next = NULL;
+
+	queue->depth--;
+	sched->pending--;
+}
+
+queued_request *
+scheduler_next(request_scheduler *sched)
+{
+	if (!sched->pending)
+		return NULL;
+
+	for (int prio = 0; prio < QUEUE_PRIORITY_MAX; prio++) {
+		request_queue *best = NULL;
+
+		for (request_queue *queue = sched->queues; queue;
+				queue = queue->next) {
+			if (!queue->head || (int)queue->priority != prio)
+				continue;
+			if (!best || queue->vtime < best->vtime)
+				best = queue;
+		}
+		if (!best)
+			continue;
+
+		queued_request *req = best->head;
+		unlink_request(sched, &best->head);
+
+		sched->vclock[prio] = best->vtime;
+		best->vtime += VTIME_SCALE / best->weight;
+		return req;
+	}
+	return NULL;
+}
+
+queued_request *
+scheduler_take_expired(request_scheduler *sched, struct timespec *now)
+{
+	for (request_queue *queue = sched->queues; queue; queue = queue->next) {
+		if (!queue->deadline)
+			continue;
+
+		for (queued_request **prev = &queue->head; *prev;
+				prev = &(*prev)->next) {
+			queued_request *req = *prev;
+
+			if (elapsed_usecs(&req->deadline, now) < 0)
+				continue;
+
+			unlink_request(sched, prev);
+			queue->expired++;
+			return req;
+		}
+	}
+	return NULL;
+}
+
+queued_request *
+scheduler_cancel_fd(request_scheduler *sched, int sd)
+{
+	for (request_queue *queue = sched->queues; queue; queue = queue->next) {
+		for (queued_request **prev = &queue->head; *prev;
+				prev = &(*prev)->next) {
+			if ((*prev)->sd != sd)
+				continue;
+
+			queued_request *req = *prev;
+			unlink_request(sched, prev);
+			return req;
+		}
+	}
+	return NULL;
+}
+
+void
+scheduler_account(queued_request *req, struct timespec *start,
+		  struct timespec *end)
+{
+	request_queue *queue = req->queue;
+
+	queue->served++;
+	queue->wait_usecs += elapsed_usecs(&req->arrival, start);
+	queue->service_usecs += elapsed_usecs(start, end);
+}
+
+void
+scheduler_log_stats(request_scheduler *sched, cms_context *cms, int priority)
+{
+	for (request_queue *queue = sched->queues; queue; queue = queue->next) {
+		if (!queue->served && !queue->rejected && !queue->expired)
+			continue;
+
+		uint64_t served = queue->served ? queue->served : 1;
+		cms->log(cms, priority|LOG_NOTICE,
+			"queue %s: %llu signed, %llu rejected, %llu expired, "
+			"average wait %llu us, average signing time %llu us",
+			queue->name,
+			(unsigned long long)queue->served,
+			(unsigned long long)queue->rejected,
+			(unsigned long long)queue->expired,
+			(unsigned long long)(queue->wait_usecs / served),
+			(unsigned long long)(queue->service_usecs / served));
+	}
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * pesignd doesn't sign things in the order the connections happen to sit
+ * in its pollfd array any more.  Each signing request goes into a queue
+ * belonging to whoever sent it: the queue for their user, or for their
+ * (primary) group, if /etc/pesign/queues has an entry for either, and
+ * otherwise a queue of their own that's made on the fly with the default
+ * settings.
+ *
+ * Queues in a higher priority class are always served first.  Within a
+ * class, queues take turns in proportion to their weight, so one build
+ * tree submitting hundreds of requests can't starve everybody else.  A
+ * queue which is full rejects new requests right away, and a request that
+ * has waited past its queue's deadline is cancelled instead of signed.
+ */
+typedef enum {
+	QUEUE_PRIORITY_HIGH,
+	QUEUE_PRIORITY_NORMAL,
+	QUEUE_PRIORITY_LOW,
+	QUEUE_PRIORITY_MAX
+} queue_priority;
+
+typedef enum {
+	QUEUE_DEFAULT,
+	QUEUE_USER,
+	QUEUE_GROUP,
+	QUEUE_DYNAMIC,
+} queue_kind;
+
+struct request_queue;
+
+typedef struct queued_request {
+	struct queued_request *next;
+	struct request_queue *queue;
+	int sd;
+	uint32_t command;
+	char *tokenname;
+	char *certname;
+	char *digest_name;		/* CMD_SIGN_DIGEST only */
+	uint8_t *digest;
+	uint32_t digest_len;
+	int infd;
+	int outfd;
+	struct timespec arrival;
+	struct timespec deadline;
+	audit_record record;
+} queued_request;
+
+typedef struct request_queue {
+	struct request_queue *next;
+	char *name;
+	queue_kind kind;
+	uint32_t id;
+
+	unsigned int weight;
+	queue_priority priority;
+	unsigned int max_depth;
+	unsigned int deadline;
+
+	unsigned int depth;
+	uint64_t vtime;
+	queued_request *head;
+	queued_request **tail;
+
+	uint64_t served;
+	uint64_t rejected;
+	uint64_t expired;
+	uint64_t wait_usecs;
+	uint64_t service_usecs;
+} request_queue;
+
+typedef struct {
+	request_queue *queues;
+	request_queue defaults;
+	uint64_t vclock[QUEUE_PRIORITY_MAX];
+	unsigned int pending;
+} request_scheduler;
+
+#define SCHEDULER_CONFIG "/etc/pesign/queues"
+
+extern void scheduler_init(request_scheduler *sched);
+extern void scheduler_fini(request_scheduler *sched);
+extern int scheduler_read_config(request_scheduler *sched, const char *path,
+				 cms_context *cms, int priority);
+extern request_queue *scheduler_find_queue(request_scheduler *sched,
+					   uid_t uid, gid_t gid);
+extern int scheduler_add(request_scheduler *sched, request_queue *queue,
+			 queued_request *req);
+extern unsigned int scheduler_retry_hint(request_queue *queue);
+extern queued_request *scheduler_next(request_scheduler *sched);
+extern queued_request *scheduler_take_expired(request_scheduler *sched,
+					      struct timespec *now);
+extern queued_request *scheduler_cancel_fd(request_scheduler *sched, int sd);
+extern void scheduler_account(queued_request *req, struct timespec *start,
+			      struct timespec *end);
+extern void scheduler_log_stats(request_scheduler *sched, cms_context *cms,
+				int priority);
+extern void free_queued_request(queued_request *req);
+extern long long elapsed_usecs(struct timespec *start, struct timespec *end);
+
+#endif /* SCHEDULER_H */
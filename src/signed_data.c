@@ -21,41 +21,28 @@
 #include <syslog.h>
 
 #include "pesign.h"
+#include "signed_data_priv.h"
 
 #include <prerror.h>
 #include <nss.h>
 
-static int
+int
 generate_algorithm_id_list(cms_context *cms, SECAlgorithmID ***algorithm_list_p)
 {
 	SECAlgorithmID **algorithms = NULL;
-	int err = 0;
+
+	if (generate_signer_template(cms) < 0)
+		return -1;
 
 	algorithms = PORT_ArenaZAlloc(cms->arena, sizeof (SECAlgorithmID *) *
 						  2);
 	if (!algorithms)
 		return -1;
 
-	algorithms[0] = PORT_ArenaZAlloc(cms->arena, sizeof(SECAlgorithmID));
-	if (!algorithms[0]) {
-		err = PORT_GetError();
-		goto err_list;
-	}
-
-	if (generate_algorithm_id(cms, algorithms[0],
-			digest_get_digest_oid(cms)) < 0) {
-		err = PORT_GetError();
-		goto err_item;
-	}
+	algorithms[0] = &cms->template->digest_algorithms[cms->selected_digest];
 
 	*algorithm_list_p = algorithms;
 	return 0;
-err_item:
-	PORT_ZFree(algorithms[0], sizeof (SECAlgorithmID));
-err_list:
-	PORT_ZFree(algorithms, sizeof (SECAlgorithmID *) * 2);
-	PORT_SetError(err);
-	return -1;
 }
 
 void
@@ -73,61 +60,18 @@ free_algorithm_list(cms_context *cms __attribute__((__unused__)),
 #endif
 }
 
-static int
+int
 generate_certificate_list(cms_context *cms, SECItem ***certificate_list_p)
 {
-	SECItem **certificates = NULL;
-	void *mark = PORT_ArenaMark(cms->arena);
-
-	certificates = PORT_ArenaZAlloc(cms->arena, sizeof (SECItem *) * 3);
-	if (!certificates) {
-		save_port_err(PORT_ArenaRelease(cms->arena, mark));
-		cmsreterr(-1, cms, "could not allocate certificate list");
-	}
-	int i = 0;
-
-	certificates[i] = PORT_ArenaZAlloc(cms->arena, sizeof (SECItem));
-	if (!certificates[i]) {
-		save_port_err(PORT_ArenaRelease(cms->arena, mark));
-		cmsreterr(-1, cms, "could not allocate certificate entry");
-	}
-	SECITEM_CopyItem(cms->arena, certificates[i++], &cms->cert->derCert);
-
-	if (!is_issuer_of(cms->cert, cms->cert)) {
-		CERTCertificate *signer = NULL;
-		int rc = find_named_certificate(cms, cms->cert->issuerName,
-						&signer);
-		if (rc == 0 && signer &&
-				signer->derCert.len && signer->derCert.data) {
-			if (signer->derCert.len != cms->cert->derCert.len ||
-					memcmp(signer->derCert.data,
-						cms->cert->derCert.data,
-						signer->derCert.len)) {
-				certificates[i] = PORT_ArenaZAlloc(cms->arena,
-							sizeof (SECItem));
-				if (!certificates[i]) {
-					save_port_err(
-						PORT_ArenaRelease(cms->arena, mark));
-					cmsreterr(-1, cms,"could not allocate "
-						"certificate entry");
-				}
-				SECITEM_CopyItem(cms->arena, certificates[i++],
-						&signer->derCert);
-			}
-			CERT_DestroyCertificate(signer);
-		}
-	}
+	/* The signer's certificate and its issuer were looked up and copied
+	 * when the certificate was found; the encoder only reads these. */
+	if (generate_signer_template(cms) < 0)
+		return -1;
 
-	*certificate_list_p = certificates;
+	*certificate_list_p = cms->template->certificates;
 	return 0;
 }
 
-typedef enum {
-	PE_SIGNER_INFO,
-	AUTHVAR_SIGNER_INFO,
-	END_SIGNER_INFO_LIST
-} SignerInfoType;
-
 int
 generate_signerInfo_list(cms_context *cms, SpcSignerInfo ***signerInfo_list_p, SignerInfoType type)
 {
@@ -153,6 +97,8 @@ generate_signerInfo_list(cms_context *cms, SpcSignerInfo ***signerInfo_list_p, S
 		rc = generate_spc_signer_info(cms, signerInfo_list[0]);
 	else if (type == AUTHVAR_SIGNER_INFO)
 		rc = generate_authvar_signer_info(cms, signerInfo_list[0]);
+	else if (type == CATALOG_SIGNER_INFO)
+		rc = generate_catalog_signer_info(cms, signerInfo_list[0]);
 	else
 		goto err_item;
 	if (rc < 0) {
@@ -174,93 +120,124 @@ err_list:
 	return -1;
 }
 
-typedef struct {
-	SECItem version;
-	SECAlgorithmID **algorithms;
-	SpcContentInfo cinfo;
-	SECItem **certificates;
-	SECItem **crls;
-	SpcSignerInfo **signerInfos;
-} SignedData;
-
-SEC_ASN1Template SignedDataTemplate[] = {
-	{
-	.kind = SEC_ASN1_SEQUENCE,
-	.offset = 0,
-	.sub = NULL,
-	.size = sizeof (SignedData)
-	},
-	{
-	.kind = SEC_ASN1_INTEGER,
-	.offset = offsetof(SignedData, version),
-	.sub = &SEC_IntegerTemplate,
-	.size = sizeof (SECItem)
-	},
-	{
-	.kind = SEC_ASN1_SET_OF,
-	.offset = offsetof(SignedData, algorithms),
-	.sub = &SECOID_AlgorithmIDTemplate,
-	.size = sizeof (SECItem),
-	},
-	{
-	.kind = SEC_ASN1_INLINE,
-	.offset = offsetof(SignedData, cinfo),
-	.sub = &SpcContentInfoTemplate,
-	.size = sizeof (SpcContentInfo),
-	},
-	{
-	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 0 |
-		SEC_ASN1_CONSTRUCTED |
-		SEC_ASN1_OPTIONAL,
-	.offset = offsetof(SignedData, certificates),
-	.sub = &SEC_SetOfAnyTemplate,
-	.size = sizeof(SECItem**),
-	},
-	{
-	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 1 |
-		SEC_ASN1_CONSTRUCTED |
-		SEC_ASN1_OPTIONAL,
-	.offset = offsetof(SignedData, crls),
-	.sub = &SEC_SetOfAnyTemplate,
-	.size = sizeof (SECItem **),
-	},
-	{
-	.kind = SEC_ASN1_SET_OF,
-	.offset = offsetof(SignedData, signerInfos),
-	.sub = &SpcSignerInfoTemplate,
-	.size = 0,
-	},
-	{ 0, }
-};
-
-typedef struct {
-	SECItem contentType;
-	SECItem content;
-} ContentInfo;
-
-SEC_ASN1Template ContentInfoTemplate[] = {
-	{
-	.kind = SEC_ASN1_SEQUENCE,
-	.offset = 0,
-	.sub = NULL,
-	.size = sizeof (ContentInfo),
-	},
-	{
-	.kind = SEC_ASN1_OBJECT_ID,
-	.offset = offsetof(ContentInfo, contentType),
-	.sub = &SEC_ObjectIDTemplate,
-	.size = sizeof (SECItem),
-	},
-	{
-	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 0 |
-		SEC_ASN1_CONSTRUCTED |
-		SEC_ASN1_EXPLICIT,
-	.offset = offsetof(ContentInfo, content),
-	.sub = &SEC_AnyTemplate,
-	.size = sizeof (SECItem),
-	},
-	{ 0, }
-};
+/*
+ * What gets written, since there's no template for it any more:
+ *
+ *	ContentInfo ::= SEQUENCE {
+ *		contentType		OBJECT IDENTIFIER (pkcs7-signedData),
+ *		content			[0] EXPLICIT SignedData }
+ *
+ *	SignedData ::= SEQUENCE {
+ *		version			INTEGER,
+ *		digestAlgorithms	SET OF AlgorithmIdentifier,
+ *		contentInfo		SpcContentInfo,
+ *		certificates		[0] IMPLICIT SET OF ANY OPTIONAL,
+ *		crls			[1] IMPLICIT SET OF ANY OPTIONAL,
+ *		signerInfos		SET OF SpcSignerInfo }
+ *
+ * The lengths all get worked out first, so the whole thing goes into one
+ * buffer in one pass, rather than each level being encoded on its own and
+ * then copied into the next one out.
+ */
+static size_t
+der_items_length(SECItem **items)
+{
+	size_t len = 0;
+
+	for (int i = 0; items && items[i] != NULL; i++)
+		len += items[i]->len;
+	return len;
+}
+
+static uint8_t *
+der_put_items(uint8_t *p, uint8_t tag, SECItem **items)
+{
+	size_t len = der_items_length(items);
+
+	if (len == 0)
+		return p;
+	p = der_put_header(p, tag, len);
+	for (int i = 0; items[i] != NULL; i++)
+		p = der_put_raw(p, items[i]);
+	return p;
+}
+
+int
+encode_signed_data(cms_context *cms, SignedData *sd, SECItem *sdp)
+{
+	SECOidData *oid = SECOID_FindOIDByTag(SEC_OID_PKCS7_SIGNED_DATA);
+	size_t algorithms = 0, cinfo, certificates, crls, signer_infos = 0;
+	size_t signed_data, content_info;
+	uint8_t *buf, *p;
+
+	if (!oid)
+		cmsreterr(-1, cms, "could not find OID for SignedData");
+
+	for (int i = 0; sd->algorithms[i] != NULL; i++)
+		algorithms += der_algorithm_id_length(sd->algorithms[i]);
+
+	cinfo = der_length(sd->cinfo.contentType.len);
+	if (sd->cinfo.content.len)
+		cinfo += der_length(sd->cinfo.content.len);
+
+	certificates = der_items_length(sd->certificates);
+	crls = der_items_length(sd->crls);
+
+	for (int i = 0; sd->signerInfos[i] != NULL; i++)
+		signer_infos += der_spc_signer_info_length(sd->signerInfos[i]);
+
+	signed_data = der_integer_length(&sd->version) +
+		      der_length(algorithms) + der_length(cinfo) +
+		      (certificates ? der_length(certificates) : 0) +
+		      (crls ? der_length(crls) : 0) +
+		      der_length(signer_infos);
+	content_info = der_length(oid->oid.len) +
+		       der_length(der_length(signed_data));
+
+	sdp->type = siBuffer;
+	sdp->len = der_length(content_info);
+	sdp->data = buf = PORT_ArenaAlloc(cms->arena, sdp->len);
+	if (!buf)
+		cmsreterr(-1, cms, "could not encode SignedData");
+
+	p = der_put_header(buf, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   content_info);
+	p = der_put(p, SEC_ASN1_OBJECT_ID, oid->oid.data, oid->oid.len);
+	p = der_put_header(p, SEC_ASN1_CONTEXT_SPECIFIC | SEC_ASN1_CONSTRUCTED |
+			   0, der_length(signed_data));
+
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   signed_data);
+	p = der_put_integer(p, &sd->version);
+	p = der_put_header(p, SEC_ASN1_SET | SEC_ASN1_CONSTRUCTED, algorithms);
+	for (int i = 0; sd->algorithms[i] != NULL; i++)
+		p = der_put_algorithm_id(p, sd->algorithms[i]);
+
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED, cinfo);
+	p = der_put(p, SEC_ASN1_OBJECT_ID, sd->cinfo.contentType.data,
+		    sd->cinfo.contentType.len);
+	if (sd->cinfo.content.len)
+		p = der_put(p, SEC_ASN1_CONTEXT_SPECIFIC |
+			    SEC_ASN1_CONSTRUCTED | 0,
+			    sd->cinfo.content.data, sd->cinfo.content.len);
+
+	p = der_put_items(p, SEC_ASN1_CONTEXT_SPECIFIC | SEC_ASN1_CONSTRUCTED |
+			  0, sd->certificates);
+	p = der_put_items(p, SEC_ASN1_CONTEXT_SPECIFIC | SEC_ASN1_CONSTRUCTED |
+			  1, sd->crls);
+
+	p = der_put_header(p, SEC_ASN1_SET | SEC_ASN1_CONSTRUCTED,
+			   signer_infos);
+	for (int i = 0; sd->signerInfos[i] != NULL; i++)
+		p = der_put_spc_signer_info(p, sd->signerInfos[i]);
+
+	if (p != buf + sdp->len) {
+		cms->log(cms, LOG_ERR, "SignedData came out %td bytes, not %u",
+			 p - buf, sdp->len);
+		return -1;
+	}
+	return 0;
+}
 
 int
 generate_spc_signed_data(cms_context *cms, SECItem *sdp)
@@ -300,29 +277,11 @@ generate_spc_signed_data(cms_context *cms, SECItem *sdp)
 		return -1;
 	}
 
-	SECItem encoded = { 0, };
-	if (SEC_ASN1EncodeItem(cms->arena, &encoded, &sd, SignedDataTemplate)
-			== NULL) {
-		save_port_err(PORT_ArenaRelease(cms->arena, mark));
-		cmsreterr(-1, cms, "could not encode SignedData");
-	}
-
-	ContentInfo sdw;
-	memset(&sdw, '\0', sizeof (sdw));
-
-	SECOidData *oid = SECOID_FindOIDByTag(SEC_OID_PKCS7_SIGNED_DATA);
-
-	memcpy(&sdw.contentType, &oid->oid, sizeof (sdw.contentType));
-	memcpy(&sdw.content, &encoded, sizeof (sdw.content));
-
-	SECItem wrapper = { 0, };
-	if (SEC_ASN1EncodeItem(cms->arena, &wrapper, &sdw,
-			ContentInfoTemplate) == NULL) {
-		save_port_err(PORT_ArenaRelease(cms->arena, mark));
-		cmsreterr(-1, cms, "could not encode SignedData");
+	if (encode_signed_data(cms, &sd, sdp) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		return -1;
 	}
 
-	memcpy(sdp, &wrapper, sizeof(*sdp));
 	PORT_ArenaUnmark(cms->arena, mark);
 	return 0;
 }
@@ -365,29 +324,78 @@ generate_authvar_signed_data(cms_context *cms, SECItem *sdp)
 		return -1;
 	}
 
-	SECItem encoded = { 0, };
-	if (SEC_ASN1EncodeItem(cms->arena, &encoded, &sd, SignedDataTemplate)
-			== NULL) {
-		save_port_err(PORT_ArenaRelease(cms->arena, mark));
-		cmsreterr(-1, cms, "could not encode SignedData");
+	if (encode_signed_data(cms, &sd, sdp) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		return -1;
 	}
 
-	ContentInfo sdw;
-	memset(&sdw, '\0', sizeof (sdw));
+	PORT_ArenaUnmark(cms->arena, mark);
+	return 0;
+}
 
-	SECOidData *oid = SECOID_FindOIDByTag(SEC_OID_PKCS7_SIGNED_DATA);
+/*
+ * A catalog is signed like a binary, except that what's signed is the
+ * certificate trust list itself rather than an SpcIndirectDataContent
+ * holding the binary's digest.
+ */
+int
+generate_catalog_signed_data(cms_context *cms, SECItem *ctl, SECItem *sdp)
+{
+	SignedData sd;
 
-	memcpy(&sdw.contentType, &oid->oid, sizeof (sdw.contentType));
-	memcpy(&sdw.content, &encoded, sizeof (sdw.content));
+	if (!sdp || !ctl)
+		return -1;
+
+	memset(&sd, '\0', sizeof (sd));
+	void *mark = PORT_ArenaMark(cms->arena);
 
-	SECItem wrapper = { 0, };
-	if (SEC_ASN1EncodeItem(cms->arena, &wrapper, &sdw,
-			ContentInfoTemplate) == NULL) {
+	if (SEC_ASN1EncodeInteger(cms->arena, &sd.version, 1) == NULL) {
 		save_port_err(PORT_ArenaRelease(cms->arena, mark));
-		cmsreterr(-1, cms, "could not encode SignedData");
+		cmsreterr(-1, cms, "could not encode integer");
+	}
+
+	if (generate_algorithm_id_list(cms, &sd.algorithms) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		return -1;
+	}
+
+	if (get_ms_oid_secitem(szOID_CTL, &sd.cinfo.contentType) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		cms->log(cms, LOG_ERR, "could not get OID for szOID_CTL");
+		return -1;
+	}
+	memcpy(&sd.cinfo.content, ctl, sizeof (sd.cinfo.content));
+
+	cms->ci_digest = SECITEM_AllocItem(cms->arena, NULL,
+					   digest_get_digest_size(cms));
+	if (!cms->ci_digest) {
+		save_port_err(PORT_ArenaRelease(cms->arena, mark));
+		cmsreterr(-1, cms, "could not allocate digest");
+	}
+	if (generate_catalog_digest(ctl, digest_get_digest_oid(cms),
+				    cms->ci_digest) < 0) {
+		save_port_err(PORT_ArenaRelease(cms->arena, mark));
+		cmsreterr(-1, cms, "could not digest catalog");
+	}
+
+	if (generate_certificate_list(cms, &sd.certificates) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		return -1;
+	}
+
+	sd.crls = NULL;
+
+	if (generate_signerInfo_list(cms, &sd.signerInfos,
+				     CATALOG_SIGNER_INFO) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		return -1;
+	}
+
+	if (encode_signed_data(cms, &sd, sdp) < 0) {
+		PORT_ArenaRelease(cms->arena, mark);
+		return -1;
 	}
 
-	memcpy(sdp, &wrapper, sizeof(*sdp));
 	PORT_ArenaUnmark(cms->arena, mark);
 	return 0;
 }
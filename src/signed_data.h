@@ -21,5 +21,7 @@
 
 extern int generate_spc_signed_data(cms_context *cms, SECItem *sdp);
 extern int generate_authvar_signed_data(cms_context *cms, SECItem *sdp);
+extern int generate_catalog_signed_data(cms_context *cms, SECItem *ctl,
+					SECItem *sdp);
 
 #endif /* SIGNED_DATA_H */
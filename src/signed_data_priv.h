@@ -0,0 +1,53 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef SIGNED_DATA_PRIV_H
+#define SIGNED_DATA_PRIV_H 1
+
+/*
+ * The pieces generate_*_signed_data() are made of.  Nothing outside
+ * signed_data.c needs them but der_diff.c, which builds a SignedData the
+ * same way and encodes it with the old templates as well.
+ */
+typedef enum {
+	PE_SIGNER_INFO,
+	AUTHVAR_SIGNER_INFO,
+	CATALOG_SIGNER_INFO,
+	END_SIGNER_INFO_LIST
+} SignerInfoType;
+
+typedef struct {
+	SECItem version;
+	SECAlgorithmID **algorithms;
+	SpcContentInfo cinfo;
+	SECItem **certificates;
+	SECItem **crls;
+	SpcSignerInfo **signerInfos;
+} SignedData;
+
+extern int generate_algorithm_id_list(cms_context *cms,
+				      SECAlgorithmID ***algorithm_list_p);
+extern int generate_certificate_list(cms_context *cms,
+				     SECItem ***certificate_list_p);
+extern int generate_signerInfo_list(cms_context *cms,
+				    SpcSignerInfo ***signerInfo_list_p,
+				    SignerInfoType type);
+extern int encode_signed_data(cms_context *cms, SignedData *sd,
+			      SECItem *sdp);
+
+#endif /* SIGNED_DATA_PRIV_H */
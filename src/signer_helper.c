@@ -0,0 +1,367 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "pesign.h"
+
+#include <prerror.h>
+
+struct signer_helper_response {
+	uint32_t id;
+	int32_t rc;
+	uint32_t size;
+	struct signer_helper_response *next;
+	uint8_t payload[];
+};
+
+int
+signer_helper_new(cms_context *cms, const char *command)
+{
+	signer_helper *helper = calloc(1, sizeof (*helper));
+	if (!helper) {
+		cms->log(cms, LOG_ERR, "could not allocate signer helper: %m");
+		return -1;
+	}
+
+	helper->command = strdup(command);
+	if (!helper->command) {
+		save_errno(free(helper));
+		cms->log(cms, LOG_ERR, "could not allocate signer helper: %m");
+		return -1;
+	}
+	helper->pid = -1;
+	helper->sd = -1;
+	pthread_mutex_init(&helper->lock, NULL);
+	pthread_cond_init(&helper->cond, NULL);
+
+	/* a second --signer-helper replaces the first one */
+	signer_helper_free(cms->helper);
+	cms->helper = helper;
+	return 0;
+}
+
+/* Wait up to "ms" milliseconds for the helper to exit; returns 0 once it
+ * has been reaped. */
+static int
+wait_for_helper(pid_t pid, int ms)
+{
+	for (;;) {
+		pid_t rc = waitpid(pid, NULL, WNOHANG);
+		if (rc == pid || (rc < 0 && errno != EINTR))
+			return 0;
+		if (ms <= 0)
+			return -1;
+		usleep(10000);
+		ms -= 10;
+	}
+}
+
+void
+signer_helper_free(signer_helper *helper)
+{
+	if (!helper)
+		return;
+
+	/* closing our end is the helper's cue to exit; if it doesn't take
+	 * the hint, it gets SIGTERM, and if it's really wedged, SIGKILL. */
+	if (helper->sd >= 0)
+		close(helper->sd);
+	if (helper->pid > 0 && wait_for_helper(helper->pid, 1000) < 0) {
+		kill(helper->pid, SIGTERM);
+		if (wait_for_helper(helper->pid, 2000) < 0) {
+			kill(helper->pid, SIGKILL);
+			waitpid(helper->pid, NULL, 0);
+		}
+	}
+
+	while (helper->pending) {
+		struct signer_helper_response *next = helper->pending->next;
+		free(helper->pending);
+		helper->pending = next;
+	}
+
+	pthread_cond_destroy(&helper->cond);
+	pthread_mutex_destroy(&helper->lock);
+	xfree(helper->command);
+	free(helper);
+}
+
+/* The helper isn't started until somebody actually needs a signature (or
+ * pesignd warms up), so that pesignd forks it after it has dropped
+ * privileges. */
+int
+signer_helper_start(cms_context *cms)
+{
+	signer_helper *helper = cms->helper;
+	int sv[2];
+
+	if (!helper) {
+		cms->log(cms, LOG_ERR, "no signer helper configured");
+		return -1;
+	}
+
+	if (helper->sd >= 0)
+		return 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0) {
+		cms->log(cms, LOG_ERR, "could not create signer helper "
+			"socket: %m");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		cms->log(cms, LOG_ERR, "could not start signer helper: %m");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		/* pesignd keeps SIGHUP blocked; don't pass that along */
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		close(sv[0]);
+		if (dup2(sv[1], STDIN_FILENO) < 0 ||
+				dup2(sv[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		execl("/bin/sh", "sh", "-c", helper->command, (char *)NULL);
+		_exit(127);
+	}
+
+	close(sv[1]);
+	helper->sd = sv[0];
+	helper->pid = pid;
+	return 0;
+}
+
+static int
+write_all(int sd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = send(sd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+read_all(int sd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = recv(sd, p, len, MSG_WAITALL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+signer_helper_submit(cms_context *cms, SECItem *data, uint32_t *idp)
+{
+	signer_helper *helper = cms->helper;
+
+	if (signer_helper_start(cms) < 0)
+		return -1;
+
+	const char *name = digest_get_digest_name(cms);
+	uint32_t namelen = strlen(name) + 1;
+
+	signer_helper_msghdr hdr = {
+		.version = SIGNER_HELPER_VERSION,
+		.command = SH_CMD_SIGN,
+		.id = helper->next_id++,
+		.size = sizeof (namelen) + namelen + data->len,
+	};
+
+	if (write_all(helper->sd, &hdr, sizeof (hdr)) < 0 ||
+	    write_all(helper->sd, &namelen, sizeof (namelen)) < 0 ||
+	    write_all(helper->sd, (void *)name, namelen) < 0 ||
+	    write_all(helper->sd, data->data, data->len) < 0) {
+		cms->log(cms, LOG_ERR, "could not send request to signer "
+			"helper: %m");
+		return -1;
+	}
+
+	*idp = hdr.id;
+	return 0;
+}
+
+static struct signer_helper_response *
+read_response(cms_context *cms, signer_helper *helper)
+{
+	signer_helper_msghdr hdr;
+	int32_t rc;
+
+	if (read_all(helper->sd, &hdr, sizeof (hdr)) < 0) {
+		cms->log(cms, LOG_ERR, "could not read signer helper "
+			"response: %m");
+		return NULL;
+	}
+
+	if (hdr.version != SIGNER_HELPER_VERSION ||
+			hdr.command != SH_CMD_RESPONSE ||
+			hdr.size < sizeof (rc) ||
+			hdr.size - sizeof (rc) > SIGNER_HELPER_MAX_RESPONSE) {
+		cms->log(cms, LOG_ERR, "got invalid response from signer "
+			"helper");
+		return NULL;
+	}
+
+	if (read_all(helper->sd, &rc, sizeof (rc)) < 0) {
+		cms->log(cms, LOG_ERR, "could not read signer helper "
+			"response: %m");
+		return NULL;
+	}
+
+	uint32_t size = hdr.size - sizeof (rc);
+	struct signer_helper_response *resp;
+	resp = calloc(1, sizeof (*resp) + size + 1);
+	if (!resp) {
+		cms->log(cms, LOG_ERR, "could not allocate memory: %m");
+		return NULL;
+	}
+	resp->id = hdr.id;
+	resp->rc = rc;
+	resp->size = size;
+
+	if (read_all(helper->sd, resp->payload, size) < 0) {
+		save_errno(free(resp));
+		cms->log(cms, LOG_ERR, "could not read signer helper "
+			"response: %m");
+		return NULL;
+	}
+
+	return resp;
+}
+
+int
+signer_helper_collect(cms_context *cms, uint32_t id, SECItem *sig)
+{
+	signer_helper *helper = cms->helper;
+	struct signer_helper_response *resp = NULL;
+	struct signer_helper_response **prev;
+
+	if (!helper || helper->sd < 0) {
+		cms->log(cms, LOG_ERR, "signer helper is not running");
+		return -1;
+	}
+
+	/*
+	 * One thread at a time reads from the helper, and hands whatever it
+	 * gets that isn't its own to the others through pending; everybody
+	 * else waits for that.  It may also have already come in while we
+	 * were busy with something else.
+	 */
+	pthread_mutex_lock(&helper->lock);
+	while (!resp) {
+		for (prev = &helper->pending; *prev; prev = &(*prev)->next) {
+			if ((*prev)->id == id) {
+				resp = *prev;
+				*prev = resp->next;
+				break;
+			}
+		}
+		if (resp)
+			break;
+
+		if (helper->reading) {
+			pthread_cond_wait(&helper->cond, &helper->lock);
+			continue;
+		}
+
+		helper->reading = 1;
+		pthread_mutex_unlock(&helper->lock);
+		struct signer_helper_response *r = read_response(cms, helper);
+		pthread_mutex_lock(&helper->lock);
+		helper->reading = 0;
+		pthread_cond_broadcast(&helper->cond);
+
+		/* if the helper is gone, the others find that out when
+		 * they try to read next */
+		if (!r) {
+			pthread_mutex_unlock(&helper->lock);
+			return -1;
+		}
+
+		if (r->id == id) {
+			resp = r;
+			break;
+		}
+		r->next = helper->pending;
+		helper->pending = r;
+	}
+	pthread_mutex_unlock(&helper->lock);
+
+	if (resp->rc != 0) {
+		cms->log(cms, LOG_ERR, "signer helper failed: %s",
+			resp->size ? (char *)resp->payload : "unknown error");
+		free(resp);
+		return -1;
+	}
+
+	if (resp->size == 0) {
+		cms->log(cms, LOG_ERR, "signer helper returned empty "
+			"signature");
+		free(resp);
+		return -1;
+	}
+
+	SECItem *signature = SECITEM_AllocItem(cms->arena, NULL, resp->size);
+	if (!signature) {
+		save_port_err(free(resp));
+		cmsreterr(-1, cms, "could not allocate signature");
+	}
+	memcpy(signature->data, resp->payload, resp->size);
+	free(resp);
+
+	memcpy(sig, signature, sizeof (*sig));
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef SIGNER_HELPER_H
+#define SIGNER_HELPER_H 1
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A signer helper is a long-running child process that holds the private
+ * key somewhere we can't see it (rpm-sign, an HSM agent, whatever) and does
+ * the raw private key operation for us.  We talk to it over a socketpair
+ * connected to its stdin and stdout.
+ *
+ * Every message starts with a signer_helper_msghdr, followed by "size"
+ * bytes of payload.  A SH_CMD_SIGN payload is a pesignd_string-style
+ * digest name ("sha256", ...) and then the bytes to be signed; the helper
+ * hashes and signs them (i.e. sha256WithRSAEncryption) and sends back a
+ * SH_CMD_RESPONSE with the same id.  A response payload is an int32_t rc,
+ * then either the raw signature (rc == 0) or an error message.
+ *
+ * Requests are tagged with an id, so several can be outstanding at once
+ * and responses may come back in any order.  Sending a request has to be
+ * done under the caller's key_lock, so requests don't get interleaved;
+ * collecting one doesn't, and any number of threads can wait for their
+ * own responses at the same time.
+ */
+typedef struct {
+	uint32_t version;
+	uint32_t command;
+	uint32_t id;
+	uint32_t size;
+} signer_helper_msghdr;
+
+typedef enum {
+	SH_CMD_SIGN,
+	SH_CMD_RESPONSE,
+	SH_CMD_LIST_END
+} signer_helper_cmd;
+
+#define SIGNER_HELPER_VERSION 0x5e1f4e70
+
+/* An RSA-16384 signature is 2k; anything much bigger than that isn't a
+ * signature, and we aren't going to allocate it. */
+#define SIGNER_HELPER_MAX_RESPONSE (16 * 1024)
+
+struct signer_helper_response;
+
+typedef struct signer_helper {
+	char *command;
+	pid_t pid;
+	int sd;
+	uint32_t next_id;
+
+	/* responses that came in for somebody else, and whether some
+	 * thread is reading the next one; both are under lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int reading;
+	struct signer_helper_response *pending;
+} signer_helper;
+
+extern int signer_helper_new(cms_context *cms, const char *command);
+extern void signer_helper_free(signer_helper *helper);
+extern int signer_helper_start(cms_context *cms);
+extern int signer_helper_submit(cms_context *cms, SECItem *data,
+				uint32_t *idp);
+extern int signer_helper_collect(cms_context *cms, uint32_t id,
+				 SECItem *sig);
+
+#endif /* SIGNER_HELPER_H */
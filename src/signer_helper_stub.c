@@ -0,0 +1,220 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+/*
+ * A signer helper for testing --signer-helper without an HSM.  It opens an
+ * NSS database, finds the key for one certificate, and then answers
+ * SH_CMD_SIGN requests on stdin/stdout until pesign hangs up, the same way
+ * a real helper would.  With --fail it refuses every request instead, which
+ * is handy for checking the error paths.
+ *
+ * It isn't built by default; "make signer_helper_stub" in src/, and then
+ * something like:
+ *
+ *   pesign -s -i foo.efi -o foo.signed.efi -c "my cert" \
+ *	--signer-helper "./signer_helper_stub /etc/pki/pesign 'my cert'"
+ *
+ * signer_helper_test.c runs pesign's side of the protocol against it:
+ * "make check-signer-helper CERTDIR=/etc/pki/pesign NICKNAME='my cert'".
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pesign.h"
+
+#include <cryptohi.h>
+#include <keyhi.h>
+#include <nss.h>
+#include <pk11pub.h>
+#include <prerror.h>
+
+static struct {
+	const char *name;
+	SECOidTag signature_tag;
+} algs[] = {
+	{ "sha256", SEC_OID_PKCS1_SHA256_WITH_RSA_ENCRYPTION },
+	{ "sha1", SEC_OID_PKCS1_SHA1_WITH_RSA_ENCRYPTION },
+};
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+respond(uint32_t id, int32_t rc, const void *payload, uint32_t size)
+{
+	signer_helper_msghdr hdr = {
+		.version = SIGNER_HELPER_VERSION,
+		.command = SH_CMD_RESPONSE,
+		.id = id,
+		.size = sizeof (rc) + size,
+	};
+
+	if (write_all(STDOUT_FILENO, &hdr, sizeof (hdr)) < 0 ||
+	    write_all(STDOUT_FILENO, &rc, sizeof (rc)) < 0 ||
+	    write_all(STDOUT_FILENO, payload, size) < 0)
+		err(1, "signer_helper_stub: could not write response");
+}
+
+static void
+respond_error(uint32_t id, const char *msg)
+{
+	respond(id, -1, msg, strlen(msg) + 1);
+}
+
+static void
+handle_sign(SECKEYPrivateKey *privkey, uint32_t id, uint8_t *payload,
+	    uint32_t size, int fail)
+{
+	uint32_t namelen;
+
+	if (size < sizeof (namelen)) {
+		respond_error(id, "short request");
+		return;
+	}
+	memcpy(&namelen, payload, sizeof (namelen));
+	if (namelen == 0 || namelen > size - sizeof (namelen) ||
+			payload[sizeof (namelen) + namelen - 1] != '\0') {
+		respond_error(id, "malformed digest name");
+		return;
+	}
+
+	char *name = (char *)payload + sizeof (namelen);
+	uint8_t *data = payload + sizeof (namelen) + namelen;
+	uint32_t datalen = size - sizeof (namelen) - namelen;
+
+	if (fail) {
+		respond_error(id, "signer_helper_stub: refusing as asked");
+		return;
+	}
+
+	SECOidTag tag = SEC_OID_UNKNOWN;
+	for (unsigned int i = 0; i < sizeof (algs) / sizeof (algs[0]); i++) {
+		if (!strcmp(algs[i].name, name)) {
+			tag = algs[i].signature_tag;
+			break;
+		}
+	}
+	if (tag == SEC_OID_UNKNOWN) {
+		respond_error(id, "unsupported digest");
+		return;
+	}
+
+	SECItem sig = { 0, };
+	if (SEC_SignData(&sig, data, datalen, privkey, tag) != SECSuccess) {
+		respond_error(id, PORT_ErrorToString(PORT_GetError()));
+		return;
+	}
+	respond(id, 0, sig.data, sig.len);
+	SECITEM_FreeItem(&sig, PR_FALSE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int fail = 0;
+
+	if (argc == 4 && !strcmp(argv[3], "--fail"))
+		fail = 1;
+	else if (argc != 3)
+		errx(1, "usage: signer_helper_stub <certdir> <nickname> "
+			"[--fail]");
+
+	if (NSS_Init(argv[1]) != SECSuccess)
+		errx(1, "signer_helper_stub: could not open \"%s\": %s",
+			argv[1], PORT_ErrorToString(PORT_GetError()));
+
+	CERTCertificate *cert = PK11_FindCertFromNickname(argv[2], NULL);
+	if (!cert)
+		errx(1, "signer_helper_stub: could not find \"%s\": %s",
+			argv[2], PORT_ErrorToString(PORT_GetError()));
+
+	SECKEYPrivateKey *privkey = PK11_FindKeyByAnyCert(cert, NULL);
+	if (!privkey)
+		errx(1, "signer_helper_stub: could not find key for \"%s\": "
+			"%s", argv[2], PORT_ErrorToString(PORT_GetError()));
+
+	for (;;) {
+		signer_helper_msghdr hdr;
+
+		/* pesign closing its end is how we know we're done */
+		if (read_all(STDIN_FILENO, &hdr, sizeof (hdr)) < 0)
+			break;
+
+		if (hdr.version != SIGNER_HELPER_VERSION)
+			errx(1, "signer_helper_stub: bad protocol version "
+				"0x%08x", hdr.version);
+
+		uint8_t *payload = malloc(hdr.size ? hdr.size : 1);
+		if (!payload)
+			err(1, "signer_helper_stub");
+		if (read_all(STDIN_FILENO, payload, hdr.size) < 0)
+			errx(1, "signer_helper_stub: truncated request");
+
+		if (hdr.command == SH_CMD_SIGN)
+			handle_sign(privkey, hdr.id, payload, hdr.size, fail);
+		else
+			respond_error(hdr.id, "unknown command");
+		free(payload);
+	}
+
+	SECKEY_DestroyPrivateKey(privkey);
+	CERT_DestroyCertificate(cert);
+	NSS_Shutdown();
+	return 0;
+}
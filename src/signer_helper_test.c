@@ -0,0 +1,368 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+/*
+ * Runs the signer helper code against signer_helper_stub the way pesign
+ * does.  There are four cases:
+ *
+ *   - several threads sign at once through one helper.  Each one sends its
+ *     request under a shared key_lock and then waits for its own answer.
+ *   - a batch of requests is sent first, and then collected in the
+ *     opposite order.
+ *   - a helper refuses every request.
+ *   - a helper answers with more than any signature could be.
+ *
+ * Every signature that comes back is checked against the certificate.
+ *
+ * It isn't built by default; "make signer_helper_test signer_helper_stub"
+ * in src/, and then:
+ *
+ *   ./signer_helper_test /etc/pki/pesign "my cert"
+ *
+ * The database needs the certificate's private key, for the stub to sign
+ * with.  signer_helper_stub is expected in the same directory as this.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pesign.h"
+
+#include <cryptohi.h>
+#include <hasht.h>
+#include <keyhi.h>
+#include <nss.h>
+#include <pk11pub.h>
+#include <prerror.h>
+
+#define NTHREADS 8
+#define NSIGS 32
+#define NBATCH 16
+
+static const char *self;
+static const char *certdir;
+static const char *nickname;
+static char *stub;
+static CERTCertificate *cert;
+
+static int
+logger(cms_context *cms __attribute__((__unused__)),
+       int priority __attribute__((__unused__)), char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	return 0;
+}
+
+static cms_context *
+new_context(const char *command)
+{
+	cms_context *cms = NULL;
+
+	if (cms_context_alloc(&cms) < 0)
+		errx(1, "could not allocate cms context");
+	cms->log = logger;
+	if (set_digest_parameters(cms, "sha256") < 0)
+		errx(1, "could not select sha256");
+	cms->cert = CERT_DupCertificate(cert);
+	if (generate_signer_template(cms) < 0)
+		errx(1, "could not make a signer template");
+	if (command && signer_helper_new(cms, command) < 0)
+		errx(1, "could not set up signer helper");
+	return cms;
+}
+
+static char *
+stub_command(const char *extra)
+{
+	char *command;
+
+	if (asprintf(&command, "'%s' '%s' '%s'%s", stub, certdir, nickname,
+		     extra) < 0)
+		err(1, "signer_helper_test");
+	return command;
+}
+
+static int
+check_signature(const void *data, size_t len, SECItem *sig)
+{
+	SECKEYPublicKey *pubkey = CERT_ExtractPublicKey(cert);
+	SECStatus status;
+
+	if (!pubkey)
+		errx(1, "could not get public key: %s",
+			PORT_ErrorToString(PORT_GetError()));
+	status = VFY_VerifyData(data, len, pubkey, sig,
+				SEC_OID_PKCS1_SHA256_WITH_RSA_ENCRYPTION, NULL);
+	SECKEY_DestroyPublicKey(pubkey);
+	if (status != SECSuccess) {
+		warnx("bad signature: %s",
+		      PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+	return 0;
+}
+
+/* Make a PE signer info for some content, which is what sends the
+ * request, and check what came back. */
+static int
+sign_and_check(cms_context *cms, const char *content)
+{
+	SpcSignerInfo si;
+
+	cms->ci_digest = SECITEM_AllocItem(cms->arena, NULL, SHA256_LENGTH);
+	if (!cms->ci_digest)
+		errx(1, "could not allocate digest");
+	if (PK11_HashBuf(SEC_OID_SHA256, cms->ci_digest->data,
+			 (unsigned char *)content, strlen(content))
+			!= SECSuccess)
+		errx(1, "could not hash content: %s",
+			PORT_ErrorToString(PORT_GetError()));
+	if (generate_spc_signer_info(cms, &si) < 0)
+		return -1;
+
+	/* what got signed is the attributes as a SET; in the signer info
+	 * they're tagged [0] instead */
+	uint8_t *tbs = malloc(si.signedAttrs.len);
+	if (!tbs)
+		err(1, "signer_helper_test");
+	memcpy(tbs, si.signedAttrs.data, si.signedAttrs.len);
+	tbs[0] = SEC_ASN1_SET | SEC_ASN1_CONSTRUCTED;
+	int rc = check_signature(tbs, si.signedAttrs.len, &si.signature);
+	free(tbs);
+	return rc;
+}
+
+typedef struct {
+	int n;
+	signer_helper *helper;
+	pthread_mutex_t *key_lock;
+	int failures;
+} worker;
+
+static void *
+sign_thread(void *data)
+{
+	worker *w = data;
+	cms_context *cms = new_context(NULL);
+	char content[64];
+
+	cms->helper = w->helper;
+	cms->key_lock = w->key_lock;
+	for (int i = 0; i < NSIGS; i++) {
+		snprintf(content, sizeof (content), "thread %d, signature %d",
+			 w->n, i);
+		if (sign_and_check(cms, content) < 0)
+			w->failures++;
+	}
+	cms->helper = NULL;
+	cms->key_lock = NULL;
+	cms_context_fini(cms);
+	return NULL;
+}
+
+static int
+test_threads(void)
+{
+	char *command = stub_command("");
+	cms_context *cms = new_context(command);
+	pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_t threads[NTHREADS];
+	worker workers[NTHREADS];
+	int failures = 0;
+
+	for (int i = 0; i < NTHREADS; i++) {
+		workers[i] = (worker) {
+			.n = i,
+			.helper = cms->helper,
+			.key_lock = &key_lock,
+		};
+		errno = pthread_create(&threads[i], NULL, sign_thread,
+				       &workers[i]);
+		if (errno)
+			err(1, "could not start thread");
+	}
+	for (int i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], NULL);
+		failures += workers[i].failures;
+	}
+
+	cms_context_fini(cms);
+	free(command);
+	return failures ? -1 : 0;
+}
+
+/* The stub answers in the order it's asked, so collecting the last one
+ * first leaves all the others waiting in pending. */
+static int
+test_out_of_order(void)
+{
+	char *command = stub_command("");
+	cms_context *cms = new_context(command);
+	char content[NBATCH][32];
+	uint32_t ids[NBATCH];
+	int rc = 0;
+
+	for (int i = 0; i < NBATCH; i++) {
+		snprintf(content[i], sizeof (content[i]), "request %d", i);
+		SECItem data = {
+			.type = siBuffer,
+			.data = (unsigned char *)content[i],
+			.len = strlen(content[i]),
+		};
+		if (signer_helper_submit(cms, &data, &ids[i]) < 0)
+			errx(1, "could not send request %d", i);
+	}
+
+	for (int i = NBATCH - 1; i >= 0; i--) {
+		SECItem sig;
+
+		if (signer_helper_collect(cms, ids[i], &sig) < 0 ||
+		    check_signature(content[i], strlen(content[i]), &sig) < 0)
+			rc = -1;
+	}
+
+	cms_context_fini(cms);
+	free(command);
+	return rc;
+}
+
+static int
+test_refused(void)
+{
+	char *command = stub_command(" --fail");
+	cms_context *cms = new_context(command);
+	int rc = sign_and_check(cms, "refused") < 0 ? 0 : -1;
+
+	cms_context_fini(cms);
+	free(command);
+	return rc;
+}
+
+static int
+test_oversized(void)
+{
+	char *command;
+
+	if (asprintf(&command, "'%s' --oversized-helper", self) < 0)
+		err(1, "signer_helper_test");
+
+	cms_context *cms = new_context(command);
+	int rc = sign_and_check(cms, "oversized") < 0 ? 0 : -1;
+
+	cms_context_fini(cms);
+	free(command);
+	return rc;
+}
+
+/*
+ * This is what test_oversized() runs as the helper: it answers the first
+ * request with a header claiming a payload one byte bigger than we'll
+ * take, and then waits to be hung up on.
+ */
+static int
+oversized_helper(void)
+{
+	signer_helper_msghdr hdr;
+	int32_t rc = 0;
+	char buf[4096];
+
+	if (read(STDIN_FILENO, &hdr, sizeof (hdr)) != sizeof (hdr))
+		return 1;
+	hdr.command = SH_CMD_RESPONSE;
+	hdr.size = sizeof (rc) + SIGNER_HELPER_MAX_RESPONSE + 1;
+	if (write(STDOUT_FILENO, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+	    write(STDOUT_FILENO, &rc, sizeof (rc)) != sizeof (rc))
+		return 1;
+	while (read(STDIN_FILENO, buf, sizeof (buf)) > 0)
+		;
+	return 0;
+}
+
+static struct {
+	const char *name;
+	int (*test)(void);
+} tests[] = {
+	{ "threads", test_threads },
+	{ "out of order", test_out_of_order },
+	{ "refused", test_refused },
+	{ "oversized", test_oversized },
+};
+
+int
+main(int argc, char *argv[])
+{
+	int failed = 0;
+
+	self = argv[0];
+	if (argc == 2 && !strcmp(argv[1], "--oversized-helper"))
+		return oversized_helper();
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: signer_helper_test <certdir> "
+			"<nickname>\n");
+		exit(1);
+	}
+	certdir = argv[1];
+	nickname = argv[2];
+
+	const char *slash = strrchr(self, '/');
+	if (asprintf(&stub, "%.*ssigner_helper_stub",
+		     slash ? (int)(slash - self + 1) : 0, self) < 0)
+		err(1, "signer_helper_test");
+
+	if (NSS_Init(certdir) != SECSuccess)
+		errx(1, "could not open \"%s\": %s", certdir,
+			PORT_ErrorToString(PORT_GetError()));
+	cert = PK11_FindCertFromNickname(nickname, NULL);
+	if (!cert)
+		errx(1, "could not find \"%s\": %s", nickname,
+			PORT_ErrorToString(PORT_GetError()));
+
+	/* once, and not in the threads; every context shares them */
+	cms_context *cms = NULL;
+	if (cms_context_alloc(&cms) < 0)
+		errx(1, "could not allocate cms context");
+	cms->log = logger;
+	if (register_oids(cms) != SECSuccess)
+		errx(1, "could not register OIDs");
+	cms_context_fini(cms);
+
+	for (unsigned int i = 0; i < sizeof (tests) / sizeof (tests[0]); i++) {
+		int rc = tests[i].test();
+
+		printf("%s: %s\n", tests[i].name, rc < 0 ? "FAILED" : "ok");
+		if (rc < 0)
+			failed = 1;
+	}
+
+	CERT_DestroyCertificate(cert);
+	NSS_Shutdown();
+	free(stub);
+	return failed;
+}
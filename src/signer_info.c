@@ -70,8 +70,14 @@ SEC_ASN1Template SignedAttributesTemplate[] = {
 	}
 };
 
-int
-generate_signed_attributes(cms_context *cms, SECItem *sattrs)
+/*
+ * The content type attribute has to name whatever the SignedData holds;
+ * that's SpcIndirectDataContent for a signed binary and a certificate
+ * trust list for a catalog.
+ */
+static int
+generate_signed_attributes_for(cms_context *cms, SECItem *sattrs,
+			       ms_oid_t content_type)
 {
 	Attribute *attrs[5];
 	memset(attrs, '\0', sizeof (attrs));
@@ -105,7 +111,7 @@ generate_signed_attributes(cms_context *cms, SECItem *sattrs)
 	attrs[1]->attrType = oid->oid;
 
 	SECItem *content_types[2] = { NULL, NULL };
-	tag = find_ms_oid_tag(SPC_INDIRECT_DATA_OBJID);
+	tag = find_ms_oid_tag(content_type);
 	if (tag == SEC_OID_UNKNOWN)
 		goto err;
 	if (generate_object_id(cms, &encoded, tag) < 0)
@@ -157,8 +163,15 @@ err:
 	return -1;
 }
 
+int
+generate_signed_attributes(cms_context *cms, SECItem *sattrs)
+{
+	return generate_signed_attributes_for(cms, sattrs,
+					      SPC_INDIRECT_DATA_OBJID);
+}
+
 static int
-sign_blob(cms_context *cms, SECItem *sigitem, SECItem *sign_content)
+__sign_blob(cms_context *cms, SECItem *sigitem, SECItem *sign_content)
 {
 	sign_content = SECITEM_ArenaDupItem(cms->arena, sign_content);
 	if (!sign_content)
@@ -223,16 +236,140 @@ err:
 	return -1;
 }
 
+/*
+ * The signer helper tags its requests, so only sending one has to be done
+ * under key_lock; while we wait for the signature, the other threads can
+ * send theirs.
+ */
 static int
-generate_unsigned_attributes(cms_context *cms, SECItem *uattrs)
+helper_sign_blob(cms_context *cms, SECItem *sigitem, SECItem *sign_content)
 {
-	Attribute *attrs[1];
+	uint32_t id;
+	int rc;
+
+	if (content_is_empty(sign_content->data, sign_content->len)) {
+		cms->log(cms, LOG_ERR, "not signing empty digest");
+		return -1;
+	}
+
+	if (cms->key_lock)
+		pthread_mutex_lock(cms->key_lock);
+	rc = signer_helper_submit(cms, sign_content, &id);
+	if (cms->key_lock)
+		pthread_mutex_unlock(cms->key_lock);
+	if (rc < 0)
+		return -1;
+
+	return signer_helper_collect(cms, id, sigitem);
+}
+
+/* see key_lock in cms_context */
+static int
+sign_blob(cms_context *cms, SECItem *sigitem, SECItem *sign_content)
+{
+	if (cms->helper)
+		return helper_sign_blob(cms, sigitem, sign_content);
+
+	if (!cms->key_lock)
+		return __sign_blob(cms, sigitem, sign_content);
+
+	pthread_mutex_lock(cms->key_lock);
+	int rc = __sign_blob(cms, sigitem, sign_content);
+	pthread_mutex_unlock(cms->key_lock);
+	return rc;
+}
+
+/*
+ * Like sign_blob(), but for content that's already been hashed, so it
+ * never has to be in memory all at once.
+ */
+static int
+sign_digest(cms_context *cms, SECItem *sigitem, SECItem *digest)
+{
+	SECItem tmp, *signature;
+	SECKEYPrivateKey *privkey;
+	SECStatus status;
+
+	if (cms->helper) {
+		cms->log(cms, LOG_ERR, "signer helpers can't sign a digest");
+		return -1;
+	}
+
+	PK11_SetPasswordFunc(cms->func ? cms->func : readpw);
+	privkey = PK11_FindKeyByAnyCert(cms->cert,
+				cms->pwdata ? cms->pwdata : NULL);
+	if (!privkey) {
+		cms->log(cms, LOG_ERR, "could not get private key: %s",
+			PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+
+	memset(&tmp, '\0', sizeof (tmp));
+	status = SGN_Digest(privkey, digest_get_digest_oid(cms), &tmp, digest);
+	SECKEY_DestroyPrivateKey(privkey);
+	if (status != SECSuccess) {
+		cms->log(cms, LOG_ERR, "error signing data: %s",
+			PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+
+	signature = SECITEM_ArenaDupItem(cms->arena, &tmp);
+	SECITEM_FreeItem(&tmp, PR_FALSE);
+	if (!signature) {
+		cms->log(cms, LOG_ERR, "error signing data: %s",
+			PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+	memcpy(sigitem, signature, sizeof(*sigitem));
+	return 0;
+}
+
+/*
+ * The only unsigned attribute we make is an RFC 3161 countersignature,
+ * which is a timestamp token over the signature; without a timestamp
+ * server there aren't any, and the field is left out.
+ */
+static int
+generate_unsigned_attributes(cms_context *cms, SECItem *uattrs,
+			     SECItem *signature)
+{
+	Attribute *attrs[2];
 	memset(attrs, '\0', sizeof (attrs));
 
+	uattrs->len = 0;
+	uattrs->data = NULL;
+	if (!cms->tsa)
+		return 0;
+
+	SECItem token;
+	int rc = 1;
+	if (cms->timestamp_sizing)
+		rc = timestamp_placeholder(cms, &token);
+	if (rc > 0)
+		rc = timestamp_signature(cms, signature, &token);
+	if (rc < 0)
+		goto err;
+
+	attrs[0] = PORT_ArenaZAlloc(cms->arena, sizeof (Attribute));
+	if (!attrs[0])
+		goto err;
+	if (get_ms_oid_secitem(szOID_RFC3161_counterSign,
+			       &attrs[0]->attrType) < 0)
+		goto err;
+
+	SECItem **tokens = PORT_ArenaZAlloc(cms->arena, 2 * sizeof (SECItem *));
+	if (!tokens)
+		goto err;
+	tokens[0] = SECITEM_ArenaDupItem(cms->arena, &token);
+	if (!tokens[0])
+		goto err;
+	attrs[0]->attrValues = tokens;
+
 	Attribute **attrtmp = attrs;
 	if (SEC_ASN1EncodeItem(cms->arena, uattrs, &attrtmp,
 				AttributeSetTemplate) == NULL)
 		goto err;
+	uattrs->data[0] = SEC_ASN1_CONTEXT_SPECIFIC | 1 | SEC_ASN1_CONSTRUCTED;
 	return 0;
 err:
 	return -1;
@@ -335,22 +472,67 @@ SEC_ASN1Template SpcSignerInfoTemplate[] = {
 	.sub = &SEC_OctetStringTemplate,
 	.size = sizeof (SECItem)
 	},
-#if 0
 	{
 	.kind = SEC_ASN1_CONTEXT_SPECIFIC | 1 |
 		SEC_ASN1_CONSTRUCTED |
-		SEC_ASN1_OPTIONAL |
-		SEC_ASN1_EXPLICIT,
+		SEC_ASN1_OPTIONAL,
 	.offset = offsetof(SpcSignerInfo, unsignedAttrs),
 	.sub = &SEC_AnyTemplate,
 	.size = sizeof (SECItem)
 	},
-#endif
 	{ 0, }
 };
 
-int
-generate_spc_signer_info(cms_context *cms, SpcSignerInfo *sip)
+/*
+ * SpcSignerInfoTemplate, written out by hand; see der_length() in
+ * cms_common.c.  The signed and unsigned attributes are already encoded,
+ * [0] and [1] tags and all, since the signature has to be made over the
+ * former before we get here.
+ */
+static size_t
+spc_signer_info_contents_length(SpcSignerInfo *si)
+{
+	IssuerAndSerialNumber *iasn = &si->sid.signerValue.iasn;
+
+	return der_integer_length(&si->CMSVersion) +
+	       der_length(iasn->issuer.len +
+			  der_integer_length(&iasn->serial)) +
+	       der_algorithm_id_length(&si->digestAlgorithm) +
+	       si->signedAttrs.len +
+	       der_algorithm_id_length(&si->signatureAlgorithm) +
+	       der_length(si->signature.len) +
+	       si->unsignedAttrs.len;
+}
+
+size_t
+der_spc_signer_info_length(SpcSignerInfo *si)
+{
+	return der_length(spc_signer_info_contents_length(si));
+}
+
+uint8_t *
+der_put_spc_signer_info(uint8_t *p, SpcSignerInfo *si)
+{
+	IssuerAndSerialNumber *iasn = &si->sid.signerValue.iasn;
+
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   spc_signer_info_contents_length(si));
+	p = der_put_integer(p, &si->CMSVersion);
+	p = der_put_header(p, SEC_ASN1_SEQUENCE | SEC_ASN1_CONSTRUCTED,
+			   iasn->issuer.len + der_integer_length(&iasn->serial));
+	p = der_put_raw(p, &iasn->issuer);
+	p = der_put_integer(p, &iasn->serial);
+	p = der_put_algorithm_id(p, &si->digestAlgorithm);
+	p = der_put_raw(p, &si->signedAttrs);
+	p = der_put_algorithm_id(p, &si->signatureAlgorithm);
+	p = der_put(p, SEC_ASN1_OCTET_STRING, si->signature.data,
+		    si->signature.len);
+	return der_put_raw(p, &si->unsignedAttrs);
+}
+
+static int
+generate_signer_info_for(cms_context *cms, SpcSignerInfo *sip,
+			 ms_oid_t content_type)
 {
 	if (!sip)
 		return -1;
@@ -358,27 +540,26 @@ generate_spc_signer_info(cms_context *cms, SpcSignerInfo *sip)
 	SpcSignerInfo si;
 	memset(&si, '\0', sizeof (si));
 
-	if (SEC_ASN1EncodeInteger(cms->arena, &si.CMSVersion, 1) == NULL) {
-		cms->log(cms, LOG_ERR, "could not encode CMSVersion: %s",
-			PORT_ErrorToString(PORT_GetError()));
+	if (generate_signer_template(cms) < 0)
 		goto err;
-	}
+	signer_template *st = cms->template;
+
+	si.CMSVersion = st->version;
 
 	si.sid.signerType = signerTypeIssuerAndSerialNumber;
-	si.sid.signerValue.iasn.issuer = cms->cert->derIssuer;
-	si.sid.signerValue.iasn.serial = cms->cert->serialNumber;
+	si.sid.signerValue.iasn.issuer = st->issuer;
+	si.sid.signerValue.iasn.serial = st->serial;
 
-	if (generate_algorithm_id(cms, &si.digestAlgorithm,
-			digest_get_digest_oid(cms)) < 0)
-		goto err;
+	si.digestAlgorithm = st->digest_algorithms[cms->selected_digest];
 
 
-	if (cms->raw_signature) {
+	if (cms->raw_signature && content_type == SPC_INDIRECT_DATA_OBJID) {
 		memcpy(&si.signedAttrs, cms->raw_signed_attrs,
 			sizeof (si.signedAttrs));
 		memcpy(&si.signature, cms->raw_signature, sizeof(si.signature));
 	} else {
-		if (generate_signed_attributes(cms, &si.signedAttrs) < 0)
+		if (generate_signed_attributes_for(cms, &si.signedAttrs,
+						   content_type) < 0)
 			goto err;
 
 		if (sign_blob(cms, &si.signature, &si.signedAttrs) < 0)
@@ -388,11 +569,10 @@ generate_spc_signer_info(cms_context *cms, SpcSignerInfo *sip)
 	si.signedAttrs.data[0] = SEC_ASN1_CONTEXT_SPECIFIC | 0 |
 				SEC_ASN1_CONSTRUCTED;
 
-	if (generate_algorithm_id(cms, &si.signatureAlgorithm,
-				digest_get_encryption_oid(cms)) < 0)
-		goto err;
+	si.signatureAlgorithm = st->encryption_algorithms[cms->selected_digest];
 
-	if (generate_unsigned_attributes(cms, &si.unsignedAttrs) < 0)
+	if (generate_unsigned_attributes(cms, &si.unsignedAttrs,
+					 &si.signature) < 0)
 		goto err;
 
 	memcpy(sip, &si, sizeof(si));
@@ -401,42 +581,49 @@ err:
 	return -1;
 }
 
+int
+generate_spc_signer_info(cms_context *cms, SpcSignerInfo *sip)
+{
+	return generate_signer_info_for(cms, sip, SPC_INDIRECT_DATA_OBJID);
+}
+
+int
+generate_catalog_signer_info(cms_context *cms, SpcSignerInfo *sip)
+{
+	return generate_signer_info_for(cms, sip, szOID_CTL);
+}
+
 int
 generate_authvar_signer_info(cms_context *cms, SpcSignerInfo *sip)
 {
 	SpcSignerInfo si;
-	SECItem buf;
 
 	if (!sip)
 		return -1;
 
 	memset(&si, '\0', sizeof (si));
 
-	if (SEC_ASN1EncodeInteger(cms->arena, &si.CMSVersion, 1) == NULL) {
-		cms->log(cms, LOG_ERR, "could not encode CMSVersion: %s",
-			PORT_ErrorToString(PORT_GetError()));
+	if (generate_signer_template(cms) < 0)
 		goto err;
-	}
+	signer_template *st = cms->template;
+
+	si.CMSVersion = st->version;
 
 	si.sid.signerType = signerTypeIssuerAndSerialNumber;
-	si.sid.signerValue.iasn.issuer = cms->cert->derIssuer;
-	si.sid.signerValue.iasn.serial = cms->cert->serialNumber;
+	si.sid.signerValue.iasn.issuer = st->issuer;
+	si.sid.signerValue.iasn.serial = st->serial;
 
-	if (generate_algorithm_id(cms, &si.digestAlgorithm,
-			digest_get_digest_oid(cms)) < 0)
-		goto err;
+	si.digestAlgorithm = st->digest_algorithms[cms->selected_digest];
 
 	si.signedAttrs.len = 0;
 	si.signedAttrs.data = NULL;
 
-	buf.len = cms->authbuf_len;
-	buf.data = cms->authbuf;
-	if (sign_blob(cms, &si.signature, &buf) < 0)
+	/* the variable's been hashed already; see generate_descriptor() */
+	if (sign_digest(cms, &si.signature,
+			cms->digests[cms->selected_digest].pe_digest) < 0)
 		goto err;
 
-	if (generate_algorithm_id(cms, &si.signatureAlgorithm,
-				digest_get_encryption_oid(cms)) < 0)
-		goto err;
+	si.signatureAlgorithm = st->encryption_algorithms[cms->selected_digest];
 
 	si.unsignedAttrs.len = 0;
 	si.unsignedAttrs.data = NULL;
@@ -63,6 +63,9 @@ extern SEC_ASN1Template SpcSignerInfoTemplate[];
 
 extern int generate_signed_attributes(cms_context *cms, SECItem *sattrs);
 extern int generate_spc_signer_info(cms_context *cms, SpcSignerInfo *sip);
+extern int generate_catalog_signer_info(cms_context *cms, SpcSignerInfo *sip);
 extern int generate_authvar_signer_info(cms_context *cms, SpcSignerInfo *sip);
+extern size_t der_spc_signer_info_length(SpcSignerInfo *si);
+extern uint8_t *der_put_spc_signer_info(uint8_t *p, SpcSignerInfo *si);
 
 #endif /* SIGNER_INFO */
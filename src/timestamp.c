@@ -0,0 +1,985 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include "pesign.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <prerror.h>
+#include <hasht.h>
+#include <pk11pub.h>
+#include <secasn1.h>
+#include <secerr.h>
+#include <secoid.h>
+
+typedef struct timestamp_request {
+	SECOidTag hash;
+	uint8_t imprint[HASH_LENGTH_MAX];
+	unsigned int imprint_len;
+	uint8_t nonce[8];
+
+	SECItem token;			/* malloced */
+	int done;
+	int rc;
+	int refs;
+
+	struct timestamp_request *next;
+} timestamp_request;
+
+typedef struct timestamp_cache {
+	SECOidTag hash;
+	uint8_t imprint[HASH_LENGTH_MAX];
+	unsigned int imprint_len;
+	SECItem token;
+	struct timestamp_cache *next;
+} timestamp_cache;
+
+typedef struct {
+	SECAlgorithmID hashAlgorithm;
+	SECItem hashedMessage;
+} MessageImprint;
+
+static SEC_ASN1Template MessageImprintTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (MessageImprint),
+	},
+	{
+	.kind = SEC_ASN1_INLINE,
+	.offset = offsetof(MessageImprint, hashAlgorithm),
+	.sub = &SECOID_AlgorithmIDTemplate,
+	.size = sizeof (SECAlgorithmID),
+	},
+	{
+	.kind = SEC_ASN1_OCTET_STRING,
+	.offset = offsetof(MessageImprint, hashedMessage),
+	.sub = &SEC_OctetStringTemplate,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+typedef struct {
+	SECItem version;
+	MessageImprint messageImprint;
+	SECItem nonce;
+	SECItem certReq;
+} TimeStampReq;
+
+static SEC_ASN1Template TimeStampReqTemplate[] = {
+	{
+	.kind = SEC_ASN1_SEQUENCE,
+	.offset = 0,
+	.sub = NULL,
+	.size = sizeof (TimeStampReq),
+	},
+	{
+	.kind = SEC_ASN1_INTEGER,
+	.offset = offsetof(TimeStampReq, version),
+	.sub = &SEC_IntegerTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_INLINE,
+	.offset = offsetof(TimeStampReq, messageImprint),
+	.sub = &MessageImprintTemplate,
+	.size = sizeof (MessageImprint),
+	},
+	{
+	.kind = SEC_ASN1_INTEGER,
+	.offset = offsetof(TimeStampReq, nonce),
+	.sub = &SEC_IntegerTemplate,
+	.size = sizeof (SECItem),
+	},
+	{
+	.kind = SEC_ASN1_BOOLEAN,
+	.offset = offsetof(TimeStampReq, certReq),
+	.sub = &SEC_BooleanTemplate,
+	.size = sizeof (SECItem),
+	},
+	{ 0, }
+};
+
+static int
+parse_url(timestamp_client *tsa, const char *url)
+{
+	const char *host, *end, *port = NULL, *path;
+	size_t hostlen;
+
+	if (strncasecmp(url, "http://", 7)) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	host = url + 7;
+
+	path = strchr(host, '/');
+	if (!path)
+		path = host + strlen(host);
+
+	if (*host == '[') {
+		end = memchr(host, ']', path - host);
+		if (!end)
+			goto inval;
+		host++;
+		hostlen = end - host;
+		end++;
+	} else {
+		end = memchr(host, ':', path - host);
+		if (!end)
+			end = path;
+		hostlen = end - host;
+	}
+	if (hostlen == 0)
+		goto inval;
+	if (end < path) {
+		if (*end != ':' || end + 1 == path)
+			goto inval;
+		port = end + 1;
+	}
+
+	tsa->host = strndup(host, hostlen);
+	tsa->port = port ? strndup(port, path - port) : strdup("80");
+	tsa->path = strdup(*path ? path : "/");
+	if (!tsa->host || !tsa->port || !tsa->path)
+		return -1;
+	return 0;
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+int
+timestamp_client_new(cms_context *cms, const char *url)
+{
+	timestamp_client *tsa = calloc(1, sizeof (*tsa));
+	if (!tsa) {
+		cms->log(cms, LOG_ERR,
+			 "could not allocate timestamp client: %m");
+		return -1;
+	}
+	tsa->fd = -1;
+
+	tsa->url = strdup(url);
+	if (!tsa->url || parse_url(tsa, url) < 0) {
+		cms->log(cms, LOG_ERR, "invalid timestamp server \"%s\": %m",
+			 url);
+		timestamp_client_free(tsa);
+		return -1;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tsa->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&tsa->lock, NULL);
+
+	cms->tsa = tsa;
+	return 0;
+}
+
+void
+timestamp_client_free(timestamp_client *tsa)
+{
+	if (!tsa)
+		return;
+
+	if (tsa->fd >= 0)
+		close(tsa->fd);
+
+	while (tsa->cache) {
+		timestamp_cache *next = tsa->cache->next;
+		xfree(tsa->cache->token.data);
+		free(tsa->cache);
+		tsa->cache = next;
+	}
+
+	if (tsa->url) {
+		pthread_cond_destroy(&tsa->cond);
+		pthread_mutex_destroy(&tsa->lock);
+	}
+
+	xfree(tsa->path);
+	xfree(tsa->port);
+	xfree(tsa->host);
+	xfree(tsa->url);
+	free(tsa);
+}
+
+static timestamp_cache *
+find_cached(timestamp_client *tsa, timestamp_request *req)
+{
+	for (timestamp_cache *tc = tsa->cache; tc; tc = tc->next) {
+		if (tc->hash == req->hash &&
+		    tc->imprint_len == req->imprint_len &&
+		    !memcmp(tc->imprint, req->imprint, req->imprint_len))
+			return tc;
+	}
+	return NULL;
+}
+
+static void
+add_cached(timestamp_client *tsa, timestamp_request *req)
+{
+	timestamp_cache *tc, **tcp;
+
+	tc = calloc(1, sizeof (*tc));
+	if (!tc)
+		return;
+	tc->token.data = malloc(req->token.len);
+	if (!tc->token.data) {
+		free(tc);
+		return;
+	}
+	memcpy(tc->token.data, req->token.data, req->token.len);
+	tc->token.len = req->token.len;
+	tc->hash = req->hash;
+	memcpy(tc->imprint, req->imprint, req->imprint_len);
+	tc->imprint_len = req->imprint_len;
+
+	tc->next = tsa->cache;
+	tsa->cache = tc;
+	if (++tsa->ncache <= TIMESTAMP_CACHE_SIZE)
+		return;
+
+	/* drop the oldest */
+	for (tcp = &tsa->cache; (*tcp)->next; tcp = &(*tcp)->next)
+		;
+	xfree((*tcp)->token.data);
+	free(*tcp);
+	*tcp = NULL;
+	tsa->ncache--;
+}
+
+static int
+encode_request(cms_context *cms, PRArenaPool *arena, timestamp_request *req,
+	       SECItem *der)
+{
+	TimeStampReq tsreq;
+	uint8_t version = 1;
+	uint8_t yes = 0xff;
+
+	memset(&tsreq, '\0', sizeof (tsreq));
+	tsreq.version.data = &version;
+	tsreq.version.len = 1;
+	if (SECOID_SetAlgorithmID(arena,
+				&tsreq.messageImprint.hashAlgorithm,
+				req->hash, NULL) != SECSuccess)
+		cmsreterr(-1, cms, "could not encode timestamp request");
+	tsreq.messageImprint.hashedMessage.data = req->imprint;
+	tsreq.messageImprint.hashedMessage.len = req->imprint_len;
+	tsreq.nonce.data = req->nonce;
+	tsreq.nonce.len = sizeof (req->nonce);
+	tsreq.certReq.data = &yes;
+	tsreq.certReq.len = 1;
+
+	if (SEC_ASN1EncodeItem(arena, der, &tsreq,
+			       TimeStampReqTemplate) == NULL)
+		cmsreterr(-1, cms, "could not encode timestamp request");
+	return 0;
+}
+
+/*
+ * Make sure a token is the answer to the question we asked: the
+ * messageImprint and nonce in its TSTInfo have to be ours.  That's what
+ * matches pipelined answers up with their requests.  Checking the TSA's
+ * signature on it is left to whoever checks ours.
+ */
+static int
+check_token(timestamp_request *req, SECItem *token)
+{
+	SECItem der = *token;
+	SECItem ci, sd, eci, wrap, tstder, tst, mi, hashed, x;
+
+	if (der_take(&der, 0x30, &ci) < 0 ||
+	    der_take(&ci, 0x06, &x) < 0 ||
+	    der_take(&ci, 0xa0, &wrap) < 0 ||
+	    der_take(&wrap, 0x30, &sd) < 0 ||
+	    der_take(&sd, 0x02, &x) < 0 ||
+	    der_take(&sd, 0x31, &x) < 0 ||
+	    der_take(&sd, 0x30, &eci) < 0 ||
+	    der_take(&eci, 0x06, &x) < 0 ||
+	    der_take(&eci, 0xa0, &wrap) < 0 ||
+	    der_take(&wrap, 0x04, &tstder) < 0 ||
+	    der_take(&tstder, 0x30, &tst) < 0 ||
+	    der_take(&tst, 0x02, &x) < 0 ||
+	    der_take(&tst, 0x06, &x) < 0 ||
+	    der_take(&tst, 0x30, &mi) < 0 ||
+	    der_take(&mi, 0x30, &x) < 0 ||
+	    der_take(&mi, 0x04, &hashed) < 0 ||
+	    der_take(&tst, 0x02, &x) < 0 ||
+	    der_take(&tst, 0x18, &x) < 0)
+		return -1;
+
+	if (hashed.len != req->imprint_len ||
+	    memcmp(hashed.data, req->imprint, req->imprint_len))
+		return -1;
+
+	/* accuracy and ordering are optional; the nonce isn't, if we sent
+	 * one */
+	while (tst.len > 0) {
+		uint8_t tag = tst.data[0];
+		SECItem element;
+
+		if (der_next(&tst, &element) < 0)
+			return -1;
+		if (tag != 0x02)
+			continue;
+		if (der_contents(&element, &x) < 0)
+			return -1;
+		if (x.len != sizeof (req->nonce) ||
+		    memcmp(x.data, req->nonce, sizeof (req->nonce)))
+			return -1;
+		return 0;
+	}
+	return -1;
+}
+
+static int
+parse_response(cms_context *cms, timestamp_request *req, SECItem *body)
+{
+	SECItem der = *body;
+	SECItem resp, status, st, token;
+
+	if (der_take(&der, 0x30, &resp) < 0 ||
+	    der_take(&resp, 0x30, &status) < 0 ||
+	    der_take(&status, 0x02, &st) < 0 || st.len != 1) {
+		cms->log(cms, LOG_ERR, "invalid timestamp response");
+		return -1;
+	}
+
+	/* granted, or grantedWithMods */
+	if (st.data[0] > 1) {
+		cms->log(cms, LOG_ERR, "timestamp request rejected (status %d)",
+			 st.data[0]);
+		return -1;
+	}
+
+	if (der_next(&resp, &token) < 0 || token.data[0] != 0x30 ||
+	    check_token(req, &token) < 0) {
+		cms->log(cms, LOG_ERR, "invalid timestamp token in response");
+		return -1;
+	}
+
+	req->token.data = malloc(token.len);
+	if (!req->token.data) {
+		cms->log(cms, LOG_ERR, "could not allocate timestamp: %m");
+		return -1;
+	}
+	memcpy(req->token.data, token.data, token.len);
+	req->token.len = token.len;
+	return 0;
+}
+
+static int
+tsa_connect(cms_context *cms, timestamp_client *tsa)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	struct timeval tv = {
+		.tv_sec = TIMESTAMP_TIMEOUT,
+	};
+	int rc, fd = -1;
+
+	rc = getaddrinfo(tsa->host, tsa->port, &hints, &res);
+	if (rc != 0) {
+		cms->log(cms, LOG_ERR, "could not resolve %s: %s", tsa->host,
+			 gai_strerror(rc));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		/* on Linux the send timeout covers connect() too */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		save_errno(close(fd));
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		cms->log(cms, LOG_ERR, "could not connect to %s: %m",
+			 tsa->url);
+		return -1;
+	}
+	tsa->fd = fd;
+	return 0;
+}
+
+static void
+tsa_disconnect(timestamp_client *tsa)
+{
+	if (tsa->fd >= 0)
+		close(tsa->fd);
+	tsa->fd = -1;
+}
+
+/* buffered reads of HTTP responses off the connection */
+typedef struct {
+	int fd;
+	char buf[16384];
+	size_t pos;
+	size_t end;
+} http_reader;
+
+static int
+http_fill(http_reader *hr)
+{
+	ssize_t n;
+
+	if (hr->pos > 0) {
+		memmove(hr->buf, hr->buf + hr->pos, hr->end - hr->pos);
+		hr->end -= hr->pos;
+		hr->pos = 0;
+	}
+	if (hr->end == sizeof (hr->buf)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	do {
+		n = read(hr->fd, hr->buf + hr->end, sizeof (hr->buf) - hr->end);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return n;
+	hr->end += n;
+	return n;
+}
+
+/* one line, without its CRLF; 0 at EOF */
+static int
+http_line(http_reader *hr, char **line)
+{
+	char *nl;
+	int rc;
+
+	while (!(nl = memchr(hr->buf + hr->pos, '\n', hr->end - hr->pos))) {
+		rc = http_fill(hr);
+		if (rc <= 0)
+			return rc;
+	}
+	*line = hr->buf + hr->pos;
+	*nl = '\0';
+	if (nl > *line && nl[-1] == '\r')
+		nl[-1] = '\0';
+	hr->pos = nl + 1 - hr->buf;
+	return 1;
+}
+
+/* append len more bytes of the body, which mustn't come to more than
+ * TIMESTAMP_MAX_RESPONSE in all */
+static int
+http_body(http_reader *hr, uint8_t **body, size_t *body_len, size_t len)
+{
+	uint8_t *new_body;
+	size_t n;
+
+	/* *body_len is never more than the limit, so this can't wrap */
+	if (len > TIMESTAMP_MAX_RESPONSE - *body_len) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	new_body = realloc(*body, *body_len + len);
+	if (!new_body)
+		return -1;
+	*body = new_body;
+
+	while (len > 0) {
+		if (hr->pos == hr->end) {
+			int rc = http_fill(hr);
+			if (rc <= 0) {
+				if (rc == 0)
+					errno = ECONNRESET;
+				return -1;
+			}
+		}
+		n = hr->end - hr->pos;
+		if (n > len)
+			n = len;
+		memcpy(*body + *body_len, hr->buf + hr->pos, n);
+		hr->pos += n;
+		*body_len += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read one response.  Returns 1 and sets *keep_alive if we got one, 0 if
+ * the connection closed before it started (so the request can be resent),
+ * and -1 if something broke partway through.
+ */
+static int
+http_response(http_reader *hr, int *status, uint8_t **body, size_t *body_len,
+	      int *keep_alive)
+{
+	ssize_t content_length = -1;
+	int chunked = 0;
+	char *line;
+	int rc;
+
+	*body = NULL;
+	*body_len = 0;
+
+	rc = http_line(hr, &line);
+	if (rc <= 0)
+		return rc;
+	if (strncmp(line, "HTTP/1.", 7) || sscanf(line + 9, "%3d", status) != 1)
+		goto proto;
+	*keep_alive = line[7] == '1';
+
+	while (1) {
+		rc = http_line(hr, &line);
+		if (rc <= 0)
+			goto truncated;
+		if (!*line)
+			break;
+		if (!strncasecmp(line, "Content-Length:", 15)) {
+			errno = 0;
+			content_length = strtol(line + 15, NULL, 10);
+			if (errno || content_length < 0)
+				goto proto;
+		}
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+			chunked = !!strcasestr(line + 18, "chunked");
+		else if (!strncasecmp(line, "Connection:", 11))
+			*keep_alive = !strcasestr(line + 11, "close");
+	}
+
+	if (chunked) {
+		while (1) {
+			rc = http_line(hr, &line);
+			if (rc <= 0)
+				goto truncated;
+			char *end;
+			errno = 0;
+			unsigned long len = strtoul(line, &end, 16);
+			if (errno || end == line || line[0] == '-')
+				goto proto;
+			if (len == 0)
+				break;
+			if (http_body(hr, body, body_len, len) < 0)
+				goto err;
+			rc = http_line(hr, &line);
+			if (rc <= 0)
+				goto truncated;
+		}
+		/* trailers */
+		do {
+			rc = http_line(hr, &line);
+			if (rc <= 0)
+				goto truncated;
+		} while (*line);
+	} else if (content_length >= 0) {
+		if (http_body(hr, body, body_len, content_length) < 0)
+			goto err;
+	} else {
+		/* it's done when the connection is */
+		*keep_alive = 0;
+		while (1) {
+			size_t avail = hr->end - hr->pos;
+			if (avail && http_body(hr, body, body_len, avail) < 0)
+				goto err;
+			rc = http_fill(hr);
+			if (rc < 0)
+				goto err;
+			if (rc == 0)
+				break;
+		}
+	}
+	return 1;
+truncated:
+	if (rc == 0)
+		errno = ECONNRESET;
+	goto err;
+proto:
+	errno = EPROTO;
+err:
+	xfree(*body);
+	*body_len = 0;
+	return -1;
+}
+
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Send every request in the batch down one connection without waiting
+ * for answers in between, and then read the answers, which come back in
+ * the same order.  If the server closes the connection (because it's
+ * done with keep-alive, or doesn't pipeline), we reconnect and send
+ * whatever hasn't been answered yet.
+ */
+static void
+send_batch(cms_context *cms, timestamp_client *tsa, timestamp_request **reqs,
+	   int n)
+{
+	PRArenaPool *arena;
+	char **msgs;
+	size_t *msg_lens;
+	int first = 0, reused, stalls = 0;
+
+	for (int i = 0; i < n; i++)
+		reqs[i]->rc = -1;
+
+	msgs = calloc(n, sizeof (char *));
+	msg_lens = calloc(n, sizeof (size_t));
+	arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+	if (!msgs || !msg_lens || !arena) {
+		cms->log(cms, LOG_ERR, "could not allocate memory: %m");
+		goto out;
+	}
+
+	for (int i = 0; i < n; i++) {
+		SECItem der;
+		int rc;
+
+		if (encode_request(cms, arena, reqs[i], &der) < 0)
+			goto out;
+
+		rc = asprintf(&msgs[i], "POST %s HTTP/1.1\r\n"
+			"Host: %s%s%s\r\n"
+			"Content-Type: application/timestamp-query\r\n"
+			"Accept: application/timestamp-reply\r\n"
+			"Content-Length: %u\r\n"
+			"\r\n", tsa->path, tsa->host,
+			strcmp(tsa->port, "80") ? ":" : "",
+			strcmp(tsa->port, "80") ? tsa->port : "", der.len);
+		if (rc < 0) {
+			msgs[i] = NULL;
+			cms->log(cms, LOG_ERR, "could not allocate memory: %m");
+			goto out;
+		}
+		char *msg = realloc(msgs[i], rc + der.len);
+		if (!msg) {
+			cms->log(cms, LOG_ERR, "could not allocate memory: %m");
+			goto out;
+		}
+		memcpy(msg + rc, der.data, der.len);
+		msgs[i] = msg;
+		msg_lens[i] = rc + der.len;
+	}
+
+	while (first < n) {
+		http_reader *hr;
+		int progress = 0;
+
+		reused = tsa->fd >= 0;
+		if (!reused && tsa_connect(cms, tsa) < 0)
+			goto out;
+
+		hr = calloc(1, sizeof (*hr));
+		if (!hr) {
+			cms->log(cms, LOG_ERR, "could not allocate memory: %m");
+			goto out;
+		}
+		hr->fd = tsa->fd;
+
+		for (int i = first; i < n; i++) {
+			if (send_all(tsa->fd, msgs[i], msg_lens[i]) < 0) {
+				/* answers may still be there for the ones
+				 * that made it */
+				if (errno == EPIPE || errno == ECONNRESET)
+					break;
+				cms->log(cms, LOG_ERR,
+					 "could not send to %s: %m", tsa->url);
+				free(hr);
+				tsa_disconnect(tsa);
+				goto out;
+			}
+		}
+
+		while (first < n) {
+			int status = 0, keep_alive = 0, rc;
+			uint8_t *body;
+			size_t body_len;
+
+			rc = http_response(hr, &status, &body, &body_len,
+					   &keep_alive);
+			if (rc == 0)
+				break;
+			if (rc < 0) {
+				cms->log(cms, LOG_ERR,
+					 "could not read from %s: %m",
+					 tsa->url);
+				free(hr);
+				tsa_disconnect(tsa);
+				goto out;
+			}
+
+			if (status != 200) {
+				cms->log(cms, LOG_ERR,
+					 "%s answered with HTTP status %d",
+					 tsa->url, status);
+			} else {
+				SECItem der = {
+					.type = siBuffer,
+					.data = body,
+					.len = body_len,
+				};
+				reqs[first]->rc = parse_response(cms,
+							reqs[first], &der);
+			}
+			xfree(body);
+			first++;
+			progress = 1;
+
+			if (!keep_alive)
+				break;
+		}
+		free(hr);
+
+		if (first < n) {
+			tsa_disconnect(tsa);
+			/* a stale keep-alive connection doesn't count, but
+			 * a new one that never answers does */
+			if (!progress && (!reused || ++stalls > 1)) {
+				cms->log(cms, LOG_ERR,
+					 "%s closed the connection", tsa->url);
+				goto out;
+			}
+		}
+	}
+out:
+	if (msgs) {
+		for (int i = 0; i < n; i++)
+			xfree(msgs[i]);
+		free(msgs);
+	}
+	xfree(msg_lens);
+	if (arena)
+		PORT_FreeArena(arena, PR_TRUE);
+}
+
+/*
+ * Called with tsa->lock held, by whoever finds nobody else sending.
+ * Wait a moment for company, then send everything that's pending.
+ */
+static void
+run_batch(cms_context *cms, timestamp_client *tsa)
+{
+	timestamp_request *reqs[TIMESTAMP_MAX_BATCH];
+	struct timespec deadline;
+	int n = 0;
+
+	tsa->sending = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += TIMESTAMP_BATCH_WINDOW * 1000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	while (tsa->npending < TIMESTAMP_MAX_BATCH) {
+		if (pthread_cond_timedwait(&tsa->cond, &tsa->lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	while (tsa->pending && n < TIMESTAMP_MAX_BATCH) {
+		reqs[n++] = tsa->pending;
+		tsa->pending = tsa->pending->next;
+		tsa->npending--;
+	}
+	pthread_mutex_unlock(&tsa->lock);
+
+	send_batch(cms, tsa, reqs, n);
+
+	pthread_mutex_lock(&tsa->lock);
+	for (int i = 0; i < n; i++) {
+		timestamp_request *req = reqs[i];
+
+		if (req->rc == 0) {
+			add_cached(tsa, req);
+			if (req->token.len > tsa->max_token_len)
+				tsa->max_token_len = req->token.len;
+		}
+		req->done = 1;
+	}
+	tsa->queries += n;
+	tsa->batches++;
+	tsa->sending = 0;
+	pthread_cond_broadcast(&tsa->cond);
+}
+
+static int
+dup_token(cms_context *cms, SECItem *token, SECItem *src)
+{
+	token->type = siBuffer;
+	token->data = PORT_ArenaAlloc(cms->arena, src->len);
+	if (!token->data)
+		cmsreterr(-1, cms, "could not allocate timestamp");
+	memcpy(token->data, src->data, src->len);
+	token->len = src->len;
+	return 0;
+}
+
+/*
+ * Get a TimeStampToken for this signature, hashed with the same digest
+ * it was made with.  This may block for a while, both waiting for other
+ * requests to batch up with and on the authority itself.  The token is
+ * allocated in cms->arena.
+ */
+int
+timestamp_signature(cms_context *cms, SECItem *signature, SECItem *token)
+{
+	timestamp_client *tsa = cms->tsa;
+	timestamp_request *req, **reqp;
+	timestamp_request key;
+	timestamp_cache *tc;
+	int rc;
+
+	memset(&key, '\0', sizeof (key));
+	key.hash = digest_get_digest_oid(cms);
+	key.imprint_len = digest_get_digest_size(cms);
+	if (key.imprint_len > sizeof (key.imprint) ||
+	    PK11_HashBuf(key.hash, key.imprint, signature->data,
+			 signature->len) != SECSuccess)
+		cmsreterr(-1, cms, "could not hash signature for timestamp");
+
+	pthread_mutex_lock(&tsa->lock);
+	tsa->requests++;
+
+	tc = find_cached(tsa, &key);
+	if (tc) {
+		tsa->cache_hits++;
+		rc = dup_token(cms, token, &tc->token);
+		pthread_mutex_unlock(&tsa->lock);
+		return rc;
+	}
+
+	for (req = tsa->pending; req; req = req->next) {
+		if (req->hash == key.hash &&
+		    req->imprint_len == key.imprint_len &&
+		    !memcmp(req->imprint, key.imprint, key.imprint_len))
+			break;
+	}
+
+	if (req) {
+		req->refs++;
+	} else {
+		req = calloc(1, sizeof (*req));
+		if (!req) {
+			pthread_mutex_unlock(&tsa->lock);
+			cms->log(cms, LOG_ERR, "could not allocate memory: %m");
+			return -1;
+		}
+		req->hash = key.hash;
+		memcpy(req->imprint, key.imprint, key.imprint_len);
+		req->imprint_len = key.imprint_len;
+		if (PK11_GenerateRandom(req->nonce,
+					sizeof (req->nonce)) != SECSuccess) {
+			pthread_mutex_unlock(&tsa->lock);
+			free(req);
+			cmsreterr(-1, cms, "could not generate nonce");
+		}
+		/* positive, and no leading zero to be added or dropped */
+		req->nonce[0] = (req->nonce[0] & 0x7f) | 0x40;
+		req->refs = 1;
+
+		for (reqp = &tsa->pending; *reqp; reqp = &(*reqp)->next)
+			;
+		*reqp = req;
+		if (++tsa->npending >= TIMESTAMP_MAX_BATCH)
+			pthread_cond_broadcast(&tsa->cond);
+	}
+
+	while (!req->done) {
+		if (!tsa->sending)
+			run_batch(cms, tsa);
+		else
+			pthread_cond_wait(&tsa->cond, &tsa->lock);
+	}
+
+	rc = req->rc;
+	if (rc == 0)
+		rc = dup_token(cms, token, &req->token);
+	if (--req->refs == 0) {
+		xfree(req->token.data);
+		free(req);
+	}
+	pthread_mutex_unlock(&tsa->lock);
+	return rc;
+}
+
+/*
+ * Something the size of a token, with room to spare, for working out how
+ * much space a signature will need without asking the authority for a
+ * token we'd throw away.  Returns 1 if we haven't seen a token yet and
+ * can't guess.
+ */
+int
+timestamp_placeholder(cms_context *cms, SECItem *token)
+{
+	timestamp_client *tsa = cms->tsa;
+	size_t len;
+
+	pthread_mutex_lock(&tsa->lock);
+	len = tsa->max_token_len;
+	pthread_mutex_unlock(&tsa->lock);
+
+	if (len == 0)
+		return 1;
+	len += TIMESTAMP_SLACK - 4;
+	if (len < 256 || len > 0xffff)
+		return 1;
+
+	token->type = siBuffer;
+	token->data = PORT_ArenaZAlloc(cms->arena, len + 4);
+	if (!token->data)
+		cmsreterr(-1, cms, "could not allocate timestamp");
+	token->data[0] = 0x30;
+	token->data[1] = 0x82;
+	token->data[2] = (len >> 8) & 0xff;
+	token->data[3] = len & 0xff;
+	token->len = len + 4;
+	return 0;
+}
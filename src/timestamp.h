@@ -0,0 +1,101 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H 1
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * An RFC 3161 time stamping client.  The TimeStampToken it gets back goes
+ * into a signer info's unsigned attributes as a Microsoft RFC 3161
+ * countersignature (1.3.6.1.4.1.311.3.3.1), over a hash of the signature.
+ *
+ * Each round trip to a time stamping authority costs far more than the
+ * signature it's stamping, so requests are batched: the first caller to
+ * show up waits TIMESTAMP_BATCH_WINDOW for others to join it (or until
+ * there are TIMESTAMP_MAX_BATCH of them), and then sends them all,
+ * pipelined, over one kept-alive HTTP connection while everybody else
+ * waits for their own answer.  Requests for the same imprint share one
+ * query, and answers are kept in a small cache, since the same binary
+ * signed with the same key gets the same signature.
+ *
+ * Only http:// is supported, which is what time stamping authorities
+ * generally use; the token is signed, so the transport needn't be.  That
+ * also means a local stub (openssl ts -reply behind any HTTP server) is
+ * enough to test against.
+ */
+#define TIMESTAMP_BATCH_WINDOW	20000		/* usecs */
+#define TIMESTAMP_MAX_BATCH	64
+#define TIMESTAMP_CACHE_SIZE	256
+#define TIMESTAMP_TIMEOUT	30		/* seconds */
+
+/*
+ * A reply is one TimeStampResp: a signed token and the TSA's certificates,
+ * a few kilobytes.  Anything much bigger than that isn't one, and we're
+ * not going to hold it in memory on the word of whoever's on the wire.
+ */
+#define TIMESTAMP_MAX_RESPONSE	(64 * 1024)
+
+/*
+ * Tokens for the same authority differ by a few bytes from one to the
+ * next (the serial number, fractions of a second in genTime), so room
+ * made from one needs a little to spare for the next.
+ */
+#define TIMESTAMP_SLACK		64
+
+struct timestamp_request;
+struct timestamp_cache;
+
+typedef struct timestamp_client {
+	char *url;
+	char *host;
+	char *port;
+	char *path;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* waiting for the next batch */
+	struct timestamp_request *pending;
+	int npending;
+	int sending;
+
+	struct timestamp_cache *cache;
+	int ncache;
+
+	/* biggest token we've seen, for sizing signatures */
+	size_t max_token_len;
+
+	/* only touched by whoever's sending */
+	int fd;
+
+	uint64_t requests;
+	uint64_t queries;
+	uint64_t batches;
+	uint64_t cache_hits;
+} timestamp_client;
+
+extern int timestamp_client_new(cms_context *cms, const char *url);
+extern void timestamp_client_free(timestamp_client *tsa);
+extern int timestamp_signature(cms_context *cms, SECItem *signature,
+			       SECItem *token);
+extern int timestamp_placeholder(cms_context *cms, SECItem *token);
+
+#endif /* TIMESTAMP_H */
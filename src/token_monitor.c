@@ -0,0 +1,238 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "pesign.h"
+
+#include <pk11pub.h>
+#include <prerror.h>
+
+void
+token_monitor_init(token_monitor *tm, int interval, int keep_pins)
+{
+	memset(tm, '\0', sizeof (*tm));
+	tm->interval = interval;
+	tm->keep_pins = keep_pins;
+}
+
+static void
+forget_pin(token_state *ts)
+{
+	if (!ts->pin)
+		return;
+	free_poison(ts->pin, strlen(ts->pin));
+	xfree(ts->pin);
+}
+
+void
+token_monitor_fini(token_monitor *tm)
+{
+	for (int i = 0; i < tm->ntokens; i++) {
+		forget_pin(&tm->tokens[i]);
+		xfree(tm->tokens[i].name);
+	}
+	xfree(tm->tokens);
+	tm->ntokens = 0;
+}
+
+/*
+ * Start watching a token (if we aren't already), and if we're allowed to,
+ * remember the PIN it was just unlocked with.
+ */
+int
+token_monitor_add(token_monitor *tm, const char *name, const char *pin)
+{
+	token_state *ts = NULL;
+
+	for (int i = 0; i < tm->ntokens; i++) {
+		if (!strcmp(tm->tokens[i].name, name)) {
+			ts = &tm->tokens[i];
+			break;
+		}
+	}
+
+	if (!ts) {
+		token_state *new_tokens = realloc(tm->tokens,
+				sizeof (*tm->tokens) * (tm->ntokens + 1));
+		if (!new_tokens)
+			return -1;
+		tm->tokens = new_tokens;
+		ts = &tm->tokens[tm->ntokens];
+		memset(ts, '\0', sizeof (*ts));
+		ts->name = strdup(name);
+		if (!ts->name)
+			return -1;
+		tm->ntokens++;
+	}
+
+	if (tm->keep_pins && pin) {
+		forget_pin(ts);
+		ts->pin = strdup(pin);
+		if (!ts->pin)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the token has just become usable, i.e. it wasn't the last
+ * time we looked.
+ */
+static int
+probe_token(token_state *ts, cms_context *cms, int priority)
+{
+	int was_usable = ts->present && ts->logged_in;
+	PK11SlotInfo *slot = PK11_FindSlotByName(ts->name);
+
+	ts->probes++;
+	ts->present = slot && PK11_IsPresent(slot);
+	ts->logged_in = 0;
+
+	/* asking whether we're logged in is also what keeps an idle
+	 * session from timing out on most tokens */
+	if (ts->present)
+		ts->logged_in = !PK11_NeedLogin(slot) ||
+				PK11_IsLoggedIn(slot, NULL);
+
+	if (ts->present && !ts->logged_in && ts->pin) {
+		PK11_SetPasswordFunc(get_password_passthrough);
+		SECStatus status = PK11_Authenticate(slot, PR_TRUE, ts->pin);
+		PK11_SetPasswordFunc(get_password_fail);
+
+		if (status == SECSuccess) {
+			ts->relogins++;
+			ts->logged_in = 1;
+			cms->log(cms, priority|LOG_NOTICE,
+				"logged back in to token \"%s\"", ts->name);
+		} else {
+			ts->failures++;
+			cms->log(cms, priority|LOG_ERR,
+				"could not log back in to token \"%s\": %s; "
+				"it needs to be unlocked again", ts->name,
+				PORT_ErrorToString(PORT_GetError()));
+			forget_pin(ts);
+		}
+	}
+
+	if (was_usable && !ts->present)
+		cms->log(cms, priority|LOG_WARNING,
+			"token \"%s\" has gone away", ts->name);
+	else if (was_usable && !ts->logged_in)
+		cms->log(cms, priority|LOG_WARNING,
+			"token \"%s\" has been logged out", ts->name);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts->checked);
+	if (slot)
+		PK11_FreeSlot(slot);
+
+	return !was_usable && ts->present && ts->logged_in;
+}
+
+/*
+ * Look at every token now.  Returns how many of them have just become
+ * usable, so the caller knows whether it's worth resolving certificates
+ * again.
+ */
+int
+token_monitor_probe(token_monitor *tm, cms_context *cms, int priority)
+{
+	int changed = 0;
+
+	for (int i = 0; i < tm->ntokens; i++)
+		changed += probe_token(&tm->tokens[i], cms, priority);
+
+	clock_gettime(CLOCK_MONOTONIC, &tm->next);
+	tm->next.tv_sec += tm->interval;
+	return changed;
+}
+
+int
+token_monitor_due(token_monitor *tm, struct timespec *now)
+{
+	if (tm->interval <= 0 || tm->ntokens == 0)
+		return 0;
+	if (now->tv_sec != tm->next.tv_sec)
+		return now->tv_sec > tm->next.tv_sec;
+	return now->tv_nsec >= tm->next.tv_nsec;
+}
+
+/*
+ * How long until the next check; returns 0 if there won't be one.
+ */
+int
+token_monitor_wait(token_monitor *tm, struct timespec *now,
+		   struct timespec *wait)
+{
+	if (tm->interval <= 0 || tm->ntokens == 0)
+		return 0;
+
+	if (token_monitor_due(tm, now)) {
+		wait->tv_sec = 0;
+		wait->tv_nsec = 0;
+		return 1;
+	}
+
+	wait->tv_sec = tm->next.tv_sec - now->tv_sec;
+	wait->tv_nsec = tm->next.tv_nsec - now->tv_nsec;
+	if (wait->tv_nsec < 0) {
+		wait->tv_sec--;
+		wait->tv_nsec += 1000000000;
+	}
+	return 1;
+}
+
+int
+token_monitor_status(token_monitor *tm, char **text)
+{
+	struct timespec now;
+	char *buf = NULL;
+	size_t len = 0;
+
+	FILE *f = open_memstream(&buf, &len);
+	if (!f)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < tm->ntokens; i++) {
+		token_state *ts = &tm->tokens[i];
+
+		fprintf(f, "token \"%s\": %s", ts->name,
+			!ts->probes ? "not checked yet" :
+			!ts->present ? "not present" :
+			!ts->logged_in ? "logged out" : "ready");
+		if (ts->probes)
+			fprintf(f, ", checked %lld seconds ago",
+				(long long)(now.tv_sec - ts->checked.tv_sec));
+		fprintf(f, ", %llu relogins, %llu failures%s\n",
+			(unsigned long long)ts->relogins,
+			(unsigned long long)ts->failures,
+			ts->pin ? ", PIN kept" : "");
+	}
+
+	if (fclose(f) != 0) {
+		free(buf);
+		return -1;
+	}
+	*text = buf;
+	return 0;
+}
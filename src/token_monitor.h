@@ -0,0 +1,65 @@
+/*
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Peter Jones <pjones@redhat.com>
+ */
+#ifndef TOKEN_MONITOR_H
+#define TOKEN_MONITOR_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Smartcards get pulled out, and HSM sessions time out or get logged out
+ * from the other end.  Rather than finding that out in the middle of a
+ * signing request, pesignd looks at every token it has been asked to
+ * unlock (and the one it was started with) every so often.  If one has
+ * been logged out and the daemon was started with --keep-pins, it logs
+ * back in with the PIN it was unlocked with; if that fails, the PIN is
+ * forgotten, so a bad PIN can't lock the token.
+ */
+typedef struct {
+	char *name;
+	char *pin;
+	int present;
+	int logged_in;
+	struct timespec checked;
+	uint64_t probes;
+	uint64_t relogins;
+	uint64_t failures;
+} token_state;
+
+typedef struct {
+	token_state *tokens;
+	int ntokens;
+	int interval;
+	int keep_pins;
+	struct timespec next;
+} token_monitor;
+
+extern void token_monitor_init(token_monitor *tm, int interval,
+			       int keep_pins);
+extern void token_monitor_fini(token_monitor *tm);
+extern int token_monitor_add(token_monitor *tm, const char *name,
+			     const char *pin);
+extern int token_monitor_probe(token_monitor *tm, cms_context *cms,
+			       int priority);
+extern int token_monitor_due(token_monitor *tm, struct timespec *now);
+extern int token_monitor_wait(token_monitor *tm, struct timespec *now,
+			      struct timespec *wait);
+extern int token_monitor_status(token_monitor *tm, char **text);
+
+#endif /* TOKEN_MONITOR_H */
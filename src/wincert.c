@@ -285,7 +285,10 @@ calculate_signature_space(cms_context *cms, Pe *pe)
 {
 	SECItem sig = { 0, };
 
+	/* a timestamp costs a round trip, so this gets a stand-in */
+	cms->timestamp_sizing = 1;
 	int rc = generate_spc_signed_data(cms, &sig);
+	cms->timestamp_sizing = 0;
 	if (rc < 0) {
 		fprintf(stderr, "Could not generate signed data: %m\n");
 		exit(1);